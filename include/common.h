@@ -102,9 +102,68 @@ enum AVI_TYPES { AVI_TYPE_NONE=0,
 
 #define RECORD_FILETIME_WRITEON 180000 // default 180000 == 3 mins
 #define RECORD_FILETIME_NOWRITE 30000
+#define RECORD_MOTION_HISTORY   600   // seconds of motion kept for the segments still to be written
+
+// RTP media clocks used to time the recorded samples
+#define RTP_VIDEO_CLOCK 90000
+#define RTP_AUDIO_CLOCK 8000
+// ms; sender reports putting audio and video further apart are not trusted
+#define AV_SYNC_MAX 10000
 
 #define MAX_RESTART_RETRIES 6
 
+// RTP/UDP reorder buffer, per SSRC
+#define RTP_REORDER_SLOTS   64      // packets held while waiting for a missing one
+#define RTP_REORDER_LATENCY 40      // maximum added latency in ms
+#define JPEG_HEADER_MAX     640     // room kept for the JFIF header in front of each frame
+#define JPEG_FRAME_RESERVE  (256*1024) // frame buffer made up front, grown only for larger frames
+#define JPEG_FRAME_MAX      (8*1024*1024) // a fragment reaching further is taken as corrupt
+#define JPEG_FRAGMENTS      1024    // packets and restart intervals tracked per frame before growing
+#define H264_INTERLEAVE_DEPTH 64    // NAL units held in interleaved mode without sprop-interleaving-depth
+#define H264_MAX_ACCESS_UNIT (16*1024*1024) // guard against a stream that never ends its pictures
+#define H264_ACCESS_UNIT_RESERVE (64*1024)  // first allocation of an access unit buffer
+#define H264_ACCESS_UNIT_POOL 256   // free access units kept for reuse
+#define H264_ACCESS_UNIT_PADDING 64 // zeros after the data, the decoder may read past the end
+#define SEGMENT_ARENA_CHUNK (4*1024*1024) // the frames of a recording are copied into chunks of this size
+
+// transcoding the MJPEG recordings to H.264 (--archive)
+#define ARCHIVE_QUEUE_MAX   32      // recordings waiting, later ones are kept as AVI
+#define ARCHIVE_POLL        1000    // ms between tries for a free slot on the host
+#define ARCHIVE_NICE        19      // of the transcoding threads
+#define ARCHIVE_PRESET      "veryfast"  // libx264 speed/size trade off
+#define ARCHIVE_CRF         "23"    // libx264 constant quality
+
+// motion detection on a grid of blocks
+#define MOTION_BLOCK        8       // pixels square, averaged to one luma value
+#define MOTION_GRID_COLS    16      // cells the blocks are reported in
+#define MOTION_GRID_ROWS    12
+#define MOTION_BG_SHIFT     4       // the background follows 1/16 of a change
+#define MOTION_FG_SHIFT     7       // or 1/128 while the block moves
+#define MOTION_DEV_SHIFT    5       // the deviation follows 1/32, moving or not
+#define MOTION_DEV_GAIN     3       // times the usual deviation of a block for it to move
+#define MOTION_CELL_MIN     25      // % of the blocks of a cell that move for the cell to move
+#define MOTION_LEARN        4       // analyses of the background before motion is reported
+#define MOTION_ZONES_MAX    32      // --motion and --zone together
+#define MOTION_ZONE_NONE    0xff    // a block in no zone, or excluded
+#define MOTION_VECTOR_HEIGHT 240    // lines of the picture the vectors are scaled to
+#define MOTION_VECTOR_GAIN  32      // levels for a pixel moved a frame
+
+// RTP/TCP interleaved receive buffer, must hold at least one 64k frame
+#define RTSP_TCP_BUFFER_SIZE (256*1024)
+// send an RTSP keepalive every n watchdog timeouts (~1 sec each) over tcp
+#define RTSP_KEEPALIVE_INTERVAL 20
+
+// camera simulator (camsim)
+#define CAMSIM_RTSP_PORT       8554
+#define CAMSIM_RTP_PORT        6970     // RTCP on the next port
+#define CAMSIM_PAYLOAD_MAX     1400     // RTP payload bytes per packet
+#define CAMSIM_TCP_BACKLOG     (4*1024*1024) // frames are skipped while more is queued
+#define CAMSIM_MAX_REQUEST     8192
+#define CAMSIM_SESSION_TIMEOUT 60       // in seconds, as announced to the client
+
+// slots in the latest frame mailbox, one more than the readers expected at once
+#define FRAME_MAILBOX_SLOTS 4
+
 #define SECS_BETWEEN_EVENTS 20
 
 #define HEARTBEAT_INTERVAL  30   // in minutes: 60
@@ -154,10 +213,13 @@ enum SEND_MODE { SEND_MODE_TCP, SEND_MODE_HTTP_GET };
 #define STR_STARTSTOP     "startstop"
 #define STR_DEBUGON       "debugon"
 #define STR_DEBUGOFF      "debugoff"
+#define STR_TRACEON       "traceon"
+#define STR_TRACEOFF      "traceoff"
 #define STR_LOCK          "lock"
 #define STR_UNLOCK        "unlock"
 #define STR_EVENT         "event"
 #define STR_MOTION        "motion"
+#define STR_MOTION_GRID   "grid"
 #define STR_NORECORD      "norecord"
 #define STR_VIDEO         "video"
 #define STR_VIDEO_TIME    "time"
@@ -184,6 +246,39 @@ enum SEND_MODE { SEND_MODE_TCP, SEND_MODE_HTTP_GET };
 #define STR_THUMBNAIL    "/thumbnail.jpg"
 
 #define STR_STATUSREQ    "/command.cgi"
+#define STR_METRICS      "/metrics"
+#define STR_TRACE        "/trace.json"
+
+// latency histogram buckets, 100us to 5s
+#define METRIC_BUCKETS   14
+
+// frame tracing, events kept per thread (a power of 2) and threads traced
+#define TRACE_RING_SIZE   8192
+#define TRACE_MAX_THREADS 16
+
+// HLS live output
+#define STR_HLS_PLAYLIST "/live.m3u8"
+#define STR_HLS_SEGMENT  "/live/"
+#define HLS_DEFAULT_WINDOW   5          // segments kept in memory
+#define HLS_TARGET_DURATION  2          // in seconds, segments are cut at the next IDR
+#define HLS_MAX_SEGMENT_SIZE (16*1024*1024)
+
+// HTTP server
+#define STR_HTTP_SERVER        "channel 1.0"
+#define STR_MIME_HTML          "text/html"
+#define STR_MIME_JPEG          "image/jpeg"
+#define STR_MIME_HLS_PLAYLIST  "application/vnd.apple.mpegurl"
+#define STR_MIME_HLS_SEGMENT   "video/mp2t"
+#define STR_MIME_METRICS       "text/plain; version=0.0.4"
+#define STR_MIME_JSON          "application/json"
+#define HTTP_KEEPALIVE_TIMEOUT 5000          // in ms, idle time before a connection is closed
+#define HTTP_MAX_CONNECTIONS   256
+#define HTTP_MAX_PIPELINE      16            // requests waiting for a response on one connection
+#define HTTP_MAX_HEADER_SIZE   8192          // request line and headers
+#define HTTP_MAX_BODY_SIZE     65536
+#define HTTP_MAX_COMMAND       4096          // <vchannel> command messages
+#define HTTP_READ_BUFFER       65536
+#define HTTP_MAX_OUTPUT        (4*1024*1024) // queued response bytes before reading stops
 
 #define STR_HTTP_IMAGE   "HTTP/1.1 200 OK" STR_NL \
 "Content-Type: image/jpeg" STR_NL \
@@ -193,6 +288,21 @@ enum SEND_MODE { SEND_MODE_TCP, SEND_MODE_HTTP_GET };
 "Server: channel 1.0" STR_NL
 
 
+#define STR_HTTP_HLS_PLAYLIST "HTTP/1.1 200 OK" STR_NL \
+"Content-Type: application/vnd.apple.mpegurl" STR_NL \
+"Content-Length: %1" STR_NL \
+"Date: %2" STR_NL \
+"Cache-Control: no-cache" STR_NL \
+"Access-Control-Allow-Origin: *" STR_NL \
+"Server: channel 1.0" STR_NL
+
+#define STR_HTTP_HLS_SEGMENT "HTTP/1.1 200 OK" STR_NL \
+"Content-Type: video/mp2t" STR_NL \
+"Content-Length: %1" STR_NL \
+"Date: %2" STR_NL \
+"Access-Control-Allow-Origin: *" STR_NL \
+"Server: channel 1.0" STR_NL
+
 #define STR_KEEPALIVE "Connection: Keep-Alive"
 #define STR_VCAMERA_CGI "/vcamera.cgi"
 #define STR_VCOMMAND_CGI "/vcommand.cgi"
@@ -0,0 +1,219 @@
+/**
+ * FILE:		accessunit.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for holding the NAL units of one picture, from
+ * the depacketizer to the recording
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "accessunit.h"
+#include "annexb.h"
+
+AccessUnitPool accessunits;
+
+static const char startcode[4] = { 0, 0, 0, 1 };
+
+//
+// class AccessUnit
+//
+AccessUnit::AccessUnit() :
+    tstamp(0), key(false), vcl(false), buf(NULL), length(0), capacity(0)
+{
+    nals.reserve(16);
+}
+
+AccessUnit::~AccessUnit()
+{
+    free(buf);
+}
+
+// empty it, the buffer is kept for the next picture
+void AccessUnit::clear()
+{
+    length = 0;
+    nals.resize(0);
+    tstamp = 0;
+    key = vcl = false;
+}
+
+// there is always room for the padding after the data
+bool AccessUnit::reserve(int need)
+{
+    need += H264_ACCESS_UNIT_PADDING;
+    if( need <= capacity )
+        return true;
+    int newsize = qMax(need + need/2, H264_ACCESS_UNIT_RESERVE);
+    unsigned char *p = (unsigned char*)realloc(buf, newsize);
+    if( p == NULL )
+    {
+        qWarning() << "unable to allocate access unit" << newsize;
+        return false;
+    }
+    buf = p;
+    capacity = newsize;
+    return true;
+}
+
+bool AccessUnit::append(const void *data, int size)
+{
+    if( size <= 0 )
+        return true;
+    if( !reserve(length + size) )
+        return false;
+    memcpy(buf + length, data, size);
+    length += size;
+    return true;
+}
+
+// write a start code, the NAL unit follows at the offset returned
+int AccessUnit::startNal()
+{
+    append(startcode, 4);
+    return length;
+}
+
+// the bytes from offset to the end are a whole NAL unit
+void AccessUnit::endNal(int offset)
+{
+    if( offset < 4 || offset > length )
+        return;
+    NalSlice s;
+    s.offset = offset;
+    s.size = length - offset;
+    nals.append(s);
+}
+
+// drop what was added after size, a NAL unit that was not completed
+void AccessUnit::truncate(int size)
+{
+    if( size >= 0 && size < length )
+        length = size;
+    while( !nals.isEmpty() && nals.last().offset + nals.last().size > length )
+        nals.resize(nals.count() - 1);
+}
+
+// put NAL units (the parameter sets) in front of those there already
+bool AccessUnit::prepend(const QList<QByteArray> &ps)
+{
+    int extra = 0;
+    foreach( const QByteArray &nal, ps )
+        extra += 4 + nal.size();
+    if( extra == 0 )
+        return true;
+    if( !reserve(length + extra) )
+        return false;
+    memmove(buf + extra, buf, length);
+    length += extra;
+    for( int ii=0; ii<nals.count(); ii++ )
+        nals[ii].offset += extra;
+
+    nals.insert(0, ps.count(), NalSlice());
+    int pos = 0;
+    for( int ii=0; ii<ps.count(); ii++ )
+    {
+        const QByteArray &nal = ps.at(ii);
+        memcpy(buf + pos, startcode, 4);
+        memcpy(buf + pos + 4, nal.constData(), nal.size());
+        nals[ii].offset = pos + 4;
+        nals[ii].size = nal.size();
+        pos += 4 + nal.size();
+    }
+    return true;
+}
+
+// zero the padding, once it is complete
+void AccessUnit::pad()
+{
+    if( buf )
+        memset(buf + length, 0, H264_ACCESS_UNIT_PADDING);
+}
+
+// copy in an Annex B buffer, for callers that do not build access units
+bool AccessUnit::assign(const unsigned char *data, int size, bool hevc)
+{
+    clear();
+    AnnexB walk(data, size, hevc);
+    while( walk.next() )
+    {
+        int offset = startNal();
+        if( !append(walk.nal(), walk.size()) )
+            return false;
+        endNal(offset);
+        key = key || AnnexB::isKey(walk.type(), hevc);
+        vcl = vcl || AnnexB::isVcl(walk.type(), hevc);
+    }
+    pad();
+    return true;
+}
+
+// MP4 stores each NAL unit after its size rather than a start code;
+// the buffer can then be written as the sample, as it is
+void AccessUnit::lengthPrefixed()
+{
+    for( int ii=0; ii<nals.count(); ii++ )
+    {
+        unsigned char *p = buf + nals.at(ii).offset - 4;
+        quint32 size = nals.at(ii).size;
+        p[0] = size >> 24; p[1] = size >> 16; p[2] = size >> 8; p[3] = size;
+    }
+}
+
+//
+// class AccessUnitPool
+//
+AccessUnitPool::AccessUnitPool()
+{
+}
+
+AccessUnitPool::~AccessUnitPool()
+{
+    foreach( AccessUnit *au, units )
+        delete au;
+}
+
+AccessUnit *AccessUnitPool::take()
+{
+    AccessUnit *au = NULL;
+    mutex.lock();
+    if( !units.isEmpty() )
+        au = units.takeLast();
+    mutex.unlock();
+    if( au == NULL )
+        au = new AccessUnit();
+    return au;
+}
+
+// the pool keeps a bounded number, the rest are freed
+void AccessUnitPool::release(AccessUnit *au)
+{
+    if( au == NULL )
+        return;
+    au->clear();
+    mutex.lock();
+    if( units.count() < H264_ACCESS_UNIT_POOL )
+    {
+        units.append(au);
+        au = NULL;
+    }
+    mutex.unlock();
+    delete au;
+}
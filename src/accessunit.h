@@ -0,0 +1,109 @@
+/**
+ * FILE:		accessunit.h
+ *
+ * DESCRIPTION:
+ * This is the class for holding the NAL units of one picture, from
+ * the depacketizer to the recording
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef ACCESSUNIT_H
+#define ACCESSUNIT_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <QMutex>
+
+// one NAL unit in the buffer, after its 4 byte start code
+class NalSlice
+{
+public:
+    int offset;
+    int size;
+};
+
+/*
+ * AccessUnit
+ * the NAL units of one picture in a single buffer, each after a 4 byte
+ * start code so the decoder can take it as it is. The packets are copied
+ * into it once; after that it is passed on by pointer, and whoever holds
+ * it last gives it back to the pool. The MP4 writer turns the start codes
+ * into NAL unit sizes in place and writes the buffer as the sample.
+ */
+class AccessUnit
+{
+public:
+    AccessUnit();
+    ~AccessUnit();
+
+    void clear();
+    bool isEmpty() const { return length == 0; }
+    const unsigned char *data() const { return buf; }
+    int size() const { return length; }
+    int count() const { return nals.count(); }
+    const NalSlice &nal(int ii) const { return nals.at(ii); }
+
+    // putting it together
+    int  startNal();
+    bool append(const void *data, int size);
+    void endNal(int offset);
+    void truncate(int size);
+    bool prepend(const QList<QByteArray> &ps);
+    bool assign(const unsigned char *data, int size, bool hevc);
+    void pad();
+
+    // for MP4, the start codes become the sizes of the NAL units
+    void lengthPrefixed();
+
+    quint32 tstamp;
+    bool    key;            // has an IDR (or H.265 IRAP) slice
+    bool    vcl;            // has a coded slice
+
+private:
+    Q_DISABLE_COPY(AccessUnit)
+    bool reserve(int need);
+
+    unsigned char *buf;
+    int length;
+    int capacity;
+    QVector<NalSlice> nals;
+};
+
+/*
+ * AccessUnitPool
+ * keeps released access units with their buffers, so that in the
+ * steady state a picture costs no allocation. The recording gives them
+ * back, possibly from another thread.
+ */
+class AccessUnitPool
+{
+public:
+    AccessUnitPool();
+    ~AccessUnitPool();
+    AccessUnit *take();
+    void release(AccessUnit *au);
+
+private:
+    QMutex mutex;
+    QList<AccessUnit*> units;
+};
+
+extern AccessUnitPool accessunits;
+
+#endif // ACCESSUNIT_H
@@ -0,0 +1,106 @@
+/**
+ * FILE:		annexb.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for walking the NAL units of an H.264 or H.265 byte stream
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include "annexb.h"
+
+// the first byte after the next start code, or NULL
+static const unsigned char *startCode(const unsigned char *p, const unsigned char *end)
+{
+    while( end - p >= 3 )
+    {
+        p = (const unsigned char*)memchr(p, 0, end - p - 2);
+        if( p == NULL )
+            return NULL;
+        if( p[1] == 0 && p[2] == 1 )
+            return p + 3;
+        p++;
+    }
+    return NULL;
+}
+
+AnnexB::AnnexB(const unsigned char *data, int size, bool h) :
+    hevc(h), pos(data), end(data + (size > 0 ? size : 0)), nalstart(NULL), nalsize(0)
+{
+}
+
+// move to the next NAL unit, false at the end of the buffer
+bool AnnexB::next()
+{
+    while( pos && pos < end )
+    {
+        const unsigned char *s = startCode(pos, end);
+        if( s == NULL )
+            break;
+        const unsigned char *e = startCode(s, end);
+        const unsigned char *stop = e ? e - 3 : end;
+        pos = stop;
+        // the leading zero of a 4 byte start code, and any trailing
+        // zeros, are not part of the NAL unit
+        while( stop > s && stop[-1] == 0 )
+            stop--;
+        if( stop > s )
+        {
+            nalstart = s;
+            nalsize = stop - s;
+            return true;
+        }
+    }
+    pos = end;
+    nalstart = NULL;
+    nalsize = 0;
+    return false;
+}
+
+/*
+ * H.264 (table 7-1): 1-5 are slices, 5 of an IDR picture.
+ * H.265 (table 7-1): 0-31 are slices, 16-23 of IRAP pictures,
+ * which a decoder can start at.
+ */
+AnnexB::Kind AnnexB::kind(int type, bool hevc)
+{
+    if( hevc )
+    {
+        if( type >= 16 && type <= 23 )
+            return KEY;
+        if( type < 32 )
+            return SLICE;
+        switch( type )
+        {
+        case 32: return VPS;
+        case 33: return SPS;
+        case 34: return PPS;
+        case 35: return AUD;
+        default: return OTHER;
+        }
+    }
+    switch( type )
+    {
+    case 1: case 2: case 3: case 4: return SLICE;
+    case 5: return KEY;
+    case 7: return SPS;
+    case 8: return PPS;
+    case 9: return AUD;
+    default: return OTHER;
+    }
+}
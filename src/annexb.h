@@ -0,0 +1,62 @@
+/**
+ * FILE:		annexb.h
+ *
+ * DESCRIPTION:
+ * This is the class for walking the NAL units of an H.264 or H.265 byte stream
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef ANNEXB_H
+#define ANNEXB_H
+
+#include <QtGlobal>
+
+/*
+ * AnnexB
+ * walks the NAL units of a buffer in the Annex B byte stream format,
+ * each after a 3 or 4 byte start code. The NAL units are not copied.
+ * H.265 has a 2 byte NAL unit header with the type in bits 1-6 of the first.
+ */
+class AnnexB
+{
+public:
+    // what a NAL unit is, the same for both codecs
+    enum Kind { OTHER, SLICE, KEY, VPS, SPS, PPS, AUD };
+
+    AnnexB(const unsigned char *data, int size, bool hevc = false);
+    bool next();
+    const unsigned char *nal() { return nalstart; }
+    int size() { return nalsize; }
+    int type() { return nalsize > 0 ? nalType(nalstart, hevc) : 0; }
+    Kind kind() { return kind(type(), hevc); }
+
+    static int nalType(const unsigned char *nal, bool hevc = false)
+        { return hevc ? ( nal[0] >> 1 ) & 0x3F : nal[0] & 0x1F; }
+    static Kind kind(int type, bool hevc = false);
+    static bool isKey(int type, bool hevc = false) { return kind(type, hevc) == KEY; }
+    static bool isVcl(int type, bool hevc = false)
+        { Kind k = kind(type, hevc); return k == SLICE || k == KEY; }
+
+private:
+    bool hevc;
+    const unsigned char *pos;
+    const unsigned char *end;
+    const unsigned char *nalstart;
+    int nalsize;
+};
+
+#endif // ANNEXB_H
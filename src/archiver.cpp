@@ -0,0 +1,475 @@
+/**
+ * FILE:		archiver.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for transcoding the MJPEG recordings to H.264
+ * in the background, once they have been written
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QMutex>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "../include/common.h"
+#include "vchannel.h"
+#include "archiver.h"
+#include "metrics.h"
+
+extern "C"
+{
+#ifdef FRAME_H
+	#include <libavutil/frame.h>
+#endif
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libavutil/opt.h>
+	#include <libswscale/swscale.h>
+};
+
+// for older versions of avconv
+#ifndef av_frame_alloc
+#define av_frame_alloc avcodec_alloc_frame
+#define av_frame_free  avcodec_free_frame
+#endif
+
+// acquireSlot() found no lock files to share with the other channels
+#define NO_SLOT_FILE (-2)
+
+extern VChannel *vchannel;
+
+Archiver archiver;
+
+// libavcodec opens and closes codecs under this lock,
+// as the decoders of the live stream may be opened at the same time
+static int lockManager(void **mutex, enum AVLockOp op)
+{
+    switch( op )
+    {
+    case AV_LOCK_CREATE:
+        *mutex = new QMutex;
+        break;
+    case AV_LOCK_OBTAIN:
+        ((QMutex*)*mutex)->lock();
+        break;
+    case AV_LOCK_RELEASE:
+        ((QMutex*)*mutex)->unlock();
+        break;
+    case AV_LOCK_DESTROY:
+        delete (QMutex*)*mutex;
+        *mutex = NULL;
+        break;
+    }
+    return 0;
+}
+
+// encode one picture, or with NULL drain the pictures the encoder holds
+static bool encodeVideo(AVFormatContext *out, AVCodecContext *enc, AVStream *st, AVFrame *frame)
+{
+    for(;;)
+    {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.data = NULL;
+        pkt.size = 0;
+        int got = 0;
+        if( avcodec_encode_video2(enc, &pkt, frame, &got) < 0 )
+            return false;
+        if( !got )
+            return true;
+
+        if( pkt.pts != (int64_t)AV_NOPTS_VALUE )
+            pkt.pts = av_rescale_q(pkt.pts, enc->time_base, st->time_base);
+        if( pkt.dts != (int64_t)AV_NOPTS_VALUE )
+            pkt.dts = av_rescale_q(pkt.dts, enc->time_base, st->time_base);
+        pkt.duration = av_rescale_q(pkt.duration, enc->time_base, st->time_base);
+        pkt.stream_index = st->index;
+        int ret = av_interleaved_write_frame(out, &pkt);
+        av_free_packet(&pkt);
+        if( ret < 0 )
+            return false;
+        // at most one packet comes out for each picture that goes in
+        if( frame )
+            return true;
+    }
+}
+
+//
+// class ArchiveJob
+//
+ArchiveJob::ArchiveJob(Archiver *a, const QString &src, const QString &tag) :
+    archiver(a), source(src), event(tag)
+{
+}
+
+void ArchiveJob::run()
+{
+    QThread::currentThread()->setPriority(QThread::LowestPriority);
+#ifdef Q_OS_LINUX
+    // the normal scheduler ignores the thread priority, so the thread is niced
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), ARCHIVE_NICE);
+#endif
+
+    int slot = archiver->acquireSlot();
+    if( slot != -1 )
+    {
+        metrics.archiveActive.add(1);
+        qint64 start = Metrics::now();
+
+        QString base = source;
+        if( base.endsWith(".avi") )
+            base.chop(4);
+        QString part = base + ".part";
+        bool audio = false;
+        qint64 frames = 0;
+        bool ok = transcode(part, audio, frames);
+        QString target = base + ( audio ? ".mov" : ".mp4" );
+        if( ok )
+        {
+            QFile::remove(target);
+            ok = QFile::rename(part, target);
+        }
+        archiver->releaseSlot(slot);
+
+        if( ok )
+        {
+            qint64 in = QFileInfo(source).size();
+            QFile::remove(source);
+            metrics.archiveTime.observe(Metrics::now() - start);
+            metrics.archiveFiles.add();
+            metrics.archiveFrames.add(frames);
+            metrics.archiveBytesIn.add(in);
+            metrics.archiveBytesOut.add(QFileInfo(target).size());
+            QDEBUG << "archived" << source << "as" << target << frames << "frames";
+            QMetaObject::invokeMethod(archiver, "finished", Qt::QueuedConnection,
+                                      Q_ARG(QString, target), Q_ARG(QString, event));
+        } else
+        {
+            QFile::remove(part);
+            if( !archiver->stopping() )
+            {
+                metrics.archiveFailed.add();
+                qWarning() << "unable to transcode, kept as recorded:" << source;
+            }
+        }
+        metrics.archiveActive.add(-1);
+    }
+    archiver->pending.deref();
+    metrics.archivePending.add(-1);
+}
+
+// decode the MJPEG and encode it again as H.264 into 'dst';
+// the audio, if any, is copied
+bool ArchiveJob::transcode(const QString &dst, bool &audio, qint64 &frames)
+{
+    bool ok = false;
+    bool decopen = false;
+    bool encopen = false;
+    bool yuvalloc = false;
+    AVFormatContext *in = NULL;
+    AVFormatContext *out = NULL;
+    AVCodecContext *dec = NULL;
+    AVCodecContext *enc = NULL;
+    AVStream *ovs = NULL;
+    AVStream *oas = NULL;
+    AVFrame *picture = NULL;
+    AVFrame *yuv = NULL;
+    struct SwsContext *sws = NULL;
+    int vs = -1;
+    int as = -1;
+    QByteArray src = source.toLocal8Bit();
+    QByteArray name = dst.toLocal8Bit();
+
+    if( avformat_open_input(&in, src.constData(), NULL, NULL) < 0 )
+    {
+        qWarning() << "unable to open" << source;
+        return false;
+    }
+
+    do
+    {
+        if( avformat_find_stream_info(in, NULL) < 0 )
+            break;
+        for( unsigned int ii=0; ii<in->nb_streams; ii++ )
+        {
+            AVMediaType type = in->streams[ii]->codec->codec_type;
+            if( type == AVMEDIA_TYPE_VIDEO && vs < 0 )
+                vs = ii;
+            if( type == AVMEDIA_TYPE_AUDIO && as < 0 )
+                as = ii;
+        }
+        if( vs < 0 )
+            break;
+        audio = ( as >= 0 );
+
+        dec = in->streams[vs]->codec;
+        AVCodec *decoder = avcodec_find_decoder(dec->codec_id);
+        if( decoder == NULL || avcodec_open2(dec, decoder, NULL) < 0 )
+            break;
+        decopen = true;
+
+        AVCodec *encoder = avcodec_find_encoder_by_name("libx264");
+        if( encoder == NULL )
+            encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+        if( encoder == NULL )
+        {
+            qWarning() << "no H.264 encoder in libavcodec";
+            break;
+        }
+
+        // MP4 has no place for G.711 or pcm, QuickTime does
+        if( avformat_alloc_output_context2(&out, NULL, audio ? "mov" : "mp4", name.constData()) < 0 || out == NULL )
+            break;
+
+        ovs = avformat_new_stream(out, encoder);
+        if( ovs == NULL )
+            break;
+        enc = ovs->codec;
+        enc->width = dec->width;
+        enc->height = dec->height;
+        enc->sample_aspect_ratio = dec->sample_aspect_ratio;
+        enc->pix_fmt = encoder->pix_fmts ? encoder->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+        // the AVI frame times are kept
+        enc->time_base = in->streams[vs]->time_base;
+        ovs->time_base = enc->time_base;
+        // one thread, the cap on transcodes is also a cap on cores
+        enc->thread_count = 1;
+        if( out->oformat->flags & AVFMT_GLOBALHEADER )
+            enc->flags |= CODEC_FLAG_GLOBAL_HEADER;
+        // libx264 only, other encoders keep their defaults
+        av_opt_set(enc->priv_data, "preset", ARCHIVE_PRESET, 0);
+        av_opt_set(enc->priv_data, "crf", ARCHIVE_CRF, 0);
+        if( avcodec_open2(enc, encoder, NULL) < 0 )
+            break;
+        encopen = true;
+
+        if( audio )
+        {
+            oas = avformat_new_stream(out, NULL);
+            if( oas == NULL || avcodec_copy_context(oas->codec, in->streams[as]->codec) < 0 )
+                break;
+            oas->codec->codec_tag = 0;
+            oas->time_base = in->streams[as]->time_base;
+            if( out->oformat->flags & AVFMT_GLOBALHEADER )
+                oas->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+        }
+
+        if( avio_open(&out->pb, name.constData(), AVIO_FLAG_WRITE) < 0 )
+            break;
+        if( avformat_write_header(out, NULL) < 0 )
+            break;
+
+        picture = av_frame_alloc();
+        yuv = av_frame_alloc();
+        if( picture == NULL || yuv == NULL ||
+            avpicture_alloc((AVPicture*)yuv, enc->pix_fmt, enc->width, enc->height) < 0 )
+            break;
+        yuvalloc = true;
+        yuv->width = enc->width;
+        yuv->height = enc->height;
+        yuv->format = enc->pix_fmt;
+
+        bool failed = false;
+        int64_t lastpts = (int64_t)AV_NOPTS_VALUE;
+        AVPacket pkt;
+        while( !failed && av_read_frame(in, &pkt) >= 0 )
+        {
+            if( archiver->stopping() )
+                failed = true;
+            else
+            // the empty chunks stand for lost frames
+            if( pkt.stream_index == vs && pkt.size > 0 )
+            {
+                int got = 0;
+                // a damaged frame is left out
+                if( avcodec_decode_video2(dec, picture, &got, &pkt) < 0 )
+                    got = 0;
+                if( got )
+                {
+                    sws = sws_getCachedContext(sws, dec->width, dec->height, dec->pix_fmt,
+                                               enc->width, enc->height, enc->pix_fmt,
+                                               SWS_BICUBIC, NULL, NULL, NULL);
+                    if( sws == NULL )
+                    {
+                        failed = true;
+                    } else
+                    {
+                        sws_scale(sws, picture->data, picture->linesize, 0, dec->height,
+                                  yuv->data, yuv->linesize);
+                        // MJPEG has no reordering, the picture is this packet
+                        int64_t pts = pkt.pts != (int64_t)AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+                        if( lastpts != (int64_t)AV_NOPTS_VALUE && ( pts == (int64_t)AV_NOPTS_VALUE || pts <= lastpts ) )
+                            pts = lastpts + 1;
+                        else
+                        if( pts == (int64_t)AV_NOPTS_VALUE )
+                            pts = 0;
+                        yuv->pts = lastpts = pts;
+                        if( !encodeVideo(out, enc, ovs, yuv) )
+                            failed = true;
+                        frames++;
+                    }
+                }
+            } else
+            if( pkt.stream_index == as )
+            {
+                AVStream *ias = in->streams[as];
+                if( pkt.pts != (int64_t)AV_NOPTS_VALUE )
+                    pkt.pts = av_rescale_q(pkt.pts, ias->time_base, oas->time_base);
+                if( pkt.dts != (int64_t)AV_NOPTS_VALUE )
+                    pkt.dts = av_rescale_q(pkt.dts, ias->time_base, oas->time_base);
+                pkt.duration = av_rescale_q(pkt.duration, ias->time_base, oas->time_base);
+                pkt.pos = -1;
+                pkt.stream_index = oas->index;
+                if( av_interleaved_write_frame(out, &pkt) < 0 )
+                    failed = true;
+            }
+            av_free_packet(&pkt);
+        }
+        if( failed || frames == 0 )
+            break;
+        if( !encodeVideo(out, enc, ovs, NULL) )
+            break;
+        ok = ( av_write_trailer(out) == 0 );
+    } while( 0 );
+
+    if( sws )
+        sws_freeContext(sws);
+    if( yuvalloc )
+        avpicture_free((AVPicture*)yuv);
+    av_frame_free(&yuv);
+    av_frame_free(&picture);
+    if( encopen )
+        avcodec_close(enc);
+    if( decopen )
+        avcodec_close(dec);
+    if( out )
+    {
+        if( out->pb )
+            avio_close(out->pb);
+        avformat_free_context(out);
+    }
+    avformat_close_input(&in);
+    return ok;
+}
+
+//
+// class Archiver
+//
+Archiver::Archiver() :
+    threads(0), pending(0), halt(0)
+{
+}
+
+Archiver::~Archiver()
+{
+    stop();
+}
+
+// at most 'n' transcodes at once on this host, 0 turns it off
+void Archiver::setThreads(int n)
+{
+    threads = qMax(n, 0);
+    if( threads == 0 )
+        return;
+    pool.setMaxThreadCount(threads);
+    av_register_all();
+    avcodec_register_all();
+    av_lockmgr_register(lockManager);
+}
+
+bool Archiver::archive(const QString &filename, const QString &tag)
+{
+    if( threads == 0 || stopping() )
+        return false;
+    if( (int)pending >= ARCHIVE_QUEUE_MAX )
+    {
+        qWarning() << "archive queue full, kept as recorded:" << filename;
+        return false;
+    }
+    pending.ref();
+    metrics.archivePending.add(1);
+    pool.start(new ArchiveJob(this, filename, tag));
+    return true;
+}
+
+// the transcodes are abandoned, their AVI files stay as they are
+void Archiver::stop()
+{
+    halt.fetchAndStoreOrdered(1);
+    pool.waitForDone();
+}
+
+// a transcode is announced like the recording it replaces
+void Archiver::finished(QString target, QString tag)
+{
+    if( vchannel && !tag.isEmpty() )
+        vchannel->sendEventMessage(tag + target + "</" STR_VIDEO ">");
+}
+
+// wait for one of the host wide slots, -1 if stopped first.
+// The slots are files locked for the length of a transcode;
+// the lock goes with the process if it dies
+int Archiver::acquireSlot()
+{
+#ifndef _WIN32
+    while( !stopping() )
+    {
+        bool opened = false;
+        for( int ii=0; ii<threads; ii++ )
+        {
+            QString path = QDir::tempPath() + QString("/vchannel-archive.%1.lock").arg(ii);
+            int fd = open(path.toLocal8Bit().constData(), O_RDWR | O_CREAT, 0666);
+            if( fd < 0 )
+                continue;
+            opened = true;
+            if( flock(fd, LOCK_EX | LOCK_NB) == 0 )
+                return fd;
+            close(fd);
+        }
+        if( !opened )
+        {
+            QDEBUG << "no archive lock files, the channels do not share the cap";
+            return NO_SLOT_FILE;
+        }
+        usleep(ARCHIVE_POLL*1000);
+    }
+    return -1;
+#else
+    // only the pool of this channel limits the transcodes
+    return stopping() ? -1 : NO_SLOT_FILE;
+#endif
+}
+
+void Archiver::releaseSlot(int fd)
+{
+#ifndef _WIN32
+    if( fd >= 0 )
+        close(fd);
+#else
+    Q_UNUSED(fd);
+#endif
+}
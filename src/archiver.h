@@ -0,0 +1,93 @@
+/**
+ * FILE:		archiver.h
+ *
+ * DESCRIPTION:
+ * This is the class for transcoding the MJPEG recordings to H.264
+ * in the background, once they have been written
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef ARCHIVER_H
+#define ARCHIVER_H
+
+#include <QObject>
+#include <QString>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QAtomicInt>
+
+class Archiver;
+
+/*
+ * ArchiveJob
+ * one AVI recording. The H.264 file is written next to it under a
+ * temporary name, and only replaces the AVI once it is complete.
+ * Audio is copied as it was recorded, so a recording with audio
+ * becomes a QuickTime file rather than an MP4.
+ */
+class ArchiveJob : public QRunnable
+{
+public:
+    ArchiveJob(Archiver *a, const QString &src, const QString &tag);
+    void run();
+
+private:
+    bool transcode(const QString &dst, bool &audio, qint64 &frames);
+
+    Archiver *archiver;
+    QString source;
+    QString event;             // opening tag of the event message
+};
+
+/*
+ * Archiver
+ * runs the jobs on a pool of at most 'n' threads at the lowest priority,
+ * so they only use the time live ingest leaves. Every vchannel on the
+ * host shares the same 'n' slots, taken by locking a file per slot.
+ * The finished recordings are announced from the main thread.
+ */
+class Archiver : public QObject
+{
+    Q_OBJECT
+public:
+    Archiver();
+    ~Archiver();
+    void setThreads(int n);
+    bool enabled() { return threads > 0; }
+    // true if the recording was queued
+    bool archive(const QString &filename, const QString &tag);
+    void waitForDone() { pool.waitForDone(); }
+    void stop();
+    bool stopping() { return (int)halt != 0; }
+
+public slots:
+    void finished(QString target, QString tag);
+
+private:
+    int  acquireSlot();
+    void releaseSlot(int fd);
+
+    int threads;
+    QThreadPool pool;
+    QAtomicInt pending;        // queued or running
+    QAtomicInt halt;
+    friend class ArchiveJob;
+};
+
+extern Archiver archiver;
+
+#endif // ARCHIVER_H
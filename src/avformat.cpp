@@ -22,6 +22,7 @@
 
 #include <QtDebug>
 #include <QDir>
+#include <QFileInfo>
 #include <QStatusBar>
 #include <QTimer>
 #include <QLabel>
@@ -29,6 +30,8 @@
 #include "vchannel.h"
 #include "avformat.h"
 #include "recordschedule.h"
+#include "accessunit.h"
+#include "archiver.h"
 
 
 using namespace command_line_arguments;
@@ -45,7 +48,7 @@ extern RecordSchedule recordschedule;
  *  AvFormat class
  */
 
-AvFormat::AvFormat(ChannelFormat * ch0, ChannelFormat * ch1 ): streams(STREAMS_NONE), stopstreaming(false), writeon(false)
+AvFormat::AvFormat(ChannelFormat * ch0, ChannelFormat * ch1 ): streams(STREAMS_NONE), stopstreaming(false), writeon(false), pendingwrite(false)
 {
     QDir dir(directory);
 
@@ -80,6 +83,22 @@ void AvFormat::setImageSize(int w, int h)
     avchannel1->setImageSize(w,h);
 }
 
+void AvFormat::setAudioPayload(int pt)
+{
+	Q_ASSERT(avchannel0);
+	Q_ASSERT(avchannel1);
+    avchannel0->setAudioPayload(pt);
+    avchannel1->setAudioPayload(pt);
+}
+
+void AvFormat::setWallclock(STREAMS stream, quint32 tstamp, qint64 ms)
+{
+	Q_ASSERT(avchannel0);
+	Q_ASSERT(avchannel1);
+    avchannel0->setWallclock(stream, tstamp, ms);
+    avchannel1->setWallclock(stream, tstamp, ms);
+}
+
 void AvFormat::setChannelID(QString id, STREAMS s )
 {
     channelid = id;
@@ -92,6 +111,9 @@ void AvFormat::setChannelID(QString id, STREAMS s )
 
 bool AvFormat::writeFinal()
 {
+    // the segment before is written first
+    writePending();
+
     datetime = prevdatetime;
     prevdatetime = QDateTime();
     if( channel == 0 )
@@ -112,6 +134,8 @@ bool AvFormat::writeFinal()
 void AvFormat::switchChannel()
 {
 	QDEBUG << __FUNCTION__  << channel;
+    // a write still waiting is done before its channel is reused
+    writePending();
     datetime = prevdatetime;
     prevdatetime = QDateTime::currentDateTime();
     if( channel == 0 )
@@ -121,7 +145,18 @@ void AvFormat::switchChannel()
         channel = 0;
     else
         return;
-    QTimer::singleShot(1, this, SLOT(writeChannel()));
+    // with a timelapse the write waits for the motion that may follow,
+    // so the end of the segment can be kept as its pre-roll
+    pendingwrite = true;
+    QTimer::singleShot(recordschedule.isTimelapse(datetime) ? SECS_BEFORE_EVENT*1000 : 1, this, SLOT(writePending()));
+}
+
+void AvFormat::writePending()
+{
+    if( !pendingwrite )
+        return;
+    pendingwrite = false;
+    writeChannel();
 }
 
 void AvFormat::writeChannel()
@@ -141,7 +176,9 @@ void AvFormat::writeChannel()
 
     QDir dir(path);
     writeon = false;
-    qint64 duration = datetime.msecsTo(QDateTime::currentDateTime());
+    bool timelapse = false;
+    // the segment ended at the switch, which may be a little while ago
+    qint64 duration = datetime.msecsTo(prevdatetime.isValid() ? prevdatetime : QDateTime::currentDateTime());
     QString ftime = QString("%1").arg(datetime.toTime_t());
     QString flength = QString("%1").arg(duration/1000);
     QString ftype   = QString("%1").arg(recordschedule.eventType(datetime));
@@ -160,33 +197,54 @@ void AvFormat::writeChannel()
         // check whether the schedules allows writing
         // see whether the start of recording overlaps
         writeon = recordschedule.isScheduled(datetime);
+        // motion modes can write a timelapse between the motion
+        timelapse = recordschedule.isTimelapse(datetime);
+        writeon = writeon || timelapse;
     }
 
     if( writeon)
     {
         QDEBUG << __FUNCTION__ <<  "write file:" << filename;
         bool res = false;
+        qint64 start = Metrics::now();
 
+        ChannelFormat *written = NULL;
         if( channel == 0 )
         {
+            avchannel1->setTimelapse(timelapse ? recordschedule.timelapseSecs() : 0);
             res = avchannel1->writeAv(filename,streams, datetime, duration );
+            written = avchannel1;
         } else
         if( channel == 1 )
         {
+            avchannel0->setTimelapse(timelapse ? recordschedule.timelapseSecs() : 0);
             res = avchannel0->writeAv(filename,streams, datetime, duration  );
+            written = avchannel0;
         }
+        // a segment that could not be written is thrown away,
+        // rather than carried into the next one
+        if( !res && written )
+            written->deleteFrames();
+        metrics.writeTime.observe(Metrics::now() - start);
+        if( res )
+            metrics.writeBytes.add(QFileInfo(filename).size());
 
         //notify the main program of a new file
         if( res )
         {
+            QString tag = "<" STR_VIDEO " time='" + ftime + "' length='" +
+            		flength + "' type='" + ftype + "' >";
             if( vchannel )
             {
-                QString qs = "<" STR_VIDEO " time='" + ftime + "' length='" +
-                		flength + "' type='" + ftype + "' >";
+                QString qs = tag;
                 qs += filename;
                 qs += "</" STR_VIDEO ">";
                 vchannel->sendEventMessage(qs);
             }
+            // MJPEG is transcoded to H.264 in the background with --archive,
+            // and the new file is announced the same way
+            if( archiver.enabled() && filename.endsWith(".avi") )
+                archiver.archive(filename, tag);
         }
     } else
     {
@@ -202,17 +260,17 @@ void AvFormat::writeChannel()
 }
 
 
-int AvFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream )
+int AvFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream, quint32 tstamp )
 {
 	int ret = 0;
     if( stopstreaming ) return 1;
 
 
     if( channel == 0 )
-        ret = avchannel0 -> recordFrame(frame, size, stream, writeon);
+        ret = avchannel0 -> recordFrame(frame, size, stream, writeon, tstamp);
     else
     if( channel == 1 )
-        ret = avchannel1 -> recordFrame(frame, size, stream, writeon);
+        ret = avchannel1 -> recordFrame(frame, size, stream, writeon, tstamp);
     else // we are done - stop recording
         return -1;
 
@@ -223,3 +281,28 @@ int AvFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream )
     return ret;
 }
 
+// as recordFrame, the access unit is owned by the channel from here on
+int AvFormat::recordAccessUnit(AccessUnit *au)
+{
+    int ret = 0;
+    if( stopstreaming )
+    {
+        accessunits.release(au);
+        return 1;
+    }
+
+    if( channel == 0 )
+        ret = avchannel0 -> recordAccessUnit(au, writeon);
+    else
+    if( channel == 1 )
+        ret = avchannel1 -> recordAccessUnit(au, writeon);
+    else // we are done - stop recording
+    {
+        accessunits.release(au);
+        return -1;
+    }
+
+    if( ret == 0 )
+        switchChannel();
+    return ret;
+}
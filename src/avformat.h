@@ -39,19 +39,20 @@ public:
     AvFormat(ChannelFormat * ch0, ChannelFormat * ch1);
     ~AvFormat();
     void setImageSize(int w, int h);
+    void setAudioPayload(int pt);
+    void setWallclock(STREAMS stream, quint32 tstamp, qint64 ms);
     void setChannelID(QString id, STREAMS s );
     void stop() { stopstreaming = true; }
-    const QByteArray *frame() { \
-    	if(channel==0 && avchannel0) return avchannel0->frame(); \
-    	if(channel==1 && avchannel1) return avchannel1->frame(); \
-    	return NULL;}
     void switchChannel();
+    bool compressedAudio() { return avchannel0 && avchannel0->compressedAudio(); }
     // to be re-implemented depending on the av format
     virtual bool writeFinal();
-    virtual int recordFrame(const unsigned char *frame, int size, STREAMS stream );
+    virtual int recordFrame(const unsigned char *frame, int size, STREAMS stream, quint32 tstamp );
+    virtual int recordAccessUnit(AccessUnit *au);
 
 public slots:
     void writeChannel();
+    void writePending();
 
 private:
     QString channelid;
@@ -60,6 +61,7 @@ private:
     QDateTime prevdatetime;
     bool stopstreaming;
     bool writeon;
+    bool pendingwrite;         // the segment before is still to be written
 
     volatile int channel;
     ChannelFormat *avchannel0;
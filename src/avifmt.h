@@ -126,6 +126,10 @@ typedef struct {
   WORD  cbSize;
 }WAVEFORMATEX;
 
+#define WAVE_FORMAT_PCM   0x0001
+#define WAVE_FORMAT_ALAW  0x0006
+#define WAVE_FORMAT_MULAW 0x0007
+
 struct AVI_odml
 {
     unsigned char id[4];
@@ -38,6 +38,9 @@ extern VChannel   *vchannel;
 extern QString globalstatus;
 extern RecordSchedule recordschedule;
 
+// a larger gap in the RTP timestamps is taken as a discontinuity, not a loss
+#define MAX_DROP_FRAMES 100
+
 /*
  * AviChannelFormat
  */
@@ -54,7 +57,12 @@ AviChannelFormat::~AviChannelFormat()
     QDEBUG << __FUNCTION__;
 }
 
-int AviChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream, bool writeon )
+bool AviChannelFormat::compressedAudio()
+{
+    return ng711 != 0;
+}
+
+int AviChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream, bool writeon, quint32 tstamp )
 {
     int ret = 1;
     Q_ASSERT(frame);
@@ -69,18 +77,18 @@ int AviChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS
         QDEBUG << "timer start";
     }
 
-    QByteArray *f = new QByteArray((const char*)frame,size);
-    if(f)
+    // video chunks are rounded up to 4 bytes
+    ArenaBuffer f = arena.copy(frame, size, stream == STREAMS_VIDEO ? 4 : 1);
+    if( !f.isNull() )
     {
         if( stream == STREAMS_VIDEO )
         {
-            // round up to 4 bytes
-            int tmp = ((4-(size%4)) % 4);
-            while(tmp--) f->append('\0');
-            jpgSize += f->length();
+            jpgSize += f.size;
 
             videoListMarker.append( dataList.count() );
             dataList.append(f);
+            addTime(tstamp);
+            buffered(f.size);
             frames++;
 
             if( framecount == 0 )
@@ -104,7 +112,9 @@ int AviChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS
         {
             audioListMarker.append( dataList.count() );
             dataList.append(f);
-            samples+= f->length();
+            addTime(tstamp);
+            buffered(f.size);
+            samples+= f.size;
         }
         else
         {
@@ -135,11 +145,121 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
     int ms = timer.elapsed()+300;   // time elapsed in milliseconds
     int buffers = dataList.count();
     int us_per_frame = (1000*ms)/frames;
+    bool timed = ( timeList.count() == buffers );
+
+    // with a timelapse, the frames away from motion that are not kept are
+    // written as empty (drop) frames, so the timing stays as recorded
+    if( timelapse > 0 )
+    {
+        QVector<qint8> kind(buffers, BUFFER_AUDIO);
+        foreach( quint32 vv, videoListMarker )
+            kind[vv] = BUFFER_KEY;
+        QVector<bool> keep = filterGops(kind);
+        for( int ii=0; ii<buffers; ii++ )
+        {
+            if( keep.at(ii) )
+                continue;
+            jpgSize -= dataList.at(ii).size;
+            dataList[ii].size = 0;
+        }
+    }
+    // bytes per audio sample: G.711 as received or 16-bit pcm
+    int bps = compressedAudio() ? 1 : 2;
+    char silencebyte = 0;
+    if( bps == 1 )
+        silencebyte = ( audiopayload == PAYLOAD_PCMA ) ? (char)0xd5 : (char)0xff;
+
+    // the frame interval is taken from the RTP clock of the video:
+    // the mean of the deltas, leaving out the gaps where frames were lost
+    quint32 interval = 0;
+    if( timed && videoListMarker.count() > 1 )
+    {
+        for( int pass=0; pass<2; pass++ )
+        {
+            qint64 sum = 0;
+            int cnt = 0;
+            for( int vv=1; vv<videoListMarker.count(); vv++ )
+            {
+                qint32 delta = rtpDelta( timeList.at(videoListMarker.at(vv-1)), timeList.at(videoListMarker.at(vv)) );
+                if( delta > 0 && delta < RTP_VIDEO_CLOCK*10 && ( pass==0 || (quint32)delta <= interval*3/2 ) )
+                {
+                    sum += delta;
+                    cnt++;
+                }
+            }
+            if( cnt )
+                interval = sum/cnt;
+        }
+    }
+
+    // the audio starts against the first video frame by the sender reports
+    quint32 audiolead = 0;
+    if( timed && !videoListMarker.isEmpty() )
+        audiolead = alignAudio(audioListMarker, timeList.at(videoListMarker.at(0)), bps);
+
+    // lost video frames are replaced by empty (drop) frames and gaps in the
+    // audio by silence, so both streams stay in step with their RTP clocks
+    QList<quint32> padding;
+    quint32 dropframes = 0;
+    quint32 silence = 0;
+    quint32 padchunks = 0;
+    quint32 alignbytes = 0;     // after each chunk of an odd size, to keep the next word aligned
+    {
+        int aa = 0;
+        int vv = 0;
+        quint32 prevvideo = 0;
+        quint32 nextaudio = 0;
+        for( int ii=0; ii<buffers; ii++ )
+        {
+            quint32 pad = 0;
+            if( audioListMarker.count()==0 || ( vv < videoListMarker.count() && videoListMarker.at(vv) == (quint32)ii ) )
+            {
+                if( interval && vv > 0 )
+                {
+                    qint32 delta = rtpDelta( prevvideo, timeList.at(ii) );
+                    if( delta > 0 )
+                        pad = ( delta + interval/2 ) / interval - 1;
+                    if( pad > MAX_DROP_FRAMES )
+                        pad = 0;
+                }
+                prevvideo = timed ? timeList.at(ii) : 0;
+                alignbytes += dataList.at(ii).size & 1;
+                dropframes += pad;
+                padchunks += pad;
+                vv++;
+            } else
+            if( aa < audioListMarker.count() && audioListMarker.at(aa) == (quint32)ii )
+            {
+                if( aa == 0 )
+                    pad = audiolead;
+                if( timed && aa > 0 )
+                {
+                    qint32 delta = rtpDelta( nextaudio, timeList.at(ii) );
+                    if( delta > 0 && delta <= RTP_AUDIO_CLOCK )
+                        pad = bps*delta;
+                }
+                if( timed )
+                    nextaudio = timeList.at(ii) + dataList.at(ii).size/bps;
+                silence += pad;
+                alignbytes += ( pad & 1 ) + ( dataList.at(ii).size & 1 );
+                if( pad ) padchunks++;
+                aa++;
+            }
+            padding.append(pad);
+        }
+    }
+    if( interval )
+    {
+        ms = ((frames + dropframes) * interval) / (RTP_VIDEO_CLOCK/1000);
+        if( ms <= 0 ) ms = 1;
+        us_per_frame = ((quint64)interval * 1000000) / RTP_VIDEO_CLOCK;
+    }
+    QDEBUG << "interval" << interval << "drop frames" << dropframes << "silence" << silence;
 
     if( streams == STREAMS_AV ) // todo: handle other cases
-        riffSize = sizeof(AVI_list_hdrl) + 4 + sizeof(AVI_list_strl_a) + 4 + jpgSize + samples + buffers*24+16 ;  //todo
+        riffSize = sizeof(AVI_list_hdrl) + 4 + sizeof(AVI_list_strl_a) + 4 + jpgSize + samples + silence + alignbytes + (buffers+padchunks)*24+16 ;  //todo
     else
-        riffSize = sizeof(AVI_list_hdrl) + 4 + 4 + jpgSize +  buffers*24+16;  //todo
+        riffSize = sizeof(AVI_list_hdrl) + 4 + 4 + jpgSize + alignbytes + (buffers+padchunks)*24+16;  //todo
 
     if( riffSize >= maxRiffSize )
     {
@@ -176,7 +296,7 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 		 avih.max_bytes_per_sec = (1000*jpgSize)/ms;  // bytes per second
 		 avih.padding           = 0;
 		 avih.flags             = AVIF_HASINDEX | AVIF_WASCAPTUREFILE | AVIF_ISINTERLEAVED;
-		 avih.tot_frames        = buffers;
+		 avih.tot_frames        = buffers + padchunks;
 		 avih.init_frames       = 0;
 		 avih.streams           = (streams==STREAMS_AV?2:1);        // for audio as well change to 2
 		 avih.buff_sz           = 100000;
@@ -207,12 +327,20 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 			strh.priority=0;
 			//strh.language=0;
 			strh.init_frames=0; // todo   us_per_frame;       /* initial frames (???) */
-			strh.scale=16;
-			strh.rate=strh.scale* (frames*1000)/ms;
+			if( interval )
+			{
+				// one frame per RTP interval
+				strh.scale=interval;
+				strh.rate=RTP_VIDEO_CLOCK;
+			} else
+			{
+				strh.scale=16;
+				strh.rate=strh.scale* (frames*1000)/ms;
+			}
 			QDEBUG << "rate=" <<strh.rate;
 
 			strh.start=0;
-			strh.length=frames;
+			strh.length=frames + dropframes;
 			strh.buff_sz=0;           /* suggested buffer size */
 			strh.quality=0;
 			strh.sample_sz=0;
@@ -271,10 +399,10 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 			strh.scale=1;
 			strh.rate=8000;
 			strh.start=0;
-			strh.length=samples;
+			strh.length=(samples + silence)/bps;
 			strh.buff_sz=0;           /* suggested buffer size */
 			strh.quality=0;
-			strh.sample_sz=2;
+			strh.sample_sz=bps;
 			strh.rect = 0;
 			out << LI4(sizeof(AVI_strh));
 			out.writeRawData((const char*)&strh, sizeof(strh) );   // output includes the length
@@ -283,13 +411,16 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 			out.writeRawData(TAG_strf,sizeof(TAG_strf));
 			out << LI4(sizeof(WAVEFORMATEX));
 			WAVEFORMATEX strf;
-			strf.wFormatTag = 0x0001; // PCM audio
+			if( bps == 1 )
+				strf.wFormatTag = ( audiopayload == PAYLOAD_PCMA ) ? WAVE_FORMAT_ALAW : WAVE_FORMAT_MULAW;
+			else
+				strf.wFormatTag = WAVE_FORMAT_PCM;
 			strf.cbSize = 0;     // extra format info
-			strf.nBlockAlign = 2;
+			strf.nBlockAlign = bps;
 			strf.nChannels = 1;
-			strf.nSamplesPerSec = 8000;
+			strf.nSamplesPerSec = RTP_AUDIO_CLOCK;
 			strf.nAvgBytesPerSec = strf.nBlockAlign * strf.nSamplesPerSec;
-			strf.wBitsPerSample =16;
+			strf.wBitsPerSample = 8*bps;
 			out.writeRawData((const char*)&strf, sizeof(strf) );   // output includes the length
 		}
                  //                        // list odml
@@ -306,7 +437,7 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 
 		// list movi
 		out.writeRawData(TAG_LIST,sizeof(TAG_LIST));
-		size = jpgSize + samples + 8*buffers + 4;
+		size = jpgSize + samples + silence + alignbytes + 8*(buffers+padchunks) + 4;
 		out << LI4(size);
 		out.writeRawData(TAG_movi,sizeof(TAG_movi));
 
@@ -315,57 +446,97 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 		QDEBUG << "Saving buffers:" << buffers;
 		for(uint ii=0; ii<(uint)buffers; ii++)
 		{
-			QByteArray *frame = dataList.at(ii);
-			int sz = frame->size();
+			const ArenaBuffer &frame = dataList.at(ii);
+			int sz = frame.size;
+			quint32 pad = padding.at(ii);
 
 			if( audioListMarker.count()==0 || ( vv < videoListMarker.count() && videoListMarker.at(vv) == ii ) )
 			{
 				vv++;
+				// empty chunks for the lost frames
+				while( pad-- )
+				{
+					out.writeRawData(TAG_00db,sizeof(TAG_00db));
+					out << LI4(0);
+				}
 				// video stream tag
 				out.writeRawData(TAG_00db,sizeof(TAG_00db));
 			} else
 			if( aa < audioListMarker.count() && audioListMarker.at(aa) == ii )
 			{
 				aa++;
+				// silence for the lost samples
+				if( pad )
+				{
+					out.writeRawData(TAG_01wb,sizeof(TAG_01wb));
+					out << LI4(pad);
+					out.writeRawData(QByteArray(pad,silencebyte).constData(),pad);
+					if( pad & 1 )
+						out.writeRawData("\0",1);
+				}
 				// audio stream tag
 				out.writeRawData(TAG_01wb,sizeof(TAG_01wb));
 			}
 			out << LI4(sz);
-			out.writeRawData(frame->constData(),sz);
+			out.writeRawData(frame.data,sz);
+			// the word alignment byte is not part of the chunk
+			if( sz & 1 )
+				out.writeRawData("\0",1);
 		}
 
 		// write indices
 		out.writeRawData(TAG_idx1,sizeof(TAG_idx1));
-		size = 16*buffers;
+		size = 16*(buffers+padchunks);
 		out << LI4(size);
 		quint32 offset = 4;
 		aa = 0;
 		vv = 0;
 		for(uint ii=0; ii<(uint)buffers; ii++)
 		{
-			QByteArray *frame = dataList.at(ii);
+			int sz = dataList.at(ii).size;
+			quint32 pad = padding.at(ii);
 			if( audioListMarker.count()==0 || ( vv < videoListMarker.count() && videoListMarker.at(vv) == ii ) )
 			{
 				vv++;
+				// drop frames are not key frames
+				while( pad-- )
+				{
+					out.writeRawData(TAG_00db,sizeof(TAG_00db));
+					out << LI4(0);
+					out << LI4(offset);
+					out << LI4(0);
+					offset += 8;
+				}
 				// video stream tag
 				out.writeRawData(TAG_00db,sizeof(TAG_00db));
 			} else
 			if( aa < audioListMarker.count() && audioListMarker.at(aa) == ii )
 			{
 				aa++;
+				if( pad )
+				{
+					out.writeRawData(TAG_01wb,sizeof(TAG_01wb));
+					out << LI4(16);
+					out << LI4(offset);
+					out << LI4(pad);
+					offset += pad + ( pad & 1 ) + 8;
+				}
 				// audio stream tag
 				out.writeRawData(TAG_01wb,sizeof(TAG_01wb));
 			}
 
 			out << LI4(16);
 			out << LI4(offset);
-			out << LI4(frame->size());
-			offset += frame->size() + 8;
-			// clean up the buffer
-			delete frame;
+			out << LI4(sz);
+			offset += sz + ( sz & 1 ) + 8;
 		}
 		out.writeRawData("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0",32);
+		tracePersisted(audioListMarker);
+		// the buffers of the segment go all at once
 		dataList.clear();
+		arena.reset();
+		clearTimes();
+		released();
 		audioListMarker.clear();
 		videoListMarker.clear();
 		frames = 0;
@@ -388,18 +559,14 @@ bool AviChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, q
 //
 void AviChannelFormat::deleteFrames()
 {
-    int buffers = dataList.count();
-
-    QDEBUG << "delete all frames:" << buffers;
-
-    for(uint ii=0; ii<(uint)buffers; ii++)
-    {
-        QByteArray *frame = dataList.at(ii);
-        // clean up the buffer
-        if( frame ) delete frame;
-    }
+    QDEBUG << "delete all frames:" << dataList.count();
 
     dataList.clear();
+    arena.reset();
+    clearTimes();
+    released();
+    audioListMarker.clear();
+    videoListMarker.clear();
 
     // reset the state
     frames = 0;
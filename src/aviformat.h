@@ -66,8 +66,10 @@ public:
     AviChannelFormat();
     ~AviChannelFormat();
     bool writeAv(QString filename, STREAMS streams, QDateTime &, qint64 );
-    int recordFrame(const unsigned char *frame, int size, STREAMS stream,bool writeon );
+    int recordFrame(const unsigned char *frame, int size, STREAMS stream,bool writeon, quint32 tstamp );
     void deleteFrames();
+    // G.711 is recorded as received with --g711
+    bool compressedAudio();
 
 private:
     quint32 maxRiffSize;
@@ -0,0 +1,636 @@
+/**
+ * FILE:		bench.cpp
+ *
+ * DESCRIPTION:
+ * This is the offline benchmark, it replays recorded RTP captures
+ * through the receive, decode, motion and record pipeline
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QMap>
+#include <QStringList>
+#include <QtAlgorithms>
+
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include "../include/common.h"
+#include "vchannel.h"
+#include "rtspsocket.h"
+#include "rtpsocket.h"
+#include "avformat.h"
+#include "aviformat.h"
+#include "h264video.h"
+#include "recordschedule.h"
+#include "metrics.h"
+#include "trace.h"
+#include "archiver.h"
+
+// the settings main.cpp provides to the pipeline
+namespace command_line_arguments {
+
+	QString directory   = QDir::tempPath() + "/";
+
+	QString qsname      = "vchannel-bench";
+	QString qscname      = qsname;
+	QString qshardware;
+	QString qsurl       = "";
+	QString qseventaddress;
+	QString qsauth;
+	QString record_settings = RECORD_SETTINGS_ALL;
+
+	int     px = 0;
+	int     py = 0;
+	int     pw = 0;
+	int     ph = 0;
+
+	int     ndevice     = 0;
+	int     naudio      = 0;
+	int     nborder     = 0;
+	int     nevents     = 0;
+	int     nlock       = 0;
+	bool    usetcp = false;
+	int     threshold   = 50;
+	int     sensitivity = 50;
+	int     mx = 0;
+	int     my = 0;
+	int     mw = 100;
+	int     mh = 100;
+	QStringList motionzones;
+	QStringList motionexcludes;
+	int     nhls = 0;
+	int     ng711 = 0;
+	int     narchive = 0;
+	int     ntimelapse = 0;
+	int     nvectors = 0;
+}
+
+int 	debugsetting = 0;
+
+using namespace command_line_arguments;
+
+// there is no window, so no events are sent or shown
+QStatusBar *statusbar = NULL;
+VChannel   *vchannel  = NULL;
+
+extern RecordSchedule recordschedule;
+
+// a captured packet and when it arrived, relative to the first
+class BenchPacket
+{
+public:
+    BenchPacket(qint64 t, const QByteArray &d, bool r) : us(t), data(d), rtcp(r) {}
+    qint64     us;
+    QByteArray data;
+    bool       rtcp;
+};
+
+static quint32 get16(const uchar *p, bool swap)
+{
+    return swap ? (p[0]<<8) | p[1] : (p[1]<<8) | p[0];
+}
+
+static quint32 get32(const uchar *p, bool swap)
+{
+    return swap ? ((quint32)p[0]<<24) | ((quint32)p[1]<<16) | ((quint32)p[2]<<8) | p[3]
+                : ((quint32)p[3]<<24) | ((quint32)p[2]<<16) | ((quint32)p[1]<<8) | p[0];
+}
+
+// RTP version 2, and RTCP is told apart by its packet types 200-204
+static bool isRtp(const uchar *p, int len, bool &rtcp)
+{
+    if( len <= 12 || (p[0] >> 6) != 2 )
+        return false;
+    rtcp = p[1] >= 200 && p[1] <= 204;
+    return true;
+}
+
+/*
+ * readPcap
+ * the UDP payloads of a libpcap capture, over Ethernet (with VLAN tags),
+ * Linux cooked, loopback or raw IP links. Fragmented IPv4 datagrams,
+ * IPv6 extension headers and TCP streams are skipped.
+ */
+static bool readPcap(const QByteArray &file, int port, QList<BenchPacket> &packets)
+{
+    const uchar *p = (const uchar*)file.constData();
+    int size = file.size();
+    if( size < 24 )
+        return false;
+
+    quint32 magic = get32(p, false);
+    bool swap = false;
+    bool nsec = false;
+    switch( magic )
+    {
+    case 0xa1b2c3d4: break;
+    case 0xd4c3b2a1: swap = true; break;
+    case 0xa1b23c4d: nsec = true; break;
+    case 0x4d3cb2a1: swap = true; nsec = true; break;
+    default:
+        return false;
+    }
+    quint32 link = get32(p+20, swap);
+
+    qint64 first = -1;
+    int pos = 24;
+    while( pos + 16 <= size )
+    {
+        qint64 us = (qint64)get32(p+pos, swap)*1000000 +
+                    (nsec ? get32(p+pos+4, swap)/1000 : get32(p+pos+4, swap));
+        int len = (int)get32(p+pos+8, swap);
+        pos += 16;
+        if( len < 0 || pos + len > size )
+            break;
+        const uchar *f = p + pos;
+        pos += len;
+
+        // find the IP header
+        int ip = 0;
+        switch( link )
+        {
+        case 1:         // Ethernet
+            {
+                ip = 14;
+                int type = len >= 14 ? (f[12]<<8) | f[13] : 0;
+                while( (type == 0x8100 || type == 0x88a8) && ip + 4 <= len )
+                {
+                    type = (f[ip+2]<<8) | f[ip+3];
+                    ip += 4;
+                }
+                if( type != 0x0800 && type != 0x86dd )
+                    continue;
+            }
+            break;
+        case 113:       // Linux cooked
+            ip = 16;
+            break;
+        case 276:       // Linux cooked v2
+            ip = 20;
+            break;
+        case 0:         // BSD loopback
+            ip = 4;
+            break;
+        case 12:
+        case 14:
+        case 101:       // raw IP
+            ip = 0;
+            break;
+        default:
+            qWarning() << "Unsupported pcap link type" << link;
+            return false;
+        }
+        if( ip >= len )
+            continue;
+
+        int udp = 0;
+        if( (f[ip] >> 4) == 4 )
+        {
+            if( ip + 20 > len )
+                continue;
+            int ihl = (f[ip] & 0x0f)*4;
+            // fragments other than a whole datagram are not reassembled
+            if( f[ip+9] != 17 || (((f[ip+6]<<8) | f[ip+7]) & 0x3fff) != 0 )
+                continue;
+            udp = ip + ihl;
+        } else
+        if( (f[ip] >> 4) == 6 )
+        {
+            if( ip + 40 > len || f[ip+6] != 17 )
+                continue;
+            udp = ip + 40;
+        } else
+            continue;
+        if( udp + 8 > len )
+            continue;
+        if( port && ((f[udp+2]<<8) | f[udp+3]) != port )
+            continue;
+
+        int datacnt = qMin(((f[udp+4]<<8) | f[udp+5]) - 8, len - udp - 8);
+        bool rtcp = false;
+        if( !isRtp(f+udp+8, datacnt, rtcp) )
+            continue;
+        if( first < 0 )
+            first = us;
+        packets.append(BenchPacket(us - first, QByteArray((const char*)f+udp+8, datacnt), rtcp));
+    }
+    return true;
+}
+
+/*
+ * readRtpdump
+ * the rtpdump format of rtptools: a "#!rtpplay1.0" line, a 16 byte
+ * header, then for each packet its length, RTP length (0 for RTCP)
+ * and offset in ms, all big endian
+ */
+static bool readRtpdump(const QByteArray &file, QList<BenchPacket> &packets)
+{
+    if( !file.startsWith("#!rtpplay") )
+        return false;
+    int pos = file.indexOf('\n');
+    if( pos < 0 )
+        return false;
+    pos += 1 + 16;
+
+    const uchar *p = (const uchar*)file.constData();
+    int size = file.size();
+    while( pos + 8 <= size )
+    {
+        int len = (int)get16(p+pos, true);
+        int plen = (int)get16(p+pos+2, true);
+        qint64 us = (qint64)get32(p+pos+4, true)*1000;
+        if( len < 8 || pos + len > size )
+            break;
+        const uchar *d = p + pos + 8;
+        int datacnt = plen ? qMin(plen, len-8) : len-8;
+        pos += len;
+
+        bool rtcp = false;
+        if( isRtp(d, datacnt, rtcp) )
+            packets.append(BenchPacket(us, QByteArray((const char*)d, datacnt), rtcp));
+    }
+    return true;
+}
+
+static void sleepUs(qint64 us)
+{
+#ifdef _WIN32
+    Sleep((DWORD)(us/1000));
+#else
+    usleep((useconds_t)us);
+#endif
+}
+
+// peak resident set size in kB, -1 if it is not known
+static long peakRss()
+{
+#ifdef _WIN32
+    return -1;
+#else
+    struct rusage ru;
+    if( getrusage(RUSAGE_SELF, &ru) != 0 )
+        return -1;
+#ifdef Q_OS_MAC
+    return ru.ru_maxrss/1024;
+#else
+    return ru.ru_maxrss;
+#endif
+#endif
+}
+
+// the stages that are timed for each frame, between two trace points
+static const struct { const char *name; int from; int to; } stages[] = {
+    { "receive",     TRACE_FIRST_PACKET, TRACE_MARKER },
+    { "depacketize", TRACE_MARKER,       TRACE_DEPACKETIZED },
+    { "decode",      TRACE_DEPACKETIZED, TRACE_DECODED },
+    { "motion",      TRACE_DECODED,      TRACE_ANALYSED },
+    { "pipeline",    TRACE_FIRST_PACKET, TRACE_DECODED } };
+#define BENCH_STAGES (int)(sizeof(stages)/sizeof(stages[0]))
+
+static double percentile(const QVector<qint64> &sorted, int p)
+{
+    if( sorted.isEmpty() )
+        return 0.0;
+    return sorted.at(((sorted.count()-1)*p)/100)/1000.0;
+}
+
+static void report(const QList<TraceEvent> &events)
+{
+    // first time of each point for each frame
+    QMap<quint32, QVector<qint64> > frames;
+    foreach( const TraceEvent &e, events )
+    {
+        if( e.point >= TRACE_MAX )
+            continue;
+        QVector<qint64> &f = frames[e.id];
+        if( f.isEmpty() )
+            f.fill(-1, TRACE_MAX);
+        if( f[e.point] < 0 || e.ts < f[e.point] )
+            f[e.point] = e.ts;
+    }
+
+    printf("  %-12s %8s %9s %9s %9s %9s\n", "stage ms", "frames", "p50", "p90", "p99", "max");
+    for( int ii=0; ii<BENCH_STAGES; ii++ )
+    {
+        QVector<qint64> samples;
+        foreach( const QVector<qint64> &f, frames )
+        {
+            qint64 from = f[stages[ii].from];
+            qint64 to = f[stages[ii].to];
+            if( from >= 0 && to >= from )
+                samples.append(to - from);
+        }
+        qSort(samples);
+        printf("  %-12s %8d %9.3f %9.3f %9.3f %9.3f\n", stages[ii].name, samples.count(),
+               percentile(samples, 50), percentile(samples, 90), percentile(samples, 99),
+               percentile(samples, 100));
+    }
+}
+
+// the session description for the first video payload of the capture
+static QList<QByteArray> sessionFor(const QList<BenchPacket> &packets, int pt)
+{
+    for( int ii=0; pt < 0 && ii<packets.count(); ii++ )
+    {
+        int p = (uchar)packets.at(ii).data.at(1) & 0x7f;
+        if( !packets.at(ii).rtcp && (p == 26 || (p >= 96 && p < 128)) )
+            pt = p;
+    }
+    QList<QByteArray> sdp;
+    if( pt < 0 )
+        return sdp;
+    sdp << "v=0" << "m=video 0 RTP/AVP " + QByteArray::number(pt);
+    if( pt == 26 )
+        sdp << "a=rtpmap:26 JPEG/90000";
+    else
+        sdp << "a=rtpmap:" + QByteArray::number(pt) + " H264/90000";
+    // the attributes are read up to the line that follows them
+    sdp << "";
+    return sdp;
+}
+
+/*
+ * replay
+ * runs one capture through a headless RtpSocket, as if it were received,
+ * either as fast as it can be decoded or at the pace it was captured
+ */
+static bool replay(const QString &name, int port, int pt, const QString &sdpfile, bool realtime)
+{
+    QFile f(name);
+    if( !f.open(QIODevice::ReadOnly) )
+    {
+        fprintf(stderr, "vchannel-bench: unable to open %s\n", (const char*)name.toLocal8Bit());
+        return false;
+    }
+    QByteArray file = f.readAll();
+    f.close();
+
+    QList<BenchPacket> packets;
+    if( !readPcap(file, port, packets) && !readRtpdump(file, packets) )
+    {
+        fprintf(stderr, "vchannel-bench: %s is not a pcap or rtpdump capture\n", (const char*)name.toLocal8Bit());
+        return false;
+    }
+    file.clear();
+
+    QList<QByteArray> sdp;
+    if( !sdpfile.isEmpty() )
+    {
+        QFile fsdp(sdpfile);
+        if( fsdp.open(QIODevice::ReadOnly) )
+            sdp = fsdp.readAll().split('\n');
+        sdp << "";
+    } else
+        sdp = sessionFor(packets, pt);
+
+    RtspSocket rtsp;
+    rtsp.session()->Interpret(sdp, ndevice);
+    int format = rtsp.session()->video()->mediaformat();
+    if( sdp.isEmpty() || format < 0 )
+    {
+        fprintf(stderr, "vchannel-bench: no video found in %s\n", (const char*)name.toLocal8Bit());
+        return false;
+    }
+
+    ChannelFormat *channel0;
+    ChannelFormat *channel1;
+    if( format == 26 )
+    {
+        channel0 = (ChannelFormat*)(new AviChannelFormat());
+        channel1 = (ChannelFormat*)(new AviChannelFormat());
+    } else
+    {
+        bool hevc = rtsp.session()->video()->isHevc();
+        channel0 = (ChannelFormat*)(new Mp4ChannelFormat(hevc));
+        channel1 = (ChannelFormat*)(new Mp4ChannelFormat(hevc));
+    }
+    AvFormat *avformat = new AvFormat(channel0, channel1);
+    avformat->setChannelID(QString("bench%1").arg(ndevice), STREAMS_VIDEO);
+    RtpSocket *rtp = new RtpSocket(&rtsp, avformat);
+    rtp->configure();
+    rtp->setHeadless(true);
+
+    qint64 frames = metrics.frames.value();
+    qint64 concealed = metrics.framesConcealed.value();
+    qint64 dropped = metrics.framesDropped.value();
+    qint64 bytes = metrics.rtpBytes.value();
+    qint64 lost = metrics.rtpLost.value();
+    qint64 writes = metrics.writeTime.count();
+    qint64 writetime = metrics.writeTime.total();
+    qint64 written = metrics.writeBytes.value();
+    qint64 allocations = metrics.arenaAllocations.value();
+    qint64 archived = metrics.archiveFiles.value();
+    qint64 archiveframes = metrics.archiveFrames.value();
+    qint64 archivetime = metrics.archiveTime.total();
+    qint64 archivein = metrics.archiveBytesIn.value();
+    qint64 archiveout = metrics.archiveBytesOut.value();
+
+    QList<TraceEvent> events;
+    quint32 tracecount = Trace::local(events, 0);
+    events.clear();
+
+    QElapsedTimer wall;
+    wall.start();
+    for( int ii=0; ii<packets.count(); ii++ )
+    {
+        const BenchPacket &packet = packets.at(ii);
+        if( realtime )
+        {
+            qint64 ahead = packet.us - wall.nsecsElapsed()/1000;
+            if( ahead > 0 )
+                sleepUs(ahead);
+        }
+        if( packet.rtcp )
+            rtp->decodeRtcp(packet.data.constData(), packet.data.size());
+        else
+            rtp->receive(packet.data.constData(), packet.data.size());
+
+        // keep the trace ring from wrapping, and let the recordings switch
+        if( (ii & 63) == 63 )
+        {
+            tracecount = Trace::local(events, tracecount);
+            QCoreApplication::processEvents();
+        }
+    }
+    // packets still held for reordering are released once they are late
+    sleepUs(RTP_REORDER_LATENCY*1000);
+    rtp->flushReorder();
+    qint64 elapsed = wall.nsecsElapsed()/1000;
+    tracecount = Trace::local(events, tracecount);
+
+    // the last recording is written as the channel stops
+    QCoreApplication::processEvents();
+    avformat->writeFinal();
+    // the transcodes are not part of the elapsed time
+    archiver.waitForDone();
+
+    frames = metrics.frames.value() - frames;
+    concealed = metrics.framesConcealed.value() - concealed;
+    dropped = metrics.framesDropped.value() - dropped;
+    bytes = metrics.rtpBytes.value() - bytes;
+    lost = metrics.rtpLost.value() - lost;
+    writes = metrics.writeTime.count() - writes;
+    writetime = metrics.writeTime.total() - writetime;
+    written = metrics.writeBytes.value() - written;
+    allocations = metrics.arenaAllocations.value() - allocations;
+    archived = metrics.archiveFiles.value() - archived;
+    archiveframes = metrics.archiveFrames.value() - archiveframes;
+    archivetime = metrics.archiveTime.total() - archivetime;
+    archivein = metrics.archiveBytesIn.value() - archivein;
+    archiveout = metrics.archiveBytesOut.value() - archiveout;
+    double secs = elapsed > 0 ? elapsed/1000000.0 : 1e-6;
+
+    printf("%s: %s payload %d, %s\n", (const char*)QFileInfo(name).fileName().toLocal8Bit(),
+           format == 26 ? "MJPEG" : "H.264", format, realtime ? "real time" : "fast");
+    printf("  %d packets (%lld lost), %lld frames in %.3f s: %.1f frames/s, %.2f MB/s\n",
+           packets.count(), lost, frames, secs, frames/secs, bytes/secs/1000000.0);
+    if( concealed || dropped )
+        printf("  %lld frames concealed, %lld dropped as incomplete\n", concealed, dropped);
+    report(events);
+    printf("  record: %lld files, %.2f MB in %.3f s\n", writes, written/1000000.0, writetime/1000000.0);
+    printf("  arena: %lld buffers, %.2f MB held in %lld chunks\n", allocations,
+           metrics.arenaBytes.value()/1000000.0, metrics.arenaChunks.value());
+    if( archiver.enabled() )
+        printf("  archive: %lld files, %lld frames in %.3f s, %.2f MB to %.2f MB\n", archived, archiveframes,
+               archivetime/1000000.0, archivein/1000000.0, archiveout/1000000.0);
+    long rss = peakRss();
+    if( rss >= 0 )
+        printf("  peak rss: %ld kB\n", rss);
+    fflush(stdout);
+
+    delete rtp;
+    delete avformat;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    bool realtime = false;
+    bool record = true;
+    int port = 0;
+    int pt = -1;
+    QString sdpfile;
+    QStringList files;
+
+    for( int ii=1; ii < argc; ii++ )
+    {
+        QString arg = QString(argv[ii]).toLower();
+        if( arg == "--realtime" || arg == "-r" )
+            realtime = true;
+        else
+        if( (arg == "--port" || arg == "-p") && ii+1 < argc )
+            port = QString(argv[++ii]).toInt();
+        else
+        if( (arg == "--payload" || arg == "-t") && ii+1 < argc )
+            pt = QString(argv[++ii]).toInt();
+        else
+        if( (arg == "--sdp" || arg == "-s") && ii+1 < argc )
+            sdpfile = argv[++ii];
+        else
+        if( (arg == "--output" || arg == "-o") && ii+1 < argc )
+        {
+            directory = argv[++ii];
+            if( !directory.endsWith('/') ) directory += "/";
+        }
+        else
+        if( arg == "--norecord" || arg == "-n" )
+            record = false;
+        else
+        if( (arg == "--motion" || arg == "-m") && ii+1 < argc )
+        {
+            QStringList qsl = QString(argv[++ii]).split("-");
+            if( qsl.count() == 6 )
+            {
+                sensitivity = qsl.at(0).toInt();
+                threshold   = qsl.at(1).toInt();
+                mx = qsl.at(2).toInt();
+                my = qsl.at(3).toInt();
+                mw = qsl.at(4).toInt();
+                mh = qsl.at(5).toInt();
+            }
+        }
+        else
+        if( (arg == "--zone" || arg == "-z") && ii+1 < argc )
+            motionzones << argv[++ii];
+        else
+        if( (arg == "--exclude" || arg == "-y") && ii+1 < argc )
+            motionexcludes << argv[++ii];
+        else
+        if( arg == "--vectors" || arg == "-f" )
+            nvectors = 1;
+        else
+        if( (arg == "--archive" || arg == "-k") && ii+1 < argc )
+            narchive = QString(argv[++ii]).toInt();
+        else
+        if( arg == "--debug" || arg == "-x" )
+            debugsetting++;
+        else
+        if( arg == "--help" || arg == "-h" || arg.startsWith("-") )
+        {
+            printf("syntax: vchannel-bench <options> <capture> ...\n");
+            printf("        <capture>                             : pcap or rtpdump file of RTP over UDP\n");
+            printf("        --realtime,-r                         : replay at the captured pace (default as fast as possible)\n");
+            printf("        --port,-p     <port>                  : UDP destination port to replay from a pcap\n");
+            printf("        --payload,-t  <pt>                    : video payload type (default the first MJPEG or H264)\n");
+            printf("        --sdp,-s      <file>                  : session description of the capture\n");
+            printf("        --output,-o   <dir>                   : output directory for the recordings\n");
+            printf("        --norecord,-n                         : do not write the recordings\n");
+            printf("        --motion,-m   <s>-<t>-<x>-<y>-<w>-<h> : motion detection/window settings\n");
+            printf("        --zone,-z     <s>-<t>-<x>-<y>-<w>-<h> : another motion window (repeat for more)\n");
+            printf("        --exclude,-y  <x>,<y>,<x>,<y>,...     : polygon left out of the motion windows (repeat for more)\n");
+            printf("        --vectors,-f                          : motion from the H264 motion vectors, not the pixels\n");
+            printf("        --archive,-k  <num>                   : transcode the AVI recordings to H264, <num> at once\n");
+            printf("        --debug,-x                            : debug output (repeat for more)\n");
+            printf("        --help,-h                             : this summary\n");
+            return 0;
+        }
+        else
+            files << argv[ii];
+    }
+    if( files.isEmpty() )
+    {
+        printf("vchannel-bench: no capture - enter 'vchannel-bench --help' for details\n");
+        return 1;
+    }
+
+    recordschedule.setMode(record ? RECORD_ALWAYS : RECORD_OFF);
+    archiver.setThreads(narchive);
+    Trace::setEnabled(true);
+
+    int failed = 0;
+    foreach( QString name, files )
+    {
+        if( !replay(name, port, pt, sdpfile, realtime) )
+            failed++;
+        // each capture is a separate device so the recordings are not mixed up
+        ndevice++;
+    }
+    return failed ? 1 : 0;
+}
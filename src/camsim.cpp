@@ -0,0 +1,1007 @@
+/**
+ * FILE:		camsim.cpp
+ *
+ * DESCRIPTION:
+ * This is the camera simulator, it serves generated or looped MJPEG
+ * and H.264 streams over RTSP/RTP for load testing
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QUrl>
+#include <QDateTime>
+#include <QStringList>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "jpeglib.h"
+
+#include "camsim.h"
+
+int debugsetting = 0;
+
+//
+// class SimSource
+//
+SimSource::SimSource() : pt(26)
+{
+}
+
+/*
+ * addJpeg
+ * splits a baseline JFIF image into the parts RFC 2435 sends.
+ * The Huffman tables must be the standard ones, as RFC 2435 has
+ * no way to send them. Returns the bytes used, 0 if it cannot be sent.
+ */
+int SimSource::addJpeg(const uchar *p, int len)
+{
+    if( len < 4 || p[0] != 0xff || p[1] != 0xd8 )
+        return 0;
+
+    SimFrame f;
+    QByteArray q[2];
+    int ii = 2;
+    while( ii + 4 <= len )
+    {
+        if( p[ii] != 0xff )
+            return 0;
+        int m = p[ii+1];
+        if( m == 0xff )
+        {
+            ii++;
+            continue;
+        }
+        int seglen = (p[ii+2]<<8) | p[ii+3];
+        const uchar *seg = p + ii + 4;
+        if( seglen < 2 || ii + 2 + seglen > len )
+            return 0;
+
+        switch( m )
+        {
+        case 0xdb:      // DQT, 8 bit tables only
+            for( int jj=0; jj + 65 <= seglen-2; jj += 65 )
+            {
+                if( (seg[jj] >> 4) != 0 )
+                    return 0;
+                if( (seg[jj] & 0x0f) < 2 )
+                    q[seg[jj] & 0x0f] = QByteArray((const char*)seg+jj+1, 64);
+            }
+            break;
+        case 0xc0:      // SOF0
+            {
+                if( seglen < 17 || seg[0] != 8 || seg[5] != 3 )
+                    return 0;
+                int h = (seg[1]<<8) | seg[2];
+                int w = (seg[3]<<8) | seg[4];
+                if( w % 8 || h % 8 || w > 2040 || h > 2040 )
+                    return 0;
+                // 4:2:2 is type 0 and 4:2:0 is type 1, chroma uses table 1
+                if( seg[7] == 0x21 )
+                    f.type = 0;
+                else
+                if( seg[7] == 0x22 )
+                    f.type = 1;
+                else
+                    return 0;
+                if( seg[8] != 0 || seg[10] != 0x11 || seg[11] != 1 || seg[13] != 0x11 || seg[14] != 1 )
+                    return 0;
+                f.width = w/8;
+                f.height = h/8;
+            }
+            break;
+        case 0xc1: case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+        case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+            // not baseline
+            return 0;
+        case 0xdd:      // DRI
+            f.dri = (seg[0]<<8) | seg[1];
+            break;
+        case 0xda:      // SOS, the scan runs to the next marker that is not a restart
+            {
+                int start = ii + 2 + seglen;
+                int end = start;
+                while( end + 1 < len &&
+                       !(p[end] == 0xff && p[end+1] != 0 && (p[end+1] < 0xd0 || p[end+1] > 0xd7)) )
+                    end++;
+                if( end + 1 >= len || p[end+1] != 0xd9 || f.width == 0 || q[0].isEmpty() || q[1].isEmpty() )
+                    return 0;
+                f.qtables = q[0] + q[1];
+                f.scan = QByteArray((const char*)p+start, end-start);
+                frames.append(f);
+                return end + 2;
+            }
+        default:
+            break;
+        }
+        ii += 2 + seglen;
+    }
+    return 0;
+}
+
+// a moving bar over a gradient, so motion is detected and the frame sizes stay steady
+bool SimSource::generate(int w, int h, int fps, int quality)
+{
+    pt = 26;
+    w = (qBound(16, w, 2032)/16)*16;
+    h = (qBound(16, h, 2032)/16)*16;
+    int count = qMax(2, fps*2);
+    unsigned char *rgb = (unsigned char*)malloc(w*h*3);
+    if( rgb == NULL )
+        return false;
+
+    for( int ff=0; ff<count; ff++ )
+    {
+        int bar = (ff*w)/count;
+        for( int yy=0; yy<h; yy++ )
+        {
+            unsigned char *row = rgb + yy*w*3;
+            for( int xx=0; xx<w; xx++ )
+            {
+                bool inbar = xx >= bar && xx < bar + w/8;
+                row[3*xx]   = inbar ? 240 : (xx*255)/w;
+                row[3*xx+1] = inbar ? 240 : (yy*255)/h;
+                row[3*xx+2] = inbar ? 240 : 96;
+            }
+        }
+
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr jerr;
+        unsigned char *jpeg = NULL;
+        unsigned long jpegsize = 0;
+        cinfo.err = jpeg_std_error( &jerr );
+        jpeg_create_compress( &cinfo );
+        jpeg_mem_dest( &cinfo, &jpeg, &jpegsize );
+        cinfo.image_width = w;
+        cinfo.image_height = h;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        // the defaults are 4:2:0 with the standard Huffman tables
+        jpeg_set_defaults( &cinfo );
+        jpeg_set_quality( &cinfo, quality, TRUE );
+        jpeg_start_compress( &cinfo, TRUE );
+        JSAMPROW row_pointer[1];
+        while( cinfo.next_scanline < cinfo.image_height )
+        {
+            row_pointer[0] = &rgb[cinfo.next_scanline*w*3];
+            jpeg_write_scanlines( &cinfo, row_pointer, 1 );
+        }
+        jpeg_finish_compress( &cinfo );
+        jpeg_destroy_compress( &cinfo );
+
+        int used = addJpeg(jpeg, (int)jpegsize);
+        free(jpeg);
+        if( used == 0 )
+        {
+            free(rgb);
+            return false;
+        }
+    }
+    free(rgb);
+    return true;
+}
+
+// a file of JPEG images one after the other, as saved from an MJPEG stream
+bool SimSource::loadMjpeg(const QString &name)
+{
+    pt = 26;
+    QFile file(name);
+    if( !file.open(QIODevice::ReadOnly) )
+        return false;
+    QByteArray data = file.readAll();
+    const uchar *p = (const uchar*)data.constData();
+    int pos = 0;
+    while( pos + 4 <= data.size() )
+    {
+        int used = addJpeg(p+pos, data.size()-pos);
+        pos += used ? used : 1;
+    }
+    return !frames.isEmpty();
+}
+
+void SimSource::addAccessUnit(SimFrame &f)
+{
+    if( !f.nals.isEmpty() )
+        frames.append(f);
+    f = SimFrame();
+    f.key = false;
+}
+
+// an H.264 Annex B byte stream, split into access units
+bool SimSource::loadH264(const QString &name)
+{
+    pt = 96;
+    QFile file(name);
+    if( !file.open(QIODevice::ReadOnly) )
+        return false;
+    QByteArray data = file.readAll();
+    const uchar *p = (const uchar*)data.constData();
+    int size = data.size();
+
+    // the start of each NAL unit, after its start code
+    QList<int> starts;
+    for( int ii=0; ii+2<size; ii++ )
+        if( p[ii] == 0 && p[ii+1] == 0 && p[ii+2] == 1 )
+        {
+            starts.append(ii+3);
+            ii += 2;
+        }
+
+    SimFrame f;
+    f.key = false;
+    bool vcl = false;
+    for( int ii=0; ii<starts.count(); ii++ )
+    {
+        int end = ii+1 < starts.count() ? starts.at(ii+1) - 3 : size;
+        // trailing zeros belong to the next start code
+        while( end > starts.at(ii) && p[end-1] == 0 )
+            end--;
+        if( end <= starts.at(ii) )
+            continue;
+        QByteArray nal((const char*)p+starts.at(ii), end-starts.at(ii));
+
+        // an access unit ends before the first slice of the next picture,
+        // or before the parameter sets, SEI or delimiter that precede it
+        int type = nal.at(0) & 0x1f;
+        bool slice = type == 1 || type == 5;
+        bool firstslice = slice && nal.size() > 1 && (nal.at(1) & 0x80);
+        if( vcl && (firstslice || type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18)) )
+        {
+            addAccessUnit(f);
+            vcl = false;
+        }
+        if( type == 7 && sps.isEmpty() )
+            sps = nal;
+        if( type == 8 && pps.isEmpty() )
+            pps = nal;
+        if( type == 5 )
+            f.key = true;
+        if( slice )
+            vcl = true;
+        f.nals.append(nal);
+    }
+    if( vcl )
+        addAccessUnit(f);
+    return !frames.isEmpty();
+}
+
+// the media description of the stream
+QByteArray SimSource::sdp()
+{
+    QByteArray qba = "m=video 0 RTP/AVP " + QByteArray::number(pt) + "\r\n";
+    qba += "c=IN IP4 0.0.0.0\r\n";
+    if( pt == 26 )
+        qba += "a=rtpmap:26 JPEG/90000\r\n";
+    else
+    {
+        qba += "a=rtpmap:" + QByteArray::number(pt) + " H264/90000\r\n";
+        qba += "a=fmtp:" + QByteArray::number(pt) + " packetization-mode=1";
+        if( sps.size() >= 4 )
+            qba += ";profile-level-id=" + sps.mid(1,3).toHex();
+        if( !sps.isEmpty() && !pps.isEmpty() )
+            qba += ";sprop-parameter-sets=" + sps.toBase64() + "," + pps.toBase64();
+        qba += "\r\n";
+    }
+    qba += "a=control:trackID=0\r\n";
+    return qba;
+}
+
+// the RTP payloads of one frame, the last one carries the marker
+void SimSource::packetize(const SimFrame &f, QList<QByteArray> &payloads)
+{
+    if( pt == 26 )
+    {
+        // every packet carries the same amount of scan data,
+        // the first also has the quantization tables
+        int chunk = CAMSIM_PAYLOAD_MAX - 8 - (f.dri ? 4 : 0) - 4 - f.qtables.size();
+        for( int off=0; off < f.scan.size(); off += chunk )
+        {
+            QByteArray qba;
+            qba.reserve(CAMSIM_PAYLOAD_MAX);
+            qba.append((char)0);
+            qba.append((char)(off >> 16));
+            qba.append((char)(off >> 8));
+            qba.append((char)off);
+            qba.append((char)(f.dri ? f.type + 64 : f.type));
+            qba.append((char)255);              // the tables are in band
+            qba.append((char)f.width);
+            qba.append((char)f.height);
+            if( f.dri )
+            {
+                // restart intervals are not aligned with the packets
+                qba.append((char)(f.dri >> 8));
+                qba.append((char)f.dri);
+                qba.append((char)0xff);
+                qba.append((char)0xff);
+            }
+            if( off == 0 )
+            {
+                qba.append((char)0);
+                qba.append((char)0);           // 8 bit precision
+                qba.append((char)(f.qtables.size() >> 8));
+                qba.append((char)f.qtables.size());
+                qba.append(f.qtables);
+            }
+            qba.append(f.scan.constData()+off, qMin(chunk, f.scan.size()-off));
+            payloads.append(qba);
+        }
+    } else
+    {
+        // single NAL unit packets, and FU-A for those that do not fit
+        foreach( const QByteArray &nal, f.nals )
+        {
+            if( nal.size() <= CAMSIM_PAYLOAD_MAX )
+            {
+                payloads.append(nal);
+                continue;
+            }
+            char indicator = (nal.at(0) & 0xe0) | 28;
+            char type = nal.at(0) & 0x1f;
+            for( int pos=1; pos < nal.size(); )
+            {
+                int n = qMin(CAMSIM_PAYLOAD_MAX - 2, nal.size() - pos);
+                QByteArray qba;
+                qba.reserve(n + 2);
+                qba.append(indicator);
+                qba.append((char)(type | (pos == 1 ? 0x80 : 0) | (pos + n == nal.size() ? 0x40 : 0)));
+                qba.append(nal.constData()+pos, n);
+                payloads.append(qba);
+                pos += n;
+            }
+        }
+    }
+}
+
+//
+// class SimSession
+//
+SimSession::SimSession() :
+    tcp(false), playing(false), waitkey(true), socket(NULL), channel(0), port(0),
+    ssrc(0), seq(0), tsbase(0), packets(0), octets(0)
+{
+}
+
+//
+// class SimCamera
+//
+SimCamera::SimCamera(SimServer *s, SimSource *src, const QString &n, int f, int offset) :
+    QObject(s), server(s), source(src), camname(n), fps(f), start(offset), frameno(0), lastreport(0)
+{
+    // tick twice a frame, the frames are paced by the clock
+    timer = new QTimer(this);
+    timer->setInterval(qMax(1, 500/fps));
+    connect(timer, SIGNAL(timeout()), this, SLOT(tick()));
+    clock.start();
+    timer->start();
+}
+
+void SimCamera::play(SimSession *session)
+{
+    session->playing = true;
+    session->waitkey = true;
+    if( !sessions.contains(session) )
+        sessions.append(session);
+}
+
+void SimCamera::remove(SimSession *session)
+{
+    sessions.removeAll(session);
+}
+
+int SimCamera::playing()
+{
+    return sessions.count();
+}
+
+// the timestamp of the next frame
+quint32 SimCamera::rtpTime(SimSession *session)
+{
+    return session->tsbase + (quint32)(((qint64)frameno*RTP_VIDEO_CLOCK)/fps);
+}
+
+void SimCamera::tick()
+{
+    quint32 due = (quint32)((clock.elapsed()*fps)/1000);
+    // after a stall the missed frames are skipped, not sent in a burst
+    if( due >= frameno && due - frameno > (quint32)fps )
+        frameno = due;
+    while( frameno <= due )
+        sendFrame(frameno++);
+
+    if( clock.elapsed() - lastreport >= 1000 )
+    {
+        lastreport = clock.elapsed();
+        foreach( SimSession *session, sessions )
+            sendReport(session);
+    }
+}
+
+void SimCamera::sendFrame(quint32 n)
+{
+    if( sessions.isEmpty() )
+        return;
+
+    const SimFrame &f = source->frame(start + n);
+    QList<QByteArray> payloads;
+    source->packetize(f, payloads);
+    int pt = source->payload();
+
+    foreach( SimSession *session, sessions )
+    {
+        // a client that cannot keep up loses whole frames, as with a camera
+        if( session->tcp && session->socket->bytesToWrite() > CAMSIM_TCP_BACKLOG )
+        {
+            server->nskipped++;
+            session->waitkey = true;
+            continue;
+        }
+        if( session->waitkey && !f.key )
+            continue;
+        session->waitkey = false;
+
+        quint32 ts = session->tsbase + (quint32)(((qint64)n*RTP_VIDEO_CLOCK)/fps);
+        for( int ii=0; ii<payloads.count(); ii++ )
+        {
+            const QByteArray &payload = payloads.at(ii);
+            bool last = ii == payloads.count()-1;
+            QByteArray packet;
+            packet.reserve(12 + payload.size());
+            packet.append((char)0x80);
+            packet.append((char)((last ? 0x80 : 0) | pt));
+            packet.append((char)(session->seq >> 8));
+            packet.append((char)session->seq);
+            packet.append((char)(ts >> 24));
+            packet.append((char)(ts >> 16));
+            packet.append((char)(ts >> 8));
+            packet.append((char)ts);
+            packet.append((char)(session->ssrc >> 24));
+            packet.append((char)(session->ssrc >> 16));
+            packet.append((char)(session->ssrc >> 8));
+            packet.append((char)session->ssrc);
+            packet.append(payload);
+            session->seq++;
+            session->packets++;
+            session->octets += payload.size();
+            server->sendRtp(session, packet, last);
+        }
+    }
+}
+
+// RTCP sender report, so the client can measure the round trip
+void SimCamera::sendReport(SimSession *session)
+{
+    qint64 ms = QDateTime::currentMSecsSinceEpoch();
+    quint32 ntpsec = (quint32)(ms/1000 + 2208988800LL);
+    quint32 ntpfrac = (quint32)(((ms%1000) << 32)/1000);
+    quint32 ts = session->tsbase + (quint32)(clock.elapsed()*(RTP_VIDEO_CLOCK/1000));
+    quint32 words[6] = { session->ssrc, ntpsec, ntpfrac, ts, session->packets, session->octets };
+
+    QByteArray sr;
+    sr.append((char)0x80);
+    sr.append((char)200);
+    sr.append((char)0);
+    sr.append((char)6);
+    for( int ii=0; ii<6; ii++ )
+    {
+        sr.append((char)(words[ii] >> 24));
+        sr.append((char)(words[ii] >> 16));
+        sr.append((char)(words[ii] >> 8));
+        sr.append((char)words[ii]);
+    }
+    server->sendRtcp(session, sr);
+}
+
+//
+// class SimConnection
+//
+SimConnection::SimConnection(SimServer *s, int socketDescriptor) :
+    QObject(s), server(s)
+{
+    socket = new QTcpSocket(this);
+    socket->setSocketDescriptor(socketDescriptor);
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readRequest()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(disconnected()));
+    QDEBUG << "connection from" << socket->peerAddress().toString();
+}
+
+SimConnection::~SimConnection()
+{
+    QMap<QByteArray, SimSession*>::const_iterator it;
+    for( it = sessions.constBegin(); it != sessions.constEnd(); ++it )
+    {
+        cameras.value(it.key())->remove(it.value());
+        delete it.value();
+    }
+}
+
+void SimConnection::disconnected()
+{
+    QDEBUG << "disconnected";
+    deleteLater();
+}
+
+void SimConnection::readRequest()
+{
+    buffer += socket->readAll();
+    for(;;)
+    {
+        // interleaved RTCP from the client is not used
+        if( buffer.startsWith('$') )
+        {
+            if( buffer.size() < 4 )
+                return;
+            int len = 4 + (((uchar)buffer.at(2) << 8) | (uchar)buffer.at(3));
+            if( buffer.size() < len )
+                return;
+            buffer.remove(0, len);
+            continue;
+        }
+
+        int eoh = buffer.indexOf("\r\n\r\n");
+        if( eoh < 0 )
+        {
+            if( buffer.size() > CAMSIM_MAX_REQUEST )
+                socket->abort();
+            return;
+        }
+        int clen = 0;
+        int pos = buffer.left(eoh).toLower().indexOf("content-length:");
+        if( pos >= 0 )
+            clen = buffer.mid(pos + 15, buffer.indexOf('\r', pos) - pos - 15).trimmed().toInt();
+        if( buffer.size() < eoh + 4 + clen )
+            return;
+        QByteArray request = buffer.left(eoh);
+        buffer.remove(0, eoh + 4 + clen);
+        handle(request);
+    }
+}
+
+SimCamera *SimConnection::camera(const QByteArray &url)
+{
+    QStringList path = QUrl(QString(url)).path().split('/', QString::SkipEmptyParts);
+    if( path.isEmpty() )
+        return NULL;
+    return server->camera(path.first());
+}
+
+void SimConnection::handle(const QByteArray &request)
+{
+    QList<QByteArray> lines = request.split('\n');
+    QList<QByteArray> first = lines.at(0).trimmed().split(' ');
+    QMap<QByteArray, QByteArray> headers;
+    for( int ii=1; ii<lines.count(); ii++ )
+    {
+        int pos = lines.at(ii).indexOf(':');
+        if( pos > 0 )
+            headers.insert(lines.at(ii).left(pos).trimmed().toLower(), lines.at(ii).mid(pos+1).trimmed());
+    }
+    QByteArray cseq = headers.value("cseq");
+    if( first.count() < 3 )
+    {
+        reply(400, cseq);
+        return;
+    }
+    QByteArray method = first.at(0);
+    QByteArray url = first.at(1);
+    QByteArray id = headers.value("session").split(';').first().trimmed();
+    QDEBUG << method << url;
+
+    if( method == "OPTIONS" || method == "GET_PARAMETER" )
+    {
+        // also the keepalive of a session
+        reply(200, cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n");
+    } else
+    if( method == "DESCRIBE" )
+    {
+        SimCamera *cam = camera(url);
+        if( !server->authorized(headers.value("authorization")) )
+            reply(401, cseq, "WWW-Authenticate: Basic realm=\"camsim\"\r\n");
+        else
+        if( cam == NULL )
+            reply(404, cseq);
+        else
+        {
+            QByteArray body = "v=0\r\n";
+            body += "o=- " + QByteArray::number(QDateTime::currentDateTime().toTime_t()) + " 1 IN IP4 " +
+                    socket->localAddress().toString().toLatin1() + "\r\n";
+            body += "s=camsim " + cam->name().toLatin1() + "\r\n";
+            body += "t=0 0\r\n";
+            body += server->source()->sdp();
+            QByteArray base = url.endsWith('/') ? url : url + "/";
+            reply(200, cseq, "Content-Base: " + base + "\r\nContent-Type: application/sdp\r\n", body);
+        }
+    } else
+    if( method == "SETUP" )
+    {
+        SimCamera *cam = camera(url);
+        QByteArray transport = headers.value("transport");
+        if( !server->authorized(headers.value("authorization")) )
+        {
+            reply(401, cseq, "WWW-Authenticate: Basic realm=\"camsim\"\r\n");
+            return;
+        }
+        if( cam == NULL )
+        {
+            reply(404, cseq);
+            return;
+        }
+        if( sessions.contains(id) )
+        {
+            reply(459, cseq);
+            return;
+        }
+
+        SimSession *session = new SimSession;
+        session->socket = socket;
+        session->host = socket->peerAddress();
+        QByteArray ports;
+        int pos;
+        if( (pos = transport.indexOf("interleaved=")) >= 0 )
+        {
+            session->tcp = true;
+            session->channel = transport.mid(pos + 12).split(';').first().split('-').first().toInt();
+        } else
+        if( (pos = transport.indexOf("client_port=")) >= 0 )
+        {
+            ports = transport.mid(pos + 12).split(';').first();
+            session->port = ports.split('-').first().toInt();
+        }
+        if( !session->tcp && session->port == 0 )
+        {
+            delete session;
+            reply(461, cseq);
+            return;
+        }
+        session->ssrc = ((quint32)qrand() << 16) ^ (quint32)qrand();
+        session->seq = qrand() & 0xffff;
+        session->tsbase = ((quint32)qrand() << 16) ^ (quint32)qrand();
+        session->id = QString("%1").arg(session->ssrc ^ (quint32)qrand(), 8, 16, QChar('0')).toLatin1();
+        sessions.insert(session->id, session);
+        cameras.insert(session->id, cam);
+
+        QByteArray ssrc = QString("%1").arg(session->ssrc, 8, 16, QChar('0')).toLatin1();
+        QByteArray qba = "Transport: ";
+        if( session->tcp )
+            qba += "RTP/AVP/TCP;unicast;interleaved=" + QByteArray::number(session->channel) + "-" +
+                    QByteArray::number(session->channel+1);
+        else
+            qba += "RTP/AVP/UDP;unicast;client_port=" + ports + ";server_port=" +
+                    QByteArray::number(server->rtpPort()) + "-" + QByteArray::number(server->rtpPort()+1);
+        qba += ";ssrc=" + ssrc + "\r\n";
+        qba += "Session: " + session->id + ";timeout=" + QByteArray::number(CAMSIM_SESSION_TIMEOUT) + "\r\n";
+        reply(200, cseq, qba);
+    } else
+    if( method == "PLAY" )
+    {
+        SimSession *session = sessions.value(id);
+        if( session == NULL )
+        {
+            reply(454, cseq);
+            return;
+        }
+        SimCamera *cam = cameras.value(id);
+        QByteArray qba = "Session: " + id + "\r\nRange: npt=0.000-\r\n";
+        qba += "RTP-Info: url=" + url + ";seq=" + QByteArray::number(session->seq) +
+               ";rtptime=" + QByteArray::number(cam->rtpTime(session)) + "\r\n";
+        // the reply goes out before the first packet
+        reply(200, cseq, qba);
+        cam->play(session);
+    } else
+    if( method == "TEARDOWN" )
+    {
+        SimSession *session = sessions.take(id);
+        if( session )
+        {
+            cameras.take(id)->remove(session);
+            delete session;
+        }
+        reply(200, cseq, "Session: " + id + "\r\n");
+    } else
+        reply(501, cseq);
+}
+
+void SimConnection::reply(int status, const QByteArray &cseq, const QByteArray &headers, const QByteArray &body)
+{
+    const char *reason;
+    switch( status )
+    {
+    case 200: reason = "OK"; break;
+    case 400: reason = "Bad Request"; break;
+    case 401: reason = "Unauthorized"; break;
+    case 404: reason = "Not Found"; break;
+    case 454: reason = "Session Not Found"; break;
+    case 459: reason = "Aggregate Operation Not Allowed"; break;
+    case 461: reason = "Unsupported Transport"; break;
+    default:  reason = "Not Implemented"; break;
+    }
+    QByteArray qba = "RTSP/1.0 " + QByteArray::number(status) + " " + reason + "\r\n";
+    qba += "CSeq: " + cseq + "\r\n";
+    qba += "Server: camsim\r\n";
+    qba += headers;
+    if( !body.isEmpty() )
+        qba += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    qba += "\r\n";
+    qba += body;
+    socket->write(qba);
+}
+
+//
+// class SimServer
+//
+SimServer::SimServer(SimSource *src, int ncameras, int fps) :
+    QTcpServer(), simsource(src), rtpSocket(NULL), rtcpSocket(NULL), rtpport(0),
+    loss(0.0), reorder(0.0), nsent(0), nbytes(0), ndropped(0), nreordered(0), nskipped(0), lastbytes(0)
+{
+    for( int ii=0; ii<ncameras; ii++ )
+        simcameras.append(new SimCamera(this, src, QString("cam%1").arg(ii+1), fps, (ii*src->count())/ncameras));
+
+    QTimer *timer = new QTimer(this);
+    connect(timer, SIGNAL(timeout()), this, SLOT(status()));
+    timer->start(10000);
+    clock.start();
+}
+
+SimServer::~SimServer()
+{
+    // the connections take their sessions off the cameras
+    qDeleteAll(findChildren<SimConnection*>());
+}
+
+bool SimServer::start(int port, int rp)
+{
+    rtpport = rp;
+    rtpSocket = new QUdpSocket(this);
+    rtcpSocket = new QUdpSocket(this);
+    if( !rtpSocket->bind(rtpport) || !rtcpSocket->bind(rtpport+1) )
+    {
+        qWarning() << "camsim: unable to bind RTP ports" << rtpport << rtpport+1;
+        return false;
+    }
+    connect(rtcpSocket, SIGNAL(readyRead()), this, SLOT(readRtcp()));
+    if( !listen(QHostAddress::Any, port) )
+    {
+        qWarning() << "camsim: unable to listen on port" << port << errorString();
+        return false;
+    }
+    return true;
+}
+
+void SimServer::setAuth(const QByteArray &userpass)
+{
+    auth = userpass.isEmpty() ? QByteArray() : userpass.toBase64();
+}
+
+bool SimServer::authorized(const QByteArray &header)
+{
+    if( auth.isEmpty() )
+        return true;
+    QList<QByteArray> parts = header.split(' ');
+    return parts.count() == 2 && parts.at(0).toLower() == "basic" && parts.at(1) == auth;
+}
+
+SimCamera *SimServer::camera(const QString &name)
+{
+    foreach( SimCamera *cam, simcameras )
+        if( cam->name() == name )
+            return cam;
+    return NULL;
+}
+
+void SimServer::incomingConnection(int socketDescriptor)
+{
+    new SimConnection(this, socketDescriptor);
+}
+
+// receiver reports are read and dropped
+void SimServer::readRtcp()
+{
+    char buf[1500];
+    while( rtcpSocket->hasPendingDatagrams() )
+        rtcpSocket->readDatagram(buf, sizeof(buf));
+}
+
+void SimServer::sendUdp(SimSession *session, const QByteArray &packet)
+{
+    rtpSocket->writeDatagram(packet, session->host, session->port);
+    nsent++;
+    nbytes += packet.size();
+}
+
+/*
+ * sendRtp
+ * loss and reordering apply to UDP only, a packet that is held back
+ * is sent after the next one and never later than the end of its frame
+ */
+void SimServer::sendRtp(SimSession *session, const QByteArray &packet, bool last)
+{
+    if( session->tcp )
+    {
+        char frame[4] = { '$', (char)session->channel, (char)(packet.size() >> 8), (char)packet.size() };
+        session->socket->write(frame, sizeof(frame));
+        session->socket->write(packet);
+        nsent++;
+        nbytes += packet.size();
+        return;
+    }
+
+    if( loss > 0.0 && qrand() < loss*RAND_MAX )
+        ndropped++;
+    else
+    if( !session->held.isEmpty() )
+    {
+        sendUdp(session, packet);
+        sendUdp(session, session->held);
+        session->held.clear();
+    } else
+    if( reorder > 0.0 && !last && qrand() < reorder*RAND_MAX )
+    {
+        session->held = packet;
+        nreordered++;
+    } else
+        sendUdp(session, packet);
+
+    if( last && !session->held.isEmpty() )
+    {
+        sendUdp(session, session->held);
+        session->held.clear();
+    }
+}
+
+void SimServer::sendRtcp(SimSession *session, const QByteArray &packet)
+{
+    if( session->tcp )
+    {
+        char frame[4] = { '$', (char)(session->channel+1), (char)(packet.size() >> 8), (char)packet.size() };
+        session->socket->write(frame, sizeof(frame));
+        session->socket->write(packet);
+    } else
+        rtcpSocket->writeDatagram(packet, session->host, session->port+1);
+}
+
+QString SimServer::strStatus()
+{
+    int sessions = 0;
+    foreach( SimCamera *cam, simcameras )
+        sessions += cam->playing();
+    qint64 ms = qMax((qint64)1, clock.restart());
+    QString qs = QString("%1 cameras, %2 sessions: %3 packets %4 Mbit/s, dropped %5 reordered %6, frames skipped %7")
+            .arg(simcameras.count()).arg(sessions).arg(nsent)
+            .arg(((nbytes - lastbytes)*8.0)/(ms*1000.0), 0, 'f', 2)
+            .arg(ndropped).arg(nreordered).arg(nskipped);
+    lastbytes = nbytes;
+    return qs;
+}
+
+void SimServer::status()
+{
+    printf("%s: %s\n", (const char*)QDateTime::currentDateTime().toString(Qt::ISODate).toLatin1(),
+           (const char*)strStatus().toLatin1());
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    int port = CAMSIM_RTSP_PORT;
+    int rtpport = CAMSIM_RTP_PORT;
+    int ncameras = 1;
+    int fps = 10;
+    int w = 640;
+    int h = 480;
+    int quality = 75;
+    double loss = 0.0;
+    double reorder = 0.0;
+    uint seed = 1;
+    QString file;
+    QByteArray auth;
+
+    for( int ii=1; ii < argc; ii++ )
+    {
+        QString arg = QString(argv[ii]).toLower();
+        bool more = ii+1 < argc;
+        if( (arg == "--port" || arg == "-p") && more )
+            port = QString(argv[++ii]).toInt();
+        else
+        if( arg == "--rtp" && more )
+            rtpport = QString(argv[++ii]).toInt();
+        else
+        if( (arg == "--cameras" || arg == "-n") && more )
+            ncameras = qMax(1, QString(argv[++ii]).toInt());
+        else
+        if( (arg == "--file" || arg == "-f") && more )
+            file = argv[++ii];
+        else
+        if( (arg == "--size" || arg == "-s") && more )
+        {
+            QStringList qsl = QString(argv[++ii]).split('x');
+            if( qsl.count() == 2 )
+            {
+                w = qsl.at(0).toInt();
+                h = qsl.at(1).toInt();
+            }
+        }
+        else
+        if( (arg == "--fps" || arg == "-r") && more )
+            fps = qBound(1, QString(argv[++ii]).toInt(), 120);
+        else
+        if( (arg == "--quality" || arg == "-q") && more )
+            quality = qBound(1, QString(argv[++ii]).toInt(), 100);
+        else
+        if( (arg == "--loss" || arg == "-l") && more )
+            loss = qBound(0.0, QString(argv[++ii]).toDouble()/100.0, 1.0);
+        else
+        if( (arg == "--reorder" || arg == "-o") && more )
+            reorder = qBound(0.0, QString(argv[++ii]).toDouble()/100.0, 1.0);
+        else
+        if( (arg == "--auth" || arg == "-a") && more )
+            auth = QByteArray(argv[++ii]);
+        else
+        if( arg == "--seed" && more )
+            seed = QString(argv[++ii]).toUInt();
+        else
+        if( arg == "--debug" || arg == "-x" )
+            debugsetting++;
+        else
+        {
+            printf("syntax: camsim <options>\n");
+            printf("        --port,-p     <port>     : RTSP port (default %d)\n", CAMSIM_RTSP_PORT);
+            printf("        --rtp         <port>     : RTP port, RTCP on the next (default %d)\n", CAMSIM_RTP_PORT);
+            printf("        --cameras,-n  <num>      : cameras, served as rtsp://<host>:<port>/cam1 ...\n");
+            printf("        --file,-f     <file>     : loop an H.264 Annex B (.h264, .264) or MJPEG file\n");
+            printf("                                   (default generated MJPEG)\n");
+            printf("        --size,-s     <w>x<h>    : generated image size (default 640x480)\n");
+            printf("        --fps,-r      <fps>      : frames per second (default 10)\n");
+            printf("        --quality,-q  <1-100>    : generated JPEG quality (default 75)\n");
+            printf("        --loss,-l     <percent>  : UDP packets dropped\n");
+            printf("        --reorder,-o  <percent>  : UDP packets sent out of order\n");
+            printf("        --auth,-a     <user:pw>  : require Basic authorization\n");
+            printf("        --seed        <num>      : random seed, for repeatable loss (default 1)\n");
+            printf("        --debug,-x               : debug output\n");
+            printf("        --help,-h                : this summary\n");
+            return 0;
+        }
+    }
+    qsrand(seed);
+
+    SimSource source;
+    bool ok;
+    if( file.isEmpty() )
+        ok = source.generate(w, h, fps, quality);
+    else
+    if( file.endsWith(".h264", Qt::CaseInsensitive) || file.endsWith(".264", Qt::CaseInsensitive) )
+        ok = source.loadH264(file);
+    else
+        ok = source.loadMjpeg(file);
+    if( !ok )
+    {
+        printf("camsim: no frames that can be sent%s%s\n", file.isEmpty() ? "" : " in ",
+               (const char*)file.toLocal8Bit());
+        return 1;
+    }
+
+    SimServer server(&source, ncameras, fps);
+    server.setAuth(auth);
+    server.setLoss(loss, reorder);
+    if( !server.start(port, rtpport) )
+        return 1;
+    printf("camsim: %d %s cameras of %d frames at %d fps on rtsp://<host>:%d/cam1 ... /cam%d\n",
+           ncameras, source.payload() == 26 ? "MJPEG" : "H.264", source.count(), fps, port, ncameras);
+    fflush(stdout);
+    return a.exec();
+}
@@ -0,0 +1,214 @@
+/**
+ * FILE:		camsim.h
+ *
+ * DESCRIPTION:
+ * This is the camera simulator, it serves generated or looped MJPEG
+ * and H.264 streams over RTSP/RTP for load testing
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef CAMSIM_H
+#define CAMSIM_H
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QList>
+#include <QMap>
+
+#include "../include/common.h"
+
+// one frame, in the form it is packetized
+class SimFrame
+{
+public:
+    SimFrame() : key(true), type(0), width(0), height(0), dri(0) {}
+    bool       key;            // can be decoded on its own
+
+    // MJPEG (RFC 2435)
+    quint8     type;
+    quint8     width;          // in 8 pixel blocks
+    quint8     height;
+    quint16    dri;
+    QByteArray qtables;        // luma then chroma, 64 bytes each in zigzag order
+    QByteArray scan;           // entropy coded data
+
+    // H.264, the NAL units of one access unit without start codes
+    QList<QByteArray> nals;
+};
+
+/*
+ * SimSource
+ * a loop of frames, made once and shared by all the cameras
+ */
+class SimSource
+{
+public:
+    SimSource();
+    bool generate(int w, int h, int fps, int quality);
+    bool loadMjpeg(const QString &name);
+    bool loadH264(const QString &name);
+    int  payload() { return pt; }
+    int  count() { return frames.count(); }
+    const SimFrame &frame(quint32 ii) { return frames.at(ii % frames.count()); }
+    QByteArray sdp();
+    void packetize(const SimFrame &f, QList<QByteArray> &payloads);
+
+private:
+    int  addJpeg(const uchar *p, int len);
+    void addAccessUnit(SimFrame &f);
+
+    int pt;
+    QList<SimFrame> frames;
+    QByteArray sps;
+    QByteArray pps;
+};
+
+// a client of one camera
+class SimSession
+{
+public:
+    SimSession();
+    QByteArray   id;
+    bool         tcp;
+    bool         playing;
+    bool         waitkey;      // start at a frame that can be decoded
+    QTcpSocket  *socket;       // RTSP connection, carries interleaved RTP
+    int          channel;
+    QHostAddress host;
+    quint16      port;         // client RTP port, RTCP on the next
+    quint32      ssrc;
+    quint16      seq;
+    quint32      tsbase;
+    quint32      packets;
+    quint32      octets;
+    QByteArray   held;         // a packet being sent out of order
+};
+
+class SimServer;
+
+/*
+ * SimCamera
+ * paces the frames of the source and sends them to each playing session
+ */
+class SimCamera : public QObject
+{
+Q_OBJECT
+public:
+    SimCamera(SimServer *s, SimSource *src, const QString &n, int f, int offset);
+    QString name() { return camname; }
+    void play(SimSession *session);
+    void remove(SimSession *session);
+    quint32 rtpTime(SimSession *session);
+    int  playing();
+
+public slots:
+    void tick();
+
+private:
+    void sendFrame(quint32 frameno);
+    void sendReport(SimSession *session);
+
+    SimServer  *server;
+    SimSource  *source;
+    QString     camname;
+    int         fps;
+    int         start;         // cameras start at different frames
+    quint32     frameno;
+    QElapsedTimer clock;
+    qint64      lastreport;
+    QTimer     *timer;
+    QList<SimSession*> sessions;
+};
+
+/*
+ * SimConnection
+ * one RTSP connection; its sessions end with it
+ */
+class SimConnection : public QObject
+{
+Q_OBJECT
+public:
+    SimConnection(SimServer *s, int socketDescriptor);
+    ~SimConnection();
+
+public slots:
+    void readRequest();
+    void disconnected();
+
+private:
+    void handle(const QByteArray &request);
+    void reply(int status, const QByteArray &cseq, const QByteArray &headers = QByteArray(),
+               const QByteArray &body = QByteArray());
+    SimCamera *camera(const QByteArray &url);
+
+    SimServer  *server;
+    QTcpSocket *socket;
+    QByteArray  buffer;
+    QMap<QByteArray, SimSession*> sessions;
+    QMap<QByteArray, SimCamera*>  cameras;     // of each session
+};
+
+class SimServer : public QTcpServer
+{
+Q_OBJECT
+public:
+    SimServer(SimSource *src, int ncameras, int fps);
+    ~SimServer();
+    bool start(int port, int rtpport);
+    void setAuth(const QByteArray &userpass);
+    void setLoss(double l, double r) { loss = l; reorder = r; }
+    bool authorized(const QByteArray &header);
+    SimCamera *camera(const QString &name);
+    SimSource *source() { return simsource; }
+    int rtpPort() { return rtpport; }
+    void sendRtp(SimSession *session, const QByteArray &packet, bool last);
+    void sendRtcp(SimSession *session, const QByteArray &packet);
+    QString strStatus();
+
+public slots:
+    void readRtcp();
+    void status();
+
+protected:
+    void incomingConnection(int socketDescriptor);
+
+private:
+    void sendUdp(SimSession *session, const QByteArray &packet);
+
+    SimSource  *simsource;
+    QList<SimCamera*> simcameras;
+    QUdpSocket *rtpSocket;
+    QUdpSocket *rtcpSocket;
+    int         rtpport;
+    QByteArray  auth;
+    double      loss;          // fraction of UDP packets dropped
+    double      reorder;       // fraction of UDP packets sent late
+    quint64     nsent;
+    quint64     nbytes;
+    quint64     ndropped;
+    quint64     nreordered;
+    quint64     nskipped;      // frames not queued to slow TCP clients
+    quint64     lastbytes;
+    QElapsedTimer clock;
+    friend class SimCamera;
+};
+
+#endif // CAMSIM_H
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# RTSP/RTP camera simulator for load testing
+#
+#-------------------------------------------------
+
+QT       += network core
+QT       -= gui
+LIBS += -L/usr/lib -ljpeg
+
+TARGET = ../bin/camsim
+TEMPLATE = app
+CONFIG += console
+
+
+SOURCES += camsim.cpp
+
+HEADERS  += camsim.h \
+    ../include/common.h
@@ -30,6 +30,8 @@
 #include "avformat.h"
 #include "recordschedule.h"
 #include "vchannel.h"
+#include "trace.h"
+#include "accessunit.h"
 
 extern QString directory;
 extern bool usetcp;
@@ -47,22 +49,28 @@ extern RecordSchedule recordschedule;
 
 ChannelFormat::ChannelFormat( QString ext ):
         samples(0), frames(0),
-        width(0), height(0)
+        width(0), height(0), audiopayload(0), timelapse(0), databytes(0)
 {
     QDEBUG << __FUNCTION__;
     framecount = 100;
     elapsed = 0;
     // save the file extension
     fileextension = ext;
+    for( int ii=0; ii<STREAMS_MAX; ii++ )
+    {
+        srtstamp[ii] = 0;
+        srclock[ii] = 0;
+    }
 }
 
 ChannelFormat::~ChannelFormat()
 {
     QDEBUG << __FUNCTION__;
+    released();
 }
 
 // to be implemented to capture each frame
-int ChannelFormat::recordFrame(const unsigned char * /*frame*/, int /*size*/, STREAMS /*stream*/, bool /* writeon*/ )
+int ChannelFormat::recordFrame(const unsigned char * /*frame*/, int /*size*/, STREAMS /*stream*/, bool /* writeon*/, quint32 /*tstamp*/ )
 {
     int ret = 1;
 
@@ -71,6 +79,14 @@ int ChannelFormat::recordFrame(const unsigned char * /*frame*/, int /*size*/, ST
     return ret;
 }
 
+// formats that do not keep access units record a copy
+int ChannelFormat::recordAccessUnit(AccessUnit *au, bool writeon)
+{
+    int ret = recordFrame(au->data(), au->size(), STREAMS_VIDEO, writeon, au->tstamp);
+    accessunits.release(au);
+    return ret;
+}
+
 // TODO
 // this must be implemented to write the assigned format
 bool ChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, qint64  )
@@ -88,18 +104,12 @@ bool ChannelFormat::writeAv(QString filename, STREAMS streams, QDateTime &, qint
 //
 void ChannelFormat::deleteFrames()
 {
-    int buffers = dataList.count();
-
-    QDEBUG << "delete all frames:" << buffers;
-
-    for(uint ii=0; ii<(uint)buffers; ii++)
-    {
-        QByteArray *frame = dataList.at(ii);
-        // clean up the buffer
-        if( frame ) delete frame;
-    }
+    QDEBUG << "delete all frames:" << dataList.count();
 
     dataList.clear();
+    arena.reset();
+    clearTimes();
+    released();
 
     // reset the state
     frames = 0;
@@ -109,9 +119,117 @@ void ChannelFormat::deleteFrames()
 
 }
 
-const QByteArray *ChannelFormat::frame()
+// The RTP clocks of audio and video start anywhere, so the first audio
+// buffer is placed against the first video sample, RTP timestamp 'video',
+// by the RTCP sender reports of both streams. Audio from before the video
+// is cut off the front of the buffers; when the audio starts later the
+// bytes of silence, 'bps' a sample, to put before it are returned.
+// Without a report for each stream the buffers are left in arrival order.
+quint32 ChannelFormat::alignAudio(const QList<quint32> &audio, quint32 video, int bps)
 {
-	if( dataList.isEmpty() )
-		return NULL;
-	return dataList.last();
+    if( audio.isEmpty() || (int)audio.at(0) >= timeList.count() ||
+        srclock[STREAMS_VIDEO] == 0 || srclock[STREAMS_AUDIO] == 0 )
+        return 0;
+
+    // in audio samples
+    qint64 lead = ( srclock[STREAMS_AUDIO] - srclock[STREAMS_VIDEO] ) * (RTP_AUDIO_CLOCK/1000)
+                + rtpDelta(srtstamp[STREAMS_AUDIO], timeList.at(audio.at(0)))
+                - (qint64)rtpDelta(srtstamp[STREAMS_VIDEO], video) * RTP_AUDIO_CLOCK / RTP_VIDEO_CLOCK;
+    QDEBUG << "audio starts" << lead/(RTP_AUDIO_CLOCK/1000) << "ms after the video";
+    if( lead > (qint64)AV_SYNC_MAX*(RTP_AUDIO_CLOCK/1000) || lead < -(qint64)AV_SYNC_MAX*(RTP_AUDIO_CLOCK/1000) )
+        return 0;
+    if( lead >= 0 )
+        return lead*bps;
+
+    quint32 cut = -lead*bps;
+    for( int aa=0; aa<audio.count() && cut; aa++ )
+    {
+        int ii = audio.at(aa);
+        ArenaBuffer &buffer = dataList[ii];
+        quint32 cc = qMin(cut, (quint32)buffer.size);
+        buffer.data += cc;
+        buffer.size -= cc;
+        if( ii < timeList.count() )
+            timeList[ii] += cc/bps;
+        samples -= cc;
+        cut -= cc;
+    }
+    return 0;
+}
+
+// With a timelapse, a GOP with a frame in the window around motion is
+// written whole; elsewhere only the key frame of a GOP is written, once
+// every 'timelapse' seconds. A GOP is a key frame and the video after it
+// up to the next one. Audio is always written.
+QVector<bool> ChannelFormat::filterGops(const QVector<qint8> &kind)
+{
+    int count = kind.count();
+    QVector<bool> keep(count, true);
+    if( timelapse <= 0 || clockList.count() != count )
+        return keep;
+
+    bool kept = false;
+    qint64 last = 0;           // when the last video written arrived
+    int ii = 0;
+    while( ii < count )
+    {
+        if( kind.at(ii) == BUFFER_AUDIO )
+        {
+            ii++;
+            continue;
+        }
+        bool motion = false;
+        int end = ii;
+        do
+        {
+            if( kind.at(end) != BUFFER_AUDIO && !motion )
+                motion = recordschedule.inMotion(clockList.at(end));
+            end++;
+        } while( end < count && kind.at(end) != BUFFER_KEY );
+
+        if( motion )
+        {
+            kept = true;
+            last = clockList.at(end-1);
+        } else
+        {
+            for( int jj=ii; jj<end; jj++ )
+                if( kind.at(jj) != BUFFER_AUDIO )
+                    keep[jj] = false;
+            if( kind.at(ii) == BUFFER_KEY && ( !kept || clockList.at(ii) - last >= timelapse*1000LL ) )
+            {
+                keep[ii] = true;
+                kept = true;
+                last = clockList.at(ii);
+            }
+        }
+        ii = end;
+    }
+    return keep;
+}
+
+// trace the video frames in dataList as written,
+// the audio buffers are listed in 'audio'
+void ChannelFormat::tracePersisted(const QList<quint32> &audio)
+{
+    if( !Trace::enabled() )
+        return;
+
+    int aa = 0;
+    bool first = true;
+    quint32 last = 0;
+    for( int ii=0; ii<timeList.count(); ii++ )
+    {
+        if( aa < audio.count() && audio.at(aa) == (quint32)ii )
+        {
+            aa++;
+            continue;
+        }
+        // the NAL units of one access unit share a timestamp
+        if( !first && timeList.at(ii) == last )
+            continue;
+        first = false;
+        last = timeList.at(ii);
+        Trace::record(TRACE_PERSISTED, last);
+    }
 }
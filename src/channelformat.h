@@ -27,13 +27,24 @@
 #include <QtGlobal>
 #include <QByteArray>
 #include <QList>
+#include <QVector>
 #include <QString>
 #include <QTime>
+#include <QDateTime>
 
 #include <string.h>
 
+#include "metrics.h"
+#include "segmentarena.h"
+
+class AccessUnit;
+
 enum STREAMS { STREAMS_NONE=0, STREAMS_VIDEO, STREAMS_AV, STREAMS_AUDIO,  STREAMS_MAX };
 
+// RTP payload types for G.711
+#define PAYLOAD_PCMU 0
+#define PAYLOAD_PCMA 8
+
 
 class ChannelFormat
 {
@@ -41,10 +52,18 @@ public:
     ChannelFormat(QString ext);
     virtual ~ChannelFormat();
     void setImageSize(int w, int h) { width = w; height = h;}
+    void setAudioPayload(int pt) { audiopayload = pt; }
+    // seconds between the key frames written without motion, 0 writes every frame
+    void setTimelapse(int secs) { timelapse = secs; }
+    // the wallclock of an RTP timestamp of the stream, from its last RTCP sender report
+    void setWallclock(STREAMS stream, quint32 tstamp, qint64 ms) { srtstamp[stream] = tstamp; srclock[stream] = ms; }
     virtual bool writeAv(QString filename, STREAMS streams, QDateTime & datetime, qint64 duration );
-    virtual int recordFrame(const unsigned char *frame, int size, STREAMS stream,bool writeon );
+    virtual int recordFrame(const unsigned char *frame, int size, STREAMS stream,bool writeon, quint32 tstamp );
+    // takes ownership of the access unit
+    virtual int recordAccessUnit(AccessUnit *au, bool writeon);
     virtual void deleteFrames();
-    const QByteArray *frame();
+    // true when audio is recorded as received (G.711) rather than as 16-bit pcm
+    virtual bool compressedAudio() { return false; }
 	long timelength() { return timer.elapsed(); }
 	QString &fileExt() { return fileextension; }
 
@@ -56,11 +75,35 @@ protected:
     long elapsed;
     quint32 width;
     quint32 height;
+    int audiopayload;    // RTP payload type of the audio, G.711 u-law or a-law
+    int timelapse;
 
     QTime timer;
     QString fileextension;
 
-    QList<QByteArray *> dataList;
+    SegmentArena arena;         // the buffers of the segment being recorded
+    QVector<ArenaBuffer> dataList;
+    QList<quint32> timeList;    // RTP timestamp of each buffer in dataList
+    QList<qint64> clockList;    // and when it arrived, in ms since the epoch
+    qint64 databytes;           // bytes held in dataList
+    quint32 srtstamp[STREAMS_MAX];  // an RTP timestamp of each stream
+    qint64 srclock[STREAMS_MAX];    // and its wallclock in ms since the epoch, 0 without a sender report
+
+    // keep the buffer memory metric in step with dataList
+    void buffered(int size) { databytes += size; metrics.bufferBytes.add(size); }
+    void released() { metrics.bufferBytes.add(-databytes); databytes = 0; }
+    void tracePersisted(const QList<quint32> &audio);
+    void addTime(quint32 tstamp) { timeList.append(tstamp); clockList.append(QDateTime::currentMSecsSinceEpoch()); }
+    void clearTimes() { timeList.clear(); clockList.clear(); }
+
+    // the kind of each buffer, for the timelapse filter
+    enum { BUFFER_AUDIO = -1, BUFFER_VIDEO = 0, BUFFER_KEY = 1 };
+    QVector<bool> filterGops(const QVector<qint8> &kind);
+    // line the audio up with the video, returns the bytes of silence before it
+    quint32 alignAudio(const QList<quint32> &audio, quint32 video, int bps);
+
+    // signed difference between two RTP timestamps, handles wrap around
+    static qint32 rtpDelta(quint32 from, quint32 to) { return (qint32)(to - from); }
 
 };
 
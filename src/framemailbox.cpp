@@ -0,0 +1,80 @@
+/**
+ * FILE:		framemailbox.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for handing the latest decoded frame from the
+ * RTP receiver to the HTTP, display and motion consumers
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include "framemailbox.h"
+
+FrameMailbox::FrameMailbox() :
+    newest(-1), nposted(0), ndropped(0)
+{
+}
+
+// called by the single writer only
+// takes ownership of the frame
+bool FrameMailbox::post(MediaFrame *frame)
+{
+    MediaFramePtr ptr(frame);
+    int current = newest;
+
+    for( int ii=0; ii<FRAME_MAILBOX_SLOTS; ii++ )
+    {
+        if( ii == current || boxes[ii].readers != 0 )
+            continue;
+        // no reader can reach this slot, so the old frame can be released here
+        ptr->sequence = ++nposted;
+        boxes[ii].frame = ptr;
+        // ordered: the frame is complete before the index is seen and
+        // the store is not moved after the next check of 'readers'
+        newest.fetchAndStoreOrdered(ii);
+        return true;
+    }
+    ndropped++;
+    return false;
+}
+
+// may be called from any thread
+MediaFramePtr FrameMailbox::latest()
+{
+    for(;;)
+    {
+        int ii = newest;
+        if( ii < 0 )
+            return MediaFramePtr();
+        boxes[ii].readers.ref();
+        // the writer skips pinned slots and never writes the newest one,
+        // so if it is still the newest the frame can be copied safely
+        if( newest == ii )
+        {
+            MediaFramePtr ptr = boxes[ii].frame;
+            boxes[ii].readers.deref();
+            return ptr;
+        }
+        boxes[ii].readers.deref();
+    }
+}
+
+// called by the single writer only
+// readers see an empty mailbox until the next frame is posted
+void FrameMailbox::clear()
+{
+    newest.fetchAndStoreOrdered(-1);
+}
@@ -0,0 +1,90 @@
+/**
+ * FILE:		framemailbox.h
+ *
+ * DESCRIPTION:
+ * This is the class for handing the latest decoded frame from the
+ * RTP receiver to the HTTP, display and motion consumers
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef FRAMEMAILBOX_H
+#define FRAMEMAILBOX_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QImage>
+#include <QAtomicInt>
+#include <QSharedData>
+#include <QExplicitlySharedDataPointer>
+
+#include "../include/common.h"
+
+/*
+ * MediaFrame
+ * one decoded frame; it is never modified once it has been posted,
+ * so it can be read from any thread while a reference is held
+ */
+class MediaFrame : public QSharedData
+{
+public:
+    MediaFrame() : tstamp(0), sequence(0) {}
+    QByteArray jpeg;           // encoded image (MJPEG only)
+    QImage     image;          // decoded image
+    QByteArray thumbnail;      // latest jpeg thumbnail from motion detection
+    quint32    tstamp;         // RTP timestamp
+    quint32    sequence;       // count of frames posted
+};
+
+typedef QExplicitlySharedDataPointer<MediaFrame> MediaFramePtr;
+
+class FrameMailboxSlot
+{
+public:
+    FrameMailboxSlot() {}
+    MediaFramePtr frame;
+    QAtomicInt    readers;     // consumers copying the frame pointer
+};
+
+/*
+ * FrameMailbox
+ * holds the newest frame for any number of readers and one writer.
+ * post() fills a slot that is neither the newest nor pinned by a reader
+ * and then publishes it; latest() pins the newest slot, checks that it is
+ * still the newest and takes a reference. No locks are taken and a frame is
+ * only released by the writer once no reader can reach it.
+ */
+class FrameMailbox
+{
+public:
+    FrameMailbox();
+    bool post(MediaFrame *frame);
+    MediaFramePtr latest();
+    void clear();
+    quint32 posted() { return nposted; }
+    quint32 dropped() { return ndropped; }
+
+private:
+    FrameMailboxSlot boxes[FRAME_MAILBOX_SLOTS];
+    QAtomicInt newest;         // index of the newest slot, -1 when empty
+    quint32    nposted;
+    quint32    ndropped;       // all slots were pinned by readers
+};
+
+// the latest frame from the video RTP socket
+extern FrameMailbox framemailbox;
+
+#endif // FRAMEMAILBOX_H
@@ -25,12 +25,15 @@
 #include <QImage>
 #include <QColor>
 #include <QStatusBar>
+#include <QVector>
 
 #include <math.h>
 
 #include "../include/common.h"
 #include "vchannel.h"
 #include "h264video.h"
+#include "annexb.h"
+#include "metrics.h"
 
 /*
  * Note that the approach to this module is to provide only as much as is
@@ -59,6 +62,19 @@ extern "C"
 #define av_frame_free  avcodec_free_frame
 #endif
 
+// only ffmpeg from 2.4 exports the motion vectors, and only for H.264
+#if defined(AV_CODEC_FLAG2_EXPORT_MVS)
+#define H264_EXPORT_MVS AV_CODEC_FLAG2_EXPORT_MVS
+#elif defined(CODEC_FLAG2_EXPORT_MVS)
+#define H264_EXPORT_MVS CODEC_FLAG2_EXPORT_MVS
+#endif
+#ifdef H264_EXPORT_MVS
+extern "C"
+{
+	#include <libavutil/motion_vector.h>
+};
+#endif
+
 using namespace command_line_arguments;
 
 // make the codec global to all classes
@@ -70,14 +86,18 @@ int buffer_offset = 0;
 extern QStatusBar *statusbar;
 extern QString globalstatus;
 
-// global to h264
+// global to h264, vps is only used by h265
+QByteArray vps;
 QByteArray pps;
 QByteArray sps;
 
-h264Video::h264Video() :
-			fragment_type(0), nal_type(0), start_bit(0),end_bit(0),
-			iframe(false), sync_ok(false),picture_ok(false), video_index(-1),
+h264Video::h264Video(bool h) :
+			hevc(h), interleaved(false), depth(0), nextdon(0),
+			sync_ok(false), damaged(false), dropcounted(false), hasvps(false), hassps(false), haspps(false),
+			fu_active(false), fu_start(0), fu_don(0), fu_tstamp(0), building(accessunits.take()),
+			picture_ok(false), video_index(-1),
 			dst_fmt(PIX_FMT_RGB24),dst_w(0),dst_h(0),
+			exportmvs(false), vectorframe(false), pic_w(0), pic_h(0),
 			formatContext(NULL)/*,codecContext(NULL)*/
 {
     QDEBUG << "h264Video";
@@ -86,14 +106,15 @@ h264Video::h264Video() :
     av_register_all();
     avcodec_register_all();
     // was codec = avcodec_find_decoder(CODEC_ID_H264);
-    global_codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    global_codec = avcodec_find_decoder(hevc ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264);
     Q_ASSERT(global_codec);
     codecContext = avcodec_alloc_context3(global_codec);
     Q_ASSERT(codecContext);
 //    int ret = avcodec_get_context_defaults3(codecContext, codec);
 //    QDEBUG << "avcodec_get_context_defaults3 returned=" << ret;
     codecContext->flags |= CODEC_FLAG_LOW_DELAY;
-    codecContext->flags2 |= CODEC_FLAG2_CHUNKS;
+    // each packet is a whole access unit, so the decoder does not need
+    // CODEC_FLAG2_CHUNKS and can return the picture straight away
     codecContext->thread_count = 1;
     //codecContext->thread_type = FF_THREAD_SLICE;
     //codecContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
@@ -106,17 +127,24 @@ h264Video::h264Video() :
     picture = av_frame_alloc();
     Q_ASSERT(picture);
     codecContext->skip_loop_filter = AVDISCARD_ALL; // skiploopfilter=all
+    if( nvectors )
+    {
+#ifdef H264_EXPORT_MVS
+        exportmvs = !hevc;
+        if( exportmvs )
+            codecContext->flags2 |= H264_EXPORT_MVS;
+        else
+            qWarning() << "motion vectors are only exported for H264, the pixels are used";
+#else
+        qWarning() << "motion vectors are not exported by this libavcodec, the pixels are used";
+#endif
+    }
     if( avcodec_open2(codecContext, global_codec, NULL) < 0 )
     {
     	qWarning() << "codec open failed" << endl;
     	Q_ASSERT(0);
     }
 
-    parser = av_parser_init(codecContext->codec_id);
-    Q_ASSERT(parser);
-    parser->flags |= PARSER_FLAG_ONCE;
-	av_init_packet( &pkt );
-
     waitkey = 0;
 
 	// for development debugging only
@@ -147,6 +175,10 @@ h264Video::~h264Video() {
     if ( formatContext ) {
         av_free( formatContext );
     }
+
+    accessunits.release(building);
+    foreach( AccessUnit *au, ready )
+        accessunits.release(au);
 }
 
 /* RFC 6184
@@ -188,128 +220,477 @@ h264Video::~h264Video() {
             7.4.1 in [1].
  */
 
-// extract frame and return true when whole frame is done
-bool h264Video::extractFrame(const char *hdr, qint64 size )
+void h264Video::setPacketization(int mode, int d)
 {
-	bool success = false;
-	// save these for future
-    fragment_type = hdr[0] & 0x1F;
-    nal_type = hdr[1] & 0x1F;
-    start_bit = hdr[1] & 0x80;
-    end_bit = hdr[1] & 0x40;
+	interleaved = ( mode == 2 );
+	depth = d > 0 ? d : H264_INTERLEAVE_DEPTH;
+	QDEBUG << "packetization-mode=" << mode << (interleaved ? "interleaving depth" : "") << (interleaved ? depth : 0);
+}
 
-    switch(fragment_type)
-    {
-		default: Q_ASSERT(0); // break;
-		case 0 : QDDEBUG << "Frame" << fragment_type << "[unspecified]" << endl; break;
-		case   1  : QDDEBUG << "Frame Coded slice" << endl;
+/*
+ * RFC 6184 section 5.2, the H.264 payload structures:
+ *   1-23  single NAL unit
+ *   24    STAP-A   aggregated NAL units, each with a 16 bit size
+ *   25    STAP-B   as STAP-A after the 16 bit DON of the first
+ *   26    MTAP16   each NAL unit with a DON and a 16 bit timestamp offset
+ *   27    MTAP24   as MTAP16 with a 24 bit timestamp offset
+ *   28    FU-A     a fragment of a NAL unit
+ *   29    FU-B     the first fragment of a NAL unit, with its DON
+ * RFC 7798 section 4.4, the H.265 payload structures, after a 2 byte
+ * payload header that has the type in bits 1-6:
+ *   0-47  single NAL unit
+ *   48    AP       aggregated NAL units, each with a 16 bit size
+ *   49    FU       a fragment of a NAL unit
+ *   50    PACI     not used
+ * Access units are complete at the marker, or when the timestamp changes.
+ * In interleaved mode the NAL units are first put back in decoding order
+ * and grouped by their own timestamps. Returns true when there are
+ * access units ready.
+ */
+bool h264Video::depacketize(const char *payload, int size, quint32 tstamp, bool marker)
+{
+	if( hevc )
+		depacketizeHevc((const unsigned char*)payload, size, tstamp);
+	else
+		depacketizeH264((const unsigned char*)payload, size, tstamp);
+
+	// the marker is on the last packet of an access unit in transmission
+	// order, which is not the decoding order when interleaved
+	if( marker && !interleaved )
+		finishAccessUnit();
+
+	if( building->size() > H264_MAX_ACCESS_UNIT )
+	{
+		// the rest of it is dropped as well, up to the next access unit,
+		// and what follows may refer to it
+		QDEBUG << "access unit too large, dropped";
+		metrics.framesDropped.add();
+		building->clear();
+		fu_active = false;
+		damaged = true;
+		dropcounted = true;
+		sync_ok = false;
+		hasvps = hassps = haspps = false;
+	}
+	return !ready.isEmpty();
+}
+
+void h264Video::depacketizeH264(const unsigned char *p, int size, quint32 tstamp)
+{
+	int type = size > 0 ? p[0] & 0x1F : 0;
+
+	switch( type )
+	{
+	case 0:
+	case 30:
+	case 31:
+		QDDEBUG << "undefined NAL type" << type;
+		break;
+
+	case 24:	// STAP-A
+	case 25:	// STAP-B
+	{
+		int ii = 1;
+		quint16 don = nextdon;
+		if( type == 25 )
 		{
-			qba.clear();
-			qba.append("\0\0\0\1",4);
-			qba.append(hdr,(int)size);
-			success = true;
+			if( size < 3 )
+				break;
+			don = ( p[1] << 8 ) | p[2];
+			ii = 3;
+		}
+		while( ii + 2 < size )
+		{
+			int len = ( p[ii] << 8 ) | p[ii+1];
+			ii += 2;
+			if( len == 0 || ii + len > size )
+			{
+				QDEBUG << "bad STAP size" << len;
+				damaged = true;
+				break;
+			}
+			addNal(p+ii, len, tstamp, don++);
+			ii += len;
 		}
 		break;
-		case   2  :
-			QDDEBUG << "Frame Data Partition A" << endl;
-			break;
-		case   3  :
-			QDDEBUG << "Frame Data Partition B" << endl;
-			break;
-		case   4  :
-			QDDEBUG << "Frame Data Partition C" << endl;
-			break;
-		case   5  :
-			QDDEBUG << "Frame IDR (Instantaneous Decoding Refresh) Picture" << endl;
+	}
+
+	case 26:	// MTAP16
+	case 27:	// MTAP24
+	{
+		if( size < 3 )
 			break;
-		case   6  :
+		quint16 donb = ( p[1] << 8 ) | p[2];
+		int tslen = ( type == 26 ) ? 2 : 3;
+		int ii = 3;
+		while( ii + 2 + 1 + tslen < size )
 		{
-			QDDEBUG << "Frame SEI (Supplemental Enhancement Information)" << endl;
-			qba.clear();
-			qba.append("\0\0\0\1",4);
-			qba.append(hdr,(int)size);
-			success = true;
+			// the size includes the DON difference and the timestamp offset
+			int len = ( p[ii] << 8 ) | p[ii+1];
+			ii += 2;
+			if( len <= 1 + tslen || ii + len > size )
+			{
+				QDEBUG << "bad MTAP size" << len;
+				damaged = true;
+				break;
+			}
+			quint16 don = donb + p[ii];
+			quint32 offset = ( p[ii+1] << 8 ) | p[ii+2];
+			if( tslen == 3 )
+				offset = ( offset << 8 ) | p[ii+3];
+			addNal(p+ii+1+tslen, len-1-tslen, tstamp + offset, don);
+			ii += len;
+		}
+		break;
+	}
 
+	case 28:	// FU-A
+	case 29:	// FU-B
+	{
+		int hdr = ( type == 29 ) ? 4 : 2;
+		if( size < hdr )
 			break;
-		}
-		case   7  :
-			QDDEBUG << "Frame SPS (Sequence Parameter Set)" << endl;
+		if( p[1] & 0x80 )
 		{
-//			char tmp[1024];  char *t=tmp;  for(  int ii=0; ii<size && ii < (1024/3);ii++) {
-//					sprintf(t,"%02x ",(unsigned char)hdr[ii]); t += 3; } QDEBUG << size << ":" << tmp << endl;
+			// the NAL header is made from the indicator and the FU header
+			char nalhdr = ( p[0] & 0xE0 ) | ( p[1] & 0x1F );
+			startFragment(&nalhdr, 1, tstamp, ( type == 29 ) ? ( ( p[2] << 8 ) | p[3] ) : nextdon);
+		}
+		addFragment(p+hdr, size-hdr);
+		if( p[1] & 0x40 )
+			endFragment();
+		break;
+	}
 
-			//todo sps.setRawData(hdr, (int)size);
-			qba.clear();
-			qba.append("\0\0\0\1",4);
-			qba.append(hdr,(int)size);
-			success = true;
+	default:	// a single NAL unit
+		addNal(p, size, tstamp, nextdon);
+		break;
+	}
+}
 
+/*
+ * in interleaved mode (sprop-max-don-diff > 0) each NAL unit has a DON,
+ * as a 16 bit DONL for the first of a packet and an 8 bit DOND, the
+ * difference less one, for the rest of an aggregation packet
+ */
+void h264Video::depacketizeHevc(const unsigned char *p, int size, quint32 tstamp)
+{
+	if( size < 3 )
+		return;
+	int type = AnnexB::nalType(p, true);
+	int donl = interleaved ? 2 : 0;
+
+	switch( type )
+	{
+	case 48:	// AP
+	{
+		int ii = 2;
+		quint16 don = nextdon;
+		bool first = true;
+		while( ii + donl + 2 < size )
+		{
+			if( interleaved )
+			{
+				if( first )
+				{
+					don = ( p[ii] << 8 ) | p[ii+1];
+					ii += 2;
+				} else
+					don += p[ii++] + 1;
+			}
+			first = false;
+			if( ii + 2 > size )
+				break;
+			int len = ( p[ii] << 8 ) | p[ii+1];
+			ii += 2;
+			if( len < 2 || ii + len > size )
+			{
+				QDEBUG << "bad AP size" << len;
+				damaged = true;
+				break;
+			}
+			addNal(p+ii, len, tstamp, don);
+			ii += len;
+		}
+		break;
+	}
+
+	case 49:	// FU
+	{
+		bool start = ( p[2] & 0x80 ) != 0;
+		int hdr = 3 + ( start ? donl : 0 );
+		if( size < hdr )
 			break;
+		if( start )
+		{
+			// the payload header with the type from the FU header
+			char nalhdr[2];
+			nalhdr[0] = ( p[0] & 0x81 ) | ( ( p[2] & 0x3F ) << 1 );
+			nalhdr[1] = p[1];
+			startFragment(nalhdr, 2, tstamp, interleaved ? ( ( p[3] << 8 ) | p[4] ) : nextdon);
 		}
-		case   8  :
-			QDDEBUG << "Frame PPS (Picture Parameter Set)" << endl;
+		addFragment(p+hdr, size-hdr);
+		if( p[2] & 0x40 )
+			endFragment();
+		break;
+	}
+
+	case 50:	// PACI
+		QDDEBUG << "PACI packet not used";
+		break;
+
+	default:	// a single NAL unit
+		if( interleaved )
 		{
-//			char tmp[1024];  char *t=tmp;  for(  int ii=0; ii<size && ii < (1024/3);ii++) {
-//					sprintf(t,"%02x ",(unsigned char)hdr[ii]); t += 3; } QDEBUG << tmp << endl;
+			// the DONL is between the NAL unit header and its payload
+			if( size < 4 )
+				break;
+			QByteArray nal((const char*)p, 2);
+			nal.append((const char*)p+4, size-4);
+			addNal((const unsigned char*)nal.constData(), nal.size(), tstamp, ( p[2] << 8 ) | p[3]);
+		} else
+			addNal(p, size, tstamp, nextdon);
+		break;
+	}
+}
 
-			// todo pps.setRawData(hdr,size);
-			qba.clear();
-			qba.append("\0\0\0\1",4);
-			qba.append(hdr,(int)size);
-			success = true;
+// the first fragment of a NAL unit, with the NAL header it carries
+void h264Video::startFragment(const char *nalhdr, int hdrsize, quint32 tstamp, quint16 don)
+{
+	// the end of the last one was lost
+	if( fu_active )
+		dropFragment();
+	fu_active = true;
+	fu_don = don;
+	fu_tstamp = tstamp;
+	if( interleaved )
+	{
+		fu.clear();
+		fu.append(nalhdr, hdrsize);
+	} else
+	{
+		startNal(tstamp);
+		fu_start = building->startNal();
+		building->append(nalhdr, hdrsize);
+	}
+}
 
-			break;
-		}
-		case   9  :
-			QDDEBUG << "Frame Access Unit Delimiter" << endl;
-			break;
-		case 10  :
-			QDDEBUG << "Frame EoS (End of Sequence)" << endl;
-			break;
-		case 11  :
-			QDDEBUG << "Frame EoS (End of Stream)" << endl;
-			break;
-		case 12  :
-			QDDEBUG << "Frame Filter Data" << endl;
-			break;
-		case 28:
+void h264Video::addFragment(const unsigned char *data, int size)
+{
+	if( !fu_active )
+	{
+		// fragments without their start are not used
+		if( !interleaved )
+			damaged = true;
+		return;
+	}
+	if( size <= 0 )
+		return;
+	if( interleaved )
+		fu.append((const char*)data, size);
+	else
+		building->append(data, size);
+}
+
+void h264Video::endFragment()
+{
+	if( !fu_active )
+		return;
+	fu_active = false;
+	if( interleaved )
+		addNal((const unsigned char*)fu.constData(), fu.size(), fu_tstamp, fu_don);
+	else
+	{
+		building->endNal(fu_start);
+		noteNal(building->data()+fu_start, building->size()-fu_start);
+	}
+}
+
+// take the next access unit, or NULL; the caller owns it and gives
+// it back to the pool, or passes it on to someone who will
+AccessUnit *h264Video::takeAccessUnit()
+{
+	if( ready.isEmpty() )
+		return NULL;
+	return ready.takeFirst();
+}
+
+void h264Video::addNal(const unsigned char *nal, int size, quint32 tstamp, quint16 don)
+{
+	if( !interleaved )
+	{
+		appendNal(nal, size, tstamp);
+		return;
+	}
+
+	// insert in decoding order, the DON wraps at 16 bits
+	InterleavedNal n;
+	n.don = don;
+	n.tstamp = tstamp;
+	n.nal = QByteArray((const char*)nal, size);
+	int ii = deinterleave.count();
+	while( ii > 0 && (qint16)(quint16)(don - deinterleave.at(ii-1).don) < 0 )
+		ii--;
+	deinterleave.insert(ii, n);
+	nextdon = don + 1;
+
+	while( deinterleave.count() > depth )
+	{
+		InterleavedNal first = deinterleave.takeFirst();
+		appendNal((const unsigned char*)first.nal.constData(), first.nal.size(), first.tstamp);
+	}
+}
+
+// a NAL unit of a new time completes the access unit before it
+void h264Video::startNal(quint32 tstamp)
+{
+	if( !building->isEmpty() && tstamp != building->tstamp )
+		finishAccessUnit();
+	building->tstamp = tstamp;
+}
+
+void h264Video::appendNal(const unsigned char *nal, int size, quint32 tstamp)
+{
+	if( size <= 0 )
+		return;
+	startNal(tstamp);
+	int offset = building->startNal();
+	building->append(nal, size);
+	building->endNal(offset);
+	noteNal(nal, size);
+}
+
+// a parameter set sent in band replaces the one from the sdp
+static void updateParameterSet(QByteArray &ps, const unsigned char *nal, int size, const char *name)
+{
+	if( ps.size() != size || memcmp(ps.constData(), nal, size) != 0 )
+	{
+		QDEBUG << name << "in band";
+		ps = QByteArray((const char*)nal, size);
+	}
+}
+
+void h264Video::noteNal(const unsigned char *nal, int size)
+{
+	if( size <= 0 )
+		return;
+	switch( AnnexB::kind(AnnexB::nalType(nal, hevc), hevc) )
+	{
+	case AnnexB::KEY:
+		building->key = true;
+		// fall through
+	case AnnexB::SLICE:
+		building->vcl = true;
+		break;
+	case AnnexB::VPS:
+		hasvps = true;
+		updateParameterSet(vps, nal, size, "VPS");
+		break;
+	case AnnexB::SPS:
+		hassps = true;
+		updateParameterSet(sps, nal, size, "SPS");
+		break;
+	case AnnexB::PPS:
+		haspps = true;
+		updateParameterSet(pps, nal, size, "PPS");
+		break;
+	default:
+		break;
+	}
+}
+
+void h264Video::dropFragment()
+{
+	if( !interleaved )
+	{
+		building->truncate(fu_start - 4);
+		damaged = true;
+	}
+	fu.clear();
+	fu_active = false;
+}
+
+void h264Video::finishAccessUnit()
+{
+	// the marker came before the end of a fragmented NAL unit
+	if( fu_active && !interleaved )
+		dropFragment();
+
+	// parameter sets and SEI wait for their picture, unless
+	// the picture itself was lost
+	if( !building->vcl )
+	{
+		if( damaged )
 		{
-			QDDEBUG << "Frame Image" << endl;
-			// start of frame
-			if( start_bit != 0 )
-			{
-				iframe= ( nal_type == 5 ) ? true : false;
-				// QDEBUG << "Frame FU-A " << (iframe?"frame=I":"") << endl;
-				qba.clear();
-
-				// mark the first I-frame and record from then on
-				if( !sync_ok && iframe) {
-					QDEBUG << "first Iframe " << endl;
-					sync_ok = true;
-				}
+			QDEBUG << "incomplete access unit dropped";
+			if( !dropcounted )
+				metrics.framesDropped.add();
+			building->clear();
+			hasvps = hassps = haspps = false;
+			damaged = false;
+			dropcounted = false;
+		}
+		return;
+	}
 
-				if( sync_ok) {
-					char prefix[5] = { 00,00,00,01,00 };
-					prefix[4] = ( hdr[0] & 0xE0 ) | (hdr[1] & 0x1F );
-					// QDEBUG << "NAL=" << (int)prefix[4] << endl;
-					qba.append( prefix,5 );
-				}
-			}
-			if( sync_ok && size>2 ) {
-				qba.append( hdr+2, size-2);
-			}
-			if( sync_ok && end_bit != 0 ) {
-				// write the frame
-				// return true if we decoded a frame
-				success = true;
-			} break;
+	bool use = !damaged;
+	if( damaged )
+	{
+		QDEBUG << "incomplete access unit dropped";
+		if( !dropcounted )
+			metrics.framesDropped.add();
+	} else
+	if( building->key && !sync_ok )
+	{
+		QDEBUG << "IDR, in sync";
+		sync_ok = true;
+	}
+	// after a loss the pictures refer to pictures we do not have
+	if( !sync_ok )
+		use = false;
 
+	if( use )
+	{
+		// every key frame carries its parameter sets, so that a recording
+		// or a decoder can start there
+		bool needvps = hevc && !hasvps && !vps.isEmpty();
+		if( building->key && ( needvps || !( hassps && haspps ) ) && !sps.isEmpty() && !pps.isEmpty() )
+		{
+			QList<QByteArray> ps;
+			if( hevc && !vps.isEmpty() )
+				ps.append(vps);
+			ps.append(sps);
+			ps.append(pps);
+			building->prepend(ps);
 		}
-    }
-    return success;
+		building->pad();
+		ready.append(building);
+		building = accessunits.take();
+	} else
+		building->clear();
+	hasvps = hassps = haspps = false;
+	damaged = false;
+	dropcounted = false;
 }
 
-bool h264Video::writeFrame(const char* frm, int size )
+/*
+ * a packet is missing from the sequence; the access unit being put
+ * together is dropped rather than decoded or recorded with a hole in it,
+ * and nothing is used until the next IDR (or IRAP) picture. In interleaved mode
+ * the loss can not be placed, so only the wait for an IDR applies.
+ */
+void h264Video::packetLost()
+{
+	if( fu_active )
+		dropFragment();
+	if( !interleaved )
+		damaged = true;
+	if( sync_ok )
+		QDEBUG << "waiting for the next IDR";
+	sync_ok = false;
+}
+
+bool h264Video::writeFrame(const char* frm, int size, bool convert )
 {
         // for debugging only
 //		if( size )
@@ -323,12 +704,11 @@ bool h264Video::writeFrame(const char* frm, int size )
 //			QDEBUG << "write:" << written << endl;
 //		}
 
-		// Init packet
-    	int64_t pts=0;
-    	int64_t dts=0;
-
-		av_parser_parse2(parser, codecContext, &pkt.data,&pkt.size, (const unsigned char*)frm, size,
-	                                   pts, dts, 0 /*AV_NOPTS_VALUE*/);
+		// a whole access unit is one packet, so no parser is needed
+		AVPacket pkt;
+		av_init_packet( &pkt );
+		pkt.data = (uint8_t*)frm;
+		pkt.size = size;
 
 		if( size )
 		{
@@ -348,16 +728,50 @@ bool h264Video::writeFrame(const char* frm, int size )
 					QDEBUG << "codecContext sample_aspect_ratio" << codecContext->sample_aspect_ratio.num << "/" << codecContext->sample_aspect_ratio.den;
 					QDEBUG << "codecContext time_base" << codecContext->time_base.num << "/" << codecContext->time_base.den;
 				}
-				// Convert the image from its native format to RGB
-				picture_ok = convertFrameToRGB(picture, codecContext->width,codecContext->height, codecContext->pix_fmt );
-
-				qba.clear();
+				pic_w = codecContext->width;
+				pic_h = codecContext->height;
+				takeVectors();
+				// Convert the image from its native format to RGB, unless
+				// nothing is to look at it
+				if( convert )
+					picture_ok = convertFrameToRGB(picture, codecContext->width,codecContext->height, codecContext->pix_fmt );
 			    return true;
 			}
 		}
 	    return false;
 }
 
+/*
+ * the motion vectors of a predicted picture, a key picture has none
+ */
+void h264Video::takeVectors()
+{
+	vectorframe = false;
+	mvs.clear();
+#ifdef H264_EXPORT_MVS
+	if( !exportmvs || picture->pict_type == AV_PICTURE_TYPE_I )
+		return;
+	vectorframe = true;
+	AVFrameSideData *sd = av_frame_get_side_data(picture, AV_FRAME_DATA_MOTION_VECTORS);
+	if( sd == NULL )
+		return;
+	const AVMotionVector *av = (const AVMotionVector *)sd->data;
+	int count = sd->size / sizeof(AVMotionVector);
+	mvs.resize(count);
+	for( int ii=0; ii < count; ii++ )
+	{
+		MotionVector &mv = mvs[ii];
+		mv.x = av[ii].dst_x;
+		mv.y = av[ii].dst_y;
+		mv.w = av[ii].w;
+		mv.h = av[ii].h;
+		mv.dx = av[ii].dst_x - av[ii].src_x;
+		mv.dy = av[ii].dst_y - av[ii].src_y;
+	}
+	metrics.motionVectors.add(count);
+#endif
+}
+
 /*
  * convert the YUV420p frame to RGB
  */
@@ -398,8 +812,8 @@ bool h264Video::convertFrameToRGB(AVFrame *src_frame,  int width, int height, en
  *
  */
 
-Mp4ChannelFormat::Mp4ChannelFormat(): ChannelFormat(".mp4"),
-		avio_ctx(NULL)
+Mp4ChannelFormat::Mp4ChannelFormat(bool h): ChannelFormat(".mp4"),
+		hevc(h), avio_ctx(NULL)
 {
     QDEBUG << __FUNCTION__;
 }
@@ -407,16 +821,26 @@ Mp4ChannelFormat::Mp4ChannelFormat(): ChannelFormat(".mp4"),
 Mp4ChannelFormat::~Mp4ChannelFormat()
 {
     QDEBUG << __FUNCTION__;
+    foreach( AccessUnit *au, units )
+        accessunits.release(au);
 }
 
-int Mp4ChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream, bool writeon )
+int Mp4ChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS stream, bool writeon, quint32 tstamp )
 {
-    int ret = 1;
     Q_ASSERT(frame);
     if( frame==NULL ) return -1;
     Q_ASSERT(size);
     if( size==0 ) return -1;
 
+    if( stream == STREAMS_VIDEO )
+    {
+        // video is normally passed as access units, without a copy
+        AccessUnit *au = accessunits.take();
+        au->assign(frame, size, hevc);
+        au->tstamp = tstamp;
+        return recordAccessUnit(au, writeon);
+    }
+
     // start the timer at the first frame
     if( frames==0 && samples==0 )
     {
@@ -424,65 +848,65 @@ int Mp4ChannelFormat::recordFrame(const unsigned char *frame, int size, STREAMS
         QDEBUG << "timer start";
     }
 
-    // create a new frame buffer
-	// TODO
-	// why not steal the existing frame?
-    QByteArray *f = new QByteArray((const char*)frame,size);
-    if(f)
+    if( stream == STREAMS_AUDIO )
     {
-        if( stream == STREAMS_VIDEO )
+        // G.711, one byte per sample
+        ArenaBuffer f = arena.copy(frame, size);
+        if( f.isNull() )
         {
-			frames++;
-        	// add the frame to the list
-            dataList.append(f);
+            QDEBUG << "unable to allocate buffer";
+            return 1;
+        }
+        audioListMarker.append( dataList.count() );
+        dataList.append(f);
+        units.append(NULL);
+        addTime(tstamp);
+        buffered(f.size);
+        samples += size;
+    }
+    return 1;
+}
 
+// the access unit is kept as it is until the file is written
+int Mp4ChannelFormat::recordAccessUnit(AccessUnit *au, bool writeon)
+{
+    int ret = 1;
 
-			// count only image frames
-			char typ = f->at(4);
-			switch( typ )
-			{
-			case 1:
-			case 2:
-			case 3:
-			case 4:
-			case 5:
-
-			case 6:
-			case 7:
-			case 8:
-			case 0x67:
-			case 0x68:
-				break;
-			case 0x65:
-			case 0x41:
-			default:
-				if( framecount == 0 )
-				{
-					long ee = timer.elapsed() - elapsed;
-					if( ee > 0  )
-					{
-						int fps = 1000000/ee;
-						framecount = 100;
-						elapsed = timer.elapsed();
-						globalstatus = QString("%1.%2 fps %3 H264").arg(fps/10).arg(fps%10).arg(usetcp?"T":"U");
-						if( statusbar && fps ) {
-							statusbar->showMessage(globalstatus);
-							QDEBUG << globalstatus;
-						}
-					}
-				} else
-					framecount--;
-				break;
-			}
+    // start the timer at the first frame
+    if( frames==0 && samples==0 )
+    {
+        timer.start();
+        QDEBUG << "timer start";
+    }
 
-        	if( timer.elapsed() > (writeon?RECORD_FILETIME_WRITEON:RECORD_FILETIME_NOWRITE) )
-			{
-				ret = 0; // SWITCH_CHANNELS
-			}
-		} else
-		{
-			QDEBUG << "unable to allocate buffer";
-		}
+    frames++;
+    dataList.append(ArenaBuffer());
+    units.append(au);
+    addTime(au->tstamp);
+    buffered(au->size());
+
+    // each buffer is an access unit with a picture
+    if( framecount == 0 )
+    {
+        long ee = timer.elapsed() - elapsed;
+        if( ee > 0  )
+        {
+            int fps = 1000000/ee;
+            framecount = 100;
+            elapsed = timer.elapsed();
+            globalstatus = QString("%1.%2 fps %3 %4").arg(fps/10).arg(fps%10).arg(usetcp?"T":"U").arg(hevc?"H265":"H264");
+            if( statusbar && fps ) {
+                statusbar->showMessage(globalstatus);
+                QDEBUG << globalstatus;
+            }
+        }
+    } else
+        framecount--;
+
+    // switch on video only, so the new file starts with sps and pps
+    if( timer.elapsed() > (writeon?RECORD_FILETIME_WRITEON:RECORD_FILETIME_NOWRITE) )
+    {
+        ret = 0; // SWITCH_CHANNELS
     }
     return ret;
 }
@@ -497,6 +921,159 @@ quint16 BE16(quint16 s) {
 	return (nn[1]+(nn[0]<<8));
 }
 
+// run-length encode the number of samples in each chunk for stsc
+static QList<SampleChunk> sampleChunks(const QList<quint32> &chunksamples)
+{
+	QList<SampleChunk> list;
+	for( int ii=0; ii<chunksamples.count(); ii++ )
+		if( ii == 0 || chunksamples.at(ii) != chunksamples.at(ii-1) )
+			list.append( SampleChunk(ii+1, chunksamples.at(ii), 1) );
+	return list;
+}
+
+// reads the exp-Golomb coded fields of a parameter set, after the
+// emulation prevention bytes are taken out
+class BitReader
+{
+public:
+	BitReader(const QByteArray &nal) : pos(0), failed(false)
+	{
+		int zeros = 0;
+		for( int ii=0; ii<nal.size(); ii++ )
+		{
+			char b = nal.at(ii);
+			if( zeros >= 2 && b == 3 )
+			{
+				zeros = 0;
+				continue;
+			}
+			zeros = ( b == 0 ) ? zeros + 1 : 0;
+			rbsp.append(b);
+		}
+	}
+	quint32 u(int n)
+	{
+		quint32 v = 0;
+		while( n-- > 0 )
+		{
+			int byte = pos >> 3;
+			int bit = byte < rbsp.size() ? ( (unsigned char)rbsp.at(byte) >> ( 7 - ( pos & 7 ) ) ) & 1 : 0;
+			v = ( v << 1 ) | bit;
+			pos++;
+		}
+		return v;
+	}
+	// more than 31 leading zeros is not a 32 bit value: a corrupt NAL unit
+	quint32 ue()
+	{
+		int zeros = 0;
+		while( u(1) == 0 )
+			if( ++zeros > 31 )
+			{
+				failed = true;
+				return 0;
+			}
+		return ( ( 1u << zeros ) - 1 ) + u(zeros);
+	}
+	void skip(int n) { pos += n; }
+	QByteArray rbsp;
+	int pos;
+	bool failed;				// a value could not be parsed
+};
+
+// the avcC box (ISO/IEC 14496-15 5.3.3) from the sdp or in band parameter sets
+static QByteArray avcConfiguration()
+{
+	QByteArray box;
+	if( sps.size() < 4 )
+		return box;
+	QDataStream qds(&box, QIODevice::WriteOnly);
+	AVCDecoderConfigurationRecord record("avcC", sps.constData(), sps.length(), pps.constData(), pps.length());
+	qds.writeRawData(record.header(), record.headersize);	// does not fall on 4-byte boundary
+	qds << (quint8)0xe1;
+	qds << (quint16)sps.length();
+	qds.writeRawData(sps.constData(), sps.length());
+	qds << (quint8)1;
+	qds << (quint16)pps.length();
+	qds.writeRawData(pps.constData(), pps.length());
+	return box;
+}
+
+/*
+ * the hvcC box (ISO/IEC 14496-15 8.3.3); the profile, tier and level
+ * are copied from the SPS, and the chroma format and bit depths read from it
+ */
+static QByteArray hevcConfiguration()
+{
+	QByteArray box;
+	if( sps.size() < 15 )
+		return box;
+
+	BitReader br(sps);
+	br.skip(16);					// NAL unit header
+	br.skip(4);						// sps_video_parameter_set_id
+	int sublayers = br.u(3);
+	int nested = br.u(1);
+	int ptl = br.pos >> 3;			// general profile_tier_level, 12 bytes
+	br.skip(96);
+	QVector<int> flags(sublayers);
+	for( int ii=0; ii<sublayers; ii++ )
+		flags[ii] = br.u(2);
+	if( sublayers > 0 )
+		br.skip(2*(8-sublayers));
+	for( int ii=0; ii<sublayers; ii++ )
+		br.skip(( flags[ii] & 2 ? 88 : 0 ) + ( flags[ii] & 1 ? 8 : 0 ));
+	br.ue();						// sps_seq_parameter_set_id
+	int chroma = br.ue();
+	if( chroma == 3 )
+		br.skip(1);
+	br.ue();						// width
+	br.ue();						// height
+	if( br.u(1) )					// conformance window
+	{
+		br.ue(); br.ue(); br.ue(); br.ue();
+	}
+	int lumadepth = br.ue();
+	int chromadepth = br.ue();
+	if( br.failed )
+	{
+		QDEBUG << "SPS could not be parsed";
+		return box;
+	}
+
+	QDataStream qds(&box, QIODevice::WriteOnly);
+	QList<QByteArray> arrays;
+	if( !vps.isEmpty() ) arrays.append(vps);
+	arrays.append(sps);
+	if( !pps.isEmpty() ) arrays.append(pps);
+	quint32 size = 8 + 23;
+	foreach( const QByteArray &ps, arrays )
+		size += 3 + 2 + ps.size();
+
+	qds << size;
+	qds.writeRawData("hvcC", 4);
+	qds << (quint8)1;								// configurationVersion
+	qds.writeRawData(br.rbsp.constData()+ptl, 12);	// profile space to level
+	qds << (quint16)0xF000;							// min_spatial_segmentation_idc
+	qds << (quint8)0xFC;							// parallelismType unknown
+	qds << (quint8)( 0xFC | ( chroma & 3 ) );
+	qds << (quint8)( 0xF8 | ( lumadepth & 7 ) );
+	qds << (quint8)( 0xF8 | ( chromadepth & 7 ) );
+	qds << (quint16)0;								// avgFrameRate unknown
+	// constantFrameRate, numTemporalLayers, temporalIdNested, lengthSizeMinusOne
+	qds << (quint8)( ( ( sublayers + 1 ) << 3 ) | ( nested << 2 ) | 3 );
+	qds << (quint8)arrays.count();
+	foreach( const QByteArray &ps, arrays )
+	{
+		// array_completeness set, the NAL unit type from the header
+		qds << (quint8)( 0x80 | AnnexB::nalType((const unsigned char*)ps.constData(), true) );
+		qds << (quint16)1;
+		qds << (quint16)ps.size();
+		qds.writeRawData(ps.constData(), ps.size());
+	}
+	return box;
+}
+
 // for debugging only
 //#define OUTPUT_RAW_H264 1
 
@@ -505,8 +1082,37 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 	uint frame_count = 0;
 	quint32 total_size = 0;
 	uint total_written = 0;
+	quint32 audio_count = 0;    // G.711 samples, including the silence for gaps
+	QList<quint32> audiopad;    // silence before each audio buffer
 
     int buffers = dataList.count();
+	QVector<quint32> ausize(buffers, 0);    // stored size of each access unit, 0 if skipped
+	QList<quint32> syncsamples;             // key frames, numbered from 1
+
+	// with a timelapse, the GOPs away from motion are left out
+	// but for a key frame every few seconds
+	QVector<qint8> kind(buffers, BUFFER_AUDIO);
+	for( int ii=0; ii<buffers && ii<units.count(); ii++ )
+		if( units.at(ii) )
+			kind[ii] = units.at(ii)->key ? BUFFER_KEY : BUFFER_VIDEO;
+	QVector<bool> keep = filterGops(kind);
+
+	// the audio starts against the first video sample by the sender reports
+	quint32 audiolead = 0;
+	{
+		bool started = false;
+		for( int ii=0; ii<buffers && ii<units.count() && ii<timeList.count(); ii++ )
+		{
+			AccessUnit *au = units.at(ii);
+			if( au && au->key )
+				started = true;
+			if( au && started && au->vcl && keep.at(ii) )
+			{
+				audiolead = alignAudio(audioListMarker, timeList.at(ii), 1);
+				break;
+			}
+		}
+	}
 
     // write out the raw file and convert it to mp4 later
     if( buffers > 0 )
@@ -522,75 +1128,56 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 			QDataStream qds(&file);
 #endif
 			uint ii=0;
-			uint startframe = 0;
+			bool started = false;
+			int aa = 0;
+			quint32 nextaudio = 0;
 			for(; ii<(uint)buffers; ii++)
 			{
-				QByteArray *frame = dataList.at(ii);
-				if( frame )
+				const ArenaBuffer &frame = dataList.at(ii);
+				if( !frame.isNull() && aa < audioListMarker.count() && audioListMarker.at(aa) == ii )
+				{
+					// gaps in the audio RTP timestamps are filled with silence
+					quint32 pad = 0;
+					if( aa == 0 )
+						pad = audiolead;
+					else
+					{
+						qint32 delta = rtpDelta( nextaudio, timeList.at(ii) );
+						if( delta > 0 && delta <= RTP_AUDIO_CLOCK )
+							pad = delta;
+					}
+					nextaudio = timeList.at(ii) + frame.size;
+					audiopad.append(pad);
+					audio_count += pad + frame.size;
+					total_size += pad + frame.size;
+					aa++;
+					continue;
+				}
+				AccessUnit *au = units.at(ii);
+				if( au )
 				{
 #ifdef OUTPUT_RAW_H264
 					int written = qds.writeRawData(
-						frame->constData(),
-						frame->size() );
+						(const char*)au->data(),
+						au->size() );
 					Q_ASSERT(written>0);
 #endif
-					// add up the total data size
-					char typ = frame->at(4);
-					switch( typ )
+					// the file starts at the first key frame; the NAL units
+					// are stored after a 4 byte length instead of a start code,
+					// so the sample is the same size as the access unit
+					if( au->key )
+						started = true;
+					if( started && au->vcl && keep.at(ii) )
 					{
-					case 1:
-						QDEBUG << "FCS";
-						total_size += frame->size();
-//						break;
-					case 2:
-					case 3:
-					case 4:
-					case 5:
-						QDEBUG << "VCL";
-						startframe = ii+1;
-						break;
-					case 6:
-						QDEBUG << "SEI";
-						total_size += frame->size();
-						break;
-					case 7:
-						QDEBUG << "SPS";
-						total_size += frame->size();
-						break;
-					case 8:
-						QDEBUG << "PPS";
-						total_size += frame->size();
-						break;
-					case 0x67:
-					case 0x68:
-						QDEBUG << "x67 / x68";
-						total_size += frame->size();
-						break;
-
-					case 0x65:
-					case 0x27:
-						startframe = ii+1;
-					case 0x41:
-					default:
-						// image frames
-						if( startframe>0 )
-						{
-							char tmp[64];
-							sprintf(tmp,"f: 0x%x (%d) size= %d",(int)typ, (int)typ, frame->size());
-							QDEBUG << tmp;
-
-							frame_count++;
-							total_size += frame->size();
-						} else
-						{
-							char tmp[64];
-							sprintf(tmp,"skipping frame: 0x%x (%d) size= %d",(int)typ, (int)typ, frame->size());
-							QDEBUG << tmp;
-						}
-						break;
+						frame_count++;
+						if( au->key )
+							syncsamples.append(frame_count);
+						ausize[ii] = au->size();
+						total_size += au->size();
+					} else
+					{
+						QDEBUG << "skipping access unit, size=" << au->size();
 					}
-					// free the frame memory
-					//todo delete frame;
 				}
 			}
 #ifdef OUTPUT_RAW_H264
@@ -602,6 +1189,7 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 
     	if( frame_count == 0 ) {
     		qWarning() << "No frames in image - not saved";
+    		deleteFrames();
     		return false;
     	}
 
@@ -661,7 +1249,7 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 
 			Mp4Box *mp4box = new Mp4FileTypeBox("ftyp","isom",0x200);
 			QDEBUG << "file box size=" << BE(mp4box->size) << "headersize="<<mp4box->headersize;
-			const char compatible_brands[] = "isomiso2avc1mp41" ;
+			const char *compatible_brands = hevc ? "isomiso2mp41" : "isomiso2avc1mp41" ;
 			mp4box->size = BE(BE(mp4box->size)+strlen(compatible_brands));
 			total_written += qds.writeRawData(mp4box->header(),mp4box->headersize);
 			total_written += qds.writeRawData(compatible_brands,strlen(compatible_brands));
@@ -676,81 +1264,158 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 			total_written += qds.writeRawData(mp4box->header(),mp4box->headersize);
 			delete mp4box;
 
-			// save the start of the chunk data
-			quint32 chunk_offset = BE(total_written);
-
 			// set up the sample count array
 			quint32 *sample_count_array = new quint32[frame_count];
+			// and the RTP timestamp of each sample
+			quint32 *sample_time_array = new quint32[frame_count];
 			uint frame_index =0;
 			uint prev_frame_marker = total_written;
 			uint ii=0;
-			bool startframe = false;
-			for(; ii<(uint)buffers; ii++)
+
+			// audio and video are interleaved in mdat as chunks in arrival order.
+			// Audio is held back until the current video sample is complete,
+			// so that each sample stays contiguous
+			QList<quint32> video_chunk_samples;
+			QList<quint32> video_chunk_offsets;
+			QList<quint32> audio_chunk_samples;
+			QList<quint32> audio_chunk_offsets;
+			QList<uint> pendingaudio;
+			bool videochunk = false;
+			char silence = ( audiopayload == PAYLOAD_PCMA ) ? (char)0xd5 : (char)0xff;  // a-law / u-law
+			int aa = 0;
+			int ap = 0;
+			for(; ii<=(uint)buffers; ii++)
 			{
-				QByteArray *frame = dataList.at(ii);
-				if( frame )
+				bool last = ( ii == (uint)buffers );
+				if( !pendingaudio.isEmpty() && ( last || total_written == prev_frame_marker ) )
+				{
+					quint32 count = 0;
+					audio_chunk_offsets.append(total_written);
+					for( int jj=0; jj<pendingaudio.count(); jj++ )
+					{
+						const ArenaBuffer &audio = dataList.at(pendingaudio.at(jj));
+						quint32 pad = audiopad.at(ap++);
+						if( pad )
+							total_written += qds.writeRawData(QByteArray(pad,silence).constData(),pad);
+						total_written += qds.writeRawData(audio.data,audio.size);
+						count += pad + audio.size;
+					}
+					// the audio cut off before the video leaves no chunk
+					if( count )
+						audio_chunk_samples.append(count);
+					else
+						audio_chunk_offsets.removeLast();
+					pendingaudio.clear();
+					prev_frame_marker = total_written;
+					videochunk = false;
+				}
+				if( last )
+					break;
+
+				if( aa < audioListMarker.count() && audioListMarker.at(aa) == ii )
+				{
+					pendingaudio.append(ii);
+					aa++;
+					continue;
+				}
+
+				AccessUnit *au = units.at(ii);
+				if( au )
 				{
-					char typ = frame->at(4);
-					switch( typ )
+					if( ausize[ii] > 0 )
 					{
-					case 1:
-					case 2:
-					case 3:
-					case 4:
-					case 5:
-						startframe = true;
-					case 6:
-					case 7:
-					case 8:
-					case 0x67:
-					case 0x68:
+						if( !videochunk )
 						{
-						// replace the 1st 4 bytes with the size
-						quint32 len = BE(frame->size()-4);
-						// write frames
-						quint32 written = qds.writeRawData((const char *)&len,4);
-						written += qds.writeRawData(
-							frame->constData()+4,
-							frame->size()-4 );
+							video_chunk_offsets.append(total_written);
+							video_chunk_samples.append(0);
+							videochunk = true;
+						}
+						// replace each start code with the size of its NAL unit,
+						// in place, and write the access unit as the sample
+						au->lengthPrefixed();
+						quint32 written = qds.writeRawData((const char *)au->data(), au->size());
 						Q_ASSERT(written>0);
 						total_written += written;
-						}
-						break;
-
-					case 0x65:
-					case 0x27:
-						startframe = true;
-					case 0x41:
-					default:
-						if( startframe)
-						{
-							// replace the 1st 4 bytes with the size
-							quint32 len = BE(frame->size()-4);
-							// write image frames
-							quint32 written = qds.writeRawData((const char *)&len,4);
-							written += qds.writeRawData(
-								frame->constData()+4,
-								frame->size()-4 );
-							Q_ASSERT(written>0);
-							total_written += written;
-							// save the number of bytes in each sample
-							// this is wierd, but we measure from the end of one
-							// sample to the end of the next
-							sample_count_array[frame_index++] = BE(total_written-prev_frame_marker);
-							prev_frame_marker = total_written;
-						}
-						break;
+						// save the number of bytes in each sample
+						sample_time_array[frame_index] = ii<(uint)timeList.count() ? timeList.at(ii) : 0;
+						sample_count_array[frame_index++] = BE(total_written-prev_frame_marker);
+						prev_frame_marker = total_written;
+						video_chunk_samples[video_chunk_samples.count()-1]++;
 					}
 
-					// free the frame memory
-					delete frame;
+					// the buffer goes back to the depacketizer
+					accessunits.release(au);
 				}
 			}
 			// QDEBUG << "frames=" << frame_count;
 
+			// parameter sets after the last sample do not make a chunk
+			if( !video_chunk_samples.isEmpty() && video_chunk_samples.last() == 0 )
+			{
+				video_chunk_samples.removeLast();
+				video_chunk_offsets.removeLast();
+			}
+			QList<SampleChunk> samplechunks = sampleChunks(video_chunk_samples);
+
+			// the sample durations come from the RTP clock of the camera,
+			// so variable frame rates and dropped frames play back in real time.
+			// The mean interval is used for the last sample and to replace
+			// deltas that are out of order
+			QList<SampleTime> sampletimes;
+			quint32 media_duration = 0;
+			{
+				qint32 span = rtpDelta(sample_time_array[0], sample_time_array[frame_count-1]);
+				quint32 mean = 0;
+				// gaps longer than this are taken as a discontinuity
+				qint32 maxdelta = RTP_VIDEO_CLOCK * qMax(10, 2*timelapse);
+				if( frame_count > 1 && span > 0 )
+					mean = span / (frame_count-1);
+				if( mean == 0 ) // no usable timestamps - use the wall clock
+					mean = (quint32)(duration * (RTP_VIDEO_CLOCK/1000) / frame_count);
+				if( mean == 0 )
+					mean = RTP_VIDEO_CLOCK/25;
+
+				quint32 run = 0;
+				quint32 rundelta = 0;
+				for( uint jj=0; jj<frame_count; jj++ )
+				{
+					qint32 delta = (jj+1<frame_count) ?
+							rtpDelta(sample_time_array[jj], sample_time_array[jj+1]) : (qint32)mean;
+					if( delta < 0 || delta > maxdelta )
+						delta = mean;
+					if( run && (quint32)delta != rundelta )
+					{
+						sampletimes.append( SampleTime(run, rundelta) );
+						run = 0;
+					}
+					rundelta = delta;
+					run++;
+					media_duration += delta;
+				}
+				if( run )
+					sampletimes.append( SampleTime(run, rundelta) );
+			}
+			delete [] sample_time_array;
+			// the movie and the edit list use milliseconds
+			duration = media_duration / (RTP_VIDEO_CLOCK/1000);
+			QDEBUG << "stts entries=" << sampletimes.count() << "duration(ms)=" << duration;
+
+			// the audio track follows the video track
+			QByteArray audiotrak;
+			qint64 movie_duration = duration;
+			if( audio_count > 0 )
+			{
+				qint64 audio_duration = audio_count / (RTP_AUDIO_CLOCK/1000);
+				if( audio_duration > movie_duration )
+					movie_duration = audio_duration;
+				audiotrak = audioTrack(creation_time, audio_duration, audio_count, audio_chunk_samples, audio_chunk_offsets);
+				QDEBUG << "audio samples=" << audio_count << "chunks=" << audio_chunk_offsets.count();
+			}
+
 			Mp4Box *mp4moviebox = new Mp4Box("moov");
 				Mp4MovieHeaderBox *mp4MovieHeaderBox = new Mp4MovieHeaderBox("mvhd",
-							creation_time,time_scale,duration );
+							creation_time,time_scale,movie_duration );
+				mp4MovieHeaderBox->next_track_id = BE(audiotrak.isEmpty()?2:3);
 
 				Mp4Box *mp4trackbox = new Mp4Box("trak");
 					Mp4TrackHeaderBox *mp4TrackHeaderBox = new Mp4TrackHeaderBox("tkhd",
@@ -761,7 +1426,7 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 
 					Mp4Box *mp4mediabox = new Mp4Box("mdia");
 						Mp4MediaHeaderBox *mp4MediaHeaderBox = new Mp4MediaHeaderBox("mdhd",
-								creation_time,time_scale,duration );
+								creation_time,RTP_VIDEO_CLOCK,media_duration );
 						Mp4HandlerBox *mp4HandlerBox = new Mp4HandlerBox("hdlr","VideoHandler" );
 
 						Mp4Box *mp4mediainfobox = new Mp4Box("minf");
@@ -779,36 +1444,36 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 
 								Mp4SampleBox *mp4sampledescriptionbox = new Mp4SampleBox("stsd",1);
 								// include 1 entry
-								Mp4VisualSampleEntryBox *mp4visualsampleentrybox = new Mp4VisualSampleEntryBox("avc1", width, height);
-								 	 AVCDecoderConfigurationRecord *avcdecoderconfigurationrecord = new AVCDecoderConfigurationRecord( "avcC",
-								 			sps.constData(), sps.length(), pps.constData(), pps.length());
+								Mp4VisualSampleEntryBox *mp4visualsampleentrybox = new Mp4VisualSampleEntryBox(hevc?"hvc1":"avc1", width, height);
+								 	 // avcC or hvcC, with the parameter sets
+								 	 QByteArray decoderconfiguration = hevc ? hevcConfiguration() : avcConfiguration();
 
 									 	mp4visualsampleentrybox->size = BE( BE(mp4visualsampleentrybox->size) +
-																		BE(avcdecoderconfigurationrecord->size) );
-										QDEBUG << "avcdecoderconfigurationrecord size=" << BE(avcdecoderconfigurationrecord->size);
+																		decoderconfiguration.size() );
+										QDEBUG << "decoderconfiguration size=" << decoderconfiguration.size();
 
 									mp4sampledescriptionbox->size = BE( BE(mp4sampledescriptionbox->size) +
 												  	  	      	    BE(mp4visualsampleentrybox->size) );
 									QDEBUG << "mp4visualsampleentrybox size=" << BE(mp4visualsampleentrybox->size);
 
- 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4timetosamplebox = new Mp4SampleBox("stts",1);
+ 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4timetosamplebox = new Mp4SampleBox("stts",sampletimes.count());
  	 	 	 	 	 	 	 	 mp4timetosamplebox->size = BE( BE(mp4timetosamplebox->size) +
- 	 	 	 	 	 	 	 			 	 	 	 	 	 (1*2*sizeof(quint32)) );
- 	 	 	 	 	 	 	 	 SampleTime *sampletime = new SampleTime(frame_count,duration/frame_count);
+ 	 	 	 	 	 	 	 			 	 	 	 	 	 (sampletimes.count()*sizeof(SampleTime)) );
 
- 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4syncsamplebox = new Mp4SampleBox("stss",0);
+ 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4syncsamplebox = new Mp4SampleBox("stss",syncsamples.count());
+ 	 	 	 	 	 	 	 	 mp4syncsamplebox->size = BE( BE(mp4syncsamplebox->size) +
+ 	 	 	 	 	 	 	 			 	 	 	 	 	 (syncsamples.count()*sizeof(quint32)) );
 
- 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4sampletochunkbox = new Mp4SampleBox("stsc",1);
+ 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4sampletochunkbox = new Mp4SampleBox("stsc",samplechunks.count());
  	 	 	 	 	 	 	 	 mp4sampletochunkbox->size = BE( BE(mp4sampletochunkbox->size) +
- 	 	 	 	 	 	 	 			 	 	 	 	 	 (1*sizeof(SampleChunk)) );
- 	 	 	 	 	 	 	 	 SampleChunk *samplechunk = new SampleChunk(1,frame_count,1);
+ 	 	 	 	 	 	 	 			 	 	 	 	 	 (samplechunks.count()*sizeof(SampleChunk)) );
 
  	 	 	 	 	 	 	 	 Mp4SampleSizeBox *mp4samplesizebox = new Mp4SampleSizeBox("stsz",0,frame_count);
  	 	 	 	 	 	 	 	 mp4samplesizebox->size = BE( BE(mp4samplesizebox->size) +
  	 	 	 	 	 	 	 			 	 	 	 	 	 (frame_count*sizeof(quint32)) );
- 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4chunkoffsetbox = new Mp4SampleBox("stco",1);
+ 	 	 	 	 	 	 	 	 Mp4SampleBox *mp4chunkoffsetbox = new Mp4SampleBox("stco",video_chunk_offsets.count());
  	 	 	 	 	 	 	 	 mp4chunkoffsetbox->size = BE( BE(mp4chunkoffsetbox->size) +
- 	 	 	 	 	 	 	 			 	 	 	 	 	 (1*sizeof(quint32)) );
+ 	 	 	 	 	 	 	 			 	 	 	 	 	 (video_chunk_offsets.count()*sizeof(quint32)) );
 							mp4sampletablebox->size = BE( BE(mp4sampletablebox->size) +
 													  BE(mp4sampledescriptionbox->size)+
 													  BE(mp4timetosamplebox->size) +
@@ -836,7 +1501,7 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 										BE(mp4editbox->size)+
 										BE(mp4mediabox->size) );
 
-			mp4moviebox->size = BE( BE(mp4moviebox->size)+BE(mp4MovieHeaderBox->size)+BE(mp4trackbox->size));
+			mp4moviebox->size = BE( BE(mp4moviebox->size)+BE(mp4MovieHeaderBox->size)+BE(mp4trackbox->size)+audiotrak.size());
 
 			total_written += qds.writeRawData(mp4moviebox->header(),mp4moviebox->headersize );
 			total_written += qds.writeRawData(mp4MovieHeaderBox->header(),mp4MovieHeaderBox->headersize);
@@ -855,43 +1520,41 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 			total_written += qds.writeRawData(mp4sampletablebox->header(),mp4sampletablebox->headersize);
 			total_written += qds.writeRawData(mp4sampledescriptionbox->header(),mp4sampledescriptionbox->headersize);
 			total_written += qds.writeRawData(mp4visualsampleentrybox->header(),mp4visualsampleentrybox->headersize); // does not fall on 4-byte boundary
-			total_written += qds.writeRawData(avcdecoderconfigurationrecord->header(),avcdecoderconfigurationrecord->headersize); // does not fall on 4-byte boundary
-
-			qds << (quint8)0xe1;
-			total_written += 1;
-			quint16 spslen = BE16((quint16)sps.length());
-			total_written += qds.writeRawData((const char*)&spslen,sizeof(quint16));
-			total_written += qds.writeRawData((const char*)sps.constData(),sps.length());
-
-			qds << (quint8)1;
-			total_written += 1;
-			quint16 ppslen = BE16((quint16)pps.length());
-			total_written += qds.writeRawData((const char*)&ppslen,sizeof(quint16));
-			total_written += qds.writeRawData((const char*)pps.constData(),pps.length());
+			total_written += qds.writeRawData(decoderconfiguration.constData(),decoderconfiguration.size()); // does not fall on 4-byte boundary
 
 			total_written += qds.writeRawData(mp4timetosamplebox->header(),mp4timetosamplebox->headersize);
-			total_written += qds.writeRawData((const char*)sampletime,sizeof(SampleTime));
+			for( int jj=0; jj<sampletimes.count(); jj++ )
+				total_written += qds.writeRawData((const char*)&sampletimes.at(jj),sizeof(SampleTime));
 
 			total_written += qds.writeRawData(mp4syncsamplebox->header(),mp4syncsamplebox->headersize);
+			for( int jj=0; jj<syncsamples.count(); jj++ )
+			{
+				quint32 sample = BE(syncsamples.at(jj));
+				total_written += qds.writeRawData((const char*)&sample,sizeof(quint32));
+			}
 
 			total_written += qds.writeRawData(mp4sampletochunkbox->header(),mp4sampletochunkbox->headersize);
-			total_written += qds.writeRawData((const char*)samplechunk,sizeof(SampleChunk));
+			for( int jj=0; jj<samplechunks.count(); jj++ )
+				total_written += qds.writeRawData((const char*)&samplechunks.at(jj),sizeof(SampleChunk));
 
 			total_written += qds.writeRawData(mp4samplesizebox->header(),mp4samplesizebox->headersize);
 			total_written += qds.writeRawData((const char*)sample_count_array,frame_count*sizeof(quint32));
 
 			total_written += qds.writeRawData(mp4chunkoffsetbox->header(),mp4chunkoffsetbox->headersize);
-			total_written += qds.writeRawData((const char*)&chunk_offset,sizeof(quint32));
+			for( int jj=0; jj<video_chunk_offsets.count(); jj++ )
+			{
+				quint32 chunk_offset = BE(video_chunk_offsets.at(jj));
+				total_written += qds.writeRawData((const char*)&chunk_offset,sizeof(quint32));
+			}
+
+			total_written += qds.writeRawData(audiotrak.constData(),audiotrak.size());
 
 			delete mp4chunkoffsetbox;
 			delete [] sample_count_array;
 			delete mp4samplesizebox;
-			delete samplechunk;
 			delete mp4sampletochunkbox;
 			delete mp4syncsamplebox;
-			delete sampletime;
 			delete mp4timetosamplebox;
-			delete avcdecoderconfigurationrecord;
 			delete mp4visualsampleentrybox;
 			delete mp4sampledescriptionbox;
 			delete mp4sampletablebox;
@@ -915,7 +1578,14 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 
 
 		// empty the list
+		tracePersisted(audioListMarker);
+		// the audio of the segment goes all at once
 		dataList.clear();
+		arena.reset();
+		units.clear();
+		clearTimes();
+		released();
+		audioListMarker.clear();
 
 		// reset the state
 	    frames = 0;
@@ -930,22 +1600,99 @@ bool Mp4ChannelFormat::writeAv(QString filename, STREAMS /* streams */, QDateTim
 }
 
 
+// build the 'trak' box for the G.711 audio, 8000 samples of one byte each per second.
+// The chunk offsets are absolute file offsets into mdat
+QByteArray Mp4ChannelFormat::audioTrack(quint32 creation_time, quint32 duration, quint32 count,
+		const QList<quint32> &chunksamples, const QList<quint32> &chunkoffsets)
+{
+	QByteArray trak;
+	QDataStream qds(&trak, QIODevice::WriteOnly);
+	QList<SampleChunk> samplechunks = sampleChunks(chunksamples);
+
+	Mp4Box mp4trackbox("trak");
+		Mp4TrackHeaderBox mp4TrackHeaderBox("tkhd", creation_time, 2, duration, 0, 0 );
+		mp4TrackHeaderBox.volume = BE16(0x0100);
+		Mp4Box mp4mediabox("mdia");
+			Mp4MediaHeaderBox mp4MediaHeaderBox("mdhd", creation_time, RTP_AUDIO_CLOCK, count );
+			Mp4HandlerBox mp4HandlerBox("hdlr", "SoundHandler", "soun" );
+			Mp4Box mp4mediainfobox("minf");
+				Mp4SoundMediaHeaderBox mp4SoundMediaHeaderBox("smhd");
+				Mp4Box mp4datainfobox("dinf");
+					Mp4DataReferenceBox mp4DataReferenceBox("dref",1);
+						Mp4DataEntryUrlBox mp4DataEntryUrlBox("url ");
+					mp4DataReferenceBox.size = BE( BE(mp4DataReferenceBox.size) + BE(mp4DataEntryUrlBox.size) );
+					mp4datainfobox.size = BE( BE(mp4datainfobox.size) + BE(mp4DataReferenceBox.size) );
+				Mp4Box mp4sampletablebox("stbl");
+					Mp4SampleBox mp4sampledescriptionbox("stsd",1);
+						Mp4AudioSampleEntryBox mp4audiosampleentrybox(audiopayload==PAYLOAD_PCMA?"alaw":"ulaw", RTP_AUDIO_CLOCK);
+					mp4sampledescriptionbox.size = BE( BE(mp4sampledescriptionbox.size) + BE(mp4audiosampleentrybox.size) );
+					Mp4SampleBox mp4timetosamplebox("stts",1);
+					mp4timetosamplebox.size = BE( BE(mp4timetosamplebox.size) + sizeof(SampleTime) );
+					SampleTime sampletime(count,1);
+					Mp4SampleBox mp4sampletochunkbox("stsc",samplechunks.count());
+					mp4sampletochunkbox.size = BE( BE(mp4sampletochunkbox.size) + samplechunks.count()*sizeof(SampleChunk) );
+					Mp4SampleSizeBox mp4samplesizebox("stsz",1,count);
+					Mp4SampleBox mp4chunkoffsetbox("stco",chunkoffsets.count());
+					mp4chunkoffsetbox.size = BE( BE(mp4chunkoffsetbox.size) + chunkoffsets.count()*sizeof(quint32) );
+				mp4sampletablebox.size = BE( BE(mp4sampletablebox.size) +
+											 BE(mp4sampledescriptionbox.size) +
+											 BE(mp4timetosamplebox.size) +
+											 BE(mp4sampletochunkbox.size) +
+											 BE(mp4samplesizebox.size) +
+											 BE(mp4chunkoffsetbox.size) );
+			mp4mediainfobox.size = BE( BE(mp4mediainfobox.size) +
+									   BE(mp4SoundMediaHeaderBox.size) +
+									   BE(mp4datainfobox.size) +
+									   BE(mp4sampletablebox.size) );
+		mp4mediabox.size = BE( BE(mp4mediabox.size) +
+							   BE(mp4MediaHeaderBox.size) +
+							   BE(mp4HandlerBox.size) +
+							   BE(mp4mediainfobox.size) );
+	mp4trackbox.size = BE( BE(mp4trackbox.size) + BE(mp4TrackHeaderBox.size) + BE(mp4mediabox.size) );
+
+	qds.writeRawData(mp4trackbox.header(),mp4trackbox.headersize);
+	qds.writeRawData(mp4TrackHeaderBox.header(),mp4TrackHeaderBox.headersize);
+	qds.writeRawData(mp4mediabox.header(),mp4mediabox.headersize);
+	qds.writeRawData(mp4MediaHeaderBox.header(),mp4MediaHeaderBox.headersize);
+	qds.writeRawData(mp4HandlerBox.header(),mp4HandlerBox.headersize);
+	qds.writeRawData(mp4mediainfobox.header(),mp4mediainfobox.headersize);
+	qds.writeRawData(mp4SoundMediaHeaderBox.header(),mp4SoundMediaHeaderBox.headersize);
+	qds.writeRawData(mp4datainfobox.header(),mp4datainfobox.headersize);
+	qds.writeRawData(mp4DataReferenceBox.header(),mp4DataReferenceBox.headersize);
+	qds.writeRawData(mp4DataEntryUrlBox.header(),mp4DataEntryUrlBox.headersize);
+	qds.writeRawData(mp4sampletablebox.header(),mp4sampletablebox.headersize);
+	qds.writeRawData(mp4sampledescriptionbox.header(),mp4sampledescriptionbox.headersize);
+	qds.writeRawData(mp4audiosampleentrybox.header(),mp4audiosampleentrybox.headersize);
+	qds.writeRawData(mp4timetosamplebox.header(),mp4timetosamplebox.headersize);
+	qds.writeRawData((const char*)&sampletime,sizeof(SampleTime));
+	qds.writeRawData(mp4sampletochunkbox.header(),mp4sampletochunkbox.headersize);
+	for( int ii=0; ii<samplechunks.count(); ii++ )
+		qds.writeRawData((const char*)&samplechunks.at(ii),sizeof(SampleChunk));
+	qds.writeRawData(mp4samplesizebox.header(),mp4samplesizebox.headersize);
+	qds.writeRawData(mp4chunkoffsetbox.header(),mp4chunkoffsetbox.headersize);
+	for( int ii=0; ii<chunkoffsets.count(); ii++ )
+	{
+		quint32 chunk_offset = BE(chunkoffsets.at(ii));
+		qds.writeRawData((const char*)&chunk_offset,sizeof(quint32));
+	}
+	return trak;
+}
+
 // this is used to clean up the buffer frames
 //
 void Mp4ChannelFormat::deleteFrames()
 {
-    int buffers = dataList.count();
-
-    QDEBUG << "delete all frames:" << buffers;
+    QDEBUG << "delete all frames:" << dataList.count();
 
-    for(uint ii=0; ii<(uint)buffers; ii++)
-    {
-        QByteArray *frame = dataList.at(ii);
-        // clean up the buffer
-        if( frame ) delete frame;
-    }
+    foreach( AccessUnit *au, units )
+        accessunits.release(au);
 
     dataList.clear();
+    arena.reset();
+    units.clear();
+    clearTimes();
+    released();
+    audioListMarker.clear();
 
     // reset the state
     frames = 0;
@@ -2,7 +2,7 @@
  * h264video.h
  *
  *  DESCRIPTION:
- *   This is the class for implementing h264 conversions for RTP
+ *   This is the class for implementing h264 and h265 conversions for RTP
  *   -----------------------------------------------------------------------
  *    Copyright (C) 2010-2015 OpenNetcam Project.
  *
@@ -23,6 +23,7 @@
 #ifndef H264VIDEO_H_
 #define H264VIDEO_H_
 #include <QImage>
+#include <QList>
 #include "../include/common.h"
 
 #ifndef INT64_C
@@ -36,72 +37,126 @@ extern "C"
 	#include <libswscale/swscale.h>
 }
 #include "avformat.h"
+#include "accessunit.h"
+#include "motiongrid.h"
 
+extern QByteArray vps;		// H.265 only
 extern QByteArray sps;
 extern QByteArray pps;
 
+// a NAL unit waiting to be put back in decoding order
+class InterleavedNal
+{
+public:
+	quint16    don;
+	quint32    tstamp;
+	QByteArray nal;
+};
+
 class h264Video {
 public:
-	h264Video();
+	h264Video(bool hevc = false);
 	virtual ~h264Video();
 
-	bool extractFrame(const char *hdr, qint64 size);
-	bool isH264iframe() { return iframe; }
-	bool writeFrame(const char* frm, int size );
+	bool isHevc() { return hevc; }
+	void setPacketization(int mode, int depth);
+	bool depacketize(const char *payload, int size, quint32 tstamp, bool marker);
+	AccessUnit *takeAccessUnit();
+	void packetLost();
+	bool writeFrame(const char* frm, int size, bool convert = true );
 	bool convertFrameToRGB(AVFrame *src_frame, int width, int height, enum AVPixelFormat pix_fmt );
-	const unsigned char * frame() { return (const unsigned char*)qba.constData(); }
-	int size() { return qba.size(); }
 	int width() { return dst_w; }
 	int height() { return dst_h; }
 	int format() { return dst_fmt; }
 	bool gotImage() { return picture_ok; }
 	QImage &img() {return myimage; }
-	void resetSync() { sync_ok = false; }
 
 	const unsigned char *imageRGB() { return (const unsigned char*)frameRGB?frameRGB->data[0]:NULL; }
 	int imageHeight() { return dst_h; }
 	int imageWidth() { return dst_w; }
 	int imageSize() { return frameRGB?frameRGB->linesize[0]*dst_h :0; }
 
+	// motion vectors of the last picture decoded (--vectors)
+	bool exportsVectors() { return exportmvs; }
+	bool hasVectors() { return vectorframe; }
+	const QVector<MotionVector> &vectors() { return mvs; }
+	int pictureWidth() { return pic_w; }
+	int pictureHeight() { return pic_h; }
+
 protected:
-    int fragment_type;
-    int nal_type;
-    int start_bit;
-    int end_bit;
-    bool iframe;
+    void depacketizeH264(const unsigned char *p, int size, quint32 tstamp);
+    void depacketizeHevc(const unsigned char *p, int size, quint32 tstamp);
+    void startFragment(const char *nalhdr, int hdrsize, quint32 tstamp, quint16 don);
+    void addFragment(const unsigned char *data, int size);
+    void endFragment();
+    void addNal(const unsigned char *nal, int size, quint32 tstamp, quint16 don);
+    void appendNal(const unsigned char *nal, int size, quint32 tstamp);
+    void startNal(quint32 tstamp);
+    void noteNal(const unsigned char *nal, int size);
+    void dropFragment();
+    void finishAccessUnit();
+    void takeVectors();
+
+    bool hevc;					// H.265, RFC 7798
+    bool interleaved;			// packetization-mode=2 (or h265 sprop-max-don-diff), NAL units carry a DON
+    int depth;					// NAL units held to put them back in order
+    quint16 nextdon;
     bool sync_ok;				// flag when the first keyframe is found
+    bool damaged;				// a packet of the access unit was lost
+    bool dropcounted;			// its drop is already in the metrics
+    bool hasvps;
+    bool hassps;
+    bool haspps;
+    bool fu_active;				// a fragmented NAL is being put together
+    int fu_start;				// where its NAL unit starts in the access unit
+    quint16 fu_don;
+    quint32 fu_tstamp;
+    QByteArray fu;				// in interleaved mode it is put together on its own
+    AccessUnit *building;
+    QList<AccessUnit*> ready;	// complete, until they are taken
+    QList<InterleavedNal> deinterleave;
     bool picture_ok;           // flag when first picture is decoded
     int video_index;
     int waitkey;
     int dst_fmt;
     int dst_w;
     int dst_h;
+    bool exportmvs;
+    bool vectorframe;			// a predicted picture, its vectors are in mvs
+    int pic_w;
+    int pic_h;
+    QVector<MotionVector> mvs;
 
     AVFormatContext *formatContext ;
     AVFrame *picture;
-    AVCodecParserContext *parser;
-	AVPacket pkt;
 	AVFrame *frameRGB;
 	QImage myimage;
 	SwsContext *img_convert_ctx_temp;
 
-    QByteArray qba;
-
 };
 
 // TODO move to separate file
 class Mp4ChannelFormat : ChannelFormat
 {
 public:
-	Mp4ChannelFormat();
+	Mp4ChannelFormat(bool hevc = false);
     ~Mp4ChannelFormat();
     bool writeAv(QString filename, STREAMS streams, QDateTime & datetime, qint64 duration  );
-    int recordFrame(const unsigned char *frame, int size, STREAMS stream,bool writeon );
+    int recordFrame(const unsigned char *frame, int size, STREAMS stream,bool writeon, quint32 tstamp );
+    int recordAccessUnit(AccessUnit *au, bool writeon);
     void deleteFrames();
     void setFormat(int fmt) { dst_fmt = fmt;}
+    // audio is stored as G.711, one byte per sample
+    bool compressedAudio() { return true; }
 
 private:
+    QByteArray audioTrack(quint32 creation_time, quint32 duration, quint32 count,
+                          const QList<quint32> &chunksamples, const QList<quint32> &chunkoffsets);
+
     int dst_fmt;
+    bool hevc;					// hvc1 samples rather than avc1
+    QList<AccessUnit*> units;	// the video of each buffer in dataList, NULL for audio
+    QList<quint32> audioListMarker;
     // custom ioformat for buffered IO
     AVIOContext* avio_ctx;
 };
@@ -448,8 +503,8 @@ public:
 class Mp4HandlerBox : public Mp4FullBox
 {
 public:
-	Mp4HandlerBox(const char boxtype[4], const char *name ) : Mp4FullBox(boxtype, 0, "\0\0\0" )  \
-		{ pre_defined=0; strncpy(handler_type,"vide",4) ; \
+	Mp4HandlerBox(const char boxtype[4], const char *name, const char htype[4]="vide" ) : Mp4FullBox(boxtype, 0, "\0\0\0" )  \
+		{ pre_defined=0; strncpy(handler_type,htype,4) ; \
 		  reserved[0] = reserved[1] = reserved[2] = 0; memset((char*)handler_name,0, HANDLER_NAME_SIZE); \
 		  strncpy(handler_name,name,HANDLER_NAME_SIZE-1) ; \
 		  headersize += 5*sizeof(quint32)+strlen(handler_name)+1 ; \
@@ -471,6 +526,17 @@ public:
 	quint16 opcolor[3];
 };
 
+class Mp4SoundMediaHeaderBox : public Mp4FullBox
+{
+public:
+	Mp4SoundMediaHeaderBox(const char boxtype[4]) : Mp4FullBox(boxtype, 0, "\0\0\0" )  \
+		{ balance = reserved = 0;  \
+		  headersize += 2*sizeof(quint16); \
+		  size = BE( headersize ); }
+	qint16  balance;
+	quint16 reserved;
+};
+
 class Mp4DataEntryUrlBox : public Mp4FullBox
 {
 public:
@@ -561,6 +627,27 @@ public:
 	qint16 pre_defined2;
 };
 
+// G.711 sample entry ('ulaw' / 'alaw'), one channel
+class Mp4AudioSampleEntryBox : public Mp4Box
+{
+public:
+	Mp4AudioSampleEntryBox(const char boxtype[4], quint16 rate ) : Mp4Box(boxtype )  \
+		{ reserved[0]=reserved[1]=reserved[2]=reserved[3]=reserved[4]=reserved[5]=0; \
+		  data_reference_index=BE16(1); reserved1[0]=reserved1[1]=0; \
+		  channelcount=BE16(1); samplesize=BE16(16); pre_defined=reserved2=0; \
+		  samplerate=BE(rate<<16); \
+		  headersize += 6+5*sizeof(quint16)+3*sizeof(quint32); \
+		  size = BE( headersize ); }
+	quint8  reserved[6];
+	quint16 data_reference_index;
+	quint32 reserved1[2];
+	quint16 channelcount;
+	quint16 samplesize;
+	quint16 pre_defined;
+	quint16 reserved2;
+	quint32 samplerate;
+};
+
 class AVCDecoderConfigurationRecord : public Mp4Box
 {
 public:
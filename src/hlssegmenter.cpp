@@ -0,0 +1,388 @@
+/**
+ * FILE:		hlssegmenter.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for packaging H.264 access units into a rolling
+ * window of HLS (MPEG-TS) segments for live browser playback.
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include "../include/common.h"
+#include "hlssegmenter.h"
+#include "annexb.h"
+
+extern QByteArray vps;
+extern QByteArray sps;
+extern QByteArray pps;
+
+// transport stream constants (ISO/IEC 13818-1)
+#define TS_PACKET_SIZE   188
+#define TS_PID_PAT       0x0000
+#define TS_PID_PMT       0x1000
+#define TS_PID_VIDEO     0x0100
+#define TS_STREAM_H264   0x1B
+#define TS_STREAM_HEVC   0x24
+#define TS_CLOCK         90000
+// presentation delay ahead of the PCR
+#define TS_PTS_DELAY     (TS_CLOCK/5)
+
+static const char startcode[4] = { 0, 0, 0, 1 };
+// access unit delimiter, primary_pic_type = any
+static const char audnal[6] = { 0, 0, 0, 1, 0x09, (char)0xF0 };
+// the same for H.265, type 35 with pic_type = any
+static const char hevcaudnal[7] = { 0, 0, 0, 1, 0x46, 0x01, 0x50 };
+
+// MPEG-2 CRC32 (polynomial 0x04C11DB7, no reflection)
+static quint32 crc32mpeg(const unsigned char *data, int len)
+{
+    quint32 crc = 0xFFFFFFFF;
+    for( int ii=0; ii<len; ii++ )
+    {
+        crc ^= (quint32)data[ii] << 24;
+        for( int bb=0; bb<8; bb++ )
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+    }
+    return crc;
+}
+
+HlsSegmenter::HlsSegmenter(int w, bool h) :
+    window(w), hevc(h), nextsequence(0), segstart(0), segopen(false),
+    aukey(false), auvcl(false), autstamp(0),
+    tsvalid(false), lasttstamp(0), extts(0),
+    ccpat(0), ccpmt(0), ccvideo(0)
+{
+    QDEBUG << "HlsSegmenter window=" << window << (hevc ? "h265" : "h264");
+    if( window < 2 ) window = 2;
+}
+
+HlsSegmenter::~HlsSegmenter()
+{
+    clear();
+}
+
+void HlsSegmenter::clear()
+{
+    segments.clear();
+    current.clear();
+    au.clear();
+    segopen = false;
+    aukey = auvcl = false;
+    tsvalid = false;
+}
+
+/*
+ * addAccessUnit
+ * data is the NAL units of one picture, each after a start code,
+ * and tstamp is its RTP timestamp
+ */
+void HlsSegmenter::addAccessUnit(const unsigned char *data, int size, quint32 tstamp)
+{
+    au.clear();
+    aukey = auvcl = false;
+    autstamp = tstamp;
+
+    AnnexB nals(data, size, hevc);
+    while( nals.next() )
+    {
+        switch( nals.kind() )
+        {
+        case AnnexB::VPS:   // keep the latest, they are written ahead of each IDR
+            vpsnal = QByteArray((const char*)nals.nal(), nals.size());
+            continue;
+        case AnnexB::SPS:
+            spsnal = QByteArray((const char*)nals.nal(), nals.size());
+            continue;
+        case AnnexB::PPS:
+            ppsnal = QByteArray((const char*)nals.nal(), nals.size());
+            continue;
+        case AnnexB::AUD:   // we write our own
+            continue;
+        case AnnexB::KEY:
+            aukey = true;
+            // fall through
+        case AnnexB::SLICE:
+            auvcl = true;
+            break;
+        default:
+            break;
+        }
+        au.append(startcode, 4);
+        au.append((const char*)nals.nal(), nals.size());
+    }
+
+    if( auvcl )
+        writeAccessUnit();
+    au.clear();
+    aukey = auvcl = false;
+}
+
+void HlsSegmenter::writeAccessUnit()
+{
+    // extend the 32 bit RTP timestamp
+    if( !tsvalid )
+    {
+        extts = autstamp;
+        tsvalid = true;
+    } else
+        extts += (qint32)(autstamp - lasttstamp);
+    lasttstamp = autstamp;
+
+    if( segopen )
+    {
+        // cut at an IDR once the target duration is reached
+        if( aukey && extts - segstart >= (qint64)HLS_TARGET_DURATION*TS_CLOCK )
+            closeSegment(extts);
+        else
+        if( current.size() > HLS_MAX_SEGMENT_SIZE )
+        {
+            // no IDR in sight; close it and wait for the next one
+            closeSegment(extts);
+            return;
+        }
+    }
+
+    if( !segopen )
+    {
+        // every segment must start with an IDR
+        if( !aukey )
+            return;
+        current.clear();
+        segstart = extts;
+        segopen = true;
+        writeTables();
+    }
+
+    QByteArray pes;
+    pes.reserve(sizeof(hevcaudnal) + au.size() + (aukey ? 256 : 0));
+    if( hevc )
+        pes.append(hevcaudnal, sizeof(hevcaudnal));
+    else
+        pes.append(audnal, sizeof(audnal));
+    if( aukey )
+    {
+        // prefer parameter sets seen in band, fall back to the sdp
+        const QByteArray &v = vpsnal.isEmpty() ? vps : vpsnal;
+        if( hevc && !v.isEmpty() )
+        {
+            pes.append(startcode, 4);
+            pes.append(v);
+        }
+        const QByteArray &s = spsnal.isEmpty() ? sps : spsnal;
+        const QByteArray &p = ppsnal.isEmpty() ? pps : ppsnal;
+        if( !s.isEmpty() )
+        {
+            pes.append(startcode, 4);
+            pes.append(s);
+        }
+        if( !p.isEmpty() )
+        {
+            pes.append(startcode, 4);
+            pes.append(p);
+        }
+    }
+    pes.append(au);
+
+    writePes(pes, extts + TS_PTS_DELAY, extts, aukey);
+}
+
+void HlsSegmenter::closeSegment(qint64 endts)
+{
+    segopen = false;
+    if( current.isEmpty() )
+        return;
+
+    HlsSegment seg;
+    seg.sequence = nextsequence++;
+    seg.duration = (quint32)(endts - segstart);
+    seg.data = current;
+    current.clear();
+    segments.append(seg);
+
+    while( segments.count() > window )
+        segments.removeFirst();
+
+    QDDEBUG << "HLS segment" << seg.sequence << "size=" << seg.data.size() << "duration=" << seg.duration;
+}
+
+void HlsSegmenter::writePacket(const unsigned char *pkt)
+{
+    current.append((const char*)pkt, TS_PACKET_SIZE);
+}
+
+// write the PAT and PMT at the start of each segment
+void HlsSegmenter::writeTables()
+{
+    unsigned char pkt[TS_PACKET_SIZE];
+
+    // program association table
+    memset(pkt, 0xFF, sizeof(pkt));
+    const unsigned char pat[] = {
+        0x00,                           // pointer field
+        0x00, 0xB0, 0x0D,               // table id, section length 13
+        0x00, 0x01, 0xC1, 0x00, 0x00,   // transport stream id, version, section numbers
+        0x00, 0x01,                     // program 1
+        0xE0 | (TS_PID_PMT >> 8), TS_PID_PMT & 0xFF };
+    pkt[0] = 0x47;
+    pkt[1] = 0x40 | (TS_PID_PAT >> 8);
+    pkt[2] = TS_PID_PAT & 0xFF;
+    pkt[3] = 0x10 | (ccpat++ & 0x0F);
+    memcpy(pkt+4, pat, sizeof(pat));
+    quint32 crc = crc32mpeg(pkt+5, sizeof(pat)-1);
+    unsigned char *c = pkt+4+sizeof(pat);
+    c[0] = crc >> 24; c[1] = crc >> 16; c[2] = crc >> 8; c[3] = crc;
+    writePacket(pkt);
+
+    // program map table
+    memset(pkt, 0xFF, sizeof(pkt));
+    const unsigned char pmt[] = {
+        0x00,                           // pointer field
+        0x02, 0xB0, 0x12,               // table id, section length 18
+        0x00, 0x01, 0xC1, 0x00, 0x00,   // program 1, version, section numbers
+        0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF,   // PCR pid
+        0xF0, 0x00,                     // program info length
+        hevc ? TS_STREAM_HEVC : TS_STREAM_H264, 0xE0 | (TS_PID_VIDEO >> 8), TS_PID_VIDEO & 0xFF, 0xF0, 0x00 };
+    pkt[0] = 0x47;
+    pkt[1] = 0x40 | (TS_PID_PMT >> 8);
+    pkt[2] = TS_PID_PMT & 0xFF;
+    pkt[3] = 0x10 | (ccpmt++ & 0x0F);
+    memcpy(pkt+4, pmt, sizeof(pmt));
+    crc = crc32mpeg(pkt+5, sizeof(pmt)-1);
+    c = pkt+4+sizeof(pmt);
+    c[0] = crc >> 24; c[1] = crc >> 16; c[2] = crc >> 8; c[3] = crc;
+    writePacket(pkt);
+}
+
+// packetize one access unit as a PES packet on the video pid
+void HlsSegmenter::writePes(const QByteArray &es, quint64 pts, quint64 pcr, bool key)
+{
+    unsigned char hdr[14];
+    hdr[0] = 0x00; hdr[1] = 0x00; hdr[2] = 0x01;
+    hdr[3] = 0xE0;                  // video stream 0
+    hdr[4] = hdr[5] = 0x00;         // unbounded length for video
+    hdr[6] = 0x80;                  // marker bits
+    hdr[7] = 0x80;                  // PTS only
+    hdr[8] = 0x05;                  // header data length
+    pts &= 0x1FFFFFFFFULL;
+    hdr[9]  = 0x21 | ((pts >> 29) & 0x0E);
+    hdr[10] = (pts >> 22) & 0xFF;
+    hdr[11] = ((pts >> 14) & 0xFE) | 0x01;
+    hdr[12] = (pts >> 7) & 0xFF;
+    hdr[13] = ((pts << 1) & 0xFE) | 0x01;
+
+    const unsigned char *data = (const unsigned char*)es.constData();
+    int total = sizeof(hdr) + es.size();
+    int offset = 0;
+    bool first = true;
+    unsigned char pkt[TS_PACKET_SIZE];
+
+    while( offset < total )
+    {
+        // the first packet carries the PCR in the adaptation field
+        int afsize = first ? 8 : 0;
+        int chunk = total - offset;
+        if( chunk > 184 - afsize ) chunk = 184 - afsize;
+        // pad with stuffing bytes in the adaptation field
+        if( chunk < 184 - afsize ) afsize = 184 - chunk;
+
+        pkt[0] = 0x47;
+        pkt[1] = (first ? 0x40 : 0x00) | (TS_PID_VIDEO >> 8);
+        pkt[2] = TS_PID_VIDEO & 0xFF;
+        pkt[3] = (afsize ? 0x30 : 0x10) | (ccvideo++ & 0x0F);
+
+        unsigned char *p = pkt+4;
+        if( afsize )
+        {
+            unsigned char *af = p;
+            *p++ = afsize - 1;
+            if( afsize > 1 )
+            {
+                *p++ = first ? ( 0x10 | (key ? 0x40 : 0x00) ) : 0x00;
+                if( first )
+                {
+                    quint64 base = pcr & 0x1FFFFFFFFULL;
+                    *p++ = base >> 25;
+                    *p++ = base >> 17;
+                    *p++ = base >> 9;
+                    *p++ = base >> 1;
+                    *p++ = ((base & 1) << 7) | 0x7E;
+                    *p++ = 0x00;
+                }
+                while( p < af + afsize )
+                    *p++ = 0xFF;
+            }
+        }
+
+        // copy payload, which may straddle the pes header
+        int done = 0;
+        while( done < chunk )
+        {
+            int pos = offset + done;
+            if( pos < (int)sizeof(hdr) )
+            {
+                int n = sizeof(hdr) - pos;
+                if( n > chunk - done ) n = chunk - done;
+                memcpy(p, hdr+pos, n);
+                p += n; done += n;
+            } else
+            {
+                int n = chunk - done;
+                memcpy(p, data + pos - sizeof(hdr), n);
+                p += n; done += n;
+            }
+        }
+        Q_ASSERT( p == pkt + TS_PACKET_SIZE );
+
+        writePacket(pkt);
+        offset += chunk;
+        first = false;
+    }
+}
+
+// build the live playlist from the current window
+QByteArray HlsSegmenter::playlist()
+{
+    QByteArray m3u8;
+    if( segments.isEmpty() )
+        return m3u8;
+
+    quint32 maxduration = 0;
+    for( int ii=0; ii<segments.count(); ii++ )
+        if( segments.at(ii).duration > maxduration )
+            maxduration = segments.at(ii).duration;
+
+    m3u8 += "#EXTM3U\n";
+    m3u8 += "#EXT-X-VERSION:3\n";
+    m3u8 += QString("#EXT-X-TARGETDURATION:%1\n").arg((maxduration + TS_CLOCK - 1) / TS_CLOCK).toLatin1();
+    m3u8 += QString("#EXT-X-MEDIA-SEQUENCE:%1\n").arg(segments.first().sequence).toLatin1();
+    for( int ii=0; ii<segments.count(); ii++ )
+    {
+        m3u8 += QString("#EXTINF:%1,\n").arg((double)segments.at(ii).duration / TS_CLOCK, 0, 'f', 3).toLatin1();
+        m3u8 += QString(STR_HLS_SEGMENT "%1.ts\n").arg(segments.at(ii).sequence).toLatin1();
+    }
+    return m3u8;
+}
+
+// return the segment, or an empty array if it has left the window
+QByteArray HlsSegmenter::segment(int sequence)
+{
+    for( int ii=0; ii<segments.count(); ii++ )
+        if( segments.at(ii).sequence == sequence )
+            return segments.at(ii).data;
+    return QByteArray();
+}
@@ -0,0 +1,99 @@
+/**
+ * FILE:		hlssegmenter.h
+ *
+ * DESCRIPTION:
+ * This is the class for packaging H.264 access units into a rolling
+ * window of HLS (MPEG-TS) segments for live browser playback.
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef HLSSEGMENTER_H
+#define HLSSEGMENTER_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QList>
+
+#include "../include/common.h"
+
+// a completed segment in the window
+class HlsSegment
+{
+public:
+    HlsSegment() : sequence(0), duration(0) {}
+    int        sequence;
+    quint32    duration;       // in 90kHz units
+    QByteArray data;           // MPEG-TS packets
+};
+
+/*
+ * HlsSegmenter
+ * takes the Annex-B access units exactly as they are passed to the
+ * recorder and remuxes them into MPEG-TS without decoding, as H.264 or H.265.
+ * Segments are cut at IDR (or IRAP) frames and only the last 'window' segments are kept,
+ * so memory is bounded by the window size (and HLS_MAX_SEGMENT_SIZE).
+ */
+class HlsSegmenter
+{
+public:
+    HlsSegmenter(int w = HLS_DEFAULT_WINDOW, bool hevc = false);
+    ~HlsSegmenter();
+    void addAccessUnit(const unsigned char *data, int size, quint32 tstamp);
+    QByteArray playlist();
+    QByteArray segment(int sequence);
+    void clear();
+
+private:
+    void writeAccessUnit();
+    void closeSegment(qint64 endts);
+    void writeTables();
+    void writePacket(const unsigned char *pkt);
+    void writePes(const QByteArray &pes, quint64 pts, quint64 pcr, bool key);
+
+    int        window;
+    bool       hevc;
+    int        nextsequence;
+    QList<HlsSegment> segments;
+
+    // the segment being built
+    QByteArray current;
+    qint64     segstart;       // extended 90kHz timestamp of the first access unit
+    bool       segopen;
+
+    // the access unit being built
+    QByteArray au;
+    bool       aukey;
+    bool       auvcl;
+    quint32    autstamp;
+
+    // RTP timestamp unwrapping
+    bool       tsvalid;
+    quint32    lasttstamp;
+    qint64     extts;
+
+    // parameter sets received in-band (override the sdp values)
+    QByteArray vpsnal;
+    QByteArray spsnal;
+    QByteArray ppsnal;
+
+    // continuity counters
+    quint8     ccpat;
+    quint8     ccpmt;
+    quint8     ccvideo;
+};
+
+#endif // HLSSEGMENTER_H
@@ -0,0 +1,673 @@
+/**
+ * FILE:		httpserver.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for the keep-alive HTTP/1.1 server answering
+ * snapshot, metrics, trace, status and HLS requests from its own thread
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <QCoreApplication>
+#include <QBuffer>
+#include <QLocale>
+#include <QDateTime>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
+#include "httpserver.h"
+#include "trace.h"
+
+#ifndef _WIN32
+#ifdef MSG_NOSIGNAL
+#define HTTP_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define HTTP_SEND_FLAGS 0
+#endif
+#endif
+
+static const char *reason(int status)
+{
+    switch( status )
+    {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 413: return "Request Entity Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+    }
+    return "Error";
+}
+
+//
+// class HttpResponse
+//
+HttpResponse::HttpResponse() :
+    status(404), nocache(true), keepalive(false), headonly(false), connection(0), sequence(0),
+    received(0)
+{
+}
+
+HttpResponse::HttpResponse(const HttpRequest &req, int s) :
+    status(s), nocache(true), keepalive(req.keepalive), headonly(req.method == "HEAD"),
+    connection(req.connection), sequence(req.sequence), received(req.received)
+{
+    if( status == 404 )
+        setNotFound();
+}
+
+void HttpResponse::setNotFound()
+{
+    status = 404;
+    contenttype = STR_MIME_HTML;
+    extra.clear();
+    body = QByteArray::fromRawData(STR_CONTENT_404, strlen(STR_CONTENT_404));
+}
+
+QByteArray HttpResponse::header(const QByteArray &date) const
+{
+    QByteArray h;
+    h.reserve(256);
+    h += STR_HTTP " ";
+    h += QByteArray::number(status);
+    h += ' ';
+    h += reason(status);
+    h += STR_NL;
+    if( !contenttype.isEmpty() )
+    {
+        h += "Content-Type: ";
+        h += contenttype;
+        h += STR_NL;
+    }
+    h += "Content-Length: ";
+    h += QByteArray::number(body.size());
+    h += STR_NL "Date: ";
+    h += date;
+    h += STR_NL;
+    if( nocache )
+        h += "Cache-Control: no-cache" STR_NL;
+    h += extra;
+    h += keepalive ? "Connection: keep-alive" STR_NL : "Connection: close" STR_NL;
+    h += "Server: " STR_HTTP_SERVER STR_NL STR_NL;
+    return h;
+}
+
+//
+// class HttpParser
+//
+HttpParser::HttpParser() :
+    pos(0), scan(0), headersize(0), remaining(0), state(PARSE_REQUEST_LINE), errstatus(0)
+{
+}
+
+int HttpParser::fail(int status)
+{
+    state = PARSE_ERROR;
+    errstatus = status;
+    return -1;
+}
+
+// hand over the request and drop the parsed data
+void HttpParser::finish(HttpRequest &req)
+{
+    req = current;
+    current = HttpRequest();
+    state = PARSE_REQUEST_LINE;
+    headersize = 0;
+    remaining = 0;
+    compact();
+}
+
+// drop the parsed data, only when most of the buffer has been used
+void HttpParser::compact()
+{
+    if( pos > 0 && (pos == buffer.size() || pos > buffer.size()/2) )
+    {
+        buffer.remove(0, pos);
+        scan -= pos;
+        pos = 0;
+    }
+}
+
+int HttpParser::parse(HttpRequest &req)
+{
+    for(;;)
+    {
+        if( state == PARSE_ERROR )
+            return -1;
+
+        if( state == PARSE_BODY )
+        {
+            if( buffer.size() - pos < remaining )
+                return 0;
+            current.body = buffer.mid(pos, remaining);
+            pos += remaining;
+            scan = pos;
+            finish(req);
+            return 1;
+        }
+
+        int eol = buffer.indexOf('\n', scan);
+        if( eol == -1 )
+        {
+            scan = buffer.size();
+            if( headersize + buffer.size() - pos > HTTP_MAX_HEADER_SIZE )
+                return fail(431);
+            compact();
+            return 0;
+        }
+        QByteArray line = buffer.mid(pos, eol - pos);
+        if( line.endsWith('\r') )
+            line.chop(1);
+        pos = scan = eol + 1;
+        headersize += line.size() + 2;
+        if( headersize > HTTP_MAX_HEADER_SIZE )
+            return fail(431);
+
+        if( state == PARSE_REQUEST_LINE )
+        {
+            // empty lines before the request line are ignored (RFC 7230 3.5)
+            if( line.isEmpty() )
+            {
+                headersize = 0;
+                continue;
+            }
+            // method SP request-target SP HTTP-version
+            QList<QByteArray> parts = line.split(' ');
+            if( parts.count() != 3 || parts[0].isEmpty() || parts[1].isEmpty() )
+                return fail(400);
+            if( !parts[2].startsWith("HTTP/") )
+                return fail(400);
+            if( !parts[2].startsWith("HTTP/1.") )
+                return fail(505);
+            current.method = parts[0];
+            current.minor = parts[2].mid(7).toInt();
+            int query = parts[1].indexOf('?');
+            if( query == -1 )
+            {
+                current.path = parts[1];
+            } else
+            {
+                current.path = parts[1].left(query);
+                current.query = parts[1].mid(query+1);
+            }
+            state = PARSE_HEADERS;
+            continue;
+        }
+
+        // end of the headers
+        if( line.isEmpty() )
+        {
+            // HTTP/1.1 connections persist unless closed, HTTP/1.0 ones only if asked
+            current.keepalive = current.minor >= 1;
+            QList<QByteArray> tokens = current.header("connection").split(',');
+            for( int ii=0; ii<tokens.count(); ii++ )
+            {
+                QByteArray token = tokens[ii].trimmed().toLower();
+                if( token == "close" )
+                    current.keepalive = false;
+                else if( token == "keep-alive" )
+                    current.keepalive = true;
+            }
+
+            if( current.headers.contains("transfer-encoding") )
+                return fail(501);
+            remaining = 0;
+            if( current.headers.contains("content-length") )
+            {
+                bool ok = false;
+                remaining = current.header("content-length").trimmed().toLongLong(&ok);
+                if( !ok || remaining < 0 )
+                    return fail(400);
+                if( remaining > HTTP_MAX_BODY_SIZE )
+                    return fail(413);
+            }
+            if( remaining > 0 )
+            {
+                state = PARSE_BODY;
+                continue;
+            }
+            finish(req);
+            return 1;
+        }
+
+        // obsolete line folding is rejected (RFC 7230 3.2.4)
+        if( line[0] == ' ' || line[0] == '\t' )
+            return fail(400);
+        int colon = line.indexOf(':');
+        if( colon <= 0 )
+            return fail(400);
+        QByteArray name = line.left(colon).trimmed().toLower();
+        QByteArray value = line.mid(colon+1).trimmed();
+        if( current.headers.contains(name) )
+            current.headers[name] += ", " + value;
+        else
+            current.headers.insert(name, value);
+    }
+}
+
+//
+// class HttpConnection
+//
+HttpConnection::HttpConnection(int descriptor, quint32 id, HttpServer *parent) :
+    QObject(parent), server(parent), connectionid(id), nextsequence(0), sendsequence(0),
+    closing(false), command(false)
+{
+    socket = new QTcpSocket(this);
+    socket->setSocketDescriptor(descriptor);
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    // unread data is left to the kernel so a fast client is slowed down
+    socket->setReadBufferSize(HTTP_READ_BUFFER);
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readRequests()));
+    connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(processRequests()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(closed()));
+
+    idle.setSingleShot(true);
+    idle.setInterval(HTTP_KEEPALIVE_TIMEOUT);
+    connect(&idle, SIGNAL(timeout()), this, SLOT(idleTimeout()));
+    idle.start();
+    metrics.httpConnections.add();
+}
+
+HttpConnection::~HttpConnection()
+{
+    metrics.httpConnections.add(-1);
+}
+
+void HttpConnection::readRequests()
+{
+    if( closing )
+    {
+        socket->readAll();
+        return;
+    }
+    idle.start();
+
+    QByteArray data = socket->read(qMax(0, HTTP_READ_BUFFER - parser.buffered()));
+    if( data.isEmpty() )
+        return;
+
+    // vchannel command messages arrive on the same port
+    if( command || (nextsequence == 0 && parser.buffered() == 0 && data.trimmed().startsWith('<')) )
+    {
+        readCommand(data);
+        return;
+    }
+    parser.append(data);
+    processRequests();
+}
+
+void HttpConnection::readCommand(const QByteArray &data)
+{
+    command = true;
+    commandbuf += data;
+
+    int end = commandbuf.indexOf("</" STR_VCHANNEL);
+    if( end != -1 && commandbuf.indexOf('>', end) != -1 )
+    {
+        server->forwardCommand(commandbuf);
+    } else if( commandbuf.size() < HTTP_MAX_COMMAND )
+    {
+        return;
+    }
+    // one command per connection
+    closing = true;
+    socket->disconnectFromHost();
+}
+
+void HttpConnection::processRequests()
+{
+    while( !closing && !command && nextsequence - sendsequence < HTTP_MAX_PIPELINE &&
+           socket->bytesToWrite() < HTTP_MAX_OUTPUT )
+    {
+        HttpRequest req;
+        int result = parser.parse(req);
+        if( result == 0 )
+        {
+            // any data left in the socket after it was limited
+            if( socket->bytesAvailable() > 0 && parser.buffered() < HTTP_READ_BUFFER )
+            {
+                parser.append(socket->read(HTTP_READ_BUFFER - parser.buffered()));
+                continue;
+            }
+            break;
+        }
+
+        req.connection = connectionid;
+        req.sequence = nextsequence++;
+        req.received = Metrics::now();
+        if( result < 0 )
+        {
+            // the stream can not be resynchronised, answer and close
+            HttpResponse resp(req, parser.error());
+            resp.keepalive = false;
+            closing = true;
+            queue(resp);
+            break;
+        }
+        if( !req.keepalive )
+            closing = true;
+
+        HttpResponse resp(req);
+        if( server->respond(req, resp) )
+            queue(resp);
+        else
+            server->forward(req);
+    }
+}
+
+// from the server, with a response completed in another thread
+void HttpConnection::deliver(const HttpResponse &resp)
+{
+    queue(resp);
+    processRequests();
+}
+
+// send responses in request order
+void HttpConnection::queue(const HttpResponse &resp)
+{
+    ready.insert(resp.sequence, resp);
+    while( ready.contains(sendsequence) )
+    {
+        HttpResponse r = ready.take(sendsequence++);
+        send(r);
+        metrics.httpLatency.observe(Metrics::now() - r.received);
+        if( !r.keepalive )
+        {
+            closing = true;
+            ready.clear();
+            // pending data is written before the connection closes
+            socket->disconnectFromHost();
+            return;
+        }
+    }
+    if( sendsequence == nextsequence )
+        idle.start();
+}
+
+// header and body go out in one gather write without copying the body;
+// whatever the kernel does not take is queued in the socket
+void HttpConnection::send(const HttpResponse &resp)
+{
+    QByteArray head = resp.header(server->date());
+    QByteArray body;
+    if( !resp.headonly )
+        body = resp.body;
+    qint64 written = 0;
+
+#ifndef _WIN32
+    // only when nothing is queued, or the order would change
+    if( socket->bytesToWrite() == 0 )
+    {
+        struct iovec iov[2];
+        iov[0].iov_base = head.data();
+        iov[0].iov_len = head.size();
+        iov[1].iov_base = (void*)body.constData();
+        iov[1].iov_len = body.size();
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = body.isEmpty() ? 1 : 2;
+
+        ssize_t n;
+        do {
+            n = ::sendmsg(socket->socketDescriptor(), &msg, HTTP_SEND_FLAGS);
+        } while( n < 0 && errno == EINTR );
+        // on EAGAIN everything is queued, other errors are reported by the socket
+        if( n > 0 )
+            written = n;
+    }
+#endif
+
+    if( written < head.size() )
+    {
+        socket->write(head.constData() + written, head.size() - written);
+        if( !body.isEmpty() )
+            socket->write(body);
+    } else
+    {
+        written -= head.size();
+        if( written < body.size() )
+            socket->write(body.constData() + written, body.size() - written);
+    }
+}
+
+void HttpConnection::idleTimeout()
+{
+    // a slow response is not an idle connection
+    if( sendsequence != nextsequence )
+    {
+        idle.start();
+        return;
+    }
+    QDEBUG << "http: idle connection closed" << connectionid;
+    closing = true;
+    socket->disconnectFromHost();
+}
+
+void HttpConnection::closed()
+{
+    closing = true;
+    idle.stop();
+    server->remove(connectionid);
+    deleteLater();
+}
+
+//
+// class HttpServer
+//
+HttpServer::HttpServer(FrameMailbox *mailbox) :
+    QTcpServer(NULL), thread(NULL), frames(mailbox), nextid(0),
+    snapsequence(0), datetime(0)
+{
+    qRegisterMetaType<HttpRequest>("HttpRequest");
+    qRegisterMetaType<HttpResponse>("HttpResponse");
+}
+
+HttpServer::~HttpServer()
+{
+    stop();
+}
+
+// requests are accepted from localhost and the /24 subnet of the event address
+void HttpServer::setNetwork(const QString &address)
+{
+    network = address;
+    int last = address.lastIndexOf('.');
+    if( last != -1 )
+        network = address.left(last+1);
+}
+
+bool HttpServer::allowed(const QHostAddress &address)
+{
+    QString peer = address.toString();
+    return peer.startsWith("127.0.0.1") || (!network.isEmpty() && peer.startsWith(network));
+}
+
+// start the server thread and listen from it
+bool HttpServer::start(int port)
+{
+    if( thread ) return isListening();
+
+    thread = new QThread;
+    thread->setObjectName("http");
+    moveToThread(thread);
+    thread->start();
+
+    bool ok = false;
+    QMetaObject::invokeMethod(this, "listenPort", Qt::BlockingQueuedConnection,
+                              Q_RETURN_ARG(bool, ok), Q_ARG(int, port));
+    return ok;
+}
+
+// close all connections and stop the thread, the server is returned to the calling thread
+void HttpServer::stop()
+{
+    if( !thread ) return;
+
+    QMetaObject::invokeMethod(this, "shutdown", Qt::BlockingQueuedConnection);
+    thread->quit();
+    thread->wait();
+    delete thread;
+    thread = NULL;
+}
+
+// stop accepting connections, open ones are still served
+void HttpServer::pause()
+{
+    QMetaObject::invokeMethod(this, "closeListener", Qt::QueuedConnection);
+}
+
+// may be called from any thread
+void HttpServer::reply(const HttpResponse &resp)
+{
+    QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection, Q_ARG(HttpResponse, resp));
+}
+
+bool HttpServer::listenPort(int port)
+{
+    return listen(QHostAddress::Any, port);
+}
+
+void HttpServer::closeListener()
+{
+    close();
+}
+
+void HttpServer::shutdown()
+{
+    close();
+    qDeleteAll(connections);
+    connections.clear();
+    moveToThread(QCoreApplication::instance()->thread());
+}
+
+void HttpServer::deliver(HttpResponse resp)
+{
+    HttpConnection *c = connections.value(resp.connection);
+    // the client may have gone while the response was made
+    if( c )
+        c->deliver(resp);
+}
+
+void HttpServer::incomingConnection(int socket)
+{
+    HttpConnection *c = new HttpConnection(socket, ++nextid, this);
+    if( !allowed(c->peer()) )
+    {
+        qWarning() << "Command from unknown source:" << (const char*)c->peer().toString().toAscii();
+        delete c;
+        return;
+    }
+    if( connections.count() >= HTTP_MAX_CONNECTIONS )
+    {
+        qWarning() << "http: too many connections";
+        delete c;
+        return;
+    }
+    connections.insert(c->id(), c);
+    QDEBUG << "http: incomingConnection on:" << socket << "id" << c->id();
+}
+
+// answer the requests that can be made in the server thread
+bool HttpServer::respond(const HttpRequest &req, HttpResponse &resp)
+{
+    if( req.path == STR_SNAPSHOT || req.path == STR_THUMBNAIL )
+    {
+        snapshot(req, resp);
+        return true;
+    }
+    // the counters are atomic and can be read from any thread
+    if( req.path == STR_METRICS )
+    {
+        resp.status = 200;
+        resp.contenttype = STR_MIME_METRICS;
+        resp.extra.clear();
+        resp.body = metrics.text();
+        return true;
+    }
+    // the trace rings are copied without locking their writers
+    if( req.path == STR_TRACE )
+    {
+        resp.status = 200;
+        resp.contenttype = STR_MIME_JSON;
+        resp.extra.clear();
+        resp.body = Trace::chromeJson();
+        return true;
+    }
+    return false;
+}
+
+void HttpServer::snapshot(const HttpRequest &req, HttpResponse &resp)
+{
+    MediaFramePtr frame;
+    if( frames )
+        frame = frames->latest();
+    if( !frame )
+        return;
+
+    QByteArray body;
+    if( req.path == STR_THUMBNAIL )
+    {
+        body = frame->thumbnail;
+    } else if( !frame->jpeg.isEmpty() )
+    {
+        // for mjpeg send the latest jpeg as received
+        body = frame->jpeg;
+    } else if( !frame->image.isNull() )
+    {
+        // for h264 convert the image once, all clients share the result
+        if( frame->sequence != snapsequence )
+        {
+            snapjpeg.clear();
+            QBuffer buffer(&snapjpeg);
+            buffer.open(QIODevice::WriteOnly);
+            frame->image.save(&buffer, "JPG");
+            snapsequence = frame->sequence;
+        }
+        body = snapjpeg;
+    }
+    if( body.isEmpty() )
+        return;
+
+    resp.status = 200;
+    resp.contenttype = STR_MIME_JPEG;
+    resp.extra.clear();
+    resp.body = body;
+}
+
+// RFC 7231 IMF-fixdate, made once a second
+QByteArray HttpServer::date()
+{
+    uint now = (uint)::time(NULL);
+    if( now != datetime || datestr.isEmpty() )
+    {
+        datetime = now;
+        datestr = QLocale::c().toString(QDateTime::fromTime_t(now).toUTC(),
+                                        "ddd, dd MMM yyyy hh:mm:ss 'GMT'").toLatin1();
+    }
+    return datestr;
+}
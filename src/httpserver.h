@@ -0,0 +1,209 @@
+/**
+ * FILE:		httpserver.h
+ *
+ * DESCRIPTION:
+ * This is the class for the keep-alive HTTP/1.1 server answering
+ * snapshot, metrics, trace, status and HLS requests from its own thread
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QMap>
+#include <QHash>
+#include <QTimer>
+#include <QThread>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QMetaType>
+
+#include "../include/common.h"
+#include "framemailbox.h"
+#include "metrics.h"
+
+class HttpRequest
+{
+public:
+    HttpRequest() : minor(1), keepalive(false), connection(0), sequence(0), received(0) {}
+    QByteArray header(const QByteArray &name) const { return headers.value(name.toLower()); }
+
+    QByteArray method;
+    QByteArray path;           // target up to the '?'
+    QByteArray query;          // target after the '?'
+    int        minor;          // HTTP/1.minor
+    QMap<QByteArray,QByteArray> headers;   // names in lower case
+    QByteArray body;
+    bool       keepalive;      // from the version and the Connection header
+    quint32    connection;     // connection id in the server
+    quint32    sequence;       // position in the pipeline of the connection
+    qint64     received;       // Metrics::now() when it was parsed
+};
+
+class HttpResponse
+{
+public:
+    HttpResponse();
+    HttpResponse(const HttpRequest &req, int s = 404);
+    void setNotFound();
+    QByteArray header(const QByteArray &date) const;
+
+    int        status;
+    QByteArray contenttype;
+    QByteArray extra;          // additional header lines, each ending in STR_NL
+    QByteArray body;           // implicitly shared, never copied when sent
+    bool       nocache;
+    bool       keepalive;
+    bool       headonly;       // HEAD request: the body length is sent but not the body
+    quint32    connection;
+    quint32    sequence;
+    qint64     received;
+};
+
+Q_DECLARE_METATYPE(HttpRequest)
+Q_DECLARE_METATYPE(HttpResponse)
+
+/*
+ * HttpParser
+ * an incremental request parser: data is appended as it arrives and parse()
+ * returns each complete request in turn, so pipelined requests and requests
+ * split across reads are handled alike. Lines are scanned only once.
+ */
+class HttpParser
+{
+public:
+    HttpParser();
+    void append(const QByteArray &data) { buffer += data; }
+    int  buffered() const { return buffer.size() - pos; }
+    int  parse(HttpRequest &req);   // 1 complete request, 0 more data needed, -1 error
+    int  error() const { return errstatus; }
+
+private:
+    enum State { PARSE_REQUEST_LINE, PARSE_HEADERS, PARSE_BODY, PARSE_ERROR };
+    int  fail(int status);
+    void finish(HttpRequest &req);
+    void compact();
+
+    QByteArray  buffer;
+    int         pos;           // start of the unparsed data
+    int         scan;          // where to continue looking for the end of line
+    int         headersize;
+    qint64      remaining;     // body bytes still to come
+    State       state;
+    int         errstatus;
+    HttpRequest current;
+};
+
+class HttpServer;
+
+// one client connection, lives in the server thread
+class HttpConnection : public QObject
+{
+    Q_OBJECT
+public:
+    HttpConnection(int descriptor, quint32 id, HttpServer *parent);
+    ~HttpConnection();
+    quint32 id() { return connectionid; }
+    QHostAddress peer() { return socket->peerAddress(); }
+    void deliver(const HttpResponse &resp);
+
+private slots:
+    void readRequests();
+    void processRequests();
+    void idleTimeout();
+    void closed();
+
+private:
+    void queue(const HttpResponse &resp);
+    void send(const HttpResponse &resp);
+    void readCommand(const QByteArray &data);
+
+    HttpServer *server;
+    QTcpSocket *socket;
+    HttpParser  parser;
+    quint32     connectionid;
+    quint32     nextsequence;  // given to the next request
+    quint32     sendsequence;  // the response to send next
+    QMap<quint32,HttpResponse> ready;   // responses waiting for an earlier one
+    bool        closing;       // no further requests are read
+    bool        command;       // a <vchannel> message rather than HTTP
+    QByteArray  commandbuf;
+    QTimer      idle;
+};
+
+/*
+ * HttpServer
+ * listens and serves all connections from its own thread. Snapshots,
+ * thumbnails, metrics and traces are answered there; all other requests
+ * are passed to the GUI thread with request() and answered with reply(),
+ * which may be called from any thread. Responses on a connection are always
+ * sent in the order of the requests.
+ */
+class HttpServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    HttpServer(FrameMailbox *mailbox);
+    ~HttpServer();
+    bool start(int port);
+    void stop();
+    void pause();
+    void setNetwork(const QString &address);
+    void reply(const HttpResponse &resp);
+
+    // called by the connections
+    bool allowed(const QHostAddress &address);
+    bool respond(const HttpRequest &req, HttpResponse &resp);
+    void forward(const HttpRequest &req) { emit request(req); }
+    void forwardCommand(const QByteArray &qba) { emit command(qba); }
+    void remove(quint32 id) { connections.remove(id); }
+    QByteArray date();
+
+signals:
+    void request(HttpRequest req);
+    void command(QByteArray qba);
+
+protected:
+    void incomingConnection(int socket);
+
+private slots:
+    bool listenPort(int port);
+    void closeListener();
+    void shutdown();
+    void deliver(HttpResponse resp);
+
+private:
+    void snapshot(const HttpRequest &req, HttpResponse &resp);
+
+    QThread      *thread;
+    FrameMailbox *frames;
+    QString       network;
+    quint32       nextid;
+    QHash<quint32,HttpConnection*> connections;
+
+    // the H.264 snapshot is encoded once per frame
+    quint32       snapsequence;
+    QByteArray    snapjpeg;
+
+    // the Date header changes once a second
+    uint          datetime;
+    QByteArray    datestr;
+};
+
+#endif // HTTPSERVER_H
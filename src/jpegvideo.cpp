@@ -27,6 +27,7 @@
 #include "../include/common.h"
 #include "vchannel.h"
 #include "jpegvideo.h"
+#include "metrics.h"
 
 using namespace command_line_arguments;
 
@@ -138,15 +139,10 @@ static void createHuffmanHeader(unsigned char*& p,
   p += nsymbols;
 }
 
-static unsigned computeJPEGHeaderSize(unsigned qtlen, unsigned dri) {
-  unsigned qtlen_half = qtlen/2; // in case qtlen is odd; shouldn't happen
-  return 495 + qtlen_half*2 + (dri > 0 ? 6 : 0);
-}
-
 static int createJPEGHeader(char* buf, unsigned type,
                  unsigned w, unsigned h,
                  const char* qtables, unsigned qtlen,
-                 unsigned char dri)
+                 unsigned dri)
 {
   unsigned char *ptr = (unsigned char*)buf;
   unsigned numQtables = qtlen > 64 ? 2 : 1;
@@ -201,7 +197,7 @@ static int createJPEGHeader(char* buf, unsigned type,
   *ptr++ = (BYTE)(w); // number of columns (must be a multiple of 8)
   *ptr++ = 0x03; // number of components
   *ptr++ = 0x01; // id of component
-  *ptr++ = type ? 0x22 : 0x21; // sampling ratio (h,v)
+  *ptr++ = (type & 1) ? 0x22 : 0x21; // sampling ratio (h,v), types 64+ only add restart markers
   *ptr++ = 0x00; // quant table id
   *ptr++ = 0x02; // id of component
   *ptr++ = 0x11; // sampling ratio (h,v)
@@ -262,27 +258,37 @@ static unsigned char const defaultQuantizers[128] = {
 // end copy
 
 jpegVideo::jpegVideo():
-            type(0), fragmentoffset(0xfff),firstoffset(0),
+            type(0), fragmentoffset(0),
             q(0), _width(0),_height(0), dri(0),
-            numQtables(0), qthlen(0),_jfif(NULL),size(0),_jfifsize(0),
-			pktsequence(0)
+            restartcount(0x3fff), restartfirst(false),
+            qthlen(0), qtq(-1),
+            hdrtype(0), hdrwidth(0), hdrheight(0), hdrdri(0), hdrqthlen(0), headersize(0), hdrgen(0),
+            start(NULL),size(0),concealed(false),frametime(0),
+            received(0), length(0)
 {
     QDEBUG << "jpegVideo";
+    JpegBuffer empty = { NULL, 0, 0 };
+    frame = ref = spare = empty;
+    reserve(frame, JPEG_FRAME_RESERVE);
+    // kept allocated, they are emptied with resize(0)
+    fragments.reserve(JPEG_FRAGMENTS);
+    refintervals.reserve(JPEG_FRAGMENTS);
 }
 
 jpegVideo::~jpegVideo()
 {
     QDEBUG << "~jpegVideo";
-    if( _jfif ) free(_jfif);
-    _jfif = NULL;
+    if( frame.data ) free(frame.data);
+    if( ref.data ) free(ref.data);
+    if( spare.data ) free(spare.data);
 }
 
 int  jpegVideo::parseRtpHeader(const char *hdr, int size)
 {
     if( !hdr ) return 0;
-    if( size <= 0 ) return 0;
 
-    QByteArray header = QByteArray(hdr,size);
+    // read in place, the packet is not copied
+    const unsigned char *header = (const unsigned char*)hdr;
 
     // keep count of where we are
     int cnt = 0;
@@ -300,36 +306,18 @@ int  jpegVideo::parseRtpHeader(const char *hdr, int size)
     |      Type     |       Q       |     Width     |     Height    |
     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
     */
+    if( size < 8 ) return 0;
     // analyze the main header
     cnt++;
-     unsigned int newoffset = ( ( (quint8)header.at(cnt) )*256+(quint8)header.at(cnt+1) )*256 + (quint8)header.at(cnt+2);
-     cnt+=3;
-     if( newoffset == 0 )
-     {
-        fragmentoffset = 0;
-     } else
-     if( newoffset > 0 && fragmentoffset == 0 )
-     {
-         fragmentoffset = newoffset;
-         firstoffset = newoffset + 200;
-     } else
-     if( newoffset > fragmentoffset && (newoffset - fragmentoffset < firstoffset) )
-        fragmentoffset = newoffset;
-     else
-     {
-         if ( fragmentoffset != 0x0fff )
-             QDEBUG << newoffset << " vs " << fragmentoffset << "/" << firstoffset << " Fragment offset error -> data loss";
-         fragmentoffset = 0x0fff; // set to maximum value so that we wait for the next packet
-         return 0;
-     }
-    type = (quint8)header.at(cnt++);
-    q =    (quint8)header.at(cnt++);
-    _width =(quint8)header.at(cnt++)*8;  // 8-pixel multiples
-    _height =(quint8)header.at(cnt++)*8; // 8-pixel multiples
+    fragmentoffset = ( header[cnt]*256 + header[cnt+1] )*256 + header[cnt+2];
+    cnt+=3;
+    type = header[cnt++];
+    q =    header[cnt++];
+    _width = header[cnt++]*8;  // 8-pixel multiples
+    _height = header[cnt++]*8; // 8-pixel multiples
     // for debugging
     // QDEBUG << "frag=" << fragmentoffset << " type=" << type << " Q=" << q << " w=" << _width << " h=" << _height;
     dri = 0;
-    numQtables=0;
 
     // check for restart marker header
     // marker appears on every header
@@ -353,16 +341,21 @@ int  jpegVideo::parseRtpHeader(const char *hdr, int size)
            to 1 and the Restart Count MUST be set to 0x3FFF.  This indicates
            that a receiver MUST reassemble the entire frame before decoding it.
         */
-        dri = (quint8)header.at(cnt)*256 + (quint8)header.at(cnt+1);
+        if( size < cnt+4 ) return 0;
+        dri = header[cnt]*256 + header[cnt+1];
         cnt+=2;
-        // ignore the Restart Count (for now)
+        // the restart count places the packet when others are lost
+        restartfirst = (header[cnt] & 0x80) != 0;
+        restartcount = (header[cnt] & 0x3f)*256 + header[cnt+1];
 #ifndef QT_NO_DEBUG
-        //int f_flag = (header.at(cnt)& 0x80) >> 7;
-        //int l_flag = (header.at(cnt) & 0x40) >> 6;
-        //int restart = ((quint8)header.at(cnt) & 0x3f)*256 + (quint8)header.at(cnt+1);
-        //QDEBUG << "dri=" << dri << "F=" << f_flag << "L=" << l_flag << "restart" << restart;
+        //int l_flag = (header[cnt] & 0x40) >> 6;
+        //QDEBUG << "dri=" << dri << "F=" << restartfirst << "L=" << l_flag << "restart" << restartcount;
 #endif
         cnt+=2;
+    } else
+    {
+        restartfirst = false;
+        restartcount = 0x3fff;
     }
     // check for quantization header
     // this must come after any possible restart marker header
@@ -379,62 +372,300 @@ int  jpegVideo::parseRtpHeader(const char *hdr, int size)
            |                              ...                              |
            +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
         */
-        //quint8 mbz = (quint8)header.at(cnt);             // not used
+        if( size < cnt+4 ) return 0;
+        //quint8 mbz = header[cnt];             // not used
         cnt++;
-        //quint8 precision = (quint8)header.at(cnt);       // not used
+        //quint8 precision = header[cnt];       // not used
         cnt++;
 
-        qthlen = ((quint8)header.at(cnt))*256 + (quint8)header.at(cnt+1);
+        quint16 len = header[cnt]*256 + header[cnt+1];
         cnt+=2;
 #ifndef QT_NO_DEBUG
         // for debugging
-        // QDEBUG << "mbz=" << mbz << " precision=" << precision << " qth length=" << qthlen;
+        // QDEBUG << "mbz=" << mbz << " precision=" << precision << " qth length=" << len;
 #endif
-        qth = header.mid(cnt,qthlen);
-        cnt += qthlen;
-        switch(type)
+        // only 8-bit tables fit the generated header
+        if( len == 0 || len > sizeof(qth) || size < cnt+len )
         {
-        case 0: case 64:
-        case 1: case 65:
-            numQtables = 2;
-            break;
-        default:
-            numQtables = -1; // undefined
+            QDEBUG << "bad quantization table length" << len;
+            return 0;
         }
-#ifndef QT_NO_DEBUG
-        // for debugging
-        //QDEBUG << "numQtables=" << numQtables << " dri=" << dri ;
-#endif
+        // cameras send the same tables with every frame
+        if( len != qthlen || memcmp(qth, header+cnt, len) != 0 )
+        {
+            memcpy(qth, header+cnt, len);
+            qthlen = len;
+        }
+        qtq = -1;
+        cnt += len;
+    } else
+    if( q < 128 && q != qtq )
+    {
+        makeTables(q);
     }
     return cnt;
 }
 
-bool jpegVideo::rtpToJfif(QByteArray &jpg)
+/*
+ * RFC 2435 appendix A, the tables for Q values 1 to 99 are the
+ * default tables scaled by the Q factor
+ */
+void jpegVideo::makeTables(int factor)
+{
+    int scale = qBound(1, factor, 99);
+    scale = scale < 50 ? 5000/scale : 200 - scale*2;
+    for( int ii=0; ii<128; ii++ )
+        qth[ii] = (unsigned char)qBound(1, (defaultQuantizers[ii]*scale + 50)/100, 255);
+    qthlen = 128;
+    qtq = factor;
+}
+
+// make room for datasize bytes of scan data and the end marker
+bool jpegVideo::reserve(JpegBuffer &b, quint32 datasize)
+{
+    quint32 need = JPEG_HEADER_MAX + datasize + 2;
+    if( b.data && need <= b.size )
+        return true;
+
+    // grow by half again so that a slowly growing frame size does
+    // not reallocate every frame; the header in front is kept
+    quint32 newsize = qMax(need + need/2, (quint32)(JPEG_HEADER_MAX + JPEG_FRAME_RESERVE));
+    QDEBUG << "realloc jfif:" << newsize;
+    unsigned char *p = (unsigned char*)realloc(b.data, newsize);
+    if( p == NULL )
+        return false;
+    b.data = p;
+    b.size = newsize;
+    return true;
+}
+
+// copy the fragment to its place in the frame, in whatever order it came
+bool jpegVideo::addFragment(const char *data, int len, quint32 tstamp)
 {
-    if( jpg.length() > 0 )
+    // a frame that lost its last packet ends when the next one starts
+    if( tstamp != frametime )
     {
-        int headersize = computeJPEGHeaderSize(qthlen,dri);
-        if( _jfif == NULL )
+        if( !fragments.isEmpty() )
         {
-            _jfifsize = headersize + jpg.count()+2+10000;
-            QDEBUG << "malloc jfif:" << _jfifsize;
-            _jfif = (unsigned char*)malloc(_jfifsize);
+            QDEBUG << "frame" << frametime << "dropped without its marker";
+            metrics.framesDropped.add();
+            clearFrame();
         }
-        if( _jfif )
+        frametime = tstamp;
+    }
+    if( len <= 0 )
+        return len == 0;
+    // the 24 bit fragment offset of a corrupt packet must not grow the frame
+    quint32 end = fragmentoffset + len;
+    if( end > JPEG_FRAME_MAX )
+    {
+        QDEBUG << "fragment beyond the largest frame, dropped:" << fragmentoffset << len;
+        metrics.rtpBad.add();
+        return false;
+    }
+    if( !reserve(frame, end) )
+        return false;
+    memcpy(frame.data + JPEG_HEADER_MAX + fragmentoffset, data, len);
+    received += len;
+    if( end > length )
+        length = end;
+
+    JpegFragment f = { fragmentoffset, (quint32)len, restartcount, restartfirst };
+    fragments.append(f);
+    return true;
+}
+
+// make the header again only when it would differ from the last one
+bool jpegVideo::makeHeader()
+{
+    if( qthlen == 0 )
+        return false;
+    if( headersize > 0 && type == hdrtype && _width == hdrwidth && _height == hdrheight &&
+        dri == hdrdri && qthlen == hdrqthlen && memcmp(qth, hdrqt, qthlen) == 0 )
+        return true;
+
+    headersize = createJPEGHeader((char*)header, type, _width, _height, (const char*)qth, qthlen, dri);
+    Q_ASSERT( headersize <= JPEG_HEADER_MAX );
+    hdrgen++;
+
+    hdrtype = type;
+    hdrwidth = _width;
+    hdrheight = _height;
+    hdrdri = dri;
+    hdrqthlen = qthlen;
+    memcpy(hdrqt, qth, qthlen);
+    return true;
+}
+
+void jpegVideo::putHeader(JpegBuffer &b)
+{
+    if( b.hdrgen == hdrgen )
+        return;
+    memcpy(b.data + JPEG_HEADER_MAX - headersize, header, headersize);
+    b.hdrgen = hdrgen;
+}
+
+static bool fragmentLessThan(const JpegFragment &a, const JpegFragment &b)
+{
+    return a.offset < b.offset;
+}
+
+/*
+ * put a frame with missing packets together from its complete restart
+ * intervals and the previous frame's intervals at the same places.
+ * Intervals are coded independently and each ends in the RSTn marker
+ * for its place, so they can be swapped between frames of the same
+ * size and tables. The packets must be aligned to the intervals so that
+ * the restart count says where a run of packets belongs.
+ * Returns the scan size of the frame put together in the frame buffer,
+ * or 0 when it can not be concealed.
+ */
+quint32 jpegVideo::conceal()
+{
+    if( dri == 0 || ref.data == NULL || ref.hdrgen != hdrgen )
+        return 0;
+
+    int mcuw = 16;
+    int mcuh = (type & 1) ? 16 : 8;
+    int mcus = ((_width + mcuw-1)/mcuw) * ((_height + mcuh-1)/mcuh);
+    int n = (mcus + dri-1)/dri;
+    // the restart count is 14 bits
+    if( n > 0x3fff || refintervals.count() != n+1 )
+        return 0;
+
+    // where each interval is in this frame, from 0 when it was lost
+    QVector<quint32> from(n, 0);
+    QVector<quint32> to(n, 0);
+
+    qSort(fragments.begin(), fragments.end(), fragmentLessThan);
+    const unsigned char *scan = frame.data + JPEG_HEADER_MAX;
+    int ii = 0;
+    while( ii < fragments.count() )
+    {
+        // a run of packets with nothing missing between them
+        const JpegFragment &first = fragments.at(ii);
+        quint32 end = first.offset + first.len;
+        for( ii++; ii < fragments.count() && fragments.at(ii).offset == end; ii++ )
+            end += fragments.at(ii).len;
+
+        int idx;
+        if( first.offset == 0 )
+            idx = 0;
+        else
+        if( first.first && first.restart != 0x3fff )
+            idx = first.restart;
+        else
+            continue;
+
+        // each RSTn marker ends an interval, the last has none
+        quint32 pos = first.offset;
+        bool aligned = true;
+        const unsigned char *p = scan + pos;
+        const unsigned char *e = scan + end;
+        while( idx < n && p + 1 < e && (p = (const unsigned char*)memchr(p, 0xff, e - 1 - p)) != NULL )
         {
-            if( _jfifsize < (headersize + jpg.count()+2) )
+            if( (p[1] & 0xf8) != 0xd0 )
+            {
+                p++;
+                continue;
+            }
+            if( (p[1] & 7) != (idx & 7) )
             {
-                _jfifsize = headersize + jpg.count()+2+10000;
-                QDEBUG << "free/malloc jfif:" << _jfifsize;
-                free(_jfif);
-                _jfif = (unsigned char*)malloc(_jfifsize);
+                aligned = false;
+                break;
             }
-            size = createJPEGHeader((char*)_jfif, type,
-                             _width, _height,
-                             qth.constData(), qthlen,
-                             dri);
-            memcpy( _jfif+size, jpg.constData(), jpg.count() );
-            size += jpg.count();
+            from[idx] = pos;
+            to[idx] = p + 2 - scan;
+            pos = to[idx];
+            idx++;
+            p += 2;
+        }
+        if( aligned && idx == n-1 && end == length && pos < end )
+        {
+            from[idx] = pos;
+            to[idx] = end;
+        }
+    }
+
+    quint32 datasize = 0;
+    for( int jj=0; jj<n; jj++ )
+        datasize += to[jj] > from[jj] ? to[jj] - from[jj] : refintervals.at(jj+1) - refintervals.at(jj);
+    if( !reserve(spare, datasize) )
+        return 0;
+
+    unsigned char *out = spare.data + JPEG_HEADER_MAX;
+    int lost = 0;
+    for( int jj=0; jj<n; jj++ )
+    {
+        if( to[jj] > from[jj] )
+        {
+            memcpy(out, scan + from[jj], to[jj] - from[jj]);
+            out += to[jj] - from[jj];
+        } else
+        {
+            quint32 len = refintervals.at(jj+1) - refintervals.at(jj);
+            memcpy(out, ref.data + JPEG_HEADER_MAX + refintervals.at(jj), len);
+            out += len;
+            lost++;
+        }
+    }
+    // nothing of this frame is left
+    if( lost == n )
+        return 0;
+    QDEBUG << "frame" << frametime << "concealed" << lost << "of" << n << "restart intervals";
+
+    JpegBuffer b = frame;
+    frame = spare;
+    spare = b;
+    return datasize;
+}
+
+// keep the frame to conceal the next one with, and find its intervals
+void jpegVideo::keepReference(quint32 datasize)
+{
+    refintervals.resize(0);
+    refintervals.append(0);
+    const unsigned char *scan = frame.data + JPEG_HEADER_MAX;
+    const unsigned char *e = scan + datasize;
+    for( const unsigned char *p = scan; p + 1 < e && (p = (const unsigned char*)memchr(p, 0xff, e - 1 - p)) != NULL; p++ )
+        if( (p[1] & 0xf8) == 0xd0 )
+            refintervals.append(p + 2 - scan);
+    refintervals.append(datasize);
+
+    // the next frame is written over the old reference
+    JpegBuffer b = ref;
+    ref = frame;
+    frame = b;
+    if( frame.data == NULL )
+        reserve(frame, JPEG_FRAME_RESERVE);
+}
+
+// complete the frame after its last packet; a frame with missing
+// fragments is concealed when it has restart markers or dropped
+bool jpegVideo::rtpToJfif()
+{
+    quint32 datasize = length;
+    bool complete = received > 0 && received == length;
+    concealed = false;
+    if( frame.data == NULL || !makeHeader() )
+    {
+        clearFrame();
+        return false;
+    }
+    if( !complete )
+    {
+        datasize = conceal();
+        if( datasize == 0 )
+        {
+            metrics.framesDropped.add();
+            clearFrame();
+            return false;
+        }
+        concealed = true;
+        metrics.framesConcealed.add();
+    }
+    clearFrame();
+    putHeader(frame);
 
 //            // MARKER_COMMENT
 //            // make space for a 10-byte comment
@@ -444,13 +675,17 @@ bool jpegVideo::rtpToJfif(QByteArray &jpg)
 //            _jfif[size++] = 12;
 //            for(int ii=0; ii< 12-2; ii++)
 //                _jfif[size++] = 'x';
-            _jfif[size++] = 0xff;
-            _jfif[size++] = MARKER_EOI;
-            return true;
-        }
-        return false;
-    }
-    return false;
+    frame.data[JPEG_HEADER_MAX + datasize] = 0xff;
+    frame.data[JPEG_HEADER_MAX + datasize + 1] = MARKER_EOI;
+    size = headersize + datasize + 2;
+    start = frame.data + JPEG_HEADER_MAX - headersize;
+
+    // the frame stays where it is until the next frame is complete
+    if( dri > 0 )
+        keepReference(datasize);
+    else
+        refintervals.resize(0);
+    return true;
 }
 
 // motion detection is not available in Windows
@@ -625,7 +860,14 @@ bool AnalyzeJpeg::readBmp(const unsigned char * bmp, unsigned long size, int w,
 		}
 		if( raw_image )
 		{
-			memcpy(raw_image, bmp, raw_image_size);
+			// the lines of a QImage are padded to 4 bytes, they are kept packed here
+			int stride = h ? size/h : 0;
+			if( stride > w*(bpp/8) )
+			{
+				for( int line=0; line < h; line++ )
+					memcpy(raw_image + line*w*(bpp/8), bmp + line*stride, w*(bpp/8));
+			} else
+				memcpy(raw_image, bmp, size);
 
 			width = w;
 			height = h;
@@ -29,37 +29,83 @@
 #endif
 
 #include <QByteArray>
+#include <QVector>
+
+#include "../include/common.h"
+
+// a packet of the frame being assembled
+typedef struct {
+    quint32 offset;
+    quint32 len;
+    quint16 restart;            // restart count, 0x3fff when not aligned
+    bool    first;              // starts a restart interval
+} JpegFragment;
+
+// JPEG_HEADER_MAX bytes for the header then the scan data
+typedef struct {
+    unsigned char *data;
+    quint32 size;
+    int hdrgen;                 // the header in front of the data
+} JpegBuffer;
 
 class jpegVideo
 {
 public:
     jpegVideo();
     ~jpegVideo();
-    bool rtpToJfif(QByteArray &jpg);
     int  parseRtpHeader(const char *header, int size );
-    unsigned char * jfif() { return _jfif; }
+    bool addFragment(const char *data, int len, quint32 tstamp);
+    bool rtpToJfif();
+    void clearFrame() { received = 0; length = 0; fragments.resize(0); }
+    unsigned char * jfif() { return start; }
     int count() { return size; }
     int width() { return (int)_width;}
     int height() { return (int)_height;}
-        void setSequence(int s) { pktsequence = s; }
-	bool isSequence() { if (pktsequence != -1) return true; return false; }
-        void incSequence() { if (pktsequence != -1) pktsequence++; }
+    bool isConcealed() { return concealed; }
 
 private:
+    bool reserve(JpegBuffer &b, quint32 datasize);
+    void makeTables(int factor);
+    bool makeHeader();
+    void putHeader(JpegBuffer &b);
+    quint32 conceal();
+    void keepReference(quint32 datasize);
+
     quint8  type;
     quint32 fragmentoffset;
-    quint32 firstoffset;
     quint8  q;
     quint16  _width;
     quint16  _height;
     quint16 dri;
-    int numQtables;
+    quint16 restartcount;
+    bool    restartfirst;
     quint16 qthlen;
-    QByteArray qth;
-    unsigned char* _jfif;
+    unsigned char qth[128];
+    int qtq;                    // Q the tables were made for, -1 when sent in band
+
+    // the header is made once and written in front of a buffer
+    // only when one of the values it was made from has changed
+    quint8  hdrtype;
+    quint16 hdrwidth;
+    quint16 hdrheight;
+    quint16 hdrdri;
+    quint16 hdrqthlen;
+    unsigned char hdrqt[128];
+    unsigned char header[JPEG_HEADER_MAX];
+    int headersize;
+    int hdrgen;
+
+    JpegBuffer frame;           // the fragments at their offsets
+    JpegBuffer ref;             // the last frame of a stream with restart markers
+    JpegBuffer spare;           // a concealed frame is put together here
+    QVector<quint32> refintervals;  // where each restart interval of ref starts, then its end
+    QVector<JpegFragment> fragments;
+    unsigned char* start;       // first byte of the header
     int size;
-    int _jfifsize;
-	int pktsequence;
+    bool concealed;
+    quint32 frametime;
+    quint32 received;           // bytes of the current frame
+    quint32 length;             // end of its furthest fragment
 };
 
 /* provide a class to analyze the jpeg image
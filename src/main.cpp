@@ -27,6 +27,7 @@
 
 #include "../include/common.h"
 #include "vchannel.h"
+#include "archiver.h"
 
 
 namespace command_line_arguments {
@@ -62,6 +63,13 @@ namespace command_line_arguments {
 	int     my = 0;                   // motion window
 	int     mw = 100;                 // motion window
 	int     mh = 100;                 // motion window
+	QStringList motionzones;          // more motion windows, as --motion
+	QStringList motionexcludes;       // polygons left out of the motion windows
+	int     nhls = 0;                 // HLS live segments kept (default off)
+	int     ng711 = 0;                // record G.711 audio as received (default off)
+	int     narchive = 0;             // MJPEG recordings transcoded to H.264 at once (default off)
+	int     ntimelapse = 0;           // seconds between the frames kept without motion (default off)
+	int     nvectors = 0;             // motion from the H.264 motion vectors (default off)
 }
 
 int 	debugsetting = 0;
@@ -219,6 +227,27 @@ int main(int argc, char *argv[])
             }
         }
         else
+        if( arg == "--zone" || arg == "-z"  )
+            motionzones << argv[++ii];
+        else
+        if( arg == "--exclude" || arg == "-y"  )
+            motionexcludes << argv[++ii];
+        else
+        if( arg == "--vectors" || arg == "-f"  )
+            nvectors = 1;
+        else
+        if( arg == "--hls" || arg == "-l"  )
+            nhls = QString(argv[++ii]).toInt();
+        else
+        if( arg == "--g711" || arg == "-g"  )
+            ng711 = 1;
+        else
+        if( arg == "--archive" || arg == "-k"  )
+            narchive = QString(argv[++ii]).toInt();
+        else
+        if( arg == "--timelapse" || arg == "-i"  )
+            ntimelapse = QString(argv[++ii]).toInt();
+        else
         if( arg == "--version" || arg == "-v"  )
         {
             printf("vchannel version %s:%s", STR_VERSION, __DATE__ );
@@ -246,7 +275,14 @@ int main(int argc, char *argv[])
             printf("        --record,-r   <i>-<m>-<d>-<h:m>-<h:m> : record schedule\n");
             printf("        --events,-e   <ipaddr>                : send event messages to server\n");
             printf("        --motion,-m   <s>-<t>-<x>-<y>-<w>-<h> : motion detection/window settings\n");
+            printf("        --zone,-z     <s>-<t>-<x>-<y>-<w>-<h> : another motion window (repeat for more)\n");
+            printf("        --exclude,-y  <x>,<y>,<x>,<y>,...     : polygon left out of the motion windows (repeat for more)\n");
+            printf("        --vectors,-f                          : motion from the H264 motion vectors, not the pixels\n");
             printf("        --basic,-s    <auth>                  : basic security authorization\n");
+            printf("        --hls,-l      <num>                   : HLS live output segments (H264/H265 only)\n");
+            printf("        --g711,-g                             : record AVI audio as G.711, not 16-bit pcm\n");
+            printf("        --archive,-k  <num>                   : transcode AVI recordings to H264, <num> at once per host\n");
+            printf("        --timelapse,-i <secs>                 : motion recording keeps a frame every <secs> between motion\n");
             printf("        --version,-v                          : version display\n");
             printf("        --help,-h                             : this summary\n");
             exit (0);
@@ -293,6 +329,10 @@ int main(int argc, char *argv[])
     QDEBUG <<  "hardware:" << qshardware;
     QDEBUG <<  "output directory:" << directory;
     QDEBUG <<  "lock:" << nlock;
+    QDEBUG <<  "hls:" << nhls;
+    QDEBUG <<  "g711:" << ng711;
+    QDEBUG <<  "archive:" << narchive;
+    QDEBUG <<  "timelapse:" << ntimelapse;
 
     if( qsname.isEmpty() || ndevice == -1 ) {
     	printf("vchannel: parameters missing - enter 'vchannel --help' for details\n");
@@ -302,8 +342,12 @@ int main(int argc, char *argv[])
     	printf("vchannel: URL not set - enter 'vchannel --help' for details\n");
     	exit(0);
     }
+    archiver.setThreads(narchive);
     w.show();
     int ex = a.exec();
+    // the transcodes under way are stopped while the application is still there,
+    // not left to the destructor of the global archiver
+    archiver.stop();
     qWarning() << "program exit" << ex;
     return ex;
 }
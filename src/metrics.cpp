@@ -0,0 +1,172 @@
+/**
+ * FILE:		metrics.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for the runtime counters and histograms of the
+ * media pipeline, served in the Prometheus text format
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include "metrics.h"
+
+// bucket upper bounds in microseconds, 100us to 5s
+static const qint64 bounds[METRIC_BUCKETS] = {
+    100, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000 };
+
+QElapsedTimer Metrics::clock;
+Metrics metrics;
+
+static QByteArray seconds(qint64 us)
+{
+    return QByteArray::number(us/1000000.0, 'g', 9);
+}
+
+//
+// class MetricCounter
+//
+MetricCounter::MetricCounter(const char *n, const char *h, bool g) :
+    name(n), help(h), gauge(g), count(0)
+{
+}
+
+void MetricCounter::write(QByteArray &out)
+{
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += gauge ? " gauge\n" : " counter\n";
+    out += name; out += ' '; out += QByteArray::number(value()); out += '\n';
+}
+
+//
+// class MetricHistogram
+//
+MetricHistogram::MetricHistogram(const char *n, const char *h) :
+    name(n), help(h), sum(0)
+{
+    for( int ii=0; ii<=METRIC_BUCKETS; ii++ )
+        buckets[ii] = 0;
+}
+
+void MetricHistogram::observe(qint64 us)
+{
+    int ii = 0;
+    while( ii < METRIC_BUCKETS && us > bounds[ii] )
+        ii++;
+    METRIC_ADD(&buckets[ii], 1);
+    METRIC_ADD(&sum, us);
+}
+
+qint64 MetricHistogram::count()
+{
+    qint64 total = 0;
+    for( int ii=0; ii<=METRIC_BUCKETS; ii++ )
+        total += METRIC_ADD(&buckets[ii], 0);
+    return total;
+}
+
+void MetricHistogram::write(QByteArray &out)
+{
+    out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += name; out += " histogram\n";
+
+    // the count is the sum of the buckets so the output is consistent
+    qint64 total = 0;
+    for( int ii=0; ii<=METRIC_BUCKETS; ii++ )
+    {
+        total += METRIC_ADD(&buckets[ii], 0);
+        out += name; out += "_bucket{le=\"";
+        out += ii < METRIC_BUCKETS ? seconds(bounds[ii]) : QByteArray("+Inf");
+        out += "\"} "; out += QByteArray::number(total); out += '\n';
+    }
+    out += name; out += "_sum "; out += seconds(METRIC_ADD(&sum, 0)); out += '\n';
+    out += name; out += "_count "; out += QByteArray::number(total); out += '\n';
+}
+
+//
+// class Metrics
+//
+Metrics::Metrics() :
+    rtpPackets("vchannel_rtp_packets_total", "RTP packets received"),
+    rtpBytes("vchannel_rtp_bytes_total", "RTP bytes received, including the RTP header"),
+    rtpLost("vchannel_rtp_lost_total", "RTP packets missing from the sequence"),
+    rtpOutOfOrder("vchannel_rtp_out_of_order_total", "RTP packets dropped as old or duplicated"),
+    rtpReordered("vchannel_rtp_reordered_total", "RTP packets put back in order by the reorder buffer"),
+    rtpLate("vchannel_rtp_late_total", "RTP packets arriving after the reorder buffer released their slot"),
+    rtpBad("vchannel_rtp_bad_total", "RTP packets dropped as malformed"),
+    frames("vchannel_frames_total", "video frames assembled from RTP"),
+    framesConcealed("vchannel_frames_concealed_total", "JPEG frames with lost restart intervals taken from the previous frame"),
+    framesDropped("vchannel_frames_dropped_total", "JPEG frames and H.264 access units dropped as incomplete"),
+    decodeTime("vchannel_decode_seconds", "time to decode a video frame to an image"),
+    motionTime("vchannel_motion_seconds", "time to analyse a frame for motion"),
+    motionCells("vchannel_motion_cells", "cells of the motion grid with motion at the last analysis", true),
+    motionVectors("vchannel_motion_vectors_total", "H.264 motion vectors exported for motion detection"),
+    writeTime("vchannel_write_seconds", "time to write a recording to disk"),
+    writeBytes("vchannel_write_bytes_total", "bytes of recordings written to disk"),
+    bufferBytes("vchannel_buffer_bytes", "bytes held for the next recordings", true),
+    arenaBytes("vchannel_arena_bytes", "bytes of the chunks the recordings are buffered in, used or not", true),
+    arenaChunks("vchannel_arena_chunks", "chunks the recordings are buffered in", true),
+    arenaAllocations("vchannel_arena_allocations_total", "frames and audio buffers copied into the recording chunks"),
+    archivePending("vchannel_archive_pending", "MJPEG recordings queued or being transcoded to H.264", true),
+    archiveActive("vchannel_archive_active", "MJPEG recordings being transcoded to H.264", true),
+    archiveFiles("vchannel_archive_files_total", "MJPEG recordings replaced by H.264"),
+    archiveFailed("vchannel_archive_failed_total", "MJPEG recordings that could not be transcoded and were kept"),
+    archiveFrames("vchannel_archive_frames_total", "video frames transcoded to H.264"),
+    archiveBytesIn("vchannel_archive_read_bytes_total", "bytes of the MJPEG recordings transcoded"),
+    archiveBytesOut("vchannel_archive_written_bytes_total", "bytes of the H.264 recordings that replaced them"),
+    archiveTime("vchannel_archive_seconds", "time to transcode a recording to H.264, once it has a slot"),
+    httpConnections("vchannel_http_connections", "open HTTP connections", true),
+    httpLatency("vchannel_http_request_seconds", "time from an HTTP request being read to its response being sent")
+{
+    clock.start();
+}
+
+QByteArray Metrics::text()
+{
+    QByteArray out;
+    out.reserve(8192);
+    rtpPackets.write(out);
+    rtpBytes.write(out);
+    rtpLost.write(out);
+    rtpOutOfOrder.write(out);
+    rtpReordered.write(out);
+    rtpLate.write(out);
+    rtpBad.write(out);
+    frames.write(out);
+    framesConcealed.write(out);
+    framesDropped.write(out);
+    decodeTime.write(out);
+    motionTime.write(out);
+    motionCells.write(out);
+    motionVectors.write(out);
+    writeTime.write(out);
+    writeBytes.write(out);
+    bufferBytes.write(out);
+    arenaBytes.write(out);
+    arenaChunks.write(out);
+    arenaAllocations.write(out);
+    archivePending.write(out);
+    archiveActive.write(out);
+    archiveFiles.write(out);
+    archiveFailed.write(out);
+    archiveFrames.write(out);
+    archiveBytesIn.write(out);
+    archiveBytesOut.write(out);
+    archiveTime.write(out);
+    httpConnections.write(out);
+    httpLatency.write(out);
+    return out;
+}
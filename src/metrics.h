@@ -0,0 +1,125 @@
+/**
+ * FILE:		metrics.h
+ *
+ * DESCRIPTION:
+ * This is the class for the runtime counters and histograms of the
+ * media pipeline, served in the Prometheus text format
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QElapsedTimer>
+
+#include "../include/common.h"
+
+// QAtomicInt is only 32 bits, byte counters need 64
+#ifdef Q_CC_MSVC
+#include <intrin.h>
+#define METRIC_ADD(p,v) _InterlockedExchangeAdd64((volatile __int64*)(p), (__int64)(v))
+#else
+#define METRIC_ADD(p,v) __sync_fetch_and_add((p), (qint64)(v))
+#endif
+
+class MetricCounter
+{
+public:
+    MetricCounter(const char *n, const char *h, bool g = false);
+    void add(qint64 v = 1) { METRIC_ADD(&count, v); }
+    qint64 value() { return METRIC_ADD(&count, 0); }
+    // only for a gauge with a single writer
+    void set(qint64 v) { METRIC_ADD(&count, v - value()); }
+    void write(QByteArray &out);
+
+private:
+    const char *name;
+    const char *help;
+    bool gauge;                // may go down
+    volatile qint64 count;
+};
+
+/*
+ * MetricHistogram
+ * observations are in microseconds and reported in seconds.
+ * Each observation is two atomic adds, the buckets are made
+ * cumulative only when they are written out.
+ */
+class MetricHistogram
+{
+public:
+    MetricHistogram(const char *n, const char *h);
+    void observe(qint64 us);
+    void write(QByteArray &out);
+    qint64 count();
+    qint64 total() { return METRIC_ADD(&sum, 0); }
+
+private:
+    const char *name;
+    const char *help;
+    volatile qint64 buckets[METRIC_BUCKETS+1];     // the last is +Inf
+    volatile qint64 sum;
+};
+
+class Metrics
+{
+public:
+    Metrics();
+    QByteArray text();
+    // monotonic time in microseconds
+    static qint64 now() { return clock.nsecsElapsed()/1000; }
+
+    MetricCounter   rtpPackets;
+    MetricCounter   rtpBytes;
+    MetricCounter   rtpLost;
+    MetricCounter   rtpOutOfOrder;
+    MetricCounter   rtpReordered;
+    MetricCounter   rtpLate;
+    MetricCounter   rtpBad;
+    MetricCounter   frames;
+    MetricCounter   framesConcealed;
+    MetricCounter   framesDropped;
+    MetricHistogram decodeTime;
+    MetricHistogram motionTime;
+    MetricCounter   motionCells;
+    MetricCounter   motionVectors;
+    MetricHistogram writeTime;
+    MetricCounter   writeBytes;
+    MetricCounter   bufferBytes;
+    MetricCounter   arenaBytes;
+    MetricCounter   arenaChunks;
+    MetricCounter   arenaAllocations;
+    MetricCounter   archivePending;
+    MetricCounter   archiveActive;
+    MetricCounter   archiveFiles;
+    MetricCounter   archiveFailed;
+    MetricCounter   archiveFrames;
+    MetricCounter   archiveBytesIn;
+    MetricCounter   archiveBytesOut;
+    MetricHistogram archiveTime;
+    MetricCounter   httpConnections;
+    MetricHistogram httpLatency;
+
+private:
+    static QElapsedTimer clock;
+};
+
+extern Metrics metrics;
+
+#endif // METRICS_H
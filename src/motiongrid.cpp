@@ -0,0 +1,423 @@
+/**
+ * FILE:		motiongrid.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for detecting motion on a grid of blocks, each
+ * compared with a background of its own
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "motiongrid.h"
+
+// the sum of n bytes, 16 or 8 at a time where there is SSE2
+static inline quint32 byteSum(const unsigned char *p, int n)
+{
+    quint32 sum = 0;
+    int ii = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for( ; ii+16 <= n; ii += 16 )
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(p+ii)), zero));
+    if( ii+8 <= n )
+    {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)(p+ii)), zero));
+        ii += 8;
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for( ; ii < n; ii++ )
+        sum += p[ii];
+    return sum;
+}
+
+//
+// class MotionZone
+//
+bool MotionZone::fromString(const QString &s)
+{
+    QStringList qsl = s.split('-');
+    if( qsl.count() != 6 )
+        return false;
+    sensitivity = qsl.at(0).toInt();
+    threshold = qsl.at(1).toInt();
+    int zx0 = qsl.at(2).toInt();
+    int zy0 = qsl.at(3).toInt();
+    int zx1 = qsl.at(4).toInt();
+    int zy1 = qsl.at(5).toInt();
+    rect = QRectF(zx0, zy0, zx1-zx0, zy1-zy0);
+    return rect.isValid();
+}
+
+//
+// class MotionGrid
+//
+MotionGrid::MotionGrid() :
+    width(0), height(0), x0(0), y0(0), bw(0), bh(0), ncols(0), nrows(0), analyses(0), nmoving(0),
+    vframes(0), pwidth(0), pheight(0)
+{
+}
+
+bool MotionGrid::polygonFromString(const QString &s, QPolygonF &poly)
+{
+    QStringList qsl = s.split(',');
+    if( qsl.count() < 6 || qsl.count() % 2 )
+        return false;
+    poly.clear();
+    for( int ii=0; ii+1 < qsl.count(); ii += 2 )
+        poly << QPointF(qsl.at(ii).toDouble(), qsl.at(ii+1).toDouble());
+    return true;
+}
+
+void MotionGrid::setZones(const QList<MotionZone> &z, const QList<QPolygonF> &exclude)
+{
+    // no more than can be told apart in a byte
+    zones = z.mid(0, MOTION_ZONES_MAX);
+    excludes = exclude;
+    reset();
+}
+
+void MotionGrid::reset()
+{
+    width = height = 0;
+    bw = bh = 0;
+    ncols = nrows = 0;
+    analyses = 0;
+    nmoving = 0;
+    spans.clear();
+    score.clear();
+    zonemoving.clear();
+    vframes = 0;
+}
+
+// the zones and the polygons excluded from them are drawn onto the blocks,
+// a block is in the last zone its centre is in
+void MotionGrid::rasterize(int w, int h)
+{
+    reset();
+    width = w;
+    height = h;
+
+    QRect box;
+    foreach( const MotionZone &z, zones )
+    {
+        box |= QRect( (int)(z.rect.left()*w)/100, (int)(z.rect.top()*h)/100,
+                      (int)(z.rect.width()*w)/100, (int)(z.rect.height()*h)/100 );
+    }
+    box &= QRect(0, 0, w, h);
+    x0 = box.x();
+    y0 = box.y();
+    bw = box.width() / MOTION_BLOCK;
+    bh = box.height() / MOTION_BLOCK;
+    if( bw < 1 || bh < 1 )
+    {
+        bw = bh = 0;
+        return;
+    }
+    ncols = qMin(MOTION_GRID_COLS, bw);
+    nrows = qMin(MOTION_GRID_ROWS, bh);
+
+    int n = bw*bh;
+    luma.resize(n);
+    background.resize(n);
+    deviation.resize(n);
+    cell.resize(n);
+    blockmoving.fill(false, n);
+    zone.fill(MOTION_ZONE_NONE, n);
+    cellblocks.fill(0, ncols*nrows);
+    zoneblocks.fill(0, zones.count());
+    score.fill(0, ncols*nrows);
+    zonemoving.fill(false, zones.count());
+    energy.fill(0, n);
+
+    // sensitivity is the change of level a block needs at the least,
+    // a quarter of what a single pixel needed as the blocks are much less noisy
+    zonebase.resize(zones.count());
+    for( int zz=0; zz < zones.count(); zz++ )
+        zonebase[zz] = ( ((100-zones.at(zz).sensitivity)*255)/400 + 2 ) * 256;
+
+    for( int by=0; by < bh; by++ )
+    {
+        MotionSpan span;
+        span.row = by;
+        span.start = -1;
+        for( int bx=0; bx <= bw; bx++ )
+        {
+            int ii = by*bw+bx;
+            bool in = false;
+            if( bx < bw )
+            {
+                cell[ii] = ((by*nrows)/bh)*ncols + (bx*ncols)/bw;
+                QPointF centre( ((x0 + bx*MOTION_BLOCK + MOTION_BLOCK/2)*100.0)/w,
+                                ((y0 + by*MOTION_BLOCK + MOTION_BLOCK/2)*100.0)/h );
+                for( int zz=0; zz < zones.count(); zz++ )
+                    if( zones.at(zz).rect.contains(centre) )
+                        zone[ii] = zz;
+                for( int ee=0; zone.at(ii) != MOTION_ZONE_NONE && ee < excludes.count(); ee++ )
+                    if( excludes.at(ee).containsPoint(centre, Qt::OddEvenFill) )
+                        zone[ii] = MOTION_ZONE_NONE;
+                in = zone.at(ii) != MOTION_ZONE_NONE;
+                if( in )
+                {
+                    cellblocks[cell.at(ii)]++;
+                    zoneblocks[zone.at(ii)]++;
+                }
+            }
+            if( in && span.start < 0 )
+                span.start = bx;
+            else
+            if( !in && span.start >= 0 )
+            {
+                span.end = bx;
+                spans.append(span);
+                span.start = -1;
+            }
+        }
+    }
+    QDEBUG << "motion grid" << bw << "x" << bh << "blocks in" << zones.count() << "zones," << spans.count() << "runs";
+}
+
+// the luma of a block is the mean of its bytes, the colours are not weighted
+// so that a line of a block is summed in one go
+void MotionGrid::sumBlocks(const unsigned char *image, int bpl, int bpp)
+{
+    int span = MOTION_BLOCK*bpp;
+    qint32 *l = luma.data();
+    foreach( const MotionSpan &s, spans )
+    {
+        qint32 *row = l + s.row*bw;
+        for( int bx=s.start; bx < s.end; bx++ )
+            row[bx] = 0;
+        for( int line=0; line < MOTION_BLOCK; line++ )
+        {
+            const unsigned char *p = image + (y0 + s.row*MOTION_BLOCK + line)*bpl + (x0 + s.start*MOTION_BLOCK)*bpp;
+            for( int bx=s.start; bx < s.end; bx++, p += span )
+                row[bx] += byteSum(p, span);
+        }
+        // to 1/256 of a level
+        for( int bx=s.start; bx < s.end; bx++ )
+            row[bx] = (row[bx] * 256) / (MOTION_BLOCK*MOTION_BLOCK*bpp);
+    }
+}
+
+bool MotionGrid::analyze(const unsigned char *image, int w, int h, int bpl, int bpp)
+{
+    if( image == NULL || (bpp != 1 && bpp != 3) || zones.isEmpty() )
+        return false;
+
+    if( w != width || h != height )
+        rasterize(w, h);
+    if( spans.isEmpty() )
+        return false;
+
+    sumBlocks(image, bpl, bpp);
+    return compare();
+}
+
+void MotionGrid::addVectors(const QVector<MotionVector> &mvs, int w, int h)
+{
+    if( zones.isEmpty() || w <= 0 || h <= 0 )
+        return;
+
+    // the blocks are drawn on the picture scaled as for the pixels
+    int aw = (w*MOTION_VECTOR_HEIGHT)/h;
+    if( aw != width || MOTION_VECTOR_HEIGHT != height )
+        rasterize(aw, MOTION_VECTOR_HEIGHT);
+    pwidth = w;
+    pheight = h;
+    if( spans.isEmpty() )
+        return;
+
+    // a vector is shared between the blocks its own block covers,
+    // there are few when the picture is large
+    foreach( const MotionVector &mv, mvs )
+    {
+        int moved = qAbs(mv.dx) + qAbs(mv.dy);
+        if( moved == 0 )
+            continue;
+        int px0 = ((mv.x - mv.w/2)*aw)/w - x0;
+        int px1 = ((mv.x + mv.w/2 - 1)*aw)/w - x0;
+        int py0 = ((mv.y - mv.h/2)*MOTION_VECTOR_HEIGHT)/h - y0;
+        int py1 = ((mv.y + mv.h/2 - 1)*MOTION_VECTOR_HEIGHT)/h - y0;
+        if( px1 < 0 || py1 < 0 )
+            continue;
+        int bx0 = qMax(px0, 0) / MOTION_BLOCK;
+        int by0 = qMax(py0, 0) / MOTION_BLOCK;
+        int bx1 = qMin(px1 / MOTION_BLOCK, bw-1);
+        int by1 = qMin(py1 / MOTION_BLOCK, bh-1);
+        if( bx1 < bx0 || by1 < by0 )
+            continue;
+        qint64 share = ((qint64)moved * mv.w * mv.h) / ((bx1-bx0+1)*(by1-by0+1));
+        for( int by=by0; by <= by1; by++ )
+            for( int bx=bx0; bx <= bx1; bx++ )
+                if( zone.at(by*bw+bx) != MOTION_ZONE_NONE )
+                    energy[by*bw+bx] += share;
+    }
+    vframes++;
+}
+
+bool MotionGrid::analyzeVectors()
+{
+    if( spans.isEmpty() || vframes == 0 )
+        return false;
+
+    // the mean motion of the pixels of a block in a frame, scaled to the
+    // picture the blocks are drawn on
+    double side = (double)(MOTION_BLOCK*pheight)/MOTION_VECTOR_HEIGHT;
+    double scale = (256.0*MOTION_VECTOR_GAIN*MOTION_VECTOR_HEIGHT)/(pheight*side*side*vframes);
+    foreach( const MotionSpan &s, spans )
+    {
+        for( int ii=s.row*bw+s.start; ii < s.row*bw+s.end; ii++ )
+        {
+            luma[ii] = (qint32)(energy.at(ii)*scale);
+            energy[ii] = 0;
+        }
+    }
+    vframes = 0;
+    return compare();
+}
+
+// each block of the zones is compared with its background
+bool MotionGrid::compare()
+{
+    if( analyses == 0 )
+    {
+        background = luma;
+        deviation.fill(0);
+        analyses++;
+        return false;
+    }
+
+    // the change of the zones as a whole
+    qint64 shift = 0;
+    int active = 0;
+    foreach( const MotionSpan &s, spans )
+    {
+        for( int ii=s.row*bw+s.start; ii < s.row*bw+s.end; ii++ )
+            shift += luma.at(ii) - background.at(ii);
+        active += s.end - s.start;
+    }
+    shift /= active;
+
+    bool learning = analyses < MOTION_LEARN;
+
+    QVector<int> moved(ncols*nrows, 0);
+    foreach( const MotionSpan &s, spans )
+    {
+        for( int ii=s.row*bw+s.start; ii < s.row*bw+s.end; ii++ )
+        {
+            qint32 diff = luma.at(ii) - background.at(ii);
+            qint32 d = qAbs(diff - (qint32)shift);
+            qint32 limit = qMax(zonebase.at(zone.at(ii)), MOTION_DEV_GAIN*deviation.at(ii));
+            // a block that keeps moving raises its own limit, something that
+            // stops becomes background in time
+            deviation[ii] += (d - deviation.at(ii)) >> MOTION_DEV_SHIFT;
+            if( !learning && d > limit )
+            {
+                background[ii] += diff >> MOTION_FG_SHIFT;
+                moved[cell.at(ii)]++;
+                blockmoving[ii] = true;
+            } else
+            {
+                background[ii] += diff >> MOTION_BG_SHIFT;
+                blockmoving[ii] = false;
+            }
+        }
+    }
+    if( learning )
+        analyses++;
+
+    nmoving = 0;
+    for( int ii=0; ii < ncols*nrows; ii++ )
+    {
+        score[ii] = cellblocks.at(ii) ? (100*moved.at(ii))/cellblocks.at(ii) : 0;
+        if( score.at(ii) >= MOTION_CELL_MIN )
+            nmoving++;
+    }
+    if( nmoving == 0 )
+    {
+        zonemoving.fill(false);
+        return false;
+    }
+
+    // the blocks in the cells with motion have to cover more of their zone
+    // than threshold squared, in parts per million, the scale --motion has always had
+    QVector<int> count(zones.count(), 0);
+    foreach( const MotionSpan &s, spans )
+    {
+        for( int ii=s.row*bw+s.start; ii < s.row*bw+s.end; ii++ )
+            if( blockmoving.at(ii) && score.at(cell.at(ii)) >= MOTION_CELL_MIN )
+                count[zone.at(ii)]++;
+    }
+    bool detected = false;
+    for( int zz=0; zz < zones.count(); zz++ )
+    {
+        int thres = (zoneblocks.at(zz) * zones.at(zz).threshold * zones.at(zz).threshold)/1000000;
+        zonemoving[zz] = count.at(zz) > thres;
+        detected |= zonemoving.at(zz);
+    }
+    return detected;
+}
+
+QString MotionGrid::zonesMoving() const
+{
+    QString qs;
+    for( int zz=0; zz < zonemoving.count(); zz++ )
+    {
+        if( !zonemoving.at(zz) )
+            continue;
+        if( !qs.isEmpty() )
+            qs += ',';
+        qs += QString::number(zz+1);
+    }
+    return qs;
+}
+
+QString MotionGrid::bitmap() const
+{
+    QString qs;
+    int nibble = 0;
+    int bits = 0;
+    for( int ii=0; ii < score.count(); ii++ )
+    {
+        nibble = (nibble << 1) | (score.at(ii) >= MOTION_CELL_MIN ? 1 : 0);
+        if( ++bits == 4 )
+        {
+            qs += QString::number(nibble, 16);
+            nibble = bits = 0;
+        }
+    }
+    if( bits )
+        qs += QString::number(nibble << (4-bits), 16);
+    return qs;
+}
+
+QString MotionGrid::scores() const
+{
+    QString qs;
+    for( int ii=0; ii < score.count(); ii++ )
+    {
+        if( ii )
+            qs += ',';
+        qs += QString::number(score.at(ii));
+    }
+    return qs;
+}
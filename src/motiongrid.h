@@ -0,0 +1,153 @@
+/**
+ * FILE:		motiongrid.h
+ *
+ * DESCRIPTION:
+ * This is the class for detecting motion on a grid of blocks, each
+ * compared with a background of its own
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef MOTIONGRID_H
+#define MOTIONGRID_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <QList>
+#include <QString>
+#include <QRectF>
+#include <QPolygonF>
+
+#include "../include/common.h"
+
+/*
+ * MotionGrid
+ * the motion window is averaged down to one luma value per block of
+ * MOTION_BLOCK x MOTION_BLOCK pixels. Every block keeps a running average
+ * of its background and of how far it usually strays from it, so a block
+ * moves when it differs by more than MOTION_DEV_GAIN times its own
+ * deviation: swaying trees raise their own limit and leave the rest of the
+ * image as sensitive as it was. A change of the whole image, the lights or
+ * the sun, is taken out before the blocks are compared.
+ * The blocks are reported in a coarser grid of at most
+ * MOTION_GRID_COLS x MOTION_GRID_ROWS cells, with the % of the blocks of
+ * each cell that moved.
+ *
+ * The zones, each with a sensitivity and threshold of its own, and the
+ * polygons excluded from them are drawn once onto the blocks for each
+ * image size, as runs of blocks a line. Only those runs are read and
+ * compared, so the zones cost nothing more however many there are.
+ *
+ * Rather than the pixels, the blocks can be given the motion vectors of
+ * the H.264 pictures decoded since the last analysis. The level of a block
+ * is then how far it moved in a frame, MOTION_VECTOR_GAIN levels to a pixel
+ * of a picture MOTION_VECTOR_HEIGHT lines high, and is compared with its
+ * background just as the luma is.
+ */
+
+// the motion of a block of a picture from its reference, in pixels
+class MotionVector
+{
+public:
+    qint16 x, y;               // centre of the block
+    quint8 w, h;
+    qint16 dx, dy;
+};
+Q_DECLARE_TYPEINFO(MotionVector, Q_PRIMITIVE_TYPE);
+
+// a rectangle of the image in %, as --motion has it
+class MotionZone
+{
+public:
+    MotionZone() : sensitivity(50), threshold(50) {}
+    // <sensitivity>-<threshold>-<x0>-<y0>-<x1>-<y1>
+    bool fromString(const QString &s);
+    int sensitivity;
+    int threshold;
+    QRectF rect;
+};
+
+// blocks [start,end) of line 'row' of the grid that are in a zone
+class MotionSpan
+{
+public:
+    qint16 row;
+    qint16 start;
+    qint16 end;
+};
+Q_DECLARE_TYPEINFO(MotionSpan, Q_PRIMITIVE_TYPE);
+
+class MotionGrid
+{
+public:
+    MotionGrid();
+
+    void setZones(const QList<MotionZone> &z, const QList<QPolygonF> &exclude);
+    // <x>,<y>,<x>,<y>,<x>,<y>... in % of the image, at least 3 corners
+    static bool polygonFromString(const QString &s, QPolygonF &poly);
+    bool hasZones() const { return !zones.isEmpty(); }
+
+    // the image is 1 (grey) or 3 (RGB) bytes a pixel
+    // true if there is motion
+    bool analyze(const unsigned char *image, int w, int h, int bpl, int bpp);
+    // the vectors of one predicted picture of w x h pixels
+    void addVectors(const QVector<MotionVector> &mvs, int w, int h);
+    // true if there is motion in the vectors added since the last time
+    bool analyzeVectors();
+    void reset();
+
+    bool isReady() const { return analyses >= MOTION_LEARN; }
+    int cols() const { return ncols; }
+    int rows() const { return nrows; }
+    int moving() const { return nmoving; }
+    // row by row, a bit for each cell with motion, the first in the top bit
+    QString bitmap() const;
+    // row by row, the % of the blocks of each cell with motion
+    QString scores() const;
+    // the zones with motion, counted from 1
+    QString zonesMoving() const;
+
+private:
+    void rasterize(int w, int h);
+    void sumBlocks(const unsigned char *image, int bpl, int bpp);
+    bool compare();
+
+    QList<MotionZone> zones;
+    QList<QPolygonF> excludes;
+    int width, height;         // of the image the blocks were drawn for
+    int x0, y0;                // the blocks cover the zones from here, in pixels
+    int bw, bh;                // blocks across and down
+    int ncols, nrows;
+    int analyses;
+    int nmoving;
+    QVector<MotionSpan> spans;
+    QVector<qint32> luma;      // of each block, in 1/256
+    QVector<qint32> background;
+    QVector<qint32> deviation;
+    QVector<bool> blockmoving;
+    QVector<quint16> cell;     // cell of each block
+    QVector<quint8> zone;      // zone of each block
+    QVector<int> cellblocks;   // blocks of each cell in a zone
+    QVector<int> zoneblocks;   // blocks of each zone
+    QVector<qint32> zonebase;  // least change of level for a block of each zone
+    QVector<qint64> energy;    // pixels moved times their area, since the last analysis
+    int vframes;               // pictures the energy is from
+    int pwidth, pheight;       // of the pictures
+    QVector<quint8> score;
+    QVector<bool> zonemoving;
+};
+
+#endif // MOTIONGRID_H
@@ -22,6 +22,10 @@
 
 #include <QtDebug>
 #include <QDir>
+#include <QtEndian>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "../include/common.h"
 #include "vchannel.h"
 #include "pcmaudio.h"
@@ -30,9 +34,14 @@
 
 using namespace command_line_arguments;
 
+qint32 pcmAudio::ulawtable[256];
+qint32 pcmAudio::alawtable[256];
+
 pcmAudio::pcmAudio( QObject *parent) : QObject( parent ), buffer(NULL), audio(NULL)
 {
     QDEBUG << "pcmAudio";
+    initTables();
+    table = ulawtable;
     setFormat();
 }
 
@@ -41,13 +50,66 @@ pcmAudio::~pcmAudio()
     QDEBUG << "~pcmAudio";
 }
 
-bool pcmAudio::ulaw2linear(const char *data, int len, AvFormat *av)
+// build the G.711 to 16-bit linear tables once,
+// the values are stored little endian as they are written out
+void pcmAudio::initTables()
 {
-    if( buffer == NULL )
-        return false;
+    static bool done = false;
+    if( done ) return;
 
-    QByteArray bufferout;
+    for( int ii=0; ii<256; ii++ )
+    {
+        /* Complement to obtain normal u-law value. */
+        unsigned char val = ~ii;
+        /*
+         * Extract and bias the quantization bits. Then
+         * shift up by the segment number and subtract out the bias.
+         */
+        qint16 t = ((val & QUANT_MASK) << 3) + BIAS;
+        t <<= ((unsigned)val & SEG_MASK) >> SEG_SHIFT;
+        ulawtable[ii] = qToLittleEndian<qint16>((val & SIGN_BIT) ? (BIAS - t) : (t - BIAS));
+
+        /* A-law inverts the even bits */
+        val = ii ^ 0x55;
+        t = (val & QUANT_MASK) << 4;
+        int seg = ((unsigned)val & SEG_MASK) >> SEG_SHIFT;
+        if( seg == 0 )
+            t += 8;
+        else
+        {
+            t += 0x108;
+            t <<= seg - 1;
+        }
+        alawtable[ii] = qToLittleEndian<qint16>((val & SIGN_BIT) ? t : -t);
+    }
+    done = true;
+}
 
+void pcmAudio::setPayload(int pt)
+{
+    table = ( pt == PAYLOAD_PCMA ) ? alawtable : ulawtable;
+}
+
+// table lookup, 8 samples at a time with a gather where AVX2 is available
+void pcmAudio::decode(const unsigned char *in, qint16 *out, int len, const qint32 *table)
+{
+    int xx = 0;
+#ifdef __AVX2__
+    for( ; xx+8 <= len; xx+=8 )
+    {
+        __m256i idx = _mm256_cvtepu8_epi32( _mm_loadl_epi64((const __m128i*)(in+xx)) );
+        __m256i val = _mm256_i32gather_epi32( (const int*)table, idx, 4 );
+        // narrow to 16 bits: packs works per 128-bit lane, so gather the low halves
+        val = _mm256_permute4x64_epi64( _mm256_packs_epi32(val, val), 0xd8 );
+        _mm_storeu_si128( (__m128i*)(out+xx), _mm256_castsi256_si128(val) );
+    }
+#endif
+    for( ; xx<len; xx++ )
+        out[xx] = (qint16)table[in[xx]];
+}
+
+bool pcmAudio::g711linear(const char *data, int len, AvFormat *av, quint32 tstamp)
+{
 #ifdef RECORD
         // save to file
         QString fileout = QDir::homePath()+QString("/" PROGRAM_NAME ".pcmu");
@@ -62,29 +124,9 @@ bool pcmAudio::ulaw2linear(const char *data, int len, AvFormat *av)
         }
 #endif
 
-
-    quint16  t;
-    const unsigned char * u_val = (const unsigned char*)data;
-    unsigned char val;
-
-    for (int xx=0; xx<len; xx++)
-    {
-
-     /* Complement to obtain normal u-law value. */
-     //*u_val = ~*u_val;
-     val = ~u_val[xx];
-
-     /*
-      * Extract and bias the quantization bits. Then
-      * shift up by the segment number and subtract out the bias.
-      */
-     t = ((val & QUANT_MASK) << 3) + BIAS;
-     t <<= ((unsigned)val & SEG_MASK) >> SEG_SHIFT;
-     quint16 result = ((val & SIGN_BIT) ? (BIAS - t) : (t - BIAS));
-     bufferout += (char)(result&0xff);
-     bufferout += (char)(result>>8);
-
-    }
+    // keeps its capacity between packets
+    bufferout.resize(2*len);
+    decode( (const unsigned char*)data, (qint16*)bufferout.data(), len, table );
 
     #ifdef RECORD
     {
@@ -102,11 +144,11 @@ bool pcmAudio::ulaw2linear(const char *data, int len, AvFormat *av)
     }
     #endif
 
-    if( naudio == 2 )
+    if( naudio == 2 && buffer )
         buffer->write( bufferout );
 
     if( av )
-        av->recordFrame((const unsigned char*)bufferout.constData(), bufferout.count(), STREAMS_AUDIO);
+        av->recordFrame((const unsigned char*)bufferout.constData(), bufferout.count(), STREAMS_AUDIO, tstamp);
 
     return true;
 }
@@ -140,7 +182,7 @@ void pcmAudio::setFormat()
 #endif
 }
 
-void pcmAudio::setData( QByteArray & data, AvFormat *av )
+void pcmAudio::setData( QByteArray & data, AvFormat *av, quint32 tstamp )
 {
 #ifdef QTMULTIMEDIA
     if( audio && audio->state() == QAudio::StoppedState )
@@ -149,10 +191,16 @@ void pcmAudio::setData( QByteArray & data, AvFormat *av )
         buffer = audio->start();
     }
 #endif
-    if( buffer )
+    // record the G.711 bytes as received when the format stores them directly
+    bool compressed = ( av && av->compressedAudio() );
+    if( compressed )
+        av->recordFrame((const unsigned char*)data.constData(), data.length(), STREAMS_AUDIO, tstamp);
+
+    // decode only for local playback or a pcm recording
+    if( ( naudio == 2 && buffer ) || ( av && !compressed ) )
     {
         //buffer->open(QIODevice::Append);
-        ulaw2linear( data.constData(), data.length(), av );
+        g711linear( data.constData(), data.length(), compressed?NULL:av, tstamp );
         //buffer->close();
     }
 }
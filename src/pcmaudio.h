@@ -54,14 +54,22 @@ public:
     ~pcmAudio();
 
     void setFormat();
-    void setData( QByteArray & data, AvFormat *av=NULL );
-    bool ulaw2linear(const char *data, int len, AvFormat *av);
+    void setPayload(int pt);
+    void setData( QByteArray & data, AvFormat *av=NULL, quint32 tstamp=0 );
+    bool g711linear(const char *data, int len, AvFormat *av, quint32 tstamp);
+    static void decode(const unsigned char *in, qint16 *out, int len, const qint32 *table);
 protected slots:
 #ifdef QTMULTIMEDIA
     void finishedPlaying(QAudio::State state);
 #endif
 private:
+    static void initTables();
+    static qint32 ulawtable[256];
+    static qint32 alawtable[256];
+
     QIODevice *buffer;
+    QByteArray bufferout;      // decoded 16-bit pcm, reused between packets
+    const qint32 *table;       // table for the current payload
 #ifdef QTMULTIMEDIA
     QAudioFormat format;
     QAudioOutput *audio;
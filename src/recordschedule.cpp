@@ -26,7 +26,7 @@
 ////////////////////////////////////////////////////////////////
 // RecordSchedule class
 //
-RecordSchedule::RecordSchedule() : id(0),mode(RECORD_OFF),days(DAY_NONE)
+RecordSchedule::RecordSchedule() : id(0),mode(RECORD_OFF),days(DAY_NONE),timelapse(0)
 {
 
 }
@@ -50,15 +50,63 @@ void RecordSchedule::setSchedule(QString s)
 void RecordSchedule::setMotion()
 {
     qdtMotion = QDateTime::currentDateTime();
+    addSpan(qdtMotion.toMSecsSinceEpoch());
     qWarning() << "Notification: Motion" << qdtEvent.toString(Qt::ISODate);
 }
 
 void RecordSchedule::setEvent()
 {
     qdtEvent = QDateTime::currentDateTime();
+    addSpan(qdtEvent.toMSecsSinceEpoch());
     qWarning() << "Notification: Event" << qdtEvent.toString(Qt::ISODate);
 }
 
+// motion is reported for each frame it is seen in, so a span is
+// extended while the windows around its reports overlap
+void RecordSchedule::addSpan(qint64 msecs)
+{
+    if( !spans.isEmpty() && msecs - spans.last().second <= (SECS_BEFORE_EVENT+SECS_AFTER_EVENT)*1000 )
+        spans.last().second = qMax(spans.last().second, msecs);
+    else
+        spans.append(qMakePair(msecs, msecs));
+
+    // only the segments still to be written need them
+    while( !spans.isEmpty() && spans.first().second < msecs - RECORD_MOTION_HISTORY*1000LL )
+        spans.removeFirst();
+}
+
+// the frame at 'msecs' is in the window before or after motion or an event
+bool RecordSchedule::inMotion(qint64 msecs)
+{
+    for( int ii=spans.count()-1; ii>=0; ii-- )
+    {
+        const QPair<qint64,qint64> &span = spans.at(ii);
+        if( msecs > span.second + SECS_AFTER_EVENT*1000 )
+            return false;
+        if( msecs >= span.first - SECS_BEFORE_EVENT*1000 )
+            return true;
+    }
+    return false;
+}
+
+// a segment starting at 'st' is written as a timelapse, with full rate
+// GOPs only around motion, rather than written whole or not at all
+bool RecordSchedule::isTimelapse(QDateTime st)
+{
+    if( timelapse <= 0 )
+        return false;
+    if( st.isNull() ) st = QDateTime::currentDateTime();
+
+    if( mode == RECORD_MOTION )
+        return true;
+    if( mode == RECORD_SCHEDULE_MOTION )
+    {
+        int day = st.date().dayOfWeek() -1;
+        return ( (1 << day) & days ) && start <= st.time() && end > st.time();
+    }
+    return false;
+}
+
 QString RecordSchedule::schedule()
 {
     // check for a valid string
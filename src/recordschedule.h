@@ -23,6 +23,9 @@
 #ifndef RECORDSCHEDULE_H
 #define RECORDSCHEDULE_H
 
+#include <QList>
+#include <QPair>
+
 #include "../include/common.h"
 
 class RecordSchedule
@@ -40,6 +43,11 @@ public:
     QString eventType(QDateTime st = QDateTime(), QDateTime en = QDateTime());
     QDateTime lastEvent() { return qdtEvent; }
     QDateTime lastMotion() { return qdtMotion; }
+    // motion modes write every segment, at full rate only around motion
+    void setTimelapse(int secs) { timelapse = secs; }
+    int  timelapseSecs() { return timelapse; }
+    bool isTimelapse(QDateTime st = QDateTime());
+    bool inMotion(qint64 msecs);
 
     int id;
     RECORD_MODE mode;
@@ -48,6 +56,13 @@ public:
     QTime end;
     QDateTime qdtEvent;
     QDateTime qdtMotion;
+
+private:
+    void addSpan(qint64 msecs);
+
+    int timelapse;             // seconds between the key frames kept without motion, 0 is off
+    // recent motion and events, in ms since the epoch; close ones are merged
+    QList< QPair<qint64,qint64> > spans;
 };
 
 #endif // RECORDSCHEDULE_H
@@ -0,0 +1,172 @@
+/**
+ * FILE:		rtpreorder.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for reordering RTP packets received over UDP
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include "../include/common.h"
+#include "rtpreorder.h"
+#include "metrics.h"
+
+RtpReorderBuffer::RtpReorderBuffer(int size, int latency) :
+    slot(NULL), nslots(size), holdtime(latency), initialized(false),
+    nextseq(0), highest(0), count(0),
+    maxdepth(0), nreordered(0), nlate(0), nduplicate(0), nskipped(0), njumpdrops(0),
+    nreleased(0), latencysum(0), maxlatency(0)
+{
+    // a power of two divides 65536, so seq % nslots carries on
+    // across the wrap of the sequence number
+    int n = 4;
+    while( n < nslots && n < 0x4000 )
+        n <<= 1;
+    nslots = n;
+    slot = new RtpReorderSlot[nslots];
+}
+
+RtpReorderBuffer::~RtpReorderBuffer()
+{
+    delete [] slot;
+}
+
+void RtpReorderBuffer::clear()
+{
+    for( int ii=0; ii<nslots; ii++ )
+        slot[ii].used = false;
+    jump.used = false;
+    count = 0;
+    initialized = false;
+}
+
+void RtpReorderBuffer::insert(const char *packet, int size, qint64 now)
+{
+    if( packet == NULL || size < 12 )
+        return;
+
+    quint16 seq = (quint8)packet[2]*256 + (quint8)packet[3];
+    if( !initialized )
+    {
+        nextseq = highest = seq;
+        initialized = true;
+    }
+
+    // distance from the next packet to release, allowing for wrap around
+    qint16 diff = (qint16)(quint16)(seq - nextseq);
+
+    if( diff < 0 && diff >= -nslots )
+    {
+        // already released or skipped
+        nlate++;
+        metrics.rtpLate.add();
+        return;
+    }
+
+    RtpReorderSlot *s = NULL;
+    if( diff < 0 || diff >= nslots )
+    {
+        // there is one jump slot; a further jump before the first is
+        // released is dropped rather than written over it
+        if( jump.used )
+        {
+            QDEBUG << "RTP reorder: sequence jump to" << seq << "dropped, waiting on" << jump.seq;
+            njumpdrops++;
+            metrics.rtpOutOfOrder.add();
+            return;
+        }
+        // a large gap or a restarted stream;
+        // release what we hold then continue from here
+        QDEBUG << "RTP reorder: sequence jump" << nextseq << "->" << seq;
+        s = &jump;
+    } else
+    {
+        s = &slot[seq % nslots];
+        if( s->used )
+        {
+            nduplicate++;
+            return;
+        }
+        count++;
+
+        // track how far behind the newest packet this one arrived
+        qint16 behind = (qint16)(quint16)(highest - seq);
+        if( behind > 0 )
+        {
+            nreordered++;
+            metrics.rtpReordered.add();
+            if( behind > maxdepth ) maxdepth = behind;
+        } else
+            highest = seq;
+    }
+
+    // reuse the slot allocation
+    s->data.resize(size);
+    memcpy(s->data.data(), packet, size);
+    s->arrival = now;
+    s->seq = seq;
+    s->used = true;
+}
+
+const char *RtpReorderBuffer::next(int &size, qint64 now)
+{
+    RtpReorderSlot *s = NULL;
+
+    if( count > 0 )
+    {
+        s = &slot[nextseq % nslots];
+        if( !s->used || s->seq != nextseq )
+        {
+            s = NULL;
+            // wait for the missing packet unless we have waited long enough
+            bool giveup = jump.used || (qint16)(quint16)(highest - nextseq) >= nslots/2;
+            for( int ii=0; ii<nslots && !giveup; ii++ )
+                if( slot[ii].used && now - slot[ii].arrival >= holdtime )
+                    giveup = true;
+            if( !giveup )
+                return NULL;
+
+            // skip to the next packet we hold
+            while( !slot[nextseq % nslots].used || slot[nextseq % nslots].seq != nextseq )
+            {
+                nextseq++;
+                nskipped++;
+            }
+            s = &slot[nextseq % nslots];
+        }
+        count--;
+        nextseq++;
+    } else
+    if( jump.used )
+    {
+        s = &jump;
+        nextseq = highest = s->seq;
+        nextseq++;
+    } else
+        return NULL;
+
+    s->used = false;
+
+    int added = (int)(now - s->arrival);
+    latencysum += added;
+    nreleased++;
+    if( added > maxlatency ) maxlatency = added;
+
+    size = s->data.size();
+    return s->data.constData();
+}
@@ -0,0 +1,91 @@
+/**
+ * FILE:		rtpreorder.h
+ *
+ * DESCRIPTION:
+ * This is the class for reordering RTP packets received over UDP
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef RTPREORDER_H
+#define RTPREORDER_H
+
+#include <QtGlobal>
+#include <QByteArray>
+
+#include "../include/common.h"
+
+class RtpReorderSlot
+{
+public:
+    RtpReorderSlot() : arrival(0), seq(0), used(false) {}
+    QByteArray data;
+    qint64     arrival;        // in ms
+    quint16    seq;
+    bool       used;
+};
+
+/*
+ * RtpReorderBuffer
+ * holds the packets of one SSRC in a ring indexed by sequence number and
+ * releases them in order. A missing packet is waited for until the oldest
+ * held packet is 'latency' ms old or the ring is half full, then skipped.
+ * Use: insert() each datagram, then call next() until it returns NULL.
+ */
+class RtpReorderBuffer
+{
+public:
+    RtpReorderBuffer(int size = RTP_REORDER_SLOTS, int latency = RTP_REORDER_LATENCY);
+    ~RtpReorderBuffer();
+    void insert(const char *packet, int size, qint64 now);
+    const char *next(int &size, qint64 now);
+    void clear();
+    bool holding() { return count > 0 || jump.used; }
+
+    // statistics
+    int     depth() { return maxdepth; }
+    quint32 reordered() { return nreordered; }
+    quint32 lateDrops() { return nlate; }
+    quint32 duplicates() { return nduplicate; }
+    quint32 skipped() { return nskipped; }
+    quint32 jumpDrops() { return njumpdrops; }
+    int     latency() { return nreleased ? (int)(latencysum/nreleased) : 0; }
+    int     maxLatency() { return maxlatency; }
+
+private:
+    RtpReorderSlot *slot;
+    int     nslots;
+    int     holdtime;
+    bool    initialized;
+    quint16 nextseq;           // next sequence number to release
+    quint16 highest;           // highest sequence number received
+    int     count;             // packets held
+
+    // a packet too far from nextseq, released after the ring is drained
+    RtpReorderSlot jump;
+
+    int     maxdepth;
+    quint32 nreordered;
+    quint32 nlate;
+    quint32 nduplicate;
+    quint32 nskipped;
+    quint32 njumpdrops;        // further jumps while one was held
+    quint64 nreleased;
+    quint64 latencysum;
+    int     maxlatency;
+};
+
+#endif // RTPREORDER_H
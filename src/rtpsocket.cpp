@@ -22,11 +22,14 @@
 
 #include <QLabel>
 #include <QStatusBar>
+#include <QBuffer>
 
 #include "../include/common.h"
 #include "vchannel.h"
 #include "recordschedule.h"
 #include "rtpsocket.h"
+#include "metrics.h"
+#include "trace.h"
 
 using namespace command_line_arguments;
 
@@ -48,6 +51,18 @@ RtcpPacket::RtcpPacket(quint32 s, QString name): myssrc(s)
         bad_sequence[ii] = 0;
         lost[ii] = 0;
         expected[ii]=0;
+        base_sequence[ii] = 0;
+        cycles[ii] = 0;
+        received[ii] = 0;
+        clockrate[ii] = 0;
+        jitter[ii] = 0.0;
+        transit[ii] = 0;
+        hastransit[ii] = false;
+        lsr[ii] = 0;
+        lsrtime[ii] = 0;
+        srntp[ii] = 0;
+        srrtp[ii] = 0;
+        rtt[ii] = -1;
     }
 
     // random ssrc
@@ -70,7 +85,10 @@ RtcpPacket::RtcpPacket(quint32 s, QString name): myssrc(s)
 
     cname.fill( '\0',4+size*4);
     cname.replace(0,4,(const char*)header,4);
-    cname.replace(4,4,(const char*)&myssrc,4);
+    cname[4] = (myssrc >> 24) & 0xff;
+    cname[5] = (myssrc >> 16) & 0xff;
+    cname[6] = (myssrc >> 8) & 0xff;
+    cname[7] = myssrc & 0xff;
     cname[8] = 1; // NAME
     cname[9] = name.length()&0xff;
     cname.replace(10,name.length()&0xff,(const char*)name.toLatin1());
@@ -78,54 +96,216 @@ RtcpPacket::RtcpPacket(quint32 s, QString name): myssrc(s)
     QDEBUG << "CNAME:" << cname;
 }
 
+// find the record for this source, or allocate a free one
+int RtcpPacket::index(quint32 ss)
+{
+    for( int ii=0; ii<3; ii++ )
+        if( ssrc[ii] == ss )
+            return ii;
+    for( int ii=0; ii<3; ii++ )
+        if( ssrc[ii] == 0 )
+        {
+            ssrc[ii] = ss;
+            QDEBUG << "SSRC[" << ii << "]==>" << ssrc[ii];
+            return ii;
+        }
+    return -1;
+}
+
+//
+// interarrival jitter (RFC 3550 A.8), updated in arrival order
+// now is the arrival time in ns
+void RtcpPacket::arrival(quint32 ss, quint8 pt, quint32 tstamp, qint64 now)
+{
+    int ii = index(ss);
+    if( ii < 0 ) return;
+
+    // G.711 uses an 8kHz clock, video 90kHz
+    clockrate[ii] = ( pt == 0 || pt == 8 ) ? 8000 : 90000;
+    quint32 arrivalts = (quint32)( (now/1000) * clockrate[ii] / 1000000 );
+    qint32 t = (qint32)(arrivalts - tstamp);
+    if( hastransit[ii] )
+    {
+        qint32 d = t - transit[ii];
+        if( d < 0 ) d = -d;
+        jitter[ii] += ( (double)d - jitter[ii] ) / 16.0;
+    }
+    transit[ii] = t;
+    hastransit[ii] = true;
+}
+
+quint32 RtcpPacket::cumulativeLost(int ii)
+{
+    if( received[ii] == 0 ) return 0;
+    qint64 expect = (qint64)(cycles[ii] + sequence[ii]) - base_sequence[ii] + 1;
+    qint64 l = expect - received[ii];
+    return l > 0 ? (quint32)l : 0;
+}
+
+// map an RTP timestamp to wallclock (ms since epoch) using the last SR,
+// returns 0 if no sender report has been received
+qint64 RtcpPacket::wallclock(int ii, quint32 tstamp)
+{
+    if( ii < 0 || ii > 2 || srntp[ii] == 0 || clockrate[ii] == 0 )
+        return 0;
+    qint64 ntpms = (qint64)(srntp[ii] >> 32) * 1000 + (qint64)(((srntp[ii] & 0xffffffffULL) * 1000) >> 32);
+    qint64 delta = ((qint64)(qint32)(tstamp - srrtp[ii]) * 1000) / (qint64)clockrate[ii];
+    // NTP counts from 1900
+    return ntpms - 2208988800LL*1000 + delta;
+}
+
+//
+// decode a compound RTCP packet
+void RtcpPacket::decode(const char *data, int size, qint64 now)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    while( size >= 8 )
+    {
+        if( (p[0] >> 6) != 2 )
+        {
+            QDEBUG << "RTCP: bad version";
+            return;
+        }
+        int count = p[0] & 0x1f;
+        int type = p[1];
+        int len = ( p[2]*256 + p[3] + 1 )*4;
+        if( len > size )
+        {
+            QDEBUG << "RTCP: short packet" << len << size;
+            return;
+        }
+        quint32 sender = ((quint32)p[4]<<24) | ((quint32)p[5]<<16) | ((quint32)p[6]<<8) | p[7];
+
+        const unsigned char *block = NULL;
+        if( type == 200 && len >= 28 )  // sender report
+        {
+            int ii = index(sender);
+            if( ii >= 0 )
+            {
+                quint32 ntpsec  = ((quint32)p[8]<<24) | ((quint32)p[9]<<16) | ((quint32)p[10]<<8) | p[11];
+                quint32 ntpfrac = ((quint32)p[12]<<24) | ((quint32)p[13]<<16) | ((quint32)p[14]<<8) | p[15];
+                srntp[ii] = ((quint64)ntpsec << 32) | ntpfrac;
+                srrtp[ii] = ((quint32)p[16]<<24) | ((quint32)p[17]<<16) | ((quint32)p[18]<<8) | p[19];
+                lsr[ii] = (ntpsec << 16) | (ntpfrac >> 16);
+                lsrtime[ii] = now;
+                QDDEBUG << "SR from" << sender << "ntp" << ntpsec << "rtp" << srrtp[ii];
+            }
+            block = p+28;
+        } else
+        if( type == 201 )               // receiver report
+            block = p+8;
+        else
+        if( type == 203 )               // bye
+            QDEBUG << "RTCP: BYE from" << sender;
+
+        // report blocks about us give the round trip time (RFC 3550 6.4.1)
+        for( int rr=0; block && rr<count && block+24 <= p+len; rr++, block+=24 )
+        {
+            quint32 ss   = ((quint32)block[0]<<24) | ((quint32)block[1]<<16) | ((quint32)block[2]<<8) | block[3];
+            quint32 blsr = ((quint32)block[16]<<24) | ((quint32)block[17]<<16) | ((quint32)block[18]<<8) | block[19];
+            quint32 bdlsr= ((quint32)block[20]<<24) | ((quint32)block[21]<<16) | ((quint32)block[22]<<8) | block[23];
+            if( ss != myssrc || blsr == 0 )
+                continue;
+            int ii = index(sender);
+            if( ii < 0 )
+                continue;
+            // our NTP time now, middle 32 bits
+            qint64 ms = QDateTime::currentMSecsSinceEpoch() + 2208988800LL*1000;
+            quint32 a = (quint32)( ((ms/1000) << 16) | ((((ms%1000) << 16)/1000) & 0xffff) );
+            qint32 r = (qint32)(a - blsr - bdlsr);
+            if( r >= 0 )
+                rtt[ii] = (int)( ((qint64)r * 1000) >> 16 );
+        }
+
+        p += len;
+        size -= len;
+    }
+}
+
 //
-// Receiver Report
-QByteArray RtcpPacket::packetRR()
+// Receiver Report, one report block per source (RFC 3550 6.4.2)
+// now is the current time in ns
+QByteArray RtcpPacket::packetRR(qint64 now)
 {
     QByteArray rr;
 
-    int size = 7;
+    int blocks = 0;
+    for( int ii=0; ii<3; ii++ )
+        if( ssrc[ii] != 0 ) blocks++;
 
-    // todo do this for all 3 RRs
-    unsigned char fraction_lost = (expected[0]==0 ? 0:(256 * lost[0]) / expected[0]);
+    // length in 32 bit words - 1
+    int size = 1 + 6*blocks;
 
     header[0] = (2 << 6) +       // version
                 0 +            // padding
-                1;             // reports
+                blocks;        // reports
     header[1] = 201 ;  // receiver report
     header[2] = size/256;
     header[3] = size&0xff;
 
     rr.fill('\0',4+size*4);
     rr.replace(0,4,(const char*)header,4);
-    rr.replace(4,4,(const char*)&myssrc,4);     // identifier
-
-    // SSRC group
-    rr[8] = (ssrc[0] >> 24) & 0xff;
-    rr[9] = (ssrc[0] >> 16) & 0xff;
-    rr[10] =(ssrc[0] >> 8) & 0xff;
-    rr[11] =ssrc[0] & 0xff;
-
-    // ssrc contents
-    rr[12] = fraction_lost;
+    rr[4] = (myssrc >> 24) & 0xff;     // identifier
+    rr[5] = (myssrc >> 16) & 0xff;
+    rr[6] = (myssrc >> 8) & 0xff;
+    rr[7] = myssrc & 0xff;
 
-    // lost packets
-    if( fraction_lost ) {
-        QDEBUG << "Receiver Report: fraction lost" << fraction_lost << "lost" << lost[0] << "sequence" << sequence[0];
+    int pos = 8;
+    for( int ii=0; ii<3; ii++ )
+    {
+        if( ssrc[ii] == 0 )
+            continue;
+
+        unsigned char fraction_lost = (expected[ii]==0 || lost[ii]>=expected[ii]) ? 0:(256 * lost[ii]) / expected[ii];
+        quint32 cumulative = cumulativeLost(ii);
+        quint32 highest = cycles[ii] + sequence[ii];
+        quint32 jit = (quint32)jitter[ii];
+        quint32 dlsr = 0;
+        if( lsr[ii] )
+            dlsr = (quint32)( ((now - lsrtime[ii]) / 1000) * 65536 / 1000000 );
+
+        // SSRC group
+        rr[pos+0] = (ssrc[ii] >> 24) & 0xff;
+        rr[pos+1] = (ssrc[ii] >> 16) & 0xff;
+        rr[pos+2] = (ssrc[ii] >> 8) & 0xff;
+        rr[pos+3] = ssrc[ii] & 0xff;
+
+        // lost packets
+        if( fraction_lost ) {
+            QDEBUG << "Receiver Report: fraction lost" << fraction_lost << "lost" << lost[ii] << "sequence" << sequence[ii];
+        }
+        rr[pos+4] = fraction_lost;
+        if( cumulative > 0x7fffff ) cumulative = 0x7fffff;
+        rr[pos+5] = (cumulative >> 16) & 0xff;
+        rr[pos+6] = (cumulative >> 8) & 0xff;
+        rr[pos+7] = cumulative & 0xff;
+
+        // extended highest sequence
+        rr[pos+8] = (highest >> 24) & 0xff;
+        rr[pos+9] = (highest >> 16) & 0xff;
+        rr[pos+10] = (highest >> 8) & 0xff;
+        rr[pos+11] = highest & 0xff;
+
+        // interarrival jitter
+        rr[pos+12] = (jit >> 24) & 0xff;
+        rr[pos+13] = (jit >> 16) & 0xff;
+        rr[pos+14] = (jit >> 8) & 0xff;
+        rr[pos+15] = jit & 0xff;
+
+        // last SR and delay since last SR
+        rr[pos+16] = (lsr[ii] >> 24) & 0xff;
+        rr[pos+17] = (lsr[ii] >> 16) & 0xff;
+        rr[pos+18] = (lsr[ii] >> 8) & 0xff;
+        rr[pos+19] = lsr[ii] & 0xff;
+        rr[pos+20] = (dlsr >> 24) & 0xff;
+        rr[pos+21] = (dlsr >> 16) & 0xff;
+        rr[pos+22] = (dlsr >> 8) & 0xff;
+        rr[pos+23] = dlsr & 0xff;
+
+        pos += 24;
+        lost[ii] = 0;
+        expected[ii] = 0;
     }
-    rr[13] = (lost[0] >> 16) & 0xff;
-    rr[14] = (lost[0] >> 8) & 0xff;
-    rr[15] = lost[0] & 0xff;
-
-    // highest sequence
-    rr[16] = (sequence[0] >> 24) & 0xff;
-    rr[17] = (sequence[0] >> 16) & 0xff;
-    rr[18] = (sequence[0] >> 8) & 0xff;
-    rr[19] = sequence[0] & 0xff;
-
-    // timing and jitter not implemented
-    lost[0] = lost[1] = lost[2] = 0;
-    expected[0] = expected[1] = expected[2] = 0;
     return rr;
 }
 
@@ -135,9 +315,10 @@ QByteArray RtcpPacket::packetRR()
 // RTP class
 RtpSocket::RtpSocket(RtspSocket *parent, AvFormat *av) :
     QUdpSocket(parent),
-    initialized(false), label(NULL), jpegvideo(NULL), h264video(NULL),
-    pcmaudio(NULL), rtcppacket(NULL), packetSize(0), rtcpSocket(NULL),
-    ipdatagram(NULL), ipsz(1500),mediaformat(-1)
+    initialized(false), headless(false), label(NULL), jpegvideo(NULL), h264video(NULL),
+    pcmaudio(NULL), hlssegmenter(NULL), rtcppacket(NULL), packetSize(0), rtcpSocket(NULL),
+    ipdatagram(NULL), ipsz(1500),mediaformat(-1), hevc(false), packetization(0), interleavedepth(0),
+    tracetstamp(0), reordertimer(NULL)
 {
     QDEBUG << "RtpSocket";
     quint32 uid = QUdpSocket().localAddress().toIPv4Address();
@@ -145,6 +326,41 @@ RtpSocket::RtpSocket(RtspSocket *parent, AvFormat *av) :
     avformat = av;
     Q_ASSERT(avformat);
     sdp = parent->session();
+    clock.start();
+
+    // releases held packets when nothing else arrives
+    reordertimer = new QTimer(this);
+    reordertimer->setSingleShot(true);
+    connect(reordertimer, SIGNAL(timeout()), this, SLOT(flushReorder()));
+
+    // --motion is the first zone, then each --zone
+    QList<MotionZone> zones;
+    if( mw && mh )
+    {
+        MotionZone z;
+        z.sensitivity = sensitivity;
+        z.threshold = threshold;
+        z.rect = QRectF(mx, my, mw, mh);
+        zones << z;
+    }
+    foreach( const QString &qs, motionzones )
+    {
+        MotionZone z;
+        if( z.fromString(qs) )
+            zones << z;
+        else
+            qWarning() << "invalid motion zone:" << qs;
+    }
+    QList<QPolygonF> excludes;
+    foreach( const QString &qs, motionexcludes )
+    {
+        QPolygonF poly;
+        if( MotionGrid::polygonFromString(qs, poly) )
+            excludes << poly;
+        else
+            qWarning() << "invalid motion exclusion:" << qs;
+    }
+    motiongrid.setZones(zones, excludes);
 }
 RtpSocket::~RtpSocket()
 {
@@ -153,16 +369,60 @@ RtpSocket::~RtpSocket()
     if( jpegvideo ) delete jpegvideo;
     if( h264video ) delete h264video;
     if( pcmaudio ) delete pcmaudio;
+    if( hlssegmenter ) delete hlssegmenter;
     if( rtcppacket ) delete rtcppacket;
     if( ipdatagram ) free ( ipdatagram );
+    qDeleteAll(reorder);
 }
 
 bool RtpSocket::init(int port)
 {
     QDEBUG << "RtpSocket Init";
     if( initialized ) return true;
+    configure();
+    if( usetcp )
+        // do nothing
+        return true;
+
+    if ( bind(port) )
+    {
+        connect(this, SIGNAL(readyRead()),this, SLOT(readPendingDatagrams()));
+        if( !rtcpSocket )
+            rtcpSocket = new QUdpSocket(this);
+        if( rtcpSocket && rtcpSocket->bind(port+1) )
+        {
+            connect(rtcpSocket, SIGNAL(readyRead()),this, SLOT(readRTCPDatagrams()));
+            initialized = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+// take the media format and parameter sets from the session description
+void RtpSocket::configure()
+{
     mediaformat = sdp->video()->mediaformat();
     QDEBUG << "mediaformat=" << mediaformat << endl;
+    hevc = sdp->video()->isHevc();
+    if( hevc )
+    {
+        // RFC 7798: the DON fields are present when the NAL units
+        // can be sent out of decoding order
+        packetization = sdp->video()->fmtp("sprop-max-don-diff").toInt() > 0 ? 2 : 0;
+        interleavedepth = sdp->video()->fmtp("sprop-depack-buf-nalus").toInt();
+        // each may list several, the first is used
+        QByteArray v = sdp->video()->fmtp("sprop-vps");
+        QByteArray s = sdp->video()->fmtp("sprop-sps");
+        QByteArray p = sdp->video()->fmtp("sprop-pps");
+        if( !v.isEmpty() ) vps = QByteArray::fromBase64(v.split(',').first());
+        if( !s.isEmpty() ) sps = QByteArray::fromBase64(s.split(',').first());
+        if( !p.isEmpty() ) pps = QByteArray::fromBase64(p.split(',').first());
+        QDEBUG << "h265 vpslen=" << vps.count() << "spslen=" << sps.count() << "ppslen=" << pps.count();
+        return;
+    }
+    packetization = sdp->video()->fmtp("packetization-mode").toInt();
+    interleavedepth = sdp->video()->fmtp("sprop-interleaving-depth").toInt();
     QByteArray parms = sdp->video()->fmtp( "sprop-parameter-sets");
     if( !parms.isEmpty() )
     {
@@ -186,23 +446,6 @@ bool RtpSocket::init(int port)
     	}
 
     }
-    if( usetcp )
-        // do nothing
-        return true;
-
-    if ( bind(port) )
-    {
-        connect(this, SIGNAL(readyRead()),this, SLOT(readPendingDatagrams()));
-        if( !rtcpSocket )
-            rtcpSocket = new QUdpSocket(this);
-        if( rtcpSocket && rtcpSocket->bind(port+1) )
-        {
-            connect(rtcpSocket, SIGNAL(readyRead()),this, SLOT(readRTCPDatagrams()));
-            initialized = true;
-            return true;
-        }
-    }
-    return false;
 }
 
 void RtpSocket::closeSocket()
@@ -218,8 +461,65 @@ void RtpSocket::closeSocket()
 
 void RtpSocket::readRTCPDatagrams()
 {
-    QDEBUG << "readRTCPDatagrams";
-    // todo: decode the packet
+    QDDEBUG << "readRTCPDatagrams";
+    char buf[1500];
+    while( rtcpSocket && rtcpSocket->hasPendingDatagrams() )
+    {
+        qint64 datacnt = rtcpSocket->readDatagram(buf, sizeof(buf));
+        if( datacnt > 0 )
+            decodeRtcp(buf, datacnt);
+    }
+}
+
+// RTCP received over udp, or interleaved over tcp
+void RtpSocket::decodeRtcp(const char *datagram, qint64 datacnt)
+{
+    QDDEBUG << "decodeRtcp" << datacnt;
+    if( rtcppacket == NULL )
+        return;
+    rtcppacket->decode(datagram, (int)datacnt, clock.nsecsElapsed());
+    // the recordings line the audio up with the video by the sender reports
+    if( avformat )
+        for( int ii=0; ii<3; ii++ )
+        {
+            qint64 ms = rtcppacket->wallclock(ii, rtcppacket->srrtp[ii]);
+            if( ms )
+                avformat->setWallclock( ( rtcppacket->payload[ii] == PAYLOAD_PCMU || rtcppacket->payload[ii] == PAYLOAD_PCMA ) ?
+                                        STREAMS_AUDIO : STREAMS_VIDEO, rtcppacket->srrtp[ii], ms );
+        }
+}
+
+// note the arrival time of an RTP packet for the jitter calculation,
+// this must be called as packets arrive, before they are reordered
+void RtpSocket::arrival(const char *datagram, qint64 datacnt)
+{
+    metrics.rtpPackets.add();
+    metrics.rtpBytes.add(datacnt);
+    if( rtcppacket == NULL || datacnt <= 12 )
+        return;
+    const unsigned char *h = (const unsigned char*)datagram;
+    quint32 tstamp = ((quint32)h[4]<<24) | ((quint32)h[5]<<16) | ((quint32)h[6]<<8) | h[7];
+    quint32 ss = ((quint32)h[8]<<24) | ((quint32)h[9]<<16) | ((quint32)h[10]<<8) | h[11];
+    rtcppacket->arrival(ss, h[1] & 0x7f, tstamp, clock.nsecsElapsed());
+
+    // video frames are traced from their first packet, before reordering
+    if( Trace::enabled() && ((h[1] & 0x7f) == 26 || (h[1] & 0x7f) == mediaformat) )
+    {
+        if( tstamp != tracetstamp )
+        {
+            Trace::record(TRACE_FIRST_PACKET, tstamp);
+            tracetstamp = tstamp;
+        }
+        if( h[1] & 0x80 )
+            Trace::record(TRACE_MARKER, tstamp);
+    }
+}
+
+QByteArray RtpSocket::rtcpReport()
+{
+    if( rtcppacket == NULL )
+        return QByteArray();
+    return rtcppacket->packetRR(clock.nsecsElapsed())+rtcppacket->packetCNAME();
 }
 
 bool even = true;
@@ -247,13 +547,91 @@ void RtpSocket::readPendingDatagrams()
         if( ipdatagram )
         {
             qint64 datacnt = readDatagram(ipdatagram, (qint64)ipsz, &sender, &senderPort);
-            decodeDatagrams(ipdatagram,datacnt);
+            receive(ipdatagram, datacnt);
         }
         if( !hasPendingDatagrams() )
                 return;
     }
 }
 
+// a datagram as it is received over UDP
+void RtpSocket::receive(const char *datagram, qint64 datacnt)
+{
+    if( datacnt > 12 )
+    {
+        arrival(datagram, datacnt);
+
+        // hold the packet until it can be released in sequence order
+        quint32 ss = ( ( ( (quint8)datagram[8])*256 + (quint8)datagram[9] )*256+
+                     (quint8)datagram[10] )*256 + (quint8)datagram[11];
+        RtpReorderBuffer *rb = reorder.value(ss);
+        if( rb == NULL && reorder.count() < 3 )
+        {
+            QDEBUG << "reorder buffer for SSRC" << ss;
+            rb = new RtpReorderBuffer();
+            reorder.insert(ss, rb);
+        }
+        if( rb )
+            rb->insert(datagram, (int)datacnt, clock.elapsed());
+        else
+            decodeDatagrams(datagram,datacnt);
+    } else
+        decodeDatagrams(datagram,datacnt);
+    flushReorder();
+}
+
+// pass on packets that are in sequence, or have waited long enough
+void RtpSocket::flushReorder()
+{
+    bool holding = false;
+    foreach( RtpReorderBuffer *rb, reorder )
+    {
+        int size = 0;
+        const char *packet;
+        while( (packet = rb->next(size, clock.elapsed())) != NULL )
+            decodeDatagrams(packet, size);
+        if( rb->holding() )
+            holding = true;
+    }
+    if( holding && !reordertimer->isActive() )
+        reordertimer->start(RTP_REORDER_LATENCY);
+}
+
+QString RtpSocket::strStatus()
+{
+    QString qs;
+    for( int ii=0; rtcppacket && ii<3; ii++ )
+    {
+        if( rtcppacket->ssrc[ii] == 0 )
+            continue;
+        QString qsrtt = rtcppacket->rtt[ii] < 0 ? QString("n/a") : QString("%1 ms").arg(rtcppacket->rtt[ii]);
+        qs += QString("SSRC %1 [%2]: received %3 lost %4 jitter %5 ms rtt %6%7<br/>")
+                .arg(rtcppacket->ssrc[ii],8,16,QChar('0'))
+                .arg((int)rtcppacket->payload[ii])
+                .arg(rtcppacket->received[ii])
+                .arg(rtcppacket->cumulativeLost(ii))
+                .arg(rtcppacket->jitterMs(ii),0,'f',1)
+                .arg(qsrtt)
+                .arg(rtcppacket->lsr[ii] ? " (SR)" : "");
+    }
+    QMap<quint32,RtpReorderBuffer*>::const_iterator it;
+    for( it = reorder.constBegin(); it != reorder.constEnd(); ++it )
+    {
+        RtpReorderBuffer *rb = it.value();
+        qs += QString("SSRC %1: reordered %2 (depth %3) late drops %4 skipped %5 jump drops %6 added latency %7 ms (max %8 ms)<br/>")
+                .arg(it.key(),8,16,QChar('0'))
+                .arg(rb->reordered()).arg(rb->depth()).arg(rb->lateDrops()).arg(rb->skipped())
+                .arg(rb->jumpDrops()).arg(rb->latency()).arg(rb->maxLatency());
+    }
+    if( motiongrid.isReady() )
+    {
+        qs += QString("Motion grid %1x%2: %3 cells with motion, cells %4, zones [%5]<br/>scores %6<br/>")
+                .arg(motiongrid.cols()).arg(motiongrid.rows()).arg(motiongrid.moving())
+                .arg(motiongrid.bitmap()).arg(motiongrid.zonesMoving()).arg(motiongrid.scores());
+    }
+    return qs;
+}
+
 // interpret the data stream
 void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
 {
@@ -305,10 +683,16 @@ void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
         bool validpacket = false;
         switch( pload )
         {
-        case 0: // pcm G.711 ulaw
+        case PAYLOAD_PCMU: // pcm G.711 ulaw
+        case PAYLOAD_PCMA: // pcm G.711 alaw
 // if( marker ) QDEBUG << "G.711" << seq << " " << marker;
             if( pcmaudio==NULL )
+            {
                 pcmaudio = new pcmAudio(this);
+                pcmaudio->setPayload(pload);
+                if( avformat )
+                    avformat->setAudioPayload(pload);
+            }
             validpacket = true;
             break;
 
@@ -318,10 +702,8 @@ void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
                     jpegvideo = new jpegVideo();
                 // parse RTP header for JPEG image
                 int count = jpegvideo->parseRtpHeader(data, datacnt);
-                if( count == 0 )
-                {
-                    message.clear();
-                } else
+                // a bad packet is dropped and the frame is left with a gap
+                if( count > 0 )
                 {
                     data += count;
                     datacnt -= count;
@@ -338,27 +720,13 @@ void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
 					// QDEBUG << "H.264 payload" << pload;
 					if( h264video==NULL )
 					{
-						h264video = new h264Video( /*sps.constData(),sps.count(),pps.constData(),pps.count()*/);
+						h264video = new h264Video(hevc);
 						Q_ASSERT(h264video);
-			            if( h264video->extractFrame(sps.constData(), sps.count() )  )
-			            {
-							if( avformat )
-							{
-								avformat->setImageSize(h264video->width(),h264video->height());
-								avformat->recordFrame((const unsigned char*)h264video->frame(), h264video->size(), STREAMS_VIDEO );
-							}
-			            	h264video->writeFrame(  (const char*)h264video->frame(),h264video->size() ) ;
-						}
-			            if( h264video->extractFrame(pps.constData(), pps.count() )  )
-			            {
-							if( avformat  )
-							{
-								avformat->setImageSize(h264video->width(),h264video->height());
-								avformat->recordFrame((const unsigned char*)h264video->frame(), h264video->size(), STREAMS_VIDEO );
-							}
-
-			            	h264video->writeFrame(  (const char*)h264video->frame(),h264video->size() ) ;
-						}
+						// the parameter sets from the sdp go out with each key frame
+						h264video->setPacketization(packetization, interleavedepth);
+						// live output is repackaged from the same access units we record
+						if( nhls > 0 && hlssegmenter==NULL )
+							hlssegmenter = new HlsSegmenter(nhls, hevc);
 					}
 					validpacket = true;
 				}
@@ -376,28 +744,40 @@ void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
                 if( rtcppacket->ssrc[ii] == 0 || rtcppacket->ssrc[ii] == ss )
                 {
                     if( rtcppacket->ssrc[ii] == 0 )
-                    {
                         rtcppacket->ssrc[ii] = ss;
-                        QDEBUG << "SSRC[" << ii << "]==>" << rtcppacket->ssrc[ii];
-                    }
                     rtcppacket->timestamp[ii] = tstamp;
                     rtcppacket->payload[ii] = pload;
+                    if( validpacket && rtcppacket->received[ii] == 0 )
+                    {
+                        // the first packet starts the count, with no wrap (RFC 3550 A.1)
+                        rtcppacket->sequence[ii] = seq;
+                        rtcppacket->base_sequence[ii] = seq;
+                        rtcppacket->expected[ii]++;
+                        rtcppacket->received[ii]++;
+                        QDEBUG << "SSRC[" << ii << "]==>" << rtcppacket->ssrc[ii] << "first sequence" << seq;
+                        break;
+                    }
                     // check that seq is incrementing,
-                    // handle the case of wrap around
-                    qint32 diff = seq - rtcppacket->sequence[ii];
-                    if( validpacket && (diff > 0 || diff <= -65535) )
+                    // modulo 2^16 to handle the case of wrap around
+                    qint16 diff = (qint16)(quint16)(seq - (quint16)rtcppacket->sequence[ii]);
+                    if( validpacket && diff > 0 )
                     {
+                        if( seq < rtcppacket->sequence[ii] )
+                            rtcppacket->cycles[ii] += 0x10000;
                         rtcppacket->sequence[ii] = seq;
-                        if( diff > 0 )
-                            rtcppacket->expected[ii] += diff;
+                        rtcppacket->expected[ii] += diff;
+                        rtcppacket->received[ii]++;
                         if( diff > 1 )
 						{
-							if( pload == 26 ) jpegvideo->setSequence(-1);
+							// JPEG frames find their own gaps
+							if( pload == mediaformat && h264video ) h264video->packetLost();
                             rtcppacket->lost[ii] = rtcppacket->lost[ii] + diff - 1;
+                            metrics.rtpLost.add(diff - 1);
 						}
                     } else
                     {
                         if( rtcppacket->bad_sequence[ii] < 0xFFFF ) rtcppacket->bad_sequence[ii]++;
+                        metrics.rtpOutOfOrder.add();
                         // drop out of sequence packets
                         // QDEBUG << "packet dropped: " << seq;
                         return;
@@ -405,25 +785,24 @@ void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
                     // break as we have found the record to populate
                     break;
                 }
-/* todo: detect missing packets in a frame and then tag the frame to be 
- *       discarded until the next start of frame.
- *       The marker is true for the last packet in a frame.
+/* missing packets are found by the depacketizers: a JPEG frame is
+ *       concealed or dropped at its marker, the last packet in a frame,
+ *       and H.264 waits for the next IDR picture.
  */
 
         //
         // marker is suggested for start of valid video and audio after silence
         // but it should be decoded anyway
-        if( pload == 26 )
+        if( pload == 26 && validpacket )
         {
-        	if( jpegvideo->isSequence() )
-			{
-                message += QByteArray(data, datacnt);
-				jpegvideo->incSequence();
-			}
+            // written straight into the frame buffer
+            jpegvideo->addFragment(data, datacnt, tstamp);
             if( marker )
             {
-                if( jpegvideo->isSequence() && jpegvideo->rtpToJfif(message) )
+                if( jpegvideo->rtpToJfif() )
                 {
+                    metrics.frames.add();
+                    TRACE(TRACE_DEPACKETIZED, tstamp);
                     int newsize = jpegvideo->count();
                     // try and eliminate corrupted packets
                     if( newsize < packetSize + 512 && newsize > packetSize - 512 )
@@ -431,69 +810,62 @@ void RtpSocket::decodeDatagrams(const char *datagram, qint64 datacnt)
                         if( avformat )
                         {
                             avformat->setImageSize(jpegvideo->width(),jpegvideo->height());
-                            avformat->recordFrame(jpegvideo->jfif(), newsize, STREAMS_VIDEO );
+                            avformat->recordFrame(jpegvideo->jfif(), newsize, STREAMS_VIDEO, tstamp );
                             ((RtspSocket*)parent())->updateRtpCounter();
                         }
 //                        if( even )
-                            displayImage(jpegvideo->jfif(), newsize, jpegvideo->width(), jpegvideo->height() );
+                            displayImage(jpegvideo->jfif(), newsize, jpegvideo->width(), jpegvideo->height(), tstamp );
 //                        even = !even ;
                     }
                     packetSize = newsize;
                 }
-				jpegvideo->setSequence(0);
-                message.clear();
             }
         }
         else
-        // handle h264 packet
+        // handle h264 or h265 packet
         if( pload == mediaformat )
         {
 
-        	// extractFrame returns true when frame has been fully captured
-            if( h264video->extractFrame(data, datacnt )  )
+            h264video->depacketize(data, datacnt, tstamp, marker);
+
+            // the live output and the decoder read each access unit,
+            // then the recorder takes it without a copy; key frames carry
+            // the parameter sets, so a new recording can start at any of them
+            AccessUnit *au;
+            while( (au = h264video->takeAccessUnit()) != NULL )
             {
-            	int ret = 0;
-				if( avformat  && datacnt )
-				{
-            		//avformat->setImageSize(h264video->width(),h264video->height());
-					ret = avformat->recordFrame((const unsigned char*)h264video->frame(), h264video->size(), STREAMS_VIDEO );
-				}
-            	if( h264video->writeFrame(  (const char*)h264video->frame(),h264video->size() ) )
-            	{
-					if( h264video->gotImage() ) {
-                        displayImage(h264video->imageRGB(), h264video->imageSize(), h264video->imageWidth(), h264video->imageHeight() );
-					}
-            	}
-
-            	// repeat the sps and pps when we switch buffers
-            	if( ret == 0 )
-            	{
-            		h264video->resetSync();
-		            if( h264video->extractFrame(sps.constData(), sps.count() )  )
-		            {
-						if( avformat )
-						{
-							avformat->recordFrame((const unsigned char*)h264video->frame(), h264video->size(), STREAMS_VIDEO );
-						}
-					}
-		            if( h264video->extractFrame(pps.constData(), pps.count() )  )
-		            {
-						if( avformat  )
-						{
-							avformat->recordFrame((const unsigned char*)h264video->frame(), h264video->size(), STREAMS_VIDEO );
-						}
-					}
-            	}
-				((RtspSocket*)parent())->updateRtpCounter();
-			}
-         }
+                quint32 autime = au->tstamp;
+                metrics.frames.add();
+                TRACE(TRACE_DEPACKETIZED, autime);
+                if( hlssegmenter )
+                    hlssegmenter->addAccessUnit(au->data(), au->size(), autime );
+                qint64 start = Metrics::now();
+                // with the motion vectors, a picture is only converted for the
+                // next analysis, which makes the thumbnail from it, so the
+                // display is refreshed at that rate
+                bool convert = !h264video->exportsVectors() || lastdecode < QDateTime::currentDateTime();
+                bool decoded = h264video->writeFrame( (const char*)au->data(), au->size(), convert );
+                if( decoded && h264video->hasVectors() )
+                    motiongrid.addVectors( h264video->vectors(), h264video->pictureWidth(), h264video->pictureHeight() );
+                if( decoded && convert && h264video->gotImage() )
+                {
+                    metrics.decodeTime.observe(Metrics::now() - start);
+                    displayImage(h264video->imageRGB(), h264video->imageSize(), h264video->imageWidth(), h264video->imageHeight(), autime );
+                }
+                if( avformat )
+                    avformat->recordAccessUnit(au);
+                else
+                    accessunits.release(au);
+                ((RtspSocket*)parent())->updateRtpCounter();
+            }
+        }
         else
-        if( pload == 0 )
+        if( pload == PAYLOAD_PCMU || pload == PAYLOAD_PCMA )
         {
                 message += QByteArray( data, datacnt );
             // todo
             // play the audio message
-            pcmaudio->setData(message, avformat);
+            pcmaudio->setData(message, avformat, tstamp);
             ((RtspSocket*)parent())->updateRtpCounter();
             message.clear();
         }
@@ -517,18 +889,14 @@ void RtpSocket::sendRtcp(QHostAddress host, int port)
   {
       // don't send rtcp with tcp streaming
       if( !usetcp && rtcpSocket)
-          rtcpSocket->writeDatagram ( rtcppacket->packetRR()+rtcppacket->packetCNAME(), host, port );
+          rtcpSocket->writeDatagram ( rtcpReport(), host, port );
   }
 }
 
 
 int cntr=0;
 #ifndef _WIN32
-AnalyzeJpeg rawimage1;
-AnalyzeJpeg rawimage2;
-
-int backgroundnoise = 0;
-int steadystate = 0;
+AnalyzeJpeg rawimage;
 #endif
 
 
@@ -542,101 +910,33 @@ int steadystate = 0;
 int RtpSocket::detectMotion(const unsigned char *data, unsigned int size, bool isJpeg, int w, int h, int bpp )
 {
 	// motion detection not available for Windows
-	// decode the image and check for motion by comparing 2 images 1 sec apart
+	// decode the image and compare each block of the motion window with its background
 	if( lastdecode < QDateTime::currentDateTime() )
 	{
 		bool detected = 0;
+		// the motion vectors need no picture, the one displayed makes the thumbnail
+		bool vectors = !isJpeg && h264video && h264video->exportsVectors();
 
-		if( data && size )
+		if( vectors || ( data && size ) )
 		{
 #ifndef _WIN32
-			if( cntr %2 )
-			{
-				if( isJpeg ) {
-					rawimage2.analyze( data, size );
-				} else {
-					rawimage2.readBmp( data, size,w,h, bpp );
-				}
-
+			bool decoded;
+			if( vectors ) {
+				decoded = true;
 			} else
-			{
-				if( isJpeg ) {
-					rawimage1.analyze( data, size );
-				} else {
-					rawimage1.readBmp( data, size, w, h, bpp );
-				}
+			if( isJpeg ) {
+				decoded = rawimage.analyze( data, size );
+			} else {
+				decoded = rawimage.readBmp( data, size, w, h, bpp );
 			}
 
-			// QDEBUG << "i1:" << rawimage1.size() << "i2:" << rawimage2.size() << "mw" << mw << "mh" << mh ;
-
-			if( mw && mh && lastdecode.isValid() )
+			if( decoded && motiongrid.hasZones() )
 			{
-				int deviation = 0;
-				unsigned long bg = 0;
-
-				unsigned long max = rawimage1.size();
-				if( max > rawimage2.size() ) max = rawimage2.size();
-				// QDEBUG << "image area=" << max << w << "x" << h;
-
-
-				// get pointers to the data
-				unsigned char* d1 = rawimage1.data();
-				unsigned char* d2 = rawimage2.data();
-
-				// get the size of the motion window in pixels
-				max = (mw*mh*max)/10000;
-
-				// find the pixel offsets from the y offset to the y+h offset
-				for( int yy=(my*rawimage1.h())/100; yy < ((my+mh)*rawimage1.h())/100; yy++ )
-				{
-					// find the starting pixel of the line from the x offset
-					int ls = yy*rawimage1.bytesPerLine()+(mx*rawimage1.w()*rawimage1.bytesPerPixel())/100 ;
-
-					// scan the line, one pixel at a time until the x+w offset
-					for( int xx=0; xx < (mw*rawimage1.w())/100; xx++ )
-					{
-						// take each pixel a byte at a time
-						for( int bb = 0; bb < rawimage1.bytesPerPixel(); bb++ )
-						{
-							// find the byte to compare
-							int ii=ls++;
-
-							// find the distance between the bytes
-							unsigned char diff = (d1[ii]>d2[ii])? d1[ii] - d2[ii] : d2[ii]-d1[ii];
-
-							if( cntr %2 ) {
-								d1[ii] = diff;
-							} else {
-								d2[ii] = diff; // (bb==0)?0:(bb==1)?0:(bb==2)?0:0; //diff; //
-							}
-
-							bg += diff;
-							// sensitivity is the amount each pixel must change to be registered
-							// hence the higher the number the less sensitive is the detection
-							if( diff > ((100-sensitivity)*255)/100 + backgroundnoise )
-								deviation++;
-						}
-					}
-				}
-				// for debugging
-				if( debugsetting > 1 )
-				{
-					// write out bmp image
-					if( cntr%2 ) {
-						rawimage2.writeBmp( QString("/tmp/img%1-2.bmp").arg(cntr).toLatin1()  );
-					} else {
-						rawimage1.writeBmp( QString("/tmp/img%1-1.bmp").arg(cntr).toLatin1()  );
-					}
-				}
-				// calculate threshold as a percentage of the image area (x * y)
-				int thres = (max * threshold * threshold)/1000000;
-				// record the average background noise
-				backgroundnoise = (backgroundnoise + bg/max)/2;
-				QDEBUG << "last=" << lastdecode << " deviation=" << deviation << " thres=" << thres << " steady=" << steadystate << " sens=" << (sensitivity*255)/100 << " noise=" << backgroundnoise ;
-				if( deviation > thres + steadystate )
+				if( vectors ? motiongrid.analyzeVectors()
+							: motiongrid.analyze( rawimage.data(), rawimage.w(), rawimage.h(), rawimage.w()*rawimage.bytesPerPixel(), rawimage.bytesPerPixel() ) )
 				{
 					// motion detected
-					QDEBUG << "MOTION DETECTED";
+					QDEBUG << "MOTION DETECTED" << "zones" << motiongrid.zonesMoving() << motiongrid.moving() << "cells" << motiongrid.bitmap();
 					recordschedule.setMotion();  //todo
 
 					detected = 1;
@@ -646,6 +946,9 @@ int RtpSocket::detectMotion(const unsigned char *data, unsigned int size, bool i
 						vchannel->statusBar()->showMessage( QString(STR_MOTION " on %1").arg(qscname) );
 
 						QString qs = QString("<" STR_EVENT ">" STR_MOTION " on %1 </" STR_EVENT ">").arg(qscname);
+						qs += QString("<" STR_MOTION_GRID " zones='%1' cols='%2' rows='%3' cells='%4' scores='%5'/>")
+								.arg(motiongrid.zonesMoving()).arg(motiongrid.cols()).arg(motiongrid.rows())
+								.arg(motiongrid.bitmap()).arg(motiongrid.scores());
 						vchannel->sendEventMessage(qs);
 						if( debugsetting > 1 )
 						{
@@ -661,29 +964,30 @@ int RtpSocket::detectMotion(const unsigned char *data, unsigned int size, bool i
 						}
 					}
 				}
-				steadystate = (steadystate + deviation)/2;
+				// for debugging
+				if( debugsetting > 1 && !vectors )
+				{
+					// write out bmp image
+					rawimage.writeBmp( QString("/tmp/img%1.bmp").arg(cntr).toLatin1()  );
+				}
+				metrics.motionCells.set(motiongrid.moving());
 			}
 
-			if( cntr%2 )
+			if( vectors )
 			{
-				if( rawimage2.writeJpeg() )
-				{
-					thumb_data = (const char*)rawimage2.jpg();
-					thumb_sz = rawimage2.jpgSize();
-				}
+				QBuffer buffer(&thumbnail);
+				buffer.open(QIODevice::WriteOnly);
+				qimg.scaledToHeight(240).save(&buffer, "JPG");
 			} else
+			if( decoded && rawimage.writeJpeg() )
 			{
-				if( rawimage1.writeJpeg() )
-				{
-					thumb_data = (const char*)rawimage1.jpg();
-					thumb_sz = rawimage1.jpgSize();
-				}
+				thumbnail = QByteArray((const char*)rawimage.jpg(), rawimage.jpgSize());
 			}
 
 			++cntr;
 			if( cntr >= 24 ) cntr = 0;
-		}
 #endif
+		}
 
 		lastdecode = QDateTime::currentDateTime().addMSecs(500);
 
@@ -692,10 +996,8 @@ int RtpSocket::detectMotion(const unsigned char *data, unsigned int size, bool i
 	return -1;
 }
 
-void RtpSocket::displayImage(const unsigned char * data, int size, int w, int h)
+void RtpSocket::displayImage(const unsigned char * data, int size, int w, int h, quint32 tstamp)
 {
-    if( label == NULL ) return;
-
     bool isJpeg = false;
 
     // check for JFIF image
@@ -705,12 +1007,35 @@ void RtpSocket::displayImage(const unsigned char * data, int size, int w, int h)
     	isJpeg = true;
     }
 
+    // the frame posted for the other consumers, filled in as it is decoded
+    MediaFrame *mf = new MediaFrame;
+    mf->tstamp = tstamp;
+    if( isJpeg )
+        mf->jpeg = QByteArray((const char*)data, size);
+
+    if( label == NULL && !headless )
+    {
+        mf->thumbnail = thumbnail;
+        framemailbox.post(mf);
+        return;
+    }
+
 	if( isJpeg )
 	{
-		if( !qimg.loadFromData((const uchar*)data, size) )
+		qint64 start = Metrics::now();
+		bool decoded = qimg.loadFromData((const uchar*)data, size);
+		metrics.decodeTime.observe(Metrics::now() - start);
+		if( !decoded )
+		{
+			mf->thumbnail = thumbnail;
+			framemailbox.post(mf);
 			return;
+		}
+		TRACE(TRACE_DECODED, tstamp);
 	} else
 	{
+		// decoded by the caller
+		TRACE(TRACE_DECODED, tstamp);
 		// convert the imagedata to a QImage
 		uint8_t *src = (uint8_t *)data;
 
@@ -729,16 +1054,32 @@ void RtpSocket::displayImage(const unsigned char * data, int size, int w, int h)
 
 	// motion detection is not available for Windows
 	// decode the image and check for motion by comparing 2 images 1 sec apart
+	// only the frames that are analysed are timed
+	qint64 start = Metrics::now();
+	int motion;
 	if( isJpeg ) {
-		if( detectMotion(data, size, true, w, h, 0 ) == 1 ) {
-			recordschedule.setMotion();
-		}
+		motion = detectMotion(data, size, true, w, h, 0 );
+	} else
+	if( h264video && h264video->exportsVectors() ) {
+		motion = detectMotion(NULL, 0, false );
 	} else {
 		QImage image = qimg.convertToFormat(QImage::Format_RGB888).scaledToHeight(240);
-		if( detectMotion(image.constBits(), image.byteCount (), false, image.width(), image.height(), image.bitPlaneCount() ) == 1 ) {
-			recordschedule.setMotion();
-		}
+		motion = detectMotion(image.constBits(), image.byteCount (), false, image.width(), image.height(), image.bitPlaneCount() );
+	}
+	if( motion >= 0 )
+	{
+		metrics.motionTime.observe(Metrics::now() - start);
+		TRACE(TRACE_ANALYSED, tstamp);
+	}
+	if( motion == 1 ) {
+		recordschedule.setMotion();
 	}
+	// qimg is replaced, not modified, for the next frame so the copy stays valid
+	mf->image = qimg;
+	mf->thumbnail = thumbnail;
+	framemailbox.post(mf);
+	if( label == NULL )
+		return;
 
 #ifdef _WIN32
 	QPixmap pixmap = QPixmap::fromImage(qimg);
@@ -754,6 +1095,7 @@ void RtpSocket::displayImage(const unsigned char * data, int size, int w, int h)
 			if( label->width() < w-16 )
 				pixmap = pixmap.scaledToWidth(label->width());
 			label->setPixmap(pixmap);
+			TRACE(TRACE_DISPLAYED, tstamp);
 		}
 	}
 #else
@@ -767,6 +1109,7 @@ void RtpSocket::displayImage(const unsigned char * data, int size, int w, int h)
 				pixmap = pixmap.scaledToWidth(label->width());
 
 			label->setPixmap(pixmap);
+			TRACE(TRACE_DISPLAYED, tstamp);
 		}
 	}
 #endif
@@ -25,6 +25,9 @@
 
 #include <QUdpSocket>
 #include <QLabel>
+#include <QMap>
+#include <QTimer>
+#include <QElapsedTimer>
 
 #include "../include/common.h"
 #include "jpegvideo.h"
@@ -33,6 +36,10 @@
 #include "avformat.h"
 #include "aviformat.h"
 #include "rtspsocket.h"
+#include "hlssegmenter.h"
+#include "rtpreorder.h"
+#include "framemailbox.h"
+#include "motiongrid.h"
 
 
 // class for creating RTCP packets
@@ -41,8 +48,14 @@ class RtcpPacket
 public:
     RtcpPacket(quint32 s, QString cn);
     QByteArray packetCNAME() { return cname; }
-    QByteArray packetRR() ;
+    QByteArray packetRR(qint64 now) ;
 //    QByteArray packetBYE();
+    int  index(quint32 ss);
+    void arrival(quint32 ss, quint8 pt, quint32 tstamp, qint64 now);
+    void decode(const char *data, int size, qint64 now);
+    qint64 wallclock(int ii, quint32 tstamp);
+    quint32 cumulativeLost(int ii);
+    double jitterMs(int ii) { return clockrate[ii] ? (jitter[ii]*1000.0)/clockrate[ii] : 0.0; }
 
 private:
     QByteArray cname;
@@ -57,6 +70,22 @@ public:
     quint16 bad_sequence[3];
     quint32 lost[3];
     quint16 expected[3];
+
+    // cumulative receiver statistics (RFC 3550 A.3, A.8)
+    quint32 base_sequence[3];
+    quint32 cycles[3];
+    quint32 received[3];
+    quint32 clockrate[3];
+    double  jitter[3];          // in timestamp units
+    qint32  transit[3];
+    bool    hastransit[3];
+
+    // from the last sender report, 'now' times are in ns
+    quint32 lsr[3];             // middle 32 bits of the NTP timestamp
+    qint64  lsrtime[3];
+    quint64 srntp[3];
+    quint32 srrtp[3];
+    int     rtt[3];             // in ms, -1 if not known
 };
 
 // RTP class
@@ -68,32 +97,36 @@ public:
                        AvFormat *av=NULL);
     ~RtpSocket();
     bool init(int port);
+    void configure();
     void closeSocket();
     void setLabel(QLabel *l) { label = l;}
+    // decode and analyse frames without a label to display them
+    void setHeadless(bool h) { headless = h; }
     int detectMotion(const unsigned char *data, unsigned int size, bool isJpeg, int w=0, int h=0, int bpp=0 );
-    QImage & image() { return qimg; }
-    void displayImage(const unsigned char * imagedata, int size, int w, int h);
+    void displayImage(const unsigned char * imagedata, int size, int w, int h, quint32 tstamp=0);
     void sendRtcp(QHostAddress host,int port);
     void decodeDatagrams(const char *datagram, qint64 datacnt);
-#ifndef _WIN32
-    const char *thumb() { return thumb_data; }
-    int thumb_size() { return thumb_sz; }
-#else
-    const char *thumb() { return thumbnail.constData(); }
-    int thumb_size() { return thumbnail.length(); }
-#endif
+    void decodeRtcp(const char *datagram, qint64 datacnt);
+    void arrival(const char *datagram, qint64 datacnt);
+    void receive(const char *datagram, qint64 datacnt);
+    QByteArray rtcpReport();
+    HlsSegmenter *hls() { return hlssegmenter; }
+    QString strStatus();
 signals:
 
 public slots:
     void readPendingDatagrams();
     void readRTCPDatagrams();
+    void flushReorder();
 
 private:
     bool initialized;
+    bool headless;
     QLabel *label;
     jpegVideo *jpegvideo;
     h264Video *h264video;
     pcmAudio  *pcmaudio;
+    HlsSegmenter *hlssegmenter;
     RtcpPacket *rtcppacket;
     QByteArray message;
     int packetSize;
@@ -104,16 +137,22 @@ private:
     char* ipdatagram;
     int ipsz;
     int mediaformat;
+    bool hevc;               // H.265 rather than H.264
+    int packetization;       // H.264 packetization-mode
+    int interleavedepth;     // sprop-interleaving-depth
     SessionDescription *sdp;
+    quint32 tracetstamp;     // last video frame traced on arrival
 
 
-//#ifdef _WIN32
     QByteArray thumbnail;
-//#endif
-    const char *thumb_data;
-    int thumb_sz;
     QDateTime      lastdecode;
+    MotionGrid     motiongrid;
     QImage qimg;
+
+    // per SSRC reordering of UDP packets
+    QMap<quint32,RtpReorderBuffer*> reorder;
+    QElapsedTimer  clock;
+    QTimer        *reordertimer;
 };
 
 #endif // RTPSOCKET_H
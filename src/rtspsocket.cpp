@@ -49,7 +49,9 @@ RtspSocket::RtspSocket(QLabel *parent) :
     audioEnabled(false), tcpSocket(NULL),
     optDescribe(false), optSetup(false), optPlay(false),
     optPause(false),optRecord(false), optTeardown(false),
-    avformat(NULL),rtpVideo(NULL),rtpAudio(NULL),rtpcounter(0), restart(0)
+    avformat(NULL),rtpVideo(NULL),rtpAudio(NULL),
+    tcpbuf(NULL), tcpsize(0), tcphead(0), tcptail(0), chvideo(0), chaudio(2), resync(0),
+    rtpcounter(0), restart(0), keepalive(0)
 {
     tcpSocket = new QTcpSocket(this);
     if ( tcpSocket )
@@ -99,6 +101,8 @@ RtspSocket::~RtspSocket()
     }
     if( watchdog )
         watchdog->stop();
+    if( tcpbuf )
+        free( tcpbuf );
 }
 
 void RtspSocket::processTimeout()
@@ -110,9 +114,23 @@ void RtspSocket::processTimeout()
 
         rtpcounter = 0;
 
-        // don't send rtcp with tcp
-        // todo: revisit this later
-        if( !usetcp )
+        if( usetcp )
+        {
+            // receiver report on the video RTCP channel
+            if( rtpVideo && tcpSocket->state() == QAbstractSocket::ConnectedState )
+            {
+                QByteArray rtcp = rtpVideo->rtcpReport();
+                char frame[4] = { '$', (char)(chvideo+1), (char)(rtcp.length()/256), (char)(rtcp.length()&0xff) };
+                tcpSocket->write(frame, sizeof(frame));
+                tcpSocket->write(rtcp);
+            }
+            // keep the session alive, the reply is skipped by the interleaved parser
+            if( ++keepalive >= RTSP_KEEPALIVE_INTERVAL )
+            {
+                keepalive = 0;
+                sendKEEPALIVE();
+            }
+        } else
         {
             // send RTCP CNAME
             QDEBUG << "send RTCP";
@@ -280,7 +298,11 @@ bool RtspSocket::sendSETUP(SessionMedia *session, SessionMedia *media)
     qsRequest += "User-Agent: MyNetEye 1.0 (Live Streaming)\r\n";
 
     if( usetcp )
-        qsRequest += QString("Transport: %1/TCP;unicast;client_port=%2\r\n").arg(media->protocol()).arg(media->transport("client_port"));
+    {
+        // request channels 0-1 for video and 2-3 for audio
+        int ch = (media == sdp.audio()) ? 2 : 0;
+        qsRequest += QString("Transport: %1/TCP;unicast;interleaved=%2-%3\r\n").arg(media->protocol()).arg(ch).arg(ch+1);
+    }
     else
         qsRequest += QString("Transport: %1/UDP;unicast;client_port=%2\r\n").arg(media->protocol()).arg(media->transport("client_port"));
 
@@ -455,6 +477,20 @@ bool RtspSocket::sendERRORQUERY()
     return writeData();
 }
 
+bool RtspSocket::sendKEEPALIVE()
+{
+    QDEBUG << "sendKEEPALIVE (OPTIONS)"  << _url.host();
+
+    // OPTIONS with the session id refreshes the session timeout
+    qsRequest.clear();
+    qsRequest += QString("OPTIONS %1 RTSP/1.0\r\n").arg(_url.toString());
+    qsRequest += QString("CSeq: %1\r\n").arg(++cseq);
+    qsRequest += QString("Session: %1\r\n").arg(session_id);
+    qsRequest += "User-Agent: MyNetEye 1.0 (Live Streaming)\r\n";
+    qsRequest += "\r\n";
+    return writeData();
+}
+
 bool RtspSocket::interpretERRORQUERY( QList<QByteArray> & qbl )
 {
     QDEBUG << "interpretERRORQUERY" << _url.host();
@@ -508,6 +544,114 @@ bool RtspSocket::writeData()
     return false;
 }
 
+/*
+ * readInterleaved
+ * RTP/TCP data is framed as '$' <channel> <length:16> <packet> (RFC 2326 10.12),
+ * mixed with RTSP replies to our keepalives.
+ * Read everything available into the buffer and hand each complete
+ * packet to the RTP socket in place; partial frames stay for the next read.
+ */
+void RtspSocket::readInterleaved()
+{
+    if( tcpbuf == NULL )
+    {
+        tcpsize = RTSP_TCP_BUFFER_SIZE;
+        tcpbuf = (char*)malloc(tcpsize);
+        tcphead = tcptail = 0;
+        if( tcpbuf == NULL ) return;
+    }
+
+    while( tcpSocket->bytesAvailable() > 0 )
+    {
+        // move the partial frame to the front to make room
+        if( tcptail == tcpsize && tcphead > 0 )
+        {
+            memmove(tcpbuf, tcpbuf+tcphead, tcptail-tcphead);
+            tcptail -= tcphead;
+            tcphead = 0;
+        }
+        qint64 count = tcpSocket->read(tcpbuf+tcptail, tcpsize-tcptail);
+        if( count <= 0 )
+            break;
+        tcptail += (int)count;
+
+        while( tcphead < tcptail )
+        {
+            const unsigned char *p = (const unsigned char*)tcpbuf+tcphead;
+            int avail = tcptail-tcphead;
+
+            if( p[0] == '$' )
+            {
+                if( avail < 4 )
+                    break;
+                int channel = p[1];
+                int len = p[2]*256 + p[3];
+                // wait for the rest of the packet; a frame on a channel we
+                // did not set up is skipped whole, its payload is not a header
+                if( avail < 4+len )
+                    break;
+                if( channel == chvideo || channel == chvideo+1 ||
+                    channel == chaudio || channel == chaudio+1 )
+                    dispatchInterleaved(channel, (const char*)p+4, len);
+                else
+                    QDEBUG << "interleaved frame on channel" << channel << "skipped";
+                tcphead += 4+len;
+                continue;
+            } else
+            if( p[0] >= 'A' && p[0] <= 'Z' )
+            {
+                // RTSP reply (or server request), skip headers and body
+                QByteArray qba = QByteArray::fromRawData((const char*)p, avail);
+                int eoh = qba.indexOf("\r\n\r\n");
+                if( eoh == -1 && avail < 4096 )
+                    break;
+                if( eoh != -1 && ( qba.startsWith("RTSP/") || qba.left(eoh).contains("RTSP/1.0") ) )
+                {
+                    int len = 0;
+                    int pos = qba.left(eoh).indexOf("Content-Length:");
+                    if( pos != -1 )
+                    {
+                        pos += strlen("Content-Length:");
+                        len = qba.mid(pos, qba.indexOf('\r', pos)-pos).trimmed().toInt();
+                    }
+                    // a body too big for the buffer is dropped by the resync
+                    if( eoh+4+len > tcpsize )
+                        len = 0;
+                    if( avail < eoh+4+len )
+                        break;
+                    QDEBUG << "interleaved RTSP message:" << qba.left(qba.indexOf('\r'));
+                    tcphead += eoh+4+len;
+                    continue;
+                }
+            }
+
+            // not a frame we know, resync on the next '$'
+            const char *next = (const char*)memchr(p+1, '$', avail-1);
+            int skip = next ? (int)(next - (const char*)p) : avail;
+            resync += skip;
+            tcphead += skip;
+            QDEBUG << "interleaved resync: skipped" << skip << "bytes total=" << resync;
+        }
+        if( tcphead == tcptail )
+            tcphead = tcptail = 0;
+    }
+}
+
+void RtspSocket::dispatchInterleaved(int channel, const char *data, int len)
+{
+    if( rtpVideo == NULL || len <= 0 )
+        return;
+
+    // a single RtpSocket handles both streams over tcp
+    if( channel == chvideo || channel == chaudio )
+    {
+        rtpVideo->arrival(data, len);
+        rtpVideo->decodeDatagrams(data, len);
+    }
+    else
+        rtpVideo->decodeRtcp(data, len);
+}
+
 
 // SLOTS
 void RtspSocket::slotConnected()
@@ -565,23 +709,17 @@ void RtspSocket::slotReadyRead()
 
     // QString address = tcpSocket->peerAddress().toString();
 
+    // interleaved video/audio
+    if( state == statePlaying )
+    {
+        readInterleaved();
+        return;
+    }
+
     // see whether this is a continuation packet
     if( content_len == 0)
     {
-        if( state == statePlaying )
-        {
-            qsResponse = tcpSocket->read(4);
-            // interleaved video/audio
-            if( qsResponse[0] == (char)0x24 /* && qsResponse[1] == (char)0x00 */)
-            {
-                content_len = (unsigned char)qsResponse[2] * 256 + (unsigned char)qsResponse[3];
-                if( content_len > (int)tcpSocket->bytesAvailable() )
-                    return;
-                qsResponse = tcpSocket->read(content_len);
-                content_len = 0;
-            }
-        } else
-            qsResponse = tcpSocket->readAll();
+        qsResponse = tcpSocket->readAll();
     } else
     {
         if( content_len > (int)tcpSocket->bytesAvailable() )
@@ -680,9 +818,7 @@ void RtspSocket::slotReadyRead()
         case statePlay:          ret = interpretPLAY(qbl);                  break;
         case stateEnd:           ret = interpretTEARDOWN(qbl);              break;
         case stateError:         ret = interpretERRORQUERY(qbl);            break;
-        case statePlaying:       if( rtpVideo )
-                                    rtpVideo->decodeDatagrams(qsResponse.constData(), qsResponse.length());
-                                 return;
+        case statePlaying:       return;
         case statePause:
         case stateRecord:
         default:
@@ -750,6 +886,8 @@ void RtspSocket::slotStateMachine()
     case statePlay:
         startRtp();
         Q_ASSERT(rtpVideo);
+        tcphead = tcptail = 0;
+        keepalive = 0;
         state=statePlaying;
         if( vchannel )
         {
@@ -889,12 +1027,12 @@ bool RtspSocket::startRtp()
 			avformat = new AvFormat(channel0, channel1);
 			break;
 		default:
-			// h264
+			// h264, or h265 when the rtpmap says so
 			if( sdp.video()->mediaformat() >=96 && sdp.video()->mediaformat() < 128 )
 			{
 				// create the recording channels needed by avformat, depending on the compression
-				channel0 =  (ChannelFormat*)( new Mp4ChannelFormat());
-				channel1 = (ChannelFormat*)  (new Mp4ChannelFormat());
+				channel0 =  (ChannelFormat*)( new Mp4ChannelFormat(sdp.video()->isHevc()));
+				channel1 = (ChannelFormat*)  (new Mp4ChannelFormat(sdp.video()->isHevc()));
 				// create the class to manage these recording channels
 				avformat = new AvFormat(channel0, channel1);
 			} else {
@@ -943,6 +1081,13 @@ bool RtspSocket::startRtp()
         if( audioEnabled )
             if( stream == STREAMS_VIDEO )
                 stream = STREAMS_AV;
+
+        // use the channels the server gave us, if any
+        QString qs = sdp.video()->transport("interleaved");
+        chvideo = qs.isEmpty() ? 0 : qs.left(qs.indexOf('-')).toInt();
+        qs = sdp.audio()->transport("interleaved");
+        chaudio = qs.isEmpty() ? 2 : qs.left(qs.indexOf('-')).toInt();
+        QDEBUG << "interleaved channels video=" << chvideo << "audio=" << chaudio;
     }
 
     if( avformat )
@@ -950,6 +1095,12 @@ bool RtspSocket::startRtp()
     return true;
 }
 
+// the newest frame received, safe to hold from any thread
+MediaFramePtr RtspSocket::frame()
+{
+    return framemailbox.latest();
+}
+
 bool RtspSocket::stopRtp()
 {
     QDEBUG << "stopRtp";
@@ -966,6 +1117,8 @@ bool RtspSocket::stopRtp()
     {
        rtpAudio->closeSocket();
     }
+    // no snapshots once the stream has stopped
+    framemailbox.clear();
     if( avformat )
     {
         // this causes the data to be written to disk
@@ -29,6 +29,7 @@
 #include "sessiondescription.h"
 #include "avformat.h"
 #include "aviformat.h"
+#include "framemailbox.h"
 
 enum {
       stateInit=0,
@@ -69,6 +70,7 @@ public:
     bool sendRECORD();
     bool sendTEARDOWN();
     bool sendERRORQUERY();
+    bool sendKEEPALIVE();
     bool interpretOPTIONS( QList<QByteArray> & qbl );
     bool interpretDESCRIBE( QList<QByteArray> & qbl );
     bool interpretSETUP( QList<QByteArray> & qbl, SessionMedia *media );
@@ -80,9 +82,11 @@ public:
     bool startRtp();
     bool stopRtp();
     bool writeData();
+    void readInterleaved();
+    void dispatchInterleaved(int channel, const char *data, int len);
     const char * strState() { return strstate[state]; }
     bool isWatch() { if( watchdog && watchdog->isActive() ) return true; return false; }
-    const QByteArray *frame() { if(avformat) return avformat->frame(); return NULL; }
+    MediaFramePtr frame();
     RtpSocket *rtpSocket() { if(rtpVideo) return rtpVideo; return NULL; }
     SessionDescription * session() { return &sdp; }
 
@@ -133,10 +137,21 @@ private:
     RtpSocket *rtpVideo;
     RtpSocket *rtpAudio;
 
+    // interleaved RTP/TCP receive buffer
+    // packets are parsed in place and compacted to the front
+    char   *tcpbuf;
+    int     tcpsize;
+    int     tcphead;
+    int     tcptail;
+    int     chvideo;             // interleaved channel for video RTP, RTCP is +1
+    int     chaudio;             // interleaved channel for audio RTP, RTCP is +1
+    int     resync;              // bytes skipped looking for a '$' frame
+
     // timer
     QTimer *watchdog;
     int    rtpcounter;
     int restart;
+    int keepalive;
 };
 
 #endif // RTSPSOCKET_H
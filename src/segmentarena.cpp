@@ -0,0 +1,138 @@
+/**
+ * FILE:		segmentarena.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for holding the buffers of one recording segment
+ * in a few large chunks, released all at once
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/common.h"
+#include "segmentarena.h"
+#include "metrics.h"
+
+// every buffer starts on this boundary
+#define ARENA_ALIGN 4
+
+//
+// class SegmentArena
+//
+SegmentArena::SegmentArena() :
+    offset(0), total(0), inuse(0)
+{
+}
+
+SegmentArena::~SegmentArena()
+{
+    foreach( const Block &b, blocks )
+    {
+        free(b.base);
+        metrics.arenaBytes.add(-b.size);
+        metrics.arenaChunks.add(-1);
+    }
+}
+
+void SegmentArena::addBlock(int size)
+{
+    Block b;
+    b.base = (char*)malloc(size);
+    b.size = size;
+    if( b.base == NULL )
+    {
+        QDEBUG << "unable to allocate" << size << "bytes";
+        return;
+    }
+    // a frame of its own goes in front of the chunk being filled,
+    // so the rest of that chunk is still used
+    if( size > SEGMENT_ARENA_CHUNK && !blocks.isEmpty() )
+        blocks.insert(blocks.count()-1, b);
+    else
+    {
+        blocks.append(b);
+        offset = 0;
+    }
+    total += size;
+    metrics.arenaBytes.add(size);
+    metrics.arenaChunks.add(1);
+}
+
+// NULL when the memory has run out
+char *SegmentArena::allocate(int size)
+{
+    if( blocks.isEmpty() )
+        addBlock(SEGMENT_ARENA_CHUNK);
+    if( blocks.isEmpty() )
+        return NULL;
+
+    if( size > SEGMENT_ARENA_CHUNK )
+    {
+        int count = blocks.count();
+        addBlock(size);
+        if( blocks.count() == count )
+            return NULL;
+        return blocks.at(blocks.count()-2).base;
+    }
+
+    if( offset + size > blocks.last().size )
+    {
+        int count = blocks.count();
+        addBlock(SEGMENT_ARENA_CHUNK);
+        if( blocks.count() == count )
+            return NULL;
+    }
+    char *p = blocks.last().base + offset;
+    offset += ( size + ARENA_ALIGN-1 ) & ~(ARENA_ALIGN-1);
+    return p;
+}
+
+ArenaBuffer SegmentArena::copy(const void *data, int size, int align)
+{
+    int padded = align > 1 ? ( ( size + align-1 ) / align ) * align : size;
+    char *p = allocate(padded);
+    if( p == NULL )
+        return ArenaBuffer();
+    memcpy(p, data, size);
+    memset(p + size, 0, padded - size);
+    inuse += padded;
+    metrics.arenaAllocations.add();
+    return ArenaBuffer(p, padded);
+}
+
+// every buffer is released; one chunk is kept for the next segment
+void SegmentArena::reset()
+{
+    bool kept = false;
+    for( int ii=blocks.count()-1; ii>=0; ii-- )
+    {
+        const Block &b = blocks.at(ii);
+        if( !kept && b.size == SEGMENT_ARENA_CHUNK )
+        {
+            kept = true;
+            continue;
+        }
+        free(b.base);
+        total -= b.size;
+        metrics.arenaBytes.add(-b.size);
+        metrics.arenaChunks.add(-1);
+        blocks.removeAt(ii);
+    }
+    offset = 0;
+    inuse = 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * FILE:		segmentarena.h
+ *
+ * DESCRIPTION:
+ * This is the class for holding the buffers of one recording segment
+ * in a few large chunks, released all at once
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef SEGMENTARENA_H
+#define SEGMENTARENA_H
+
+#include <QtGlobal>
+#include <QList>
+
+// a buffer in the arena, valid until the arena is reset
+class ArenaBuffer
+{
+public:
+    ArenaBuffer() : data(NULL), size(0) {}
+    ArenaBuffer(char *d, int s) : data(d), size(s) {}
+    bool isNull() const { return data == NULL; }
+    char *data;
+    int size;
+};
+Q_DECLARE_TYPEINFO(ArenaBuffer, Q_PRIMITIVE_TYPE);
+
+/*
+ * SegmentArena
+ * the frames of a segment are copied one after the other into chunks of
+ * SEGMENT_ARENA_CHUNK bytes, a frame larger than that gets a chunk of its
+ * own. Nothing is freed on its own: when the segment is written or thrown
+ * away reset() gives back every chunk but one of SEGMENT_ARENA_CHUNK bytes,
+ * which is kept for the next segment, so a long running recorder does not
+ * leave the heap full of frame sized holes.
+ * Each buffer starts on a 4 byte boundary.
+ */
+class SegmentArena
+{
+public:
+    SegmentArena();
+    ~SegmentArena();
+
+    // a copy of the data, with zeros up to a multiple of 'align' bytes
+    // counted in its size
+    ArenaBuffer copy(const void *data, int size, int align = 1);
+    void reset();
+
+    int chunks() const { return blocks.count(); }
+    qint64 reserved() const { return total; }     // bytes of the chunks
+    qint64 used() const { return inuse; }         // bytes handed out, with the padding
+
+private:
+    char *allocate(int size);
+    void addBlock(int size);
+
+    class Block
+    {
+    public:
+        char *base;
+        int size;
+    };
+    QList<Block> blocks;
+    int offset;                // next free byte in the last block
+    qint64 total;
+    qint64 inuse;
+    Q_DISABLE_COPY(SegmentArena)
+};
+
+#endif // SEGMENTARENA_H
@@ -107,6 +107,19 @@ void SessionMedia::setAttribute(QByteArray a)
     }
 }
 
+// the encoding name from the rtpmap of the media format, e.g. H264
+QString SessionMedia::encoding()
+{
+    return rtpmap.value(format).section('/', 0, 0).trimmed().toUpper();
+}
+
+// dynamic payload types are H.264 unless the rtpmap says H.265
+bool SessionMedia::isHevc()
+{
+    QString name = encoding();
+    return name == "H265" || name == "HEVC";
+}
+
 void SessionMedia::setTransport(QByteArray t)
 {
     QDEBUG << "setTransport " << t;
@@ -39,6 +39,8 @@ public:
     QString protocol() { return qsProtocol; }
     QString transport(QString key){ return qmTransport.value(key); }
     int mediaformat() { return format; }
+    QString encoding();
+    bool isHevc();
     QByteArray fmtp(QString key){ return qmFmtp.value(key); }
 
 private:
@@ -0,0 +1,205 @@
+/**
+ * FILE:		trace.cpp
+ *
+ * DESCRIPTION:
+ * This is the class for tracing each frame through the pipeline,
+ * dumped in the Chrome trace event format
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#include <QCoreApplication>
+#include <QThread>
+#include <QThreadStorage>
+#include <QMutex>
+#include <QMap>
+#include <QVector>
+
+#include "trace.h"
+#include "metrics.h"
+
+static const char *pointname[TRACE_MAX] = {
+    "first packet", "marker", "depacketized", "decoded", "analysed", "displayed", "persisted" };
+
+// the stages drawn for each frame, between two points
+static const struct { const char *name; int from; int to; } stages[] = {
+    { "receive",     TRACE_FIRST_PACKET, TRACE_MARKER },
+    { "depacketize", TRACE_MARKER,       TRACE_DEPACKETIZED },
+    { "decode",      TRACE_DEPACKETIZED, TRACE_DECODED },
+    { "motion",      TRACE_DECODED,      TRACE_ANALYSED },
+    { "display",     TRACE_DECODED,      TRACE_DISPLAYED },
+    { "persist",     TRACE_DEPACKETIZED, TRACE_PERSISTED } };
+
+volatile int Trace::on = 0;
+
+// the rings outlive their threads so they can still be dumped;
+// the mutex is only taken when a thread makes its ring and by the dump
+static QMutex ringmutex;
+static QList<TraceRing*> rings;
+
+// QThreadStorage deletes its data when the thread ends, so it holds
+// a reference to the ring rather than the ring itself
+class TraceRingRef
+{
+public:
+    TraceRingRef(TraceRing *r) : ring(r) {}
+    TraceRing *ring;
+};
+static QThreadStorage<TraceRingRef*> localring;
+
+//
+// class TraceRing
+//
+TraceRing::TraceRing(int t, const QByteArray &n) :
+    tid(t), name(n), head(0)
+{
+}
+
+void TraceRing::add(int point, quint32 id, qint64 ts)
+{
+    int h = head;
+    TraceEvent &e = events[h & (TRACE_RING_SIZE-1)];
+    e.ts = ts;
+    e.id = id;
+    e.point = point;
+    // the event is complete before the count includes it
+    head.fetchAndStoreRelease(h + 1);
+}
+
+quint32 TraceRing::copy(QList<TraceEvent> &out, quint32 from)
+{
+    quint32 end = (quint32)head.fetchAndAddOrdered(0);
+    quint32 start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    start = qMax(start, qMin(from, end));
+    QList<TraceEvent> tmp;
+    for( quint32 ii=start; ii<end; ii++ )
+        tmp.append(events[ii & (TRACE_RING_SIZE-1)]);
+
+    // the writer may have reused the oldest slots while they were copied,
+    // including the one it is writing now
+    quint32 after = (quint32)head.fetchAndAddOrdered(0);
+    quint32 valid = after >= TRACE_RING_SIZE ? after - TRACE_RING_SIZE + 1 : 0;
+    for( quint32 ii=qMax(start, valid); ii<end; ii++ )
+        out.append(tmp.at(ii - start));
+    return end;
+}
+
+//
+// class Trace
+//
+TraceRing *Trace::ring()
+{
+    if( localring.hasLocalData() )
+        return localring.localData()->ring;
+
+    TraceRing *r = NULL;
+    ringmutex.lock();
+    if( rings.count() < TRACE_MAX_THREADS )
+    {
+        QThread *thread = QThread::currentThread();
+        QByteArray name = thread->objectName().toLatin1();
+        if( name.isEmpty() )
+            name = thread == QCoreApplication::instance()->thread() ? "main" : "thread";
+        r = new TraceRing(rings.count()+1, name);
+        rings.append(r);
+    }
+    ringmutex.unlock();
+    // threads beyond the limit are not traced
+    localring.setLocalData(new TraceRingRef(r));
+    return r;
+}
+
+void Trace::record(int point, quint32 id)
+{
+    TraceRing *r = ring();
+    if( r )
+        r->add(point, id, Metrics::now());
+}
+
+quint32 Trace::local(QList<TraceEvent> &out, quint32 from)
+{
+    TraceRing *r = ring();
+    if( r == NULL )
+        return from;
+    return r->copy(out, from);
+}
+
+static void jsonEvent(QByteArray &out, const char *name, const char *ph, qint64 ts, int tid, const QByteArray &extra)
+{
+    if( out.size() > 1 )
+        out += ",\n";
+    out += "{\"name\":\""; out += name;
+    out += "\",\"cat\":\"frame\",\"ph\":\""; out += ph;
+    out += "\",\"ts\":"; out += QByteArray::number(ts);
+    out += ",\"pid\":"; out += QByteArray::number(QCoreApplication::applicationPid());
+    out += ",\"tid\":"; out += QByteArray::number(tid);
+    out += extra;
+    out += '}';
+}
+
+// each point is an instant event on its thread, and each frame gets
+// an async span per stage so the latency breakdown lines up by frame
+QByteArray Trace::chromeJson()
+{
+    QByteArray out("[");
+
+    QList<TraceRing*> copyrings;
+    ringmutex.lock();
+    copyrings = rings;
+    ringmutex.unlock();
+
+    // first time of each point for each frame
+    QMap<quint32, QVector<qint64> > frames;
+
+    foreach( TraceRing *r, copyrings )
+    {
+        jsonEvent(out, "thread_name", "M", 0, r->tid, ",\"args\":{\"name\":\"" + r->name + "\"}");
+
+        QList<TraceEvent> events;
+        r->copy(events);
+        foreach( const TraceEvent &e, events )
+        {
+            if( e.point >= TRACE_MAX )
+                continue;
+            jsonEvent(out, pointname[e.point], "i", e.ts, r->tid,
+                      ",\"s\":\"t\",\"args\":{\"frame\":" + QByteArray::number(e.id) + "}");
+
+            QVector<qint64> &f = frames[e.id];
+            if( f.isEmpty() )
+                f.fill(-1, TRACE_MAX);
+            if( f[e.point] < 0 || e.ts < f[e.point] )
+                f[e.point] = e.ts;
+        }
+    }
+
+    QMap<quint32, QVector<qint64> >::const_iterator it;
+    for( it = frames.constBegin(); it != frames.constEnd(); ++it )
+    {
+        QByteArray id = ",\"id\":\"" + QByteArray::number(it.key(), 16) + "\"";
+        const QVector<qint64> &f = it.value();
+        for( unsigned int ii=0; ii<sizeof(stages)/sizeof(stages[0]); ii++ )
+        {
+            qint64 from = f[stages[ii].from];
+            qint64 to = f[stages[ii].to];
+            if( from < 0 || to < from )
+                continue;
+            jsonEvent(out, stages[ii].name, "b", from, 0, id);
+            jsonEvent(out, stages[ii].name, "e", to, 0, id);
+        }
+    }
+    out += "]\n";
+    return out;
+}
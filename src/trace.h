@@ -0,0 +1,86 @@
+/**
+ * FILE:		trace.h
+ *
+ * DESCRIPTION:
+ * This is the class for tracing each frame through the pipeline,
+ * dumped in the Chrome trace event format
+ * -----------------------------------------------------------------------
+ *    Copyright (C) 2010-2015 OpenNetcam Project.
+ *
+ *   This  software is released under the following license:
+ *        - GNU General Public License (GPL) version 3 for use with the
+ *          Qt Open Source Edition (http://www.qt.io)
+ *
+ *    Permission to use, copy, modify, and distribute this software and its
+ *    documentation for any purpose and without fee is hereby granted
+ *    in accordance with the provisions of the GPLv3 which is available at:
+ *    http://www.gnu.org/licenses/gpl.html
+ *
+ *    This software is provided "as is" without express or implied warranty.
+ *
+ * -----------------------------------------------------------------------
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QList>
+
+#include "../include/common.h"
+
+// the points a frame passes, in order
+enum TRACE_POINT { TRACE_FIRST_PACKET=0, TRACE_MARKER, TRACE_DEPACKETIZED,
+                   TRACE_DECODED, TRACE_ANALYSED, TRACE_DISPLAYED, TRACE_PERSISTED, TRACE_MAX };
+
+// frames are identified by their RTP timestamp
+// when tracing is off this costs one branch
+#define TRACE(point, id) do { if( Trace::enabled() ) Trace::record(point, id); } while(0)
+
+class TraceEvent
+{
+public:
+    qint64  ts;                // Metrics::now()
+    quint32 id;
+    quint32 point;
+};
+
+/*
+ * TraceRing
+ * written only by the thread that owns it, the newest TRACE_RING_SIZE events
+ * are kept. A reader copies the events and then discards any the writer may
+ * have overwritten meanwhile, so neither side takes a lock.
+ */
+class TraceRing
+{
+public:
+    TraceRing(int t, const QByteArray &n);
+    void add(int point, quint32 id, qint64 ts);
+    quint32 copy(QList<TraceEvent> &out, quint32 from = 0);
+
+    int        tid;
+    QByteArray name;
+
+private:
+    QAtomicInt head;           // count of events written
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+class Trace
+{
+public:
+    static bool enabled() { return on != 0; }
+    static void setEnabled(bool e) { on = e ? 1 : 0; }
+    static void record(int point, quint32 id);
+    static QByteArray chromeJson();
+    // the events of the calling thread from count 'from', returns the new count
+    static quint32 local(QList<TraceEvent> &out, quint32 from);
+
+private:
+    static TraceRing *ring();
+    static volatile int on;
+};
+
+#endif // TRACE_H
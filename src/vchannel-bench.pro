@@ -0,0 +1,74 @@
+#-------------------------------------------------
+#
+# offline replay benchmark of the media pipeline
+#
+#-------------------------------------------------
+
+QT       += network core gui
+LIBS += -L/usr/lib -ljpeg \
+        -L/usr/lib -lavformat \
+        -L/usr/lib -lavcodec \
+        -L/usr/lib -lswscale \
+        -L/usr/lib -lavutil
+
+TARGET = ../bin/vchannel-bench
+TEMPLATE = app
+CONFIG += console
+
+
+SOURCES += bench.cpp\
+        vchannel.cpp \
+    rtspsocket.cpp \
+    rtpsocket.cpp \
+    pcmaudio.cpp \
+    avformat.cpp \
+    channelformat.cpp \
+    aviformat.cpp \
+    authentication.cpp \
+    sessiondescription.cpp \
+    recordschedule.cpp \
+    jpegvideo.cpp \
+    h264video.cpp \
+    hlssegmenter.cpp \
+    annexb.cpp \
+    accessunit.cpp \
+    segmentarena.cpp \
+    archiver.cpp \
+    motiongrid.cpp \
+    rtpreorder.cpp \
+    framemailbox.cpp \
+    httpserver.cpp \
+    metrics.cpp \
+    trace.cpp
+
+HEADERS  += vchannel.h \
+    rtspsocket.h \
+    rtpsocket.h \
+    pcmaudio.h \
+    channelformat.h \
+    avformat.h \
+    aviformat.h \
+    avifmt.h \
+    authentication.h \
+    sessiondescription.h \
+    recordschedule.h \
+    jpegvideo.h \
+    h264video.h \
+    hlssegmenter.h \
+    annexb.h \
+    accessunit.h \
+    segmentarena.h \
+    archiver.h \
+    motiongrid.h \
+    rtpreorder.h \
+    framemailbox.h \
+    httpserver.h \
+    metrics.h \
+    trace.h \
+    ../include/common.h
+
+FORMS    += vchannel.ui \
+    authdialog.ui
+
+RESOURCES += \
+    resources.qrc
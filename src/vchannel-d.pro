@@ -27,7 +27,18 @@ SOURCES += main.cpp\
     sessiondescription.cpp \
     recordschedule.cpp \
     jpegvideo.cpp \
-    h264video.cpp
+    h264video.cpp \
+    hlssegmenter.cpp \
+    annexb.cpp \
+    accessunit.cpp \
+    segmentarena.cpp \
+    archiver.cpp \
+    motiongrid.cpp \
+    rtpreorder.cpp \
+    framemailbox.cpp \
+    httpserver.cpp \
+    metrics.cpp \
+    trace.cpp
 
 HEADERS  += vchannel.h \
     rtspsocket.h \
@@ -42,6 +53,17 @@ HEADERS  += vchannel.h \
     recordschedule.h \
     jpegvideo.h \
     h264video.h \
+    hlssegmenter.h \
+    annexb.h \
+    accessunit.h \
+    segmentarena.h \
+    archiver.h \
+    motiongrid.h \
+    rtpreorder.h \
+    framemailbox.h \
+    httpserver.h \
+    metrics.h \
+    trace.h \
     ../include/common.h
 
 FORMS    += vchannel.ui \
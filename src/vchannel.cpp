@@ -30,6 +30,7 @@
 #include "vchannel.h"
 #include "ui_vchannel.h"
 #include "rtpsocket.h"
+#include "trace.h"
 
 
 using namespace command_line_arguments;
@@ -37,52 +38,9 @@ using namespace command_line_arguments;
 extern VChannel   *vchannel;
 extern QStatusBar *statusbar;
 RecordSchedule recordschedule;
+FrameMailbox framemailbox;
 extern QString globalstatus;
 
-//
-// class myTcpSocket
-//
-myTcpSocket::myTcpSocket(QObject * parent ) : QTcpSocket(parent)
-{
-    // client timer allows the connection to be closed if the client dies
-    clientTimer.setSingleShot(true);
-    // allow 1 sec between requests to keep open
-    clientTimer.setInterval(1000);
-    connect(&clientTimer, SIGNAL(timeout()), this, SLOT(deleteLater()));
-//    connect( &clientTimer,SIGNAL(timeout()), this, SLOT(disconnectFromHostImplementation()) );
-//    connect( &clientTimer,SIGNAL(timeout()), parent, SLOT(disconnected()) );
-}
-
-myTcpSocket::~myTcpSocket()
-{
-    QDEBUG << "myTcpSocket deleted" << this;
-}
-
-//
-// class myTcpServer
-//
-myTcpServer::myTcpServer(quint16 port, QObject * parent ) : QTcpServer(parent)
-{
-    listen(QHostAddress::Any, port);
-}
-
-void myTcpServer::incomingConnection(int socket)
-{
-    myTcpSocket* s = new myTcpSocket(this);
-    connect(s, SIGNAL(readyRead()), vchannel, SLOT(readIncomingCommand()));
-    connect(s, SIGNAL(disconnected()), vchannel, SLOT(disconnected()));
-    connect(s, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(error(QAbstractSocket::SocketError)) );
-
-    s->setSocketDescriptor(socket);
-    QDEBUG << "vchannel: incomingConnection on:" << socket;
-    s->keepalive();
-}
-
-void myTcpServer::error ( QAbstractSocket::SocketError socketError )
-{
-    qWarning() << "vchannel: TCP Server error: " << socketError;
-}
-
 //
 // class VChannel
 //
@@ -90,7 +48,7 @@ void myTcpServer::error ( QAbstractSocket::SocketError socketError )
 VChannel::VChannel(QWidget *parent) :
         QMainWindow(parent, (nborder==0 ?  (Qt::CustomizeWindowHint | Qt::MSWindowsFixedSizeDialogHint): Qt::Dialog | Qt::MSWindowsFixedSizeDialogHint) ),
     ui(new Ui::VChannel), pbaudio(NULL), rtspsocket(NULL), tcpsocket(NULL), newsocket(NULL),
-    tcpServer(NULL),
+    httpserver(NULL),
     restoreHeight(0),devicestate(DEVICE_IDLE),closecounter(0)
 {
     // make sure it deletes on close
@@ -261,15 +219,18 @@ VChannel::VChannel(QWidget *parent) :
         }
     }
 
-    // set up a server for command messages
-    tcpServer = new myTcpServer(EVENT_PORT+ndevice+1, this);
-    Q_ASSERT(tcpServer);
-    if( tcpServer && !tcpServer->isListening())
+    // set up a server for command messages and HTTP requests
+    httpserver = new HttpServer(&framemailbox);
+    Q_ASSERT(httpserver);
+    httpserver->setNetwork(qseventaddress);
+    connect(httpserver, SIGNAL(request(HttpRequest)), this, SLOT(httpRequest(HttpRequest)));
+    connect(httpserver, SIGNAL(command(QByteArray)), this, SLOT(tcpRequest(QByteArray)));
+    if( !httpserver->start(EVENT_PORT+ndevice+1) )
     {
         QTimer::singleShot(5000, this, SLOT(close()) );
         QMessageBox::critical(this, tr("VChannel"),
                                    tr("Unable to start the server: %1.")
-                                   .arg(tcpServer->errorString()));
+                                   .arg(httpserver->errorString()));
         close();
         return;
     }
@@ -289,6 +250,7 @@ VChannel::VChannel(QWidget *parent) :
 
     // set the record schedule times
     recordschedule.setSchedule(record_settings);
+    recordschedule.setTimelapse(ntimelapse);
 
     // start streaming
     streamStartStop();
@@ -304,8 +266,9 @@ VChannel::~VChannel()
     if( tcpsocket ) tcpsocket->deleteLater();
     tcpsocket = NULL;
 
-    if( tcpServer ) tcpServer->deleteLater();
-    tcpServer = NULL;
+    // stops the server thread
+    if( httpserver ) delete httpserver;
+    httpserver = NULL;
 
     delete ui;
 
@@ -415,196 +378,77 @@ void VChannel::slotAlign()
     //QDEBUG << "slotAlign: after:" << geometry();
 }
 
-void VChannel::disconnected()
-{
-    myTcpSocket *clientConnection = (myTcpSocket*)sender();
-
-    if( !clientConnection ) return;
-
-    if( clientConnection->state() == QAbstractSocket::ConnectedState  )
-    {
-
-        clientConnection->disconnectFromHost();
-
-        QDEBUG << "vchannel: tcp disconnected";
-        clientConnection->deleteLater();
-    }
-}
-
-void VChannel::readIncomingCommand()
+// interpret incoming messages - HTTP
+// snapshots are answered by the server thread, these requests need the GUI thread
+void VChannel::httpRequest(HttpRequest req)
 {
-    myTcpSocket *clientConnection = (myTcpSocket*)sender();
-
-    Q_ASSERT(clientConnection);
-    if( !clientConnection ) return;
+    HttpResponse resp(req);
 
-    //qint64 bytesavail = clientConnection->bytesAvailable();
-    //QDEBUG << "readIncomingCommand: bytes avail:" << bytesavail;
-
-    // limited read
-    QByteArray qba = clientConnection->read(1024);
-
-    // interpret the command
-    if( qba.isEmpty() ) return;
-    // QDEBUG << qba;
-
-    QString peer = clientConnection->peerAddress().toString();
-    // QDEBUG << "Peer address:" << peer << "event address:" << qseventaddress;
-    // guard against outside requests
-    // this assumes a /24 subnet and allows all requesters within the subnet
-    QString qsnetwork = qseventaddress;
-    int last = qseventaddress.lastIndexOf('.');
-    if( last != -1 )
+    // HLS live playlist and segments
+    if( req.path == STR_HLS_PLAYLIST || req.path.startsWith(STR_HLS_SEGMENT) )
     {
-        qsnetwork =qsnetwork.left(last);
-    }
-    if( peer.startsWith("127.0.0.1") || (!qsnetwork.isEmpty() && peer.startsWith(qsnetwork)) )
-    {
-        // detect all vchannel messages
-        int start = qba.indexOf("<" STR_VCHANNEL);
-        if( start != -1 )
+        HlsSegmenter *hls = NULL;
+        if( rtspsocket && rtspsocket->isPlaying() && rtspsocket->rtpSocket() )
+            hls = rtspsocket->rtpSocket()->hls();
+        QByteArray body;
+        if( hls && req.path == STR_HLS_PLAYLIST )
         {
-            tcpRequest(clientConnection, qba );
-        } else if( qba.left(64).contains(STR_HTTP) )
+            body = hls->playlist();
+            resp.contenttype = STR_MIME_HLS_PLAYLIST;
+        } else if( hls )
         {
-            // keepalive if httpRequest
-            // returns true
-            // QDEBUG << "vchannel: httpRequest: " << clientConnection << " from " << clientConnection->peerAddress() << clientConnection->peerPort();
-            if( httpRequest( clientConnection, qba ) )
-                return;
+            // /live/<sequence>.ts
+            QByteArray name = req.path.mid(strlen(STR_HLS_SEGMENT));
+            bool ok = false;
+            int sequence = name.endsWith(".ts") ? name.left(name.length()-3).toInt(&ok) : -1;
+            if( ok )
+                body = hls->segment(sequence);
+            resp.contenttype = STR_MIME_HLS_SEGMENT;
+            resp.nocache = false;
         }
-    } else
-        qWarning() << "Command from unknown source:" << (const char*)peer.toAscii();
-
-    QDEBUG << "vchannel: disconnect From Host" << __FILE__ << __LINE__;
-    clientConnection->disconnectFromHost();
-    clientConnection->deleteLater();
-    clientConnection = NULL;
-}
-
-// interpret incoming messages - HTTP
-bool VChannel::httpRequest(myTcpSocket * clientConnection, QByteArray &qba )
-{
-    bool keepalive = false;
-
-    // look for HTTP requests
-    QList<QByteArray> qbl = qba.split('\n');
-
-    for( int ii=0; ii< qbl.count(); ii++ )
-    {
-        if( qbl.at(ii).toLower().contains(QByteArray(STR_KEEPALIVE).toLower()))
+        if( !body.isEmpty() )
         {
-            keepalive = true;
-            clientConnection->keepalive();
-            break;
-        }
-    }
-
-    // QDEBUG << "------\n" << qbl[0] ;
-
-    QString header;
-    QString strdate = QDateTime::currentDateTime().toString("ddd, dd MMM yyyy hh:mm:ss");
-    int size = 0;
-
-    // check for snapshot requests
-    if( rtspsocket && rtspsocket->isPlaying() && qbl[0].contains(STR_SNAPSHOT) )
-    {
-    	if( rtspsocket->session()->video()->mediaformat() == 26 )  //MJPEG
-    	{
-			// for mjpeg get the image from the buffer
-			const QByteArray *frame = rtspsocket?rtspsocket->frame():NULL;
-			if( frame )
-			{
-				size = frame->length();
-				QDEBUG <<"Jpeg frame length = " << size << " Datetime= " << strdate;
-				QString header = QString(STR_HTTP_IMAGE).arg(size).arg(strdate);
-				if( keepalive )
-					header += STR_KEEPALIVE STR_NL ;
-				header += STR_NL;
-				QDEBUG << header;
-				clientConnection->write( header.toLatin1() );
-				clientConnection->write( *frame );
-
-				// QDEBUG << "vchannel: keepalive=" << keepalive;
-				return keepalive;
-			}
-    	} else
-       	if( rtspsocket->session()->video()->mediaformat() == 96 ||   //H264
-       		rtspsocket->session()->video()->mediaformat() == 97 ||
-       		rtspsocket->session()->video()->mediaformat() == 98 )
-    	{
-       		// for h264 get the QImage and convert to JPG
-			QByteArray snapshot;
-			QBuffer buffer(&snapshot);
-			buffer.open(QIODevice::WriteOnly);
-			rtspsocket->rtpSocket()->image().save(&buffer, "JPG");
-
-			const char *frame = snapshot.constData();
-            if( frame )
-            {
-                size = snapshot.length();
-                QDEBUG <<"Jpeg frame length = " << size << " Datetime= " << strdate;
-                QString header = QString(STR_HTTP_IMAGE).arg(size).arg(strdate);
-                if( keepalive )
-                    header += STR_KEEPALIVE STR_NL ;
-                header += STR_NL;
-                QDEBUG << header;
-                clientConnection->write( header.toLatin1() );
-                clientConnection->write( frame, size );
-
-                // QDEBUG << "vchannel: keepalive=" << keepalive;
-                return keepalive;
-            }
-
-    	}
-    } else
-    if( rtspsocket && rtspsocket->isPlaying() && qbl[0].contains(STR_THUMBNAIL) )
-    {
-        RtpSocket *sock = rtspsocket->rtpSocket();
-        if( sock )
+            resp.status = 200;
+            resp.extra = "Access-Control-Allow-Origin: *" STR_NL;
+            resp.body = body;
+        } else
         {
-            const char *frame = sock->thumb();
-            if( frame )
-            {
-                size = sock->thumb_size();
-                // QDEBUG <<"Jpeg frame length = " << size << " Datetime= " << strdate;
-                QString header = QString(STR_HTTP_IMAGE).arg(size).arg(strdate);
-                if( keepalive )
-                    header += STR_KEEPALIVE STR_NL ;
-                header += STR_NL;
-                // QDEBUG << header;
-                clientConnection->write( header.toLatin1() );
-                clientConnection->write( frame, size );
-
-                // QDEBUG << "vchannel: keepalive=" << keepalive;
-                return keepalive;
-            }
+            resp.setNotFound();
         }
     } else
     // check for status requests
-    if( qbl[0].contains(STR_STATUSREQ) )
+    if( req.path == STR_STATUSREQ )
     {
-        if( qbl[0].contains("?" STR_SHUTDOWN ) )
+        if( req.query.startsWith(STR_SHUTDOWN) )
         {
             qWarning() << "Shutdown command";
             globalstatus = "Shutting down";
 
             QTimer::singleShot(600, this, SLOT(close()));
         } else
-        if( qbl[0].contains("?" STR_STARTSTOP ) )
+        if( req.query.startsWith(STR_STARTSTOP) )
         {
             // start/stop command
             streamStartStop();
         } else
-        if( qbl[0].contains("?" STR_DEBUGON ) )
+        if( req.query.startsWith(STR_DEBUGON) )
         {
             if( debugsetting < 3 ) debugsetting++;
         } else
-        if( qbl[0].contains("?" STR_DEBUGOFF ) )
+        if( req.query.startsWith(STR_DEBUGOFF) )
         {
             if( debugsetting>0 ) debugsetting--;
+        } else
+        if( req.query.startsWith(STR_TRACEON) )
+        {
+            Trace::setEnabled(true);
+        } else
+        if( req.query.startsWith(STR_TRACEOFF) )
+        {
+            Trace::setEnabled(false);
         }
 
+        QString strdate = QDateTime::currentDateTime().toString("ddd, dd MMM yyyy hh:mm:ss");
         QString strtmp = QString("Status: %1 [ %2 ]<br/>").arg(ndevice).arg(globalstatus);
         strtmp += strdate + "<br/>";
         strtmp += qscname + "<br/>";
@@ -625,39 +469,34 @@ bool VChannel::httpRequest(myTcpSocket * clientConnection, QByteArray &qba )
                 strtmp += "<br/>"  "Watchdog is running";
             else
                 strtmp += "<br/>"  "Watchdog is not running";
+            if( rtspsocket->rtpSocket() )
+                strtmp += "<br/>" + rtspsocket->rtpSocket()->strStatus();
         } else {
             strtmp += "state = not running";
         }
 
         if( debugsetting > 0 )
             strtmp += "<br/>" "debug output is ON" ;
+        if( Trace::enabled() )
+            strtmp += "<br/>" "frame tracing is ON, see " STR_TRACE ;
 
-        QString statusreply = QString(STR_HTML_REPLY).arg(strtmp);
-        size = statusreply.size();
-        QDEBUG << "Status Request: response size=" << size;
-        QString header = QString(STR_HTTP_200).arg(size).arg(strdate);
-        QDEBUG << header + statusreply;
-        clientConnection->write( header.toLatin1() );
-        clientConnection->write( statusreply.toLatin1() );
-
-        // close connection by returning false
-        return keepalive;
+        resp.status = 200;
+        resp.contenttype = STR_MIME_HTML;
+        resp.body = QString(STR_HTML_REPLY).arg(strtmp).toLatin1();
+        QDEBUG << "Status Request: response size=" << resp.body.size();
     }
 
-    // return error 404 - not Found
-    size = strlen(STR_CONTENT_404);
-    header = QString(STR_HTTP_404).arg(size).arg(strdate);
-    // QDEBUG << header;
-    clientConnection->write( header.toLatin1() );
-    clientConnection->write( QByteArray(STR_CONTENT_404) );
-    // close connection by returning false
-    return false;
+    // anything else gets the 404 - not Found the response started with
+    if( httpserver )
+        httpserver->reply(resp);
 }
 
 // interpret incoming messages - TCP
-void VChannel::tcpRequest(myTcpSocket * /* clientConnection*/, QByteArray &qba, int start )
+void VChannel::tcpRequest(QByteArray qba)
 {
     int deviceid = -1;
+    int start = qba.indexOf("<" STR_VCHANNEL);
+    if( start == -1 ) return;
 
     int msg = qba.indexOf(">",start);
     if( msg != -1 )
@@ -746,8 +585,8 @@ void VChannel::closeEvent(QCloseEvent *event)
     QDEBUG << "vchannel: Close event";
     statusBar()->showMessage(tr("Shutting down"));
 
-    if( tcpServer )
-        tcpServer->close();
+    if( httpserver )
+        httpserver->pause();
 
 /*
     if( tcpsocket )
@@ -60,35 +60,17 @@ namespace command_line_arguments {
 	extern int     my;                  // motion window
 	extern int     mw;                 	// motion window
 	extern int     mh;                 	// motion window
+	extern QStringList motionzones;     // more motion windows, as --motion
+	extern QStringList motionexcludes;  // polygons left out of the motion windows
+	extern int     nhls;                // HLS live segments kept (default off)
+	extern int     ng711;               // record G.711 audio as received (default off)
+	extern int     narchive;            // MJPEG recordings transcoded to H.264 at once (default off)
+	extern int     ntimelapse;          // seconds between the frames kept without motion (default off)
+	extern int     nvectors;            // motion from the H.264 motion vectors (default off)
 }
 
 #include "rtspsocket.h"
-
-class myTcpSocket : public QTcpSocket
-{
-    Q_OBJECT
-public:
-    myTcpSocket(QObject * parent = 0);
-    ~myTcpSocket();
-    void keepalive() { clientTimer.start();}
-
-private:
-    QTimer     clientTimer;
-};
-
-class myTcpServer : public QTcpServer
-{
-    Q_OBJECT
-public:
-    myTcpServer(quint16 port, QObject * parent = 0);
-
-    void incomingConnection(int socket);
-
-protected slots:
-    void error ( QAbstractSocket::SocketError socketError );
-};
-
-
+#include "httpserver.h"
 
 namespace Ui {
     class VChannel;
@@ -105,8 +87,6 @@ public:
     void setDeviceState(int s) { if(s && s < DEVICE_MAX) devicestate = (DEVICE_STATE) s; }
 
 protected:
-    void tcpRequest(myTcpSocket * clientConnection, QByteArray &qba,int start=0 );
-    bool httpRequest(myTcpSocket * clientConnection, QByteArray &qba );
     void changeEvent(QEvent *e);
 
 protected slots:
@@ -115,8 +95,8 @@ protected slots:
     void on_minimizerestore();
     void eventConnected();
     void vchannelConnected();
-    void readIncomingCommand();
-    void disconnected();
+    void httpRequest(HttpRequest req);
+    void tcpRequest(QByteArray qba);
     void eventError(QAbstractSocket::SocketError err);
     void vchannelError(QAbstractSocket::SocketError err);
     void slotAlign();
@@ -129,7 +109,7 @@ private:
     RtspSocket *rtspsocket;
     QTcpSocket *tcpsocket;
     QTcpSocket *newsocket;
-    QTcpServer *tcpServer;
+    HttpServer *httpserver;
 
     QString qsevent;
     QString newevent;